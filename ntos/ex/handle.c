@@ -48,7 +48,13 @@ BOOLEAN ExTraceAllTables = FALSE;
 
 #endif
 
-EX_PUSH_LOCK HandleTableListLock;
+//
+//  The handle table list is walked shared by every handle snapshot and is
+//  only changed when a handle table is created, duplicated or removed, so
+//  its lock expands under shared contention from several processors.
+//
+
+EX_PUSH_LOCK_AUTO_EXPAND HandleTableListLock;
 
 ULONG TotalTraceBuffers = 0;
 
@@ -819,7 +825,7 @@ Return Value:
     //
 
     InitializeListHead( &HandleTableListHead );
-    ExInitializePushLock( &HandleTableListLock );
+    ExInitializeAutoExpandPushLock( &HandleTableListLock );
 
     return;
 }
@@ -872,11 +878,11 @@ Return Value:
     //
 
     KeEnterCriticalRegionThread (CurrentThread);
-    ExAcquirePushLockExclusive( &HandleTableListLock );
+    ExAcquireAutoExpandPushLockExclusive( &HandleTableListLock );
 
     InsertTailList( &HandleTableListHead, &HandleTable->HandleTableList );
 
-    ExReleasePushLockExclusive( &HandleTableListLock );
+    ExReleaseAutoExpandPushLockExclusive( &HandleTableListLock );
     KeLeaveCriticalRegionThread (CurrentThread);
 
 
@@ -925,7 +931,7 @@ Return Value:
     //
 
     KeEnterCriticalRegionThread (CurrentThread);
-    ExAcquirePushLockExclusive( &HandleTableListLock );
+    ExAcquireAutoExpandPushLockExclusive( &HandleTableListLock );
 
     //
     //  Remove the handle table from the handle table list.  This routine is
@@ -940,7 +946,7 @@ Return Value:
     //  Now release the global lock and return to our caller
     //
 
-    ExReleasePushLockExclusive( &HandleTableListLock );
+    ExReleaseAutoExpandPushLockExclusive( &HandleTableListLock );
     KeLeaveCriticalRegionThread (CurrentThread);
 
     return;
@@ -1417,11 +1423,11 @@ Return Value:
     //  Insert the handle table in the handle table list.
     //
 
-    ExAcquirePushLockExclusive( &HandleTableListLock );
+    ExAcquireAutoExpandPushLockExclusive( &HandleTableListLock );
 
     InsertTailList( &HandleTableListHead, &NewHandleTable->HandleTableList );
 
-    ExReleasePushLockExclusive( &HandleTableListLock );
+    ExReleaseAutoExpandPushLockExclusive( &HandleTableListLock );
     KeLeaveCriticalRegionThread (CurrentThread);
 
     //
@@ -1479,6 +1485,7 @@ Return Value:
     PHANDLE_TABLE HandleTable;
     EXHANDLE Handle;
     PHANDLE_TABLE_ENTRY HandleTableEntry;
+    PEX_PUSH_LOCK ListLock;
 
     PAGED_CODE();
 
@@ -1505,7 +1512,7 @@ Return Value:
     //
 
     KeEnterCriticalRegionThread (CurrentThread);
-    ExAcquirePushLockShared( &HandleTableListLock );
+    ListLock = ExAcquireAutoExpandPushLockShared( &HandleTableListLock );
 
     //
     //  Iterate through all the handle tables in the system.
@@ -1571,7 +1578,7 @@ Return Value:
         }
     }
 
-    ExReleasePushLockShared( &HandleTableListLock );
+    ExReleaseAutoExpandPushLockShared( ListLock );
     KeLeaveCriticalRegionThread (CurrentThread);
 
     return Status;
@@ -1625,6 +1632,7 @@ Return Value:
     PHANDLE_TABLE HandleTable;
     EXHANDLE Handle;
     PHANDLE_TABLE_ENTRY HandleTableEntry;
+    PEX_PUSH_LOCK ListLock;
 
     PAGED_CODE();
 
@@ -1651,7 +1659,7 @@ Return Value:
     //
 
     KeEnterCriticalRegionThread (CurrentThread);
-    ExAcquirePushLockShared( &HandleTableListLock );
+    ListLock = ExAcquireAutoExpandPushLockShared( &HandleTableListLock );
 
     //
     //  Iterate through all the handle tables in the system.
@@ -1717,7 +1725,7 @@ Return Value:
         }
     }
 
-    ExReleasePushLockShared( &HandleTableListLock );
+    ExReleaseAutoExpandPushLockShared( ListLock );
     KeLeaveCriticalRegionThread (CurrentThread);
 
     return Status;
@@ -26,13 +26,36 @@ Abstract:
 #pragma alloc_text(PAGE, NtWaitForKeyedEvent)
 
 //
-// Define the keyed event object type
+// Define the keyed event object type. Waiters and releasers are hashed by
+// key and process into buckets that each have their own lock and wait
+// queue, so matching a key only searches the threads that collide with it.
 //
-typedef struct _KEYED_EVENT_OBJECT {
+
+#define KEYED_EVENT_HASH_BUCKETS 64
+
+typedef struct _KEYED_EVENT_BUCKET {
     EX_PUSH_LOCK Lock;
     LIST_ENTRY WaitQueue;
+} KEYED_EVENT_BUCKET, *PKEYED_EVENT_BUCKET;
+
+typedef struct _KEYED_EVENT_OBJECT {
+    KEYED_EVENT_BUCKET HashTable[KEYED_EVENT_HASH_BUCKETS];
 } KEYED_EVENT_OBJECT, *PKEYED_EVENT_OBJECT;
 
+//
+// Keys are usually addresses of user mode locks so the low bits carry
+// little information. The process is folded in since only threads in the
+// same process can match.
+//
+
+#define KEYED_EVENT_HASH(xxxKeyValue,xxxProcess)                               \
+    ((ULONG)((((ULONG_PTR)(xxxKeyValue)) >> 2) ^                               \
+             (((ULONG_PTR)(xxxKeyValue)) >> 9) ^                               \
+             (((ULONG_PTR)(xxxProcess)) >> 7)) & (KEYED_EVENT_HASH_BUCKETS - 1))
+
+#define KEYED_EVENT_BUCKET(xxxKeyedEventObject,xxxKeyValue,xxxProcess)         \
+    (&(xxxKeyedEventObject)->HashTable[KEYED_EVENT_HASH (xxxKeyValue, xxxProcess)])
+
 POBJECT_TYPE ExpKeyedEventObjectType;
 
 //
@@ -42,18 +65,18 @@ POBJECT_TYPE ExpKeyedEventObjectType;
 
 #define KEYVALUE_RELEASE 1
 
-#define LOCK_KEYED_EVENT_EXCLUSIVE(xxxKeyedEventObject,xxxCurrentThread) { \
+#define LOCK_KEYED_EVENT_EXCLUSIVE(xxxKeyedEventBucket,xxxCurrentThread) { \
     KeEnterCriticalRegionThread (&(xxxCurrentThread)->Tcb);                \
-    ExAcquirePushLockExclusive (&(xxxKeyedEventObject)->Lock);             \
+    ExAcquirePushLockExclusive (&(xxxKeyedEventBucket)->Lock);             \
 }
 
-#define UNLOCK_KEYED_EVENT_EXCLUSIVE(xxxKeyedEventObject,xxxCurrentThread) { \
-    ExReleasePushLockExclusive (&(xxxKeyedEventObject)->Lock);               \
+#define UNLOCK_KEYED_EVENT_EXCLUSIVE(xxxKeyedEventBucket,xxxCurrentThread) { \
+    ExReleasePushLockExclusive (&(xxxKeyedEventBucket)->Lock);               \
     KeLeaveCriticalRegionThread (&(xxxCurrentThread)->Tcb);                  \
 }
 
-#define UNLOCK_KEYED_EVENT_EXCLUSIVE_UNSAFE(xxxKeyedEventObject) { \
-    ExReleasePushLockExclusive (&(xxxKeyedEventObject)->Lock);     \
+#define UNLOCK_KEYED_EVENT_EXCLUSIVE_UNSAFE(xxxKeyedEventBucket) { \
+    ExReleasePushLockExclusive (&(xxxKeyedEventBucket)->Lock);     \
 }
 
 NTSTATUS
@@ -228,6 +251,7 @@ Return Value:
     PKEYED_EVENT_OBJECT KeyedEventObject;
     HANDLE Handle;
     KPROCESSOR_MODE PreviousMode;
+    ULONG i;
 
     //
     // Get previous processor mode and probe output arguments if necessary.
@@ -271,10 +295,12 @@ Return Value:
     }
 
     //
-    // Initialize the lock and wait queue
+    // Initialize the lock and wait queue of each hash bucket
     //
-    ExInitializePushLock (&KeyedEventObject->Lock);
-    InitializeListHead (&KeyedEventObject->WaitQueue);
+    for (i = 0; i < KEYED_EVENT_HASH_BUCKETS; i++) {
+        ExInitializePushLock (&KeyedEventObject->HashTable[i].Lock);
+        InitializeListHead (&KeyedEventObject->HashTable[i].WaitQueue);
+    }
 
     //
     // Insert the object into the handle table
@@ -413,6 +439,7 @@ Return Value:
     NTSTATUS Status;
     KPROCESSOR_MODE PreviousMode;
     PKEYED_EVENT_OBJECT KeyedEventObject;
+    PKEYED_EVENT_BUCKET KeyedEventBucket;
     PETHREAD CurrentThread, TargetThread;
     PEPROCESS CurrentProcess;
     PLIST_ENTRY ListHead, ListEntry;
@@ -455,9 +482,11 @@ Return Value:
 
     CurrentProcess = PsGetCurrentProcessByThread (CurrentThread);
 
-    ListHead = &KeyedEventObject->WaitQueue;
+    KeyedEventBucket = KEYED_EVENT_BUCKET (KeyedEventObject, KeyValue, CurrentProcess);
+
+    ListHead = &KeyedEventBucket->WaitQueue;
 
-    LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventObject, CurrentThread);
+    LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventBucket, CurrentThread);
 
     ListEntry = ListHead->Flink;
     while (1) {
@@ -495,7 +524,7 @@ Return Value:
     // Release the lock but leave APC's disabled.
     // This prevents us from being suspended and holding up the target.
     //
-    UNLOCK_KEYED_EVENT_EXCLUSIVE_UNSAFE (KeyedEventObject);
+    UNLOCK_KEYED_EVENT_EXCLUSIVE_UNSAFE (KeyedEventBucket);
 
     if (TargetThread != NULL) {
         KeReleaseSemaphore (&TargetThread->KeyedWaitSemaphore,
@@ -518,13 +547,13 @@ Return Value:
         if (Status != STATUS_SUCCESS) {
             BOOLEAN Wait = TRUE;
 
-            LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventObject, CurrentThread);
+            LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventBucket, CurrentThread);
             if (!IsListEmpty (&CurrentThread->KeyedWaitChain)) {
                 RemoveEntryList (&CurrentThread->KeyedWaitChain);
                 InitializeListHead (&CurrentThread->KeyedWaitChain);
                 Wait = FALSE;
             }
-            UNLOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventObject, CurrentThread);
+            UNLOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventBucket, CurrentThread);
             //
             // If this thread was no longer in the queue then another thread
             // must be about to wake us up. Wait for that wake.
@@ -582,6 +611,7 @@ Return Value:
     NTSTATUS Status;
     KPROCESSOR_MODE PreviousMode;
     PKEYED_EVENT_OBJECT KeyedEventObject;
+    PKEYED_EVENT_BUCKET KeyedEventBucket;
     PETHREAD CurrentThread, TargetThread;
     PEPROCESS CurrentProcess;
     PLIST_ENTRY ListHead, ListEntry;
@@ -624,9 +654,11 @@ Return Value:
 
     CurrentProcess = PsGetCurrentProcessByThread (CurrentThread);
 
-    ListHead = &KeyedEventObject->WaitQueue;
+    KeyedEventBucket = KEYED_EVENT_BUCKET (KeyedEventObject, KeyValue, CurrentProcess);
+
+    ListHead = &KeyedEventBucket->WaitQueue;
 
-    LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventObject, CurrentThread);
+    LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventBucket, CurrentThread);
 
     ListEntry = ListHead->Flink;
     while (1) {
@@ -662,7 +694,7 @@ Return Value:
     // Release the lock but leave APC's disabled.
     // This prevents us from being suspended and holding up the target.
     //
-    UNLOCK_KEYED_EVENT_EXCLUSIVE_UNSAFE (KeyedEventObject);
+    UNLOCK_KEYED_EVENT_EXCLUSIVE_UNSAFE (KeyedEventBucket);
 
     if (TargetThread == NULL) {
         KeLeaveCriticalRegionThread (&CurrentThread->Tcb);
@@ -678,13 +710,13 @@ Return Value:
         if (Status != STATUS_SUCCESS) {
             BOOLEAN Wait = TRUE;
 
-            LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventObject, CurrentThread);
+            LOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventBucket, CurrentThread);
             if (!IsListEmpty (&CurrentThread->KeyedWaitChain)) {
                 RemoveEntryList (&CurrentThread->KeyedWaitChain);
                 InitializeListHead (&CurrentThread->KeyedWaitChain);
                 Wait = FALSE;
             }
-            UNLOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventObject, CurrentThread);
+            UNLOCK_KEYED_EVENT_EXCLUSIVE (KeyedEventBucket, CurrentThread);
             //
             // If this thread was no longer in the queue then another thread
             // must be about to wake us up. Wait for that wake.
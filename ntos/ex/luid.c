@@ -30,6 +30,25 @@ Abstract:
 LARGE_INTEGER ExpLuid = {1001,0};
 const LARGE_INTEGER ExpLuidIncrement = {1,0};
 
+//
+// Each processor reserves a block of LUIDs from the global source and
+// hands them out locally, so the global source is only touched once per
+// block rather than once per LUID. A block is only accessed by its owning
+// processor at DISPATCH_LEVEL.
+//
+// N.B. LUIDs are unique but are no longer allocated in increasing order
+//      across processors.
+//
+
+#define EXP_LUID_BLOCK_SIZE 64
+
+typedef struct DECLSPEC_CACHEALIGN _EXP_LUID_BLOCK {
+    LONGLONG Next;
+    LONGLONG Limit;
+} EXP_LUID_BLOCK, *PEXP_LUID_BLOCK;
+
+EXP_LUID_BLOCK ExpLuidBlocks[MAXIMUM_PROCESSORS];
+
 #pragma alloc_text(INIT, ExLuidInitialization)
 #pragma alloc_text(PAGE, NtAllocateLocallyUniqueId)
 
@@ -63,6 +82,122 @@ Return Value:
     return TRUE;
 }
 
+LONGLONG
+ExpReserveLocallyUniqueIds (
+    IN LONGLONG Count
+    )
+
+/*++
+
+Routine Description:
+
+    This function reserves a contiguous range of LUIDs from the global
+    LUID source.
+
+Arguments:
+
+    Count - Supplies the number of LUIDs to reserve.
+
+Return Value:
+
+    The first LUID of the reserved range.
+
+--*/
+
+{
+    LARGE_INTEGER Initial;
+
+#if defined (_WIN64) && !defined(_X86AMD64_)
+    Initial.QuadPart = InterlockedAdd64 (&ExpLuid.QuadPart, Count) - Count;
+#else
+    LARGE_INTEGER Value;
+
+
+    while (1) {
+        Initial.QuadPart = ExpLuid.QuadPart;
+
+        Value.QuadPart = Initial.QuadPart + Count;
+        Value.QuadPart = InterlockedCompareExchange64(&ExpLuid.QuadPart,
+                                                      Value.QuadPart,
+                                                      Initial.QuadPart);
+        if (Initial.QuadPart != Value.QuadPart) {
+            continue;
+        }
+        break;
+    }
+
+#endif
+
+    return Initial.QuadPart;
+}
+
+VOID
+ExAllocateLocallyUniqueId (
+    OUT PLUID Luid
+    )
+
+/*++
+
+Routine Description:
+
+    This function returns an LUID value that is unique since the system
+    was last rebooted. It is unique only on the system it is generated on
+    and not network wide.
+
+    The value is taken from the current processor's block, which is
+    refilled from the global LUID source when it runs dry.
+
+    N.B. A LUID is a 64-bit value and for all practical purposes will
+         never carry in the lifetime of a single boot of the system.
+         At an increment rate of 1ns, the value would carry to zero in
+         approximately 126 years.
+
+Arguments:
+
+    Luid - Supplies a pointer to a variable that receives the allocated
+        locally unique Id.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KIRQL OldIrql;
+    PEXP_LUID_BLOCK Block;
+    LARGE_INTEGER Value;
+
+    //
+    // Raise to DISPATCH_LEVEL so the block cannot be touched by another
+    // thread on this processor while it is being consumed.
+    //
+
+    OldIrql = KeGetCurrentIrql ();
+
+    if (OldIrql < DISPATCH_LEVEL) {
+        KeRaiseIrql (DISPATCH_LEVEL, &OldIrql);
+    }
+
+    Block = &ExpLuidBlocks[KeGetCurrentProcessorNumber ()];
+
+    if (Block->Next == Block->Limit) {
+        Block->Next = ExpReserveLocallyUniqueIds (EXP_LUID_BLOCK_SIZE * ExpLuidIncrement.QuadPart);
+        Block->Limit = Block->Next + EXP_LUID_BLOCK_SIZE * ExpLuidIncrement.QuadPart;
+    }
+
+    Value.QuadPart = Block->Next;
+    Block->Next += ExpLuidIncrement.QuadPart;
+
+    if (OldIrql < DISPATCH_LEVEL) {
+        KeLowerIrql (OldIrql);
+    }
+
+    Luid->LowPart = Value.LowPart;
+    Luid->HighPart = Value.HighPart;
+    return;
+}
+
 NTSTATUS
 NtAllocateLocallyUniqueId (
     __out PLUID Luid
@@ -132,6 +132,9 @@ ExpInitializePushLocks (
 //#pragma alloc_text(PAGE, ExFreeCacheAwarePushLock)
 //#pragma alloc_text(PAGE, ExAcquireCacheAwarePushLockExclusive)
 //#pragma alloc_text(PAGE, ExReleaseCacheAwarePushLockExclusive)
+//#pragma alloc_text(PAGE, ExfAcquireAutoExpandPushLockShared)
+//#pragma alloc_text(PAGE, ExAcquireAutoExpandPushLockExclusive)
+//#pragma alloc_text(PAGE, ExReleaseAutoExpandPushLockExclusive)
 
 #pragma alloc_text(INIT, ExpInitializePushLocks)
 
@@ -147,6 +150,22 @@ ULONG ExPushLockSpinCount = 0;
 #define USE_EXP_BACKOFF
 #endif
 
+//
+// Auto expanding push lock tuning. A compact lock expands once it sees
+// EXP_AUTO_EXPAND_CONTENTION contended shared acquires from at least
+// EXP_AUTO_EXPAND_PROCESSORS processors within EXP_AUTO_EXPAND_WINDOW
+// clock ticks. An expanded lock collapses when an exclusive acquire finds
+// fewer than EXP_AUTO_EXPAND_COLLAPSE shared acquires per window since
+// the last check.
+//
+
+#define EXP_AUTO_EXPAND_WINDOW     64
+#define EXP_AUTO_EXPAND_CONTENTION 256
+#define EXP_AUTO_EXPAND_PROCESSORS 4
+#define EXP_AUTO_EXPAND_COLLAPSE   1024
+
+#define EXP_AUTO_EXPAND_SLOT_BITS  (sizeof (LONG) * 8)
+
 VOID
 ExpInitializePushLocks (
     VOID
@@ -1314,6 +1333,7 @@ Return Value:
             }
             for (i = 0; i < EX_PUSH_LOCK_FANNED_COUNT; i++) {
                 PaddedPushLock->Single = TRUE;
+                PaddedPushLock->SharedAcquires = 0;
                 ExInitializePushLock (&PaddedPushLock->Lock);
                 PushLockCacheAware->Locks[i] = &PaddedPushLock->Lock;
                 PaddedPushLock++;
@@ -1343,6 +1363,7 @@ Return Value:
                     return NULL;
                 }
                 PaddedPushLock->Single = FALSE;
+                PaddedPushLock->SharedAcquires = 0;
                 ExInitializePushLock (&PaddedPushLock->Lock);
                 PushLockCacheAware->Locks[i] = &PaddedPushLock->Lock;
             }
@@ -1482,3 +1503,399 @@ Return Value:
     }
 }
 
+NTKERNELAPI
+VOID
+ExInitializeAutoExpandPushLock (
+     __out PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Initialize an auto expanding push lock. The lock starts out compact.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be initialized
+
+Return Value:
+
+    None
+
+--*/
+{
+    ExInitializePushLock (&AutoExpandPushLock->LocalLock);
+    AutoExpandPushLock->CacheAware = NULL;
+    AutoExpandPushLock->Expanded = 0;
+    AutoExpandPushLock->SharedContention = 0;
+    AutoExpandPushLock->ContendingSlots = 0;
+    AutoExpandPushLock->WindowStart = 0;
+}
+
+NTKERNELAPI
+VOID
+ExDeleteAutoExpandPushLock (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Free the resources of an auto expanding push lock. The lock must not
+    be owned.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be deleted
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (AutoExpandPushLock->CacheAware != NULL) {
+        ExFreeCacheAwarePushLock (AutoExpandPushLock->CacheAware);
+        AutoExpandPushLock->CacheAware = NULL;
+    }
+    AutoExpandPushLock->Expanded = 0;
+}
+
+VOID
+ExpResetAutoExpandPushLock (
+     IN PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Start a new sampling window for an auto expanding push lock.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be reset
+
+Return Value:
+
+    None
+
+--*/
+{
+    LARGE_INTEGER TickCount;
+
+    KeQueryTickCount (&TickCount);
+
+    AutoExpandPushLock->WindowStart = TickCount.LowPart;
+    AutoExpandPushLock->SharedContention = 0;
+    AutoExpandPushLock->ContendingSlots = 0;
+}
+
+LOGICAL
+ExpShouldExpandAutoExpandPushLock (
+     IN PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Record a contended shared acquire of a compact auto expanding push lock
+    and decide whether the lock should be expanded.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock being acquired
+
+Return Value:
+
+    LOGICAL - TRUE: The lock should be expanded, FALSE: Keep the lock compact
+
+--*/
+{
+    LARGE_INTEGER TickCount;
+    LONG SlotBit;
+    ULONG Slots;
+    ULONG Processors;
+    ULONG Required;
+
+    if (KeNumberProcessors == 1) {
+        return FALSE;
+    }
+
+    //
+    // Only touch the contending slot mask the first time a processor is
+    // seen in this window so the mask's cache line is mostly read.
+    //
+
+    SlotBit = (LONG) (1UL << (KeGetCurrentProcessorNumber () % EXP_AUTO_EXPAND_SLOT_BITS));
+    if ((AutoExpandPushLock->ContendingSlots & SlotBit) == 0) {
+        InterlockedOr (&AutoExpandPushLock->ContendingSlots, SlotBit);
+    }
+
+    if (InterlockedIncrement (&AutoExpandPushLock->SharedContention) < EXP_AUTO_EXPAND_CONTENTION) {
+        return FALSE;
+    }
+
+    //
+    // Enough contention has been seen. If it took longer than a window to
+    // accumulate then the rate is too low, so start a new window.
+    //
+
+    KeQueryTickCount (&TickCount);
+    if (TickCount.LowPart - AutoExpandPushLock->WindowStart > EXP_AUTO_EXPAND_WINDOW) {
+        ExpResetAutoExpandPushLock (AutoExpandPushLock);
+        return FALSE;
+    }
+
+    Required = EXP_AUTO_EXPAND_PROCESSORS;
+    if (Required > (ULONG) KeNumberProcessors) {
+        Required = KeNumberProcessors;
+    }
+
+    Processors = 0;
+    for (Slots = AutoExpandPushLock->ContendingSlots; Slots != 0; Slots &= Slots - 1) {
+        Processors += 1;
+    }
+
+    return (LOGICAL) (Processors >= Required);
+}
+
+VOID
+ExpExpandAutoExpandPushLock (
+     IN PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Expand a compact auto expanding push lock into its cache aware form.
+    The cache aware push lock is allocated on the first expansion and kept
+    for later ones, since readers that raced with a collapse may still
+    reference it.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be expanded
+
+Return Value:
+
+    None
+
+--*/
+{
+    PEX_PUSH_LOCK_CACHE_AWARE CacheAware;
+
+    CacheAware = NULL;
+
+    if (AutoExpandPushLock->CacheAware == NULL) {
+        CacheAware = ExAllocateCacheAwarePushLock ();
+        if (CacheAware == NULL) {
+            ExpResetAutoExpandPushLock (AutoExpandPushLock);
+            return;
+        }
+    }
+
+    //
+    // Holding the local lock exclusive keeps out all compact mode owners.
+    // Compact shared owners check the expanded state again after they get
+    // the local lock, so once this is released they move to the slots.
+    //
+
+    ExAcquirePushLockExclusive (&AutoExpandPushLock->LocalLock);
+
+    if (AutoExpandPushLock->Expanded == 0) {
+        if (AutoExpandPushLock->CacheAware == NULL) {
+            AutoExpandPushLock->CacheAware = CacheAware;
+            CacheAware = NULL;
+        }
+
+        ExpResetAutoExpandPushLock (AutoExpandPushLock);
+
+        InterlockedExchange (&AutoExpandPushLock->Expanded, 1);
+    }
+
+    ExReleasePushLockExclusive (&AutoExpandPushLock->LocalLock);
+
+    if (CacheAware != NULL) {
+        ExFreeCacheAwarePushLock (CacheAware);
+    }
+}
+
+NTKERNELAPI
+PEX_PUSH_LOCK
+FASTCALL
+ExfAcquireAutoExpandPushLockShared (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Acquire an auto expanding push lock shared. This is the slow path taken
+    when the lock is expanded or the compact lock could not be acquired with
+    a single compare exchange.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be acquired
+
+Return Value:
+
+    PEX_PUSH_LOCK - The push lock that was acquired.
+
+--*/
+{
+    PEX_PUSH_LOCK PushLock;
+
+    while (1) {
+
+        if (AutoExpandPushLock->Expanded != 0) {
+
+            //
+            // Take this processor's slot. An exclusive owner that collapsed
+            // the lock may have held the slot while we waited for it, in
+            // which case the slot no longer protects anything and we retry.
+            //
+
+            PushLock = ExAcquireCacheAwarePushLockShared (AutoExpandPushLock->CacheAware);
+
+            if (AutoExpandPushLock->Expanded != 0) {
+                InterlockedIncrement ((PLONG) &CONTAINING_RECORD (PushLock,
+                                                                  EX_PUSH_LOCK_CACHE_AWARE_PADDED,
+                                                                  Lock)->SharedAcquires);
+                return PushLock;
+            }
+
+            ExReleasePushLockShared (PushLock);
+            continue;
+        }
+
+        if (ExpShouldExpandAutoExpandPushLock (AutoExpandPushLock)) {
+            ExpExpandAutoExpandPushLock (AutoExpandPushLock);
+            continue;
+        }
+
+        PushLock = &AutoExpandPushLock->LocalLock;
+
+        ExAcquirePushLockShared (PushLock);
+
+        if (AutoExpandPushLock->Expanded == 0) {
+            return PushLock;
+        }
+
+        ExReleasePushLockShared (PushLock);
+    }
+}
+
+NTKERNELAPI
+VOID
+ExAcquireAutoExpandPushLockExclusive (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Acquire an auto expanding push lock exclusive. If the lock is expanded
+    and shared traffic has dropped off since the last check then the lock
+    is collapsed back to its compact form.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be acquired
+
+Return Value:
+
+    None
+
+--*/
+{
+    PEX_PUSH_LOCK_CACHE_AWARE CacheAware;
+    PEX_PUSH_LOCK_CACHE_AWARE_PADDED PaddedPushLock;
+    LARGE_INTEGER TickCount;
+    ULONG Elapsed;
+    ULONG SharedAcquires;
+    ULONG i, MaxLine;
+
+    //
+    // The expanded state only changes with the local lock held exclusive.
+    //
+
+    ExAcquirePushLockExclusive (&AutoExpandPushLock->LocalLock);
+
+    if (AutoExpandPushLock->Expanded == 0) {
+        return;
+    }
+
+    CacheAware = AutoExpandPushLock->CacheAware;
+
+    ExAcquireCacheAwarePushLockExclusive (CacheAware);
+
+    KeQueryTickCount (&TickCount);
+    Elapsed = TickCount.LowPart - AutoExpandPushLock->WindowStart;
+
+    if (Elapsed < EXP_AUTO_EXPAND_WINDOW) {
+        return;
+    }
+
+    //
+    // All the slots are held so the shared acquire counts are stable.
+    //
+
+    MaxLine = KeNumberProcessors;
+    if (MaxLine > EX_PUSH_LOCK_FANNED_COUNT) {
+        MaxLine = EX_PUSH_LOCK_FANNED_COUNT;
+    }
+
+    SharedAcquires = 0;
+    for (i = 0; i < MaxLine; i++) {
+        PaddedPushLock = CONTAINING_RECORD (CacheAware->Locks[i],
+                                            EX_PUSH_LOCK_CACHE_AWARE_PADDED,
+                                            Lock);
+        SharedAcquires += PaddedPushLock->SharedAcquires;
+        PaddedPushLock->SharedAcquires = 0;
+    }
+
+    ExpResetAutoExpandPushLock (AutoExpandPushLock);
+
+    if (SharedAcquires / (Elapsed / EXP_AUTO_EXPAND_WINDOW) >= EXP_AUTO_EXPAND_COLLAPSE) {
+        return;
+    }
+
+    //
+    // Collapse the lock. The local lock alone now provides exclusion so
+    // the slots can be dropped. Shared acquirers waiting on a slot will
+    // see the lock is compact and retry on the local lock.
+    //
+
+    InterlockedExchange (&AutoExpandPushLock->Expanded, 0);
+
+    ExReleaseCacheAwarePushLockExclusive (CacheAware);
+}
+
+NTKERNELAPI
+VOID
+ExReleaseAutoExpandPushLockExclusive (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Release an auto expanding push lock exclusive.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be released
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (AutoExpandPushLock->Expanded != 0) {
+        ExReleaseCacheAwarePushLockExclusive (AutoExpandPushLock->CacheAware);
+    }
+
+    ExReleasePushLockExclusive (&AutoExpandPushLock->LocalLock);
+}
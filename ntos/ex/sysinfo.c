@@ -120,6 +120,37 @@ typedef struct _SYSTEM_FIRMWARE_TABLE_HANDLER_NODE {
     LIST_ENTRY FirmwareTableProviderList;
 } SYSTEM_FIRMWARE_TABLE_HANDLER_NODE, *PSYSTEM_FIRMWARE_TABLE_HANDLER_NODE;
 
+//
+// Change tracking for SystemProcessDeltaInformation. Each delta query takes
+// a new generation and stamps the processes and threads whose counters
+// changed since they were last examined. Thread and process exits are kept
+// in a ring so a later query can report them.
+//
+
+#define EXP_PROCESS_EXIT_LOG_SIZE 4096
+
+typedef struct _EXP_PROCESS_EXIT_LOG_ENTRY {
+    HANDLE UniqueProcessId;
+    HANDLE UniqueThreadId;
+    ULONG Generation;
+} EXP_PROCESS_EXIT_LOG_ENTRY, *PEXP_PROCESS_EXIT_LOG_ENTRY;
+
+typedef struct _EXP_PROCESS_DELTA {
+    ULONG Generation;
+    ULONG NewGeneration;
+    ULONG Flags;
+    ULONG NumberOfProcesses;
+    ULONG NumberOfExits;
+    ULONG ExitInformationOffset;
+} EXP_PROCESS_DELTA, *PEXP_PROCESS_DELTA;
+
+KSPIN_LOCK ExpProcessDeltaLock;
+ULONG ExpProcessDeltaGeneration;
+ULONG ExpProcessExitLogNext;
+ULONG ExpProcessExitLogEntries;
+ULONG ExpProcessExitLogLostGeneration;
+EXP_PROCESS_EXIT_LOG_ENTRY ExpProcessExitLog[EXP_PROCESS_EXIT_LOG_SIZE];
+
 NTSTATUS
 ExpValidateLocale (
     IN LCID LocaleId
@@ -155,7 +186,41 @@ ExpGetProcessInformation (
     IN ULONG SystemInformationLength,
     OUT PULONG Length OPTIONAL,
     IN PULONG SessionId OPTIONAL,
-    IN BOOLEAN ExtendedInformation
+    IN BOOLEAN ExtendedInformation,
+    IN OUT PEXP_PROCESS_DELTA Delta OPTIONAL
+    );
+
+ULONG
+ExpStampInformationGeneration (
+    IN OUT PULONG InformationSignature,
+    IN OUT PULONG InformationGeneration,
+    IN ULONG Signature,
+    IN ULONG Generation
+    );
+
+ULONG
+ExpUpdateProcessGeneration (
+    IN PEPROCESS Process,
+    IN ULONG Generation
+    );
+
+ULONG
+ExpUpdateThreadGeneration (
+    IN PETHREAD Thread,
+    IN ULONG Generation
+    );
+
+VOID
+ExpStartProcessDelta (
+    IN OUT PEXP_PROCESS_DELTA Delta
+    );
+
+VOID
+ExpCopyProcessExitLog (
+    IN OUT PEXP_PROCESS_DELTA Delta,
+    IN PVOID MappedAddress,
+    IN ULONG SystemInformationLength,
+    IN OUT PULONG TotalSize
     );
 
 NTSTATUS
@@ -326,6 +391,7 @@ ExpRegisterFirmwareTableInformationHandler (
 #pragma alloc_text(PAGE, ExpGetObjectInformation)
 #pragma alloc_text(PAGE, ExpQueryModuleInformation)
 #pragma alloc_text(PAGE, ExpCopyProcessInfo)
+#pragma alloc_text(PAGE, ExpUpdateProcessGeneration)
 #pragma alloc_text(PAGE, ExpQueryLegacyDriverInformation)
 #pragma alloc_text(PAGE, ExLockUserBuffer)
 #pragma alloc_text(PAGE, ExpQueryNumaAvailableMemory)
@@ -1703,6 +1769,8 @@ Return Value:
     PSYSTEM_CONTEXT_SWITCH_INFORMATION ContextSwitchInformation;
     PSYSTEM_INTERRUPT_INFORMATION InterruptInformation;
     PSYSTEM_SESSION_PROCESS_INFORMATION SessionProcessInformation;
+    PSYSTEM_PROCESS_DELTA_INFORMATION ProcessDeltaInformation;
+    EXP_PROCESS_DELTA ProcessDelta;
     PVOID ProcessInformation;
     ULONG ProcessInformationLength;
     PSYSTEM_SESSION_POOLTAG_INFORMATION SessionPoolTagInformation;
@@ -1905,7 +1973,7 @@ Return Value:
             //
 
             LocalPerformanceInfo.AvailablePages = (ULONG)MmAvailablePages;
-            LocalPerformanceInfo.CommittedPages = (SYSINF_PAGE_COUNT)MmTotalCommittedPages;
+            LocalPerformanceInfo.CommittedPages = (SYSINF_PAGE_COUNT)MmQueryCommittedPages ();
             LocalPerformanceInfo.CommitLimit = (SYSINF_PAGE_COUNT)MmTotalCommitLimit;
             LocalPerformanceInfo.PeakCommitment = (SYSINF_PAGE_COUNT)MmPeakCommitment;
 
@@ -2232,7 +2300,8 @@ Return Value:
                                                SystemInformationLength,
                                                ReturnLength,
                                                NULL,
-                                               ExtendedInformation);
+                                               ExtendedInformation,
+                                               NULL);
             }
 
             break;
@@ -2262,7 +2331,53 @@ Return Value:
                                                ProcessInformationLength,
                                                ReturnLength,
                                                &SessionId,
-                                               FALSE);
+                                               FALSE,
+                                               NULL);
+            break;
+
+        case SystemProcessDeltaInformation:
+
+            ProcessDeltaInformation =
+                        (PSYSTEM_PROCESS_DELTA_INFORMATION)SystemInformation;
+
+            if (SystemInformationLength < sizeof( SYSTEM_PROCESS_DELTA_INFORMATION)) {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            //
+            // The lower level locks the buffer specified below into memory using MmProbeAndLockPages.
+            // We don't need to probe the buffers here.
+            //
+
+            ProcessDelta.Generation = ProcessDeltaInformation->Generation;
+            ProcessDelta.Flags = ProcessDeltaInformation->Flags & SYSTEM_PROCESS_DELTA_EXTENDED;
+            ProcessInformation = ProcessDeltaInformation->Buffer;
+            ProcessInformationLength = ProcessDeltaInformation->SizeOfBuf;
+
+            if (!POINTER_IS_ALIGNED (ProcessInformation, sizeof (ULONG))) {
+                return STATUS_DATATYPE_MISALIGNMENT;
+            }
+
+            Status = ExpGetProcessInformation (ProcessInformation,
+                                               ProcessInformationLength,
+                                               ReturnLength,
+                                               NULL,
+                                               (BOOLEAN)((ProcessDelta.Flags & SYSTEM_PROCESS_DELTA_EXTENDED) != 0),
+                                               &ProcessDelta);
+
+            //
+            // Only hand out the new generation once the caller has received
+            // everything that changed before it. Stamps only move forward so
+            // a retry with the old generation still returns the changes.
+            //
+
+            if (NT_SUCCESS (Status)) {
+                ProcessDeltaInformation->Generation = ProcessDelta.NewGeneration;
+                ProcessDeltaInformation->Flags = ProcessDelta.Flags;
+                ProcessDeltaInformation->NumberOfProcesses = ProcessDelta.NumberOfProcesses;
+                ProcessDeltaInformation->NumberOfExits = ProcessDelta.NumberOfExits;
+                ProcessDeltaInformation->ExitInformationOffset = ProcessDelta.ExitInformationOffset;
+            }
             break;
 
         case SystemCallCountInformation:
@@ -2532,6 +2647,83 @@ Return Value:
 
             }
 
+        case SystemPageCombineInformation:
+
+            {
+
+            SYSTEM_PAGE_COMBINE_INFORMATION CapturedPageCombineInformation;
+
+            if (SystemInformationLength != sizeof( SYSTEM_PAGE_COMBINE_INFORMATION )) {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            //
+            // Capture the statistics first as the combiner's mutex must not
+            // be held while the user buffer is written.
+            //
+
+            MmQueryPageCombineInformation (&CapturedPageCombineInformation);
+
+            *(PSYSTEM_PAGE_COMBINE_INFORMATION)SystemInformation =
+                                            CapturedPageCombineInformation;
+
+            if (ARGUMENT_PRESENT( ReturnLength )) {
+                *ReturnLength = sizeof( SYSTEM_PAGE_COMBINE_INFORMATION );
+            }
+            break;
+
+            }
+
+        case SystemWorkingSetAgingInformation:
+
+            {
+
+            SYSTEM_WORKING_SET_AGING_INFORMATION CapturedAgingInformation;
+            PEPROCESS Process;
+            KAPC_STATE ApcState;
+
+            if (SystemInformationLength != sizeof( SYSTEM_WORKING_SET_AGING_INFORMATION )) {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            CapturedAgingInformation.UniqueProcessId =
+                ((PSYSTEM_WORKING_SET_AGING_INFORMATION)SystemInformation)->UniqueProcessId;
+
+            Status = PsLookupProcessByProcessId (CapturedAgingInformation.UniqueProcessId,
+                                                 &Process);
+
+            if (!NT_SUCCESS( Status )) {
+                return Status;
+            }
+
+            //
+            // The working set list is only mapped in the context of its
+            // process.  Capture the statistics there and drop the process
+            // reference before the user buffer is written.
+            //
+
+            KeStackAttachProcess (&Process->Pcb, &ApcState);
+
+            Status = MmQueryWorkingSetAgingInformation (&CapturedAgingInformation);
+
+            KeUnstackDetachProcess (&ApcState);
+
+            ObDereferenceObject (Process);
+
+            if (!NT_SUCCESS( Status )) {
+                return Status;
+            }
+
+            *(PSYSTEM_WORKING_SET_AGING_INFORMATION)SystemInformation =
+                                            CapturedAgingInformation;
+
+            if (ARGUMENT_PRESENT( ReturnLength )) {
+                *ReturnLength = sizeof( SYSTEM_WORKING_SET_AGING_INFORMATION );
+            }
+            break;
+
+            }
+
         case SystemSessionPoolTagInformation:
 
             SessionProcessInformation =
@@ -4232,7 +4424,8 @@ ExpGetProcessInformation (
     IN ULONG SystemInformationLength,
     OUT PULONG Length OPTIONAL,
     IN PULONG SessionId OPTIONAL,
-    IN BOOLEAN ExtendedInformation
+    IN BOOLEAN ExtendedInformation,
+    IN OUT PEXP_PROCESS_DELTA Delta OPTIONAL
     )
 
 /*++
@@ -4242,6 +4435,12 @@ Routine Description:
     This function returns information about all the processes and
     threads in the system.
 
+    If Delta is specified only the processes and threads that were created
+    or whose counters changed after the generation in Delta was handed out
+    are returned, followed by records for the processes and threads that
+    exited since then. Thread counters are read without the dispatcher
+    lock in this mode.
+
 Arguments:
 
     SystemInformation - A pointer to a buffer which receives the specified
@@ -4257,6 +4456,9 @@ Arguments:
 
     ExtendedInformation - TRUE if extended information (e.g., Process PDE) is needed.
 
+    Delta - Optional delta query state. Supplies the caller's previous
+        generation and receives the new generation, flags and counts.
+
 Environment:
 
     Kernel mode.
@@ -4308,11 +4510,20 @@ Return Value:
     ULONG n, nc;
     NTSTATUS status = STATUS_SUCCESS, status1;
     PUNICODE_STRING pImageFileName;
+    PSYSTEM_PROCESS_INFORMATION LastProcessInfo = NULL;
+    ULONG ProcessStart;
+    ULONG ThreadsIncluded;
+    ULONG NumberOfThreads;
+    BOOLEAN IncludeProcess;
 
     if (ARGUMENT_PRESENT(Length)) {
         *Length = 0;
     }
 
+    if (ARGUMENT_PRESENT(Delta)) {
+        ExpStartProcessDelta (Delta);
+    }
+
     if (SystemInformationLength > 0) {
         status1 = ExLockUserBuffer (SystemInformation,
                                     SystemInformationLength,
@@ -4383,6 +4594,22 @@ Return Value:
                 continue;
             }
 
+            //
+            // For delta queries a process whose own counters did not change
+            // is only returned if one of its threads is.
+            //
+
+            IncludeProcess = TRUE;
+            if (ARGUMENT_PRESENT(Delta) &&
+                (ExpUpdateProcessGeneration (Process, Delta->NewGeneration) <= Delta->Generation) &&
+                ((Delta->Flags & SYSTEM_PROCESS_DELTA_FULL) == 0)) {
+
+                IncludeProcess = FALSE;
+            }
+
+            ProcessStart = TotalSize;
+            ThreadsIncluded = 0;
+
             ProcessInfo = (PSYSTEM_PROCESS_INFORMATION)
                             ((PUCHAR)MappedAddress + TotalSize);
 
@@ -4394,6 +4621,15 @@ Return Value:
                     leave;
                 }
 
+            } else if (IncludeProcess == FALSE) {
+
+                //
+                // The process information is filled in below once it is
+                // known that one of its threads is returned.
+                //
+
+                ProcessInfo->NumberOfThreads = 0;
+
             } else {
 
                 //
@@ -4438,6 +4674,20 @@ Return Value:
 
             NextThread = Process->Pcb.ThreadListHead.Flink;
             while (NextThread != &Process->Pcb.ThreadListHead) {
+                Thread = (PETHREAD)(CONTAINING_RECORD(NextThread,
+                                                      KTHREAD,
+                                                      ThreadListEntry));
+
+                NextThread = NextThread->Flink;
+
+                if (ARGUMENT_PRESENT(Delta) &&
+                    (ExpUpdateThreadGeneration (Thread, Delta->NewGeneration) <= Delta->Generation) &&
+                    ((Delta->Flags & SYSTEM_PROCESS_DELTA_FULL) == 0)) {
+
+                    continue;
+                }
+
+                ThreadsIncluded += 1;
                 NextEntryOffset += ThreadInfoSize;
                 TotalSize += ThreadInfoSize;
 
@@ -4449,23 +4699,32 @@ Return Value:
                     }
 
                 } else {
-                    Thread = (PETHREAD)(CONTAINING_RECORD(NextThread,
-                                                          KTHREAD,
-                                                          ThreadListEntry));
 
-                    //
-                    // Lock dispatcher database to get atomic view of thread
-                    // attributes.
-                    //
+                    if (ARGUMENT_PRESENT(Delta)) {
+
+                        //
+                        // Delta queries are issued at a high rate by
+                        // monitoring agents so the thread attributes are
+                        // sampled without the dispatcher lock.
+                        //
+
+                        ExpCopyThreadInfo (ThreadInfo, Thread, ExtendedInformation);
+
+                    } else {
+
+                        //
+                        // Lock dispatcher database to get atomic view of thread
+                        // attributes.
+                        //
+
+                        KiLockDispatcherDatabaseAtSynchLevel();
+                        ExpCopyThreadInfo (ThreadInfo, Thread, ExtendedInformation);
+                        KiUnlockDispatcherDatabaseFromSynchLevel();
+                    }
 
-                    KiLockDispatcherDatabaseAtSynchLevel();
-                    ExpCopyThreadInfo (ThreadInfo, Thread, ExtendedInformation);
-                    KiUnlockDispatcherDatabaseFromSynchLevel();
                     ProcessInfo->NumberOfThreads += 1;
                     ThreadInfo = (PCHAR) ThreadInfo + ThreadInfoSize;
                 }
-
-                NextThread = NextThread->Flink;
             }
 
             //
@@ -4474,6 +4733,36 @@ Return Value:
 
             KeReleaseInStackQueuedSpinLock(&LockHandle);
 
+            if (IncludeProcess == FALSE) {
+
+                if (ThreadsIncluded == 0) {
+
+                    //
+                    // Nothing in this process changed, give back the space
+                    // reserved for it.
+                    //
+
+                    TotalSize = ProcessStart;
+                    ProcessInfo = LastProcessInfo;
+                    continue;
+                }
+
+                if (ProcessStart + sizeof(SYSTEM_PROCESS_INFORMATION) <= SystemInformationLength) {
+                    NumberOfThreads = ProcessInfo->NumberOfThreads;
+                    ExpCopyProcessInfo (ProcessInfo, Process, ExtendedInformation);
+                    ProcessInfo->NumberOfThreads = NumberOfThreads;
+                    ProcessInfo->NextEntryOffset = 0;
+                    ProcessInfo->SessionId = ProcessSessionId;
+                    ProcessInfo->ImageName.Buffer = NULL;
+                    ProcessInfo->ImageName.Length = 0;
+                    ProcessInfo->ImageName.MaximumLength = 0;
+                    if (Process == PsIdleProcess) {
+                        ProcessInfo->HandleCount = 0;
+                        ProcessInfo->SessionId = 0;
+                    }
+                }
+            }
+
             //
             // Get the image name.
             //
@@ -4573,12 +4862,33 @@ Return Value:
             if (NT_SUCCESS (status)) {
                 ProcessInfo->NextEntryOffset = NextEntryOffset;
             }
+
+            LastProcessInfo = ProcessInfo;
+
+            if (ARGUMENT_PRESENT(Delta)) {
+                Delta->NumberOfProcesses += 1;
+            }
         }
 
-        if (NT_SUCCESS(status)) {
+        //
+        // A delta query may not have returned any process at all.
+        //
+
+        if (NT_SUCCESS(status) && (ProcessInfo != NULL)) {
             ProcessInfo->NextEntryOffset = 0;
         }
 
+        if (ARGUMENT_PRESENT(Delta)) {
+            ExpCopyProcessExitLog (Delta,
+                                   MappedAddress,
+                                   SystemInformationLength,
+                                   &TotalSize);
+
+            if (TotalSize > SystemInformationLength) {
+                status = STATUS_INFO_LENGTH_MISMATCH;
+            }
+        }
+
         if (ARGUMENT_PRESENT(Length)) {
             *Length = TotalSize;
         }
@@ -5209,6 +5519,382 @@ Return Value:
 
 }
 
+ULONG
+ExpStampInformationGeneration (
+    IN OUT PULONG InformationSignature,
+    IN OUT PULONG InformationGeneration,
+    IN ULONG Signature,
+    IN ULONG Generation
+    )
+
+/*++
+
+Routine Description:
+
+    This function records the signature of a process or thread and, if it
+    differs from the one recorded by the previous query, stamps the object
+    with a generation that every query which may already have passed the
+    object will report it in.
+
+    The stamp is the latest generation handed out if the calling query
+    holds it.  Otherwise a newer query may have already returned the old
+    counters, so the object is stamped one past the latest generation.
+    The stamp never moves backwards.
+
+Arguments:
+
+    InformationSignature - Supplies the signature recorded in the object.
+
+    InformationGeneration - Supplies the generation stamped in the object.
+
+    Signature - Supplies the signature of the counters just sampled.
+
+    Generation - Supplies the generation of the current delta query.
+
+Return Value:
+
+    The generation in which the object was last seen to change.
+
+--*/
+
+{
+    ULONG Stamp;
+    KLOCK_QUEUE_HANDLE LockHandle;
+
+    KeAcquireInStackQueuedSpinLock (&ExpProcessDeltaLock, &LockHandle);
+
+    if ((Signature != *InformationSignature) ||
+        (*InformationGeneration == 0)) {
+
+        *InformationSignature = Signature;
+
+        Stamp = ExpProcessDeltaGeneration;
+
+        if (Generation != Stamp) {
+            Stamp += 1;
+        }
+
+        if (Stamp > *InformationGeneration) {
+            *InformationGeneration = Stamp;
+        }
+    }
+
+    Stamp = *InformationGeneration;
+
+    KeReleaseInStackQueuedSpinLock (&LockHandle);
+
+    return Stamp;
+}
+
+ULONG
+ExpUpdateProcessGeneration (
+    IN PEPROCESS Process,
+    IN ULONG Generation
+    )
+
+/*++
+
+Routine Description:
+
+    This function computes a signature of the counters returned for the
+    specified process and stamps the process with a new generation if the
+    signature differs from the one recorded by the previous query.
+
+    The signature is only a change detector, the counters are sampled
+    without any locks.
+
+Arguments:
+
+    Process - Supplies a pointer to the process.
+
+    Generation - Supplies the generation of the current delta query.
+
+Return Value:
+
+    The generation in which the process was last seen to change.
+
+--*/
+
+{
+    ULONG Signature;
+
+    PAGED_CODE();
+
+    Signature = Process->Vm.PageFaultCount;
+    Signature = (Signature * 31) + Process->Vm.WorkingSetSize;
+    Signature = (Signature * 31) + (ULONG) Process->VirtualSize;
+    Signature = (Signature * 31) + (ULONG) Process->CommitCharge;
+    Signature = (Signature * 31) + (ULONG) Process->QuotaUsage[PsPagedPool];
+    Signature = (Signature * 31) + (ULONG) Process->QuotaUsage[PsNonPagedPool];
+    Signature = (Signature * 31) + Process->ActiveThreads;
+    Signature = (Signature * 31) + ObGetProcessHandleCount (Process);
+    Signature = (Signature * 31) + Process->ReadOperationCount.LowPart;
+    Signature = (Signature * 31) + Process->WriteOperationCount.LowPart;
+    Signature = (Signature * 31) + Process->OtherOperationCount.LowPart;
+    Signature = (Signature * 31) + Process->Pcb.BasePriority;
+
+    return ExpStampInformationGeneration (&Process->InformationSignature,
+                                          &Process->InformationGeneration,
+                                          Signature,
+                                          Generation);
+}
+
+ULONG
+ExpUpdateThreadGeneration (
+    IN PETHREAD Thread,
+    IN ULONG Generation
+    )
+
+/*++
+
+Routine Description:
+
+    This function computes a signature of the counters returned for the
+    specified thread and stamps the thread with a new generation if the
+    signature differs from the one recorded by the previous query.
+
+Arguments:
+
+    Thread - Supplies a pointer to the thread.
+
+    Generation - Supplies the generation of the current delta query.
+
+Environment:
+
+    Kernel mode. The process lock is held.
+
+Return Value:
+
+    The generation in which the thread was last seen to change.
+
+--*/
+
+{
+    ULONG Signature;
+
+    Signature = Thread->Tcb.KernelTime;
+    Signature = (Signature * 31) + Thread->Tcb.UserTime;
+    Signature = (Signature * 31) + Thread->Tcb.ContextSwitches;
+    Signature = (Signature * 31) + Thread->Tcb.State;
+    Signature = (Signature * 31) + Thread->Tcb.WaitReason;
+    Signature = (Signature * 31) + Thread->Tcb.Priority;
+    Signature = (Signature * 31) + Thread->Tcb.BasePriority;
+
+    return ExpStampInformationGeneration (&Thread->InformationSignature,
+                                          &Thread->InformationGeneration,
+                                          Signature,
+                                          Generation);
+}
+
+VOID
+ExpStartProcessDelta (
+    IN OUT PEXP_PROCESS_DELTA Delta
+    )
+
+/*++
+
+Routine Description:
+
+    This function allocates the generation for a delta query and decides
+    whether the caller's generation can be served incrementally.
+
+Arguments:
+
+    Delta - Supplies the caller's generation and flags, receives the new
+        generation.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KLOCK_QUEUE_HANDLE LockHandle;
+
+    Delta->NumberOfProcesses = 0;
+    Delta->NumberOfExits = 0;
+    Delta->ExitInformationOffset = 0;
+
+    KeAcquireInStackQueuedSpinLock (&ExpProcessDeltaLock, &LockHandle);
+
+    ExpProcessDeltaGeneration += 1;
+    if (ExpProcessDeltaGeneration == 0) {
+        ExpProcessDeltaGeneration = 1;
+    }
+
+    Delta->NewGeneration = ExpProcessDeltaGeneration;
+
+    //
+    // A generation of zero, one that was never handed out, or one older
+    // than exits that have already been dropped from the log cannot be
+    // served incrementally. Return every live process instead.
+    //
+
+    if ((Delta->Generation == 0) ||
+        (Delta->Generation >= Delta->NewGeneration) ||
+        (Delta->Generation < ExpProcessExitLogLostGeneration)) {
+
+        Delta->Flags |= SYSTEM_PROCESS_DELTA_FULL;
+    }
+
+    KeReleaseInStackQueuedSpinLock (&LockHandle);
+}
+
+VOID
+ExpCopyProcessExitLog (
+    IN OUT PEXP_PROCESS_DELTA Delta,
+    IN PVOID MappedAddress,
+    IN ULONG SystemInformationLength,
+    IN OUT PULONG TotalSize
+    )
+
+/*++
+
+Routine Description:
+
+    This function appends the exit records that belong to a delta query
+    after the process information already placed in the buffer.
+
+Arguments:
+
+    Delta - Supplies the delta query state, receives the exit count and
+        offset.
+
+    MappedAddress - Supplies the system address of the locked buffer.
+
+    SystemInformationLength - Supplies the length of the buffer.
+
+    TotalSize - Supplies the size used so far, receives the size including
+        the exit records.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KLOCK_QUEUE_HANDLE LockHandle;
+    PEXP_PROCESS_EXIT_LOG_ENTRY Entry;
+    PSYSTEM_PROCESS_DELTA_EXIT_INFORMATION ExitInfo;
+    ULONG Index;
+    ULONG i;
+
+    *TotalSize = ROUND_UP (*TotalSize, sizeof(PVOID));
+    Delta->ExitInformationOffset = *TotalSize;
+
+    //
+    // A full snapshot already reflects every exit up to this generation.
+    //
+
+    if (Delta->Flags & SYSTEM_PROCESS_DELTA_FULL) {
+        return;
+    }
+
+    KeAcquireInStackQueuedSpinLock (&ExpProcessDeltaLock, &LockHandle);
+
+    Index = ExpProcessExitLogNext - ExpProcessExitLogEntries;
+
+    for (i = 0; i < ExpProcessExitLogEntries; i += 1) {
+
+        Entry = &ExpProcessExitLog[(Index + i) % EXP_PROCESS_EXIT_LOG_SIZE];
+
+        if ((Entry->Generation <= Delta->Generation) ||
+            (Entry->Generation > Delta->NewGeneration)) {
+            continue;
+        }
+
+        *TotalSize += sizeof(SYSTEM_PROCESS_DELTA_EXIT_INFORMATION);
+
+        if (*TotalSize <= SystemInformationLength) {
+            ExitInfo = (PSYSTEM_PROCESS_DELTA_EXIT_INFORMATION)
+                ((PUCHAR)MappedAddress + *TotalSize - sizeof(SYSTEM_PROCESS_DELTA_EXIT_INFORMATION));
+
+            ExitInfo->UniqueProcessId = Entry->UniqueProcessId;
+            ExitInfo->UniqueThreadId = Entry->UniqueThreadId;
+        }
+
+        Delta->NumberOfExits += 1;
+    }
+
+    //
+    // Exits may have been dropped while the processes were walked.
+    //
+
+    if (Delta->Generation < ExpProcessExitLogLostGeneration) {
+        Delta->Flags |= SYSTEM_PROCESS_DELTA_EXITS_LOST;
+    }
+
+    KeReleaseInStackQueuedSpinLock (&LockHandle);
+}
+
+VOID
+ExRecordProcessInformationExit (
+    IN HANDLE UniqueProcessId,
+    IN HANDLE UniqueThreadId OPTIONAL
+    )
+
+/*++
+
+Routine Description:
+
+    This function records a thread or process exit so the next delta
+    query for process information can report it.
+
+Arguments:
+
+    UniqueProcessId - Supplies the id of the process.
+
+    UniqueThreadId - Supplies the id of the exiting thread or NULL if the
+        process itself is exiting.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    KLOCK_QUEUE_HANDLE LockHandle;
+    PEXP_PROCESS_EXIT_LOG_ENTRY Entry;
+
+    //
+    // Nothing needs to be recorded until the first delta query is made.
+    //
+
+    if (ExpProcessDeltaGeneration == 0) {
+        return;
+    }
+
+    KeAcquireInStackQueuedSpinLock (&ExpProcessDeltaLock, &LockHandle);
+
+    Entry = &ExpProcessExitLog[ExpProcessExitLogNext % EXP_PROCESS_EXIT_LOG_SIZE];
+
+    if (ExpProcessExitLogEntries == EXP_PROCESS_EXIT_LOG_SIZE) {
+
+        //
+        // The oldest entry is overwritten, callers at or before its
+        // generation must resynchronize.
+        //
+
+        if (Entry->Generation > ExpProcessExitLogLostGeneration) {
+            ExpProcessExitLogLostGeneration = Entry->Generation;
+        }
+
+    } else {
+        ExpProcessExitLogEntries += 1;
+    }
+
+    Entry->UniqueProcessId = UniqueProcessId;
+    Entry->UniqueThreadId = UniqueThreadId;
+    Entry->Generation = ExpProcessDeltaGeneration + 1;
+
+    ExpProcessExitLogNext = (ExpProcessExitLogNext + 1) % EXP_PROCESS_EXIT_LOG_SIZE;
+
+    KeReleaseInStackQueuedSpinLock (&LockHandle);
+}
+
 #if defined(_X86_)
 
 extern ULONG ExVdmOpcodeDispatchCounts[256];
@@ -78,9 +78,14 @@ typedef struct _UUID_CACHED_VALUES_STRUCT {
     LONG                AllocatedCount; // Number of UUIDs allocated
     UCHAR               ClockSeqHiAndReserved;
     UCHAR               ClockSeqLow;
-    UCHAR               NodeId[6];
 } UUID_CACHED_VALUES_STRUCT;
 
+// A per-processor cache of allocated UUIDs, only accessed by its owning
+// processor at DISPATCH_LEVEL.
+typedef struct DECLSPEC_CACHEALIGN _UUID_PROCESSOR_CACHE {
+    UUID_CACHED_VALUES_STRUCT Values;
+} UUID_PROCESSOR_CACHE, *PUUID_PROCESSOR_CACHE;
+
 
 //
 //  Global variables
@@ -90,16 +95,20 @@ typedef struct _UUID_CACHED_VALUES_STRUCT {
 LARGE_INTEGER               ExpUuidLastTimeAllocated;
 BOOLEAN                     ExpUuidCacheValid = CACHE_LOCAL_ONLY;
 
-// Make cache allocate UUIDs on first call.
-// Time = 0. Allocated = -1, ..., multicast bit in node id
-UUID_CACHED_VALUES_STRUCT   ExpUuidCachedValues = { 0, -1, 0, 0, { 0x80, 'm', 'a', 'r', 'i', 'o' }};
+// Node id used in UUIDs, multicast bit set until a seed is provided.
+UCHAR                       ExpUuidNodeId[6] = { 0x80, 'm', 'a', 'r', 'i', 'o' };
+
+// Each processor hands out UUIDs from its own block of time values and
+// refills it in batches from ExpAllocateUuids.  The caches start empty
+// so that they are filled on first use.
+UUID_PROCESSOR_CACHE        ExpUuidProcessorCache[MAXIMUM_PROCESSORS];
 
 // UUID Sequence number information
 ULONG                       ExpUuidSequenceNumber;
 BOOLEAN                     ExpUuidSequenceNumberValid;
 BOOLEAN                     ExpUuidSequenceNumberNotSaved;
 
-// A lock to protect all of the above global data.
+// A lock to protect the time and sequence number data above.
 FAST_MUTEX                  ExpUuidLock;
 
 //
@@ -120,6 +129,13 @@ extern NTSTATUS ExpUuidGetValues(
     OUT UUID_CACHED_VALUES_STRUCT *Values
     );
 
+extern BOOLEAN ExpUuidGetCachedValue(
+    IN OUT UUID_CACHED_VALUES_STRUCT *Refill,
+    OUT PULONGLONG Time,
+    OUT PUCHAR ClockSeqHiAndReserved,
+    OUT PUCHAR ClockSeqLow
+    );
+
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, ExpUuidLoadSequenceNumber)
@@ -586,7 +602,7 @@ Return Value:
         // Store the UUID seed
         //
         ProbeForRead(Seed, SEED_SIZE, sizeof(CHAR));
-        RtlCopyMemory(&ExpUuidCachedValues.NodeId[0], Seed, SEED_SIZE);
+        RtlCopyMemory(&ExpUuidNodeId[0], Seed, SEED_SIZE);
 
         if ((Seed[0] & 0x80) == 0)
             {
@@ -735,7 +751,7 @@ Return Value:
         Time->QuadPart = OutputTime.QuadPart;
         *Range = OutputRange;
         *Sequence = OutputSequence;
-        RtlCopyMemory((PVOID) Seed, &ExpUuidCachedValues.NodeId[0], SEED_SIZE);
+        RtlCopyMemory((PVOID) Seed, &ExpUuidNodeId[0], SEED_SIZE);
     }
     except (ExSystemExceptionFilter()) {
         return GetExceptionCode();
@@ -837,6 +853,79 @@ Return Value:
 
 
 
+BOOLEAN
+ExpUuidGetCachedValue(
+    IN OUT UUID_CACHED_VALUES_STRUCT *Refill,
+    OUT PULONGLONG Time,
+    OUT PUCHAR ClockSeqHiAndReserved,
+    OUT PUCHAR ClockSeqLow
+    )
+/*++
+
+Routine Description:
+
+    This routine takes the next UUID time value from the current
+    processor's cache.  If the processor's cache is empty and the caller
+    supplied a freshly allocated block, the block is installed as the
+    processor's cache first.  If the processor's cache was refilled by
+    another thread in the meantime, the value is taken from the caller's
+    block instead so the caller always makes progress after a refill.
+
+    This routine is not pageable since it runs at DISPATCH_LEVEL.
+
+Arguments:
+
+    Refill - Supplies a block of UUIDs allocated by ExpUuidGetValues.
+        AllocatedCount is zero if the caller has no block to offer.
+
+    Time - Receives the UUID time value.
+
+    ClockSeqHiAndReserved - Receives the high byte of the clock sequence
+        that goes with Time.
+
+    ClockSeqLow - Receives the low byte of the clock sequence that goes
+        with Time.
+
+Return Value:
+
+    TRUE if a value was returned, FALSE if both the processor's cache and
+    the caller's block are empty.
+
+--*/
+{
+    KIRQL OldIrql;
+    UUID_CACHED_VALUES_STRUCT *Values;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &OldIrql);
+
+    Values = &ExpUuidProcessorCache[KeGetCurrentProcessorNumber()].Values;
+
+    if (Values->AllocatedCount == 0) {
+        *Values = *Refill;
+        Refill->AllocatedCount = 0;
+        }
+    else if (Refill->AllocatedCount != 0) {
+        Values = Refill;
+        }
+
+    if (Values->AllocatedCount == 0) {
+        KeLowerIrql(OldIrql);
+        return(FALSE);
+        }
+
+    Values->AllocatedCount -= 1;
+
+    *Time = Values->Time - Values->AllocatedCount;
+    *ClockSeqHiAndReserved = Values->ClockSeqHiAndReserved;
+    *ClockSeqLow = Values->ClockSeqLow;
+
+    KeLowerIrql(OldIrql);
+
+    return(TRUE);
+}
+
+
+
 NTSTATUS
 ExUuidCreate(
     OUT UUID *Uuid
@@ -868,64 +957,32 @@ Return Value:
 
     UUID_GENERATE  *UuidGen = (UUID_GENERATE *) Uuid;
     ULONGLONG       Time;
-    LONG            Delta;
+    UUID_CACHED_VALUES_STRUCT Refill;
 
     PAGED_CODE();
 
     //
-    // Get a value from the cache.  If the cache is empty, we'll fill
-    // it and retry.  The first time cache will be empty.
+    // Get a value from this processor's cache.  If the cache is empty,
+    // we'll allocate a new block under the lock and retry.  The first
+    // time the cache will be empty.
     //
 
-    for(;;) {
-
-        // Get the highest value in the cache (though it may not
-        // be available).
-        Time = ExpUuidCachedValues.Time;
-
-        // Copy the static info into the UUID.  We can't do this later
-        // because the clock sequence could be updated by another thread.
+    Refill.AllocatedCount = 0;
 
-        *(PULONG)&UuidGen->ClockSeqHiAndReserved =
-            *(PULONG)&ExpUuidCachedValues.ClockSeqHiAndReserved;
-        *(PULONG)&UuidGen->NodeId[2] =
-            *(PULONG)&ExpUuidCachedValues.NodeId[2];
-
-        // See what we need to subtract from Time to get a valid GUID.
-        Delta = InterlockedDecrement(&ExpUuidCachedValues.AllocatedCount);
-
-        if (Time != ExpUuidCachedValues.Time) {
-
-            // If our captured time doesn't match the cache then another
-            // thread already took the lock and updated the cache. We'll
-            // just loop and try again.
-            continue;
-            }
-
-        // If the cache hadn't already run dry, we can break out of this retry
-        // loop.
-        if (Delta >= 0) {
-            break;
-            }
+    while (!ExpUuidGetCachedValue( &Refill,
+                                   &Time,
+                                   &UuidGen->ClockSeqHiAndReserved,
+                                   &UuidGen->ClockSeqLow )) {
 
         //
         // Allocate a new block of Uuids.
         //
 
-        // Take the cache lock
+        // Take the lock
         KeEnterCriticalRegion();
         ExAcquireFastMutexUnsafe(&ExpUuidLock);
 
-        // If the cache has already been updated, try again.
-        if (Time != ExpUuidCachedValues.Time) {
-            // Release the lock
-            ExReleaseFastMutexUnsafe(&ExpUuidLock);
-            KeLeaveCriticalRegion();
-            continue;
-            }
-
-        // Update the cache.
-        Status = ExpUuidGetValues( &ExpUuidCachedValues );
+        Status = ExpUuidGetValues( &Refill );
 
         if (Status != STATUS_SUCCESS) {
             // Release the lock
@@ -947,11 +1004,10 @@ Return Value:
         // Loop
         }
 
-    // Adjust the time to that of the next available UUID.
-    Time -= Delta;
-
     // Finish filling in the UUID.
 
+    RtlCopyMemory(&UuidGen->NodeId[0], &ExpUuidNodeId[0], SEED_SIZE);
+
     UuidGen->TimeLow = (ULONG) Time;
     UuidGen->TimeMid = (USHORT) (Time >> 32);
     UuidGen->TimeHiAndVersion = (USHORT)
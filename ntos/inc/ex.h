@@ -2157,6 +2157,91 @@ ExUnlockUserBuffer(
     __inout PVOID LockVariable
     );
 
+//
+// Define the system information classes implemented by the executive
+// beyond those enumerated in ntexapi.h.  They are numbered from
+// MaxSystemInfoClass and have their own terminating value so range
+// checks never confuse a class with either sentinel.
+//
+
+typedef enum _SYSTEM_INFORMATION_CLASS_EXTENSION {
+    SystemInformationClassExtensionBase = MaxSystemInfoClass,
+    SystemProcessDeltaInformation,
+    SystemPageCombineInformation,
+    SystemWorkingSetAgingInformation,
+    MaxSystemInfoClassExtension
+} SYSTEM_INFORMATION_CLASS_EXTENSION;
+
+//
+// Define the system information class used to query the processes and
+// threads that were created, exited or changed since a previous query.
+//
+
+//
+// Input flags.
+//
+
+#define SYSTEM_PROCESS_DELTA_EXTENDED       0x00000001  // return extended thread information
+
+//
+// Output flags.
+//
+
+#define SYSTEM_PROCESS_DELTA_FULL           0x00010000  // every live process was returned
+#define SYSTEM_PROCESS_DELTA_EXITS_LOST     0x00020000  // exits were dropped, caller should resync
+
+typedef struct _SYSTEM_PROCESS_DELTA_EXIT_INFORMATION {
+    HANDLE UniqueProcessId;
+    HANDLE UniqueThreadId;                  // NULL if the process exited
+} SYSTEM_PROCESS_DELTA_EXIT_INFORMATION, *PSYSTEM_PROCESS_DELTA_EXIT_INFORMATION;
+
+typedef struct _SYSTEM_PROCESS_DELTA_INFORMATION {
+    ULONG Generation;                       // in: generation of previous query or 0, out: generation of this query
+    ULONG Flags;
+    ULONG NumberOfProcesses;                // out: entries in the process chain
+    ULONG NumberOfExits;                    // out: exit records following the chain
+    ULONG ExitInformationOffset;            // out: buffer offset of the exit records
+    ULONG SizeOfBuf;
+    PVOID Buffer;
+} SYSTEM_PROCESS_DELTA_INFORMATION, *PSYSTEM_PROCESS_DELTA_INFORMATION;
+
+VOID
+ExRecordProcessInformationExit (
+    IN HANDLE UniqueProcessId,
+    IN HANDLE UniqueThreadId OPTIONAL
+    );
+
+//
+// Define the system information class used to query the page combiner
+// which merges identical private pages into shared copy on write pages.
+//
+
+typedef struct _SYSTEM_PAGE_COMBINE_INFORMATION {
+    ULONG Enabled;
+    ULONG Reserved;
+    ULONGLONG PagesScanned;                 // trimmed pages examined
+    ULONGLONG PagesCombined;                // duplicates freed into a shared page
+    ULONGLONG ZeroPagesReclaimed;           // zero pages returned to demand zero
+    ULONGLONG SharedPages;                  // shared pages currently live
+    ULONGLONG BytesSaved;                   // current savings of live shared pages
+    LARGE_INTEGER ScanTime;                 // time spent scanning, 100ns units
+} SYSTEM_PAGE_COMBINE_INFORMATION, *PSYSTEM_PAGE_COMBINE_INFORMATION;
+
+//
+// Define the system information class used to query the working set aging
+// statistics of a process.
+//
+
+#define SYSTEM_WORKING_SET_GENERATIONS 4
+
+typedef struct _SYSTEM_WORKING_SET_AGING_INFORMATION {
+    HANDLE UniqueProcessId;                 // in: process to query
+    ULONG WorkingSetSize;                   // pages in the working set
+    ULONG GenerationCounts[SYSTEM_WORKING_SET_GENERATIONS]; // estimated unaccessed pages of each age, youngest first
+    ULONG PagesTrimmed;                     // pages removed by working set trims
+    ULONG TrimRefaults;                     // pages faulted back from the standby or modified list
+} SYSTEM_WORKING_SET_AGING_INFORMATION, *PSYSTEM_WORKING_SET_AGING_INFORMATION;
+
 // begin_ntddk begin_wdm begin_ntifs
 
 #if defined(_NTDDK_) || defined(_NTIFS_)
@@ -4892,10 +4977,31 @@ typedef struct _EX_PUSH_LOCK_CACHE_AWARE_PADDED {
         EX_PUSH_LOCK Lock;
         union {
             UCHAR Pad[EX_CACHE_LINE_SIZE - sizeof (EX_PUSH_LOCK)];
-            BOOLEAN Single;
+            struct {
+                BOOLEAN Single;
+                ULONG SharedAcquires;
+            };
         };
 } EX_PUSH_LOCK_CACHE_AWARE_PADDED, *PEX_PUSH_LOCK_CACHE_AWARE_PADDED;
 
+//
+// Define an auto expanding push lock. The lock starts out as a single push
+// lock and expands into a cache aware push lock once shared acquires are
+// seen contending from several processors. It collapses back to the single
+// push lock when shared traffic drops off. The cache aware push lock is
+// kept once allocated and is freed by ExDeleteAutoExpandPushLock.
+// Expansion allocates paged pool, so these locks must not be acquired on
+// paging paths.
+//
+typedef struct _EX_PUSH_LOCK_AUTO_EXPAND {
+    EX_PUSH_LOCK LocalLock;
+    PEX_PUSH_LOCK_CACHE_AWARE CacheAware;
+    LONG volatile Expanded;
+    LONG SharedContention;
+    LONG ContendingSlots;
+    ULONG WindowStart;
+} EX_PUSH_LOCK_AUTO_EXPAND, *PEX_PUSH_LOCK_AUTO_EXPAND;
+
 // begin_wdm begin_ntddk begin_ntifs 
 
 //
@@ -5541,74 +5647,11 @@ ExLuidInitialization (
     VOID
     );
 
-//
-// VOID
-// ExAllocateLocallyUniqueId (
-//     PLUID Luid
-//     )
-//
-//*++
-//
-// Routine Description:
-//
-//     This function returns an LUID value that is unique since the system
-//     was last rebooted. It is unique only on the system it is generated on
-//     and not network wide.
-//
-//     N.B. A LUID is a 64-bit value and for all practical purposes will
-//          never carry in the lifetime of a single boot of the system.
-//          At an increment rate of 1ns, the value would carry to zero in
-//          approximately 126 years.
-//
-// Arguments:
-//
-//     Luid - Supplies a pointer to a variable that receives the allocated
-//          locally unique Id.
-//
-// Return Value:
-//
-//     The allocated LUID value.
-//
-// --*/
-
-
-extern LARGE_INTEGER ExpLuid;
-extern const LARGE_INTEGER ExpLuidIncrement;
-
-__inline
+NTKERNELAPI
 VOID
 ExAllocateLocallyUniqueId (
-    IN OUT PLUID Luid
-    )
-
-{
-    LARGE_INTEGER Initial;
-
-#if defined (_WIN64) && !defined(_X86AMD64_)
-    Initial.QuadPart = InterlockedAdd64 (&ExpLuid.QuadPart, ExpLuidIncrement.QuadPart);
-#else
-    LARGE_INTEGER Value;
-
-
-    while (1) {
-        Initial.QuadPart = ExpLuid.QuadPart;
-
-        Value.QuadPart = Initial.QuadPart + ExpLuidIncrement.QuadPart;
-        Value.QuadPart = InterlockedCompareExchange64(&ExpLuid.QuadPart,
-                                                      Value.QuadPart,
-                                                      Initial.QuadPart);
-        if (Initial.QuadPart != Value.QuadPart) {
-            continue;
-        }
-        break;
-    }
-
-#endif
-
-    Luid->LowPart = Initial.LowPart;
-    Luid->HighPart = Initial.HighPart;
-    return;
-}
+    OUT PLUID Luid
+    );
 
 // begin_ntddk begin_wdm begin_ntifs begin_ntosp
 //
@@ -7742,6 +7785,111 @@ Return Value:
     return;
 }
 
+NTKERNELAPI
+VOID
+ExInitializeAutoExpandPushLock (
+     __out PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     );
+
+NTKERNELAPI
+VOID
+ExDeleteAutoExpandPushLock (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     );
+
+NTKERNELAPI
+VOID
+ExAcquireAutoExpandPushLockExclusive (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     );
+
+NTKERNELAPI
+VOID
+ExReleaseAutoExpandPushLockExclusive (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     );
+
+NTKERNELAPI
+PEX_PUSH_LOCK
+FASTCALL
+ExfAcquireAutoExpandPushLockShared (
+     __inout PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     );
+
+PEX_PUSH_LOCK
+FORCEINLINE
+ExAcquireAutoExpandPushLockShared (
+     IN PEX_PUSH_LOCK_AUTO_EXPAND AutoExpandPushLock
+     )
+/*++
+
+Routine Description:
+
+    Acquire an auto expanding push lock shared.
+
+Arguments:
+
+    AutoExpandPushLock - Auto expanding push lock to be acquired
+
+Return Value:
+
+    PEX_PUSH_LOCK - The push lock that was acquired. This must be passed
+                    to ExReleaseAutoExpandPushLockShared.
+
+--*/
+{
+    PEX_PUSH_LOCK PushLock;
+
+    //
+    // While the lock is compact an uncontended shared acquire is a single
+    // compare exchange on the local lock. The expanded state must be
+    // checked again once the local lock is held since an expansion may
+    // have completed in between.
+    //
+
+    PushLock = &AutoExpandPushLock->LocalLock;
+
+    if (AutoExpandPushLock->Expanded == 0 &&
+        InterlockedCompareExchangePointer (&PushLock->Ptr,
+                                           (PVOID)(EX_PUSH_LOCK_SHARE_INC|EX_PUSH_LOCK_LOCK),
+                                           NULL) == NULL) {
+
+        if (AutoExpandPushLock->Expanded == 0) {
+            return PushLock;
+        }
+
+        ExReleasePushLockShared (PushLock);
+    }
+
+    return ExfAcquireAutoExpandPushLockShared (AutoExpandPushLock);
+}
+
+VOID
+FORCEINLINE
+ExReleaseAutoExpandPushLockShared (
+     IN PEX_PUSH_LOCK PushLock
+     )
+/*++
+
+Routine Description:
+
+    Release an auto expanding push lock that was acquired shared.
+
+Arguments:
+
+    PushLock - Push lock returned by ExAcquireAutoExpandPushLockShared
+
+Return Value:
+
+    None
+
+--*/
+{
+    ExReleasePushLockShared (PushLock);
+
+    return;
+}
+
 #endif // !defined(NONTOSPINTERLOCK)
 
 // end_ntosp
@@ -443,6 +443,11 @@ extern SIZE_T MmTotalCommitLimit;
 
 extern SIZE_T MmPeakCommitment;
 
+SIZE_T
+MmQueryCommittedPages (
+    VOID
+    );
+
 ULONG
 MmGetNumberOfFreeSystemPtes (
     VOID
@@ -986,6 +991,16 @@ MmQuerySystemCacheWorkingSetInformation (
     OUT PSYSTEM_FILECACHE_INFORMATION Info
     );
 
+VOID
+MmQueryPageCombineInformation (
+    OUT PSYSTEM_PAGE_COMBINE_INFORMATION Info
+    );
+
+NTSTATUS
+MmQueryWorkingSetAgingInformation (
+    IN OUT PSYSTEM_WORKING_SET_AGING_INFORMATION Info
+    );
+
 VOID
 MmWorkingSetManager (
     VOID
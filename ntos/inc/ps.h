@@ -95,6 +95,8 @@ typedef struct _MMADDRESS_NODE {
     struct _MMADDRESS_NODE *RightChild;
     ULONG_PTR StartingVpn;
     ULONG_PTR EndingVpn;
+    ULONG_PTR PrecedingGap;     // Free units between this and the previous node
+    ULONG_PTR LargestGap;       // Largest PrecedingGap in this subtree
 } MMADDRESS_NODE, *PMMADDRESS_NODE;
 
 //
@@ -510,6 +512,14 @@ typedef struct _EPROCESS {
 
     ULONG Cookie;
 
+    //
+    // Change tracking for SystemProcessDeltaInformation queries. These are
+    // only updated by the query code.
+    //
+
+    ULONG InformationGeneration;
+    ULONG InformationSignature;
+
 } EPROCESS, *PEPROCESS; 
 
 C_ASSERT( FIELD_OFFSET(EPROCESS, Pcb) == 0 );
@@ -803,6 +813,14 @@ typedef struct _ETHREAD {
     BOOLEAN DisablePageFaultClustering;
     UCHAR ActiveFaultCount;
 
+    //
+    // Change tracking for SystemProcessDeltaInformation queries. These are
+    // only updated by the query code.
+    //
+
+    ULONG InformationGeneration;
+    ULONG InformationSignature;
+
 #if defined (PERF_DATA)
     ULONG PerformanceCountLow;
     LONG PerformanceCountHigh;
@@ -24,6 +24,8 @@ Abstract:
     - Caller allocates the pool to reduce mutex hold times.
     - Various VAD-specific customizations/optimizations.
     - Hints.
+    - Each node is augmented with the largest free gap in its subtree so
+      searches for an empty address range need not visit every node.
 
 Environment:
 
@@ -71,6 +73,29 @@ MiRealPredecessor (
     IN PMMADDRESS_NODE Links
     );
 
+VOID
+MiPropagateLargestGap (
+    IN PMMADDRESS_NODE Node
+    );
+
+PMMADDRESS_NODE
+MiGetNextGapNode (
+    IN PMMADDRESS_NODE Node,
+    IN ULONG_PTR Gap
+    );
+
+PMMADDRESS_NODE
+MiGetPreviousGapNode (
+    IN PMMADDRESS_NODE Node,
+    IN ULONG_PTR Gap
+    );
+
+PMMADDRESS_NODE
+MiGetStartingNodeDown (
+    IN PMM_AVL_TABLE Table,
+    IN ULONG_PTR OptimalStart
+    );
+
 VOID
 MiInitializeVadTableAvl (
     IN PMM_AVL_TABLE Table
@@ -90,6 +115,9 @@ MiEnumerateGenericTableWithoutSplayingAvl (
 #pragma alloc_text(PAGE,MiFindEmptyAddressRangeInTree)
 #pragma alloc_text(PAGE,MiFindEmptyAddressRangeDownTree)
 #pragma alloc_text(PAGE,MiFindEmptyAddressRangeDownBasedTree)
+#pragma alloc_text(PAGE,MiGetNextGapNode)
+#pragma alloc_text(PAGE,MiGetPreviousGapNode)
+#pragma alloc_text(PAGE,MiGetStartingNodeDown)
 #endif
 
 //
@@ -143,6 +171,56 @@ MiEnumerateGenericTableWithoutSplayingAvl (
     (RtlRightChild(MiParent(Links)) == (PRTL_SPLAY_LINKS)(Links)) \
     )
 
+//
+// Every node records the number of free units (pages for VADs, bytes for
+// the based section tree) between it and the node preceding it, or the
+// start of the space if there is none, in PrecedingGap.  LargestGap holds
+// the largest PrecedingGap in the subtree rooted at the node, so any
+// subtree whose LargestGap is too small for a request can be skipped
+// without examining its nodes.
+//
+// The free space after the last node is not recorded in any node; the
+// searches check it directly.
+//
+//  ULONG_PTR
+//  MiComputePrecedingGap (
+//      PMMADDRESS_NODE Node,
+//      PMMADDRESS_NODE Previous
+//      );
+//
+
+#define MiComputePrecedingGap(Node, Previous)                       \
+    (((Previous) == NULL) ? (Node)->StartingVpn :                   \
+        ((Node)->StartingVpn - (Previous)->EndingVpn - 1))
+
+//
+//  VOID
+//  MiUpdateLargestGap (
+//      PMMADDRESS_NODE Node
+//      );
+//
+// Recalculates the LargestGap of the node from its children, which must
+// themselves be current.
+//
+
+#define MiUpdateLargestGap(Node) {                                  \
+    ULONG_PTR _Largest;                                             \
+                                                                    \
+    _Largest = (Node)->PrecedingGap;                                \
+                                                                    \
+    if (((Node)->LeftChild != NULL) &&                              \
+        ((Node)->LeftChild->LargestGap > _Largest)) {               \
+        _Largest = (Node)->LeftChild->LargestGap;                   \
+    }                                                               \
+                                                                    \
+    if (((Node)->RightChild != NULL) &&                             \
+        ((Node)->RightChild->LargestGap > _Largest)) {              \
+        _Largest = (Node)->RightChild->LargestGap;                  \
+    }                                                               \
+                                                                    \
+    (Node)->LargestGap = _Largest;                                  \
+}
+
 
 
 #if DBG
@@ -476,8 +554,8 @@ Routine Description:
     and the caller guarantees that it never requests to promote the
     root itself.
 
-    This routine only updates the tree links; the caller must update
-    the balance factors as appropriate.
+    This routine only updates the tree links and the gaps of the two nodes
+    involved; the caller must update the balance factors as appropriate.
 
 Arguments:
 
@@ -577,6 +655,14 @@ Return Value:
         G->RightChild = C;
     }
     C->u1.Parent = MI_MAKE_PARENT (G, C->u1.Balance);
+
+    //
+    // P and C now root different subtrees, but C's subtree holds the same
+    // nodes that P's did, so G is unaffected.
+    //
+
+    MiUpdateLargestGap (P);
+    MiUpdateLargestGap (C);
 }
 
 
@@ -842,8 +928,23 @@ Environment:
     PMMADDRESS_NODE Parent;
     PMMADDRESS_NODE EasyDelete;
     PMMADDRESS_NODE P;
+    PMMADDRESS_NODE Next;
+    PMMADDRESS_NODE GapParent;
     SCHAR a;
 
+    //
+    // The node following the NodeToDelete inherits its gap (and the gap
+    // of the NodeToDelete itself).  Update it while the tree is intact.
+    //
+
+    Next = MiGetNextNode (NodeToDelete);
+
+    if (Next != NULL) {
+        Next->PrecedingGap = MiComputePrecedingGap (Next,
+                                        MiGetPreviousNode (NodeToDelete));
+        MiPropagateLargestGap (Next);
+    }
+
     //
     // If the NodeToDelete has at least one NULL child pointer, then we can
     // delete it directly.
@@ -942,6 +1043,14 @@ Environment:
     Table->BalancedRoot.u1.Balance = 0;
     P = SANITIZE_PARENT_NODE (EasyDelete->u1.Parent);
 
+    //
+    // Every subtree which contained the EasyDelete has lost its gap.  The
+    // rotations below keep this node on the path to the root, so its
+    // ancestors are recalculated once the tree has its final shape.
+    //
+
+    GapParent = P;
+
     //
     // Loop until the tree is balanced.
     //
@@ -1052,8 +1161,14 @@ Environment:
             EasyDelete->RightChild->u1.Parent = MI_MAKE_PARENT (EasyDelete,
                                             EasyDelete->RightChild->u1.Balance);
         }
+
+        if (GapParent == NodeToDelete) {
+            GapParent = EasyDelete;
+        }
     }
 
+    MiPropagateLargestGap (GapParent);
+
     Table->NumberGenericTableElements -= 1;
 
     //
@@ -1326,6 +1441,7 @@ Environment:
     //
 
     PMMADDRESS_NODE NodeOrParent;
+    PMMADDRESS_NODE Next;
     TABLE_SEARCH_RESULT SearchResult;
 
     ASSERT((Table->NumberGenericTableElements >= MiWorstCaseFill[Table->DepthOfTree]) &&
@@ -1362,6 +1478,9 @@ Environment:
         ASSERT(Table->DepthOfTree == 0);
         Table->DepthOfTree = 1;
 
+        NodeToInsert->PrecedingGap = NodeToInsert->StartingVpn;
+        MiPropagateLargestGap (NodeToInsert);
+
     ASSERT((Table->NumberGenericTableElements >= MiWorstCaseFill[Table->DepthOfTree]) &&
            (Table->NumberGenericTableElements <= MiBestCaseFill[Table->DepthOfTree]));
 
@@ -1381,6 +1500,24 @@ Environment:
         NodeToInsert->u1.Parent = NodeOrParent;
         ASSERT (NodeToInsert->u1.Balance == 0);
 
+        //
+        // The new node splits the gap that preceded the node following
+        // it.  Bring the gaps up to date before rebalancing as the
+        // rotations only recalculate the nodes they move.
+        //
+
+        NodeToInsert->PrecedingGap = MiComputePrecedingGap (NodeToInsert,
+                                            MiGetPreviousNode (NodeToInsert));
+
+        MiPropagateLargestGap (NodeToInsert);
+
+        Next = MiGetNextNode (NodeToInsert);
+
+        if (Next != NULL) {
+            Next->PrecedingGap = MiComputePrecedingGap (Next, NodeToInsert);
+            MiPropagateLargestGap (Next);
+        }
+
         //
         // The above completes the standard binary tree insertion, which
         // happens to correspond to steps A1-A5 of Knuth's "balanced tree
@@ -1743,6 +1880,371 @@ Return Value:
 }
 
 
+VOID
+MiPropagateLargestGap (
+    IN PMMADDRESS_NODE Node
+    )
+
+/*++
+
+Routine Description:
+
+    This routine recalculates the largest gap of the specified node and of
+    each of its ancestors, including the root of the table.
+
+Arguments:
+
+    Node - Supplies the node whose gap or subtree has changed.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode.  The PFN lock is held for some of the tables.
+
+--*/
+
+{
+    PMMADDRESS_NODE Parent;
+
+    do {
+
+        MiUpdateLargestGap (Node);
+
+        Parent = SANITIZE_PARENT_NODE (Node->u1.Parent);
+
+        //
+        // The root of the table is its own parent.
+        //
+
+        if (Parent == Node) {
+            break;
+        }
+
+        Node = Parent;
+
+    } while (TRUE);
+
+    return;
+}
+
+
+VOID
+FASTCALL
+MiUpdateNodeGaps (
+    IN PMMADDRESS_NODE Node
+    )
+
+/*++
+
+Routine Description:
+
+    This routine must be called after the starting or ending address of
+    a node is changed in place, without removing the node from its table.
+    It recalculates the gap preceding the node and the gap preceding the
+    node that follows it.
+
+    The node may only shrink, or grow into free space, so that its
+    position in the table does not change.
+
+Arguments:
+
+    Node - Supplies the node whose bounds have changed.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode.  The PFN lock is held for some of the tables.
+
+--*/
+
+{
+    PMMADDRESS_NODE Next;
+
+    Node->PrecedingGap = MiComputePrecedingGap (Node, MiGetPreviousNode (Node));
+
+    MiPropagateLargestGap (Node);
+
+    Next = MiGetNextNode (Node);
+
+    if (Next != NULL) {
+        Next->PrecedingGap = MiComputePrecedingGap (Next, Node);
+        MiPropagateLargestGap (Next);
+    }
+
+    return;
+}
+
+
+PMMADDRESS_NODE
+MiGetNextGapNode (
+    IN PMMADDRESS_NODE Node,
+    IN ULONG_PTR Gap
+    )
+
+/*++
+
+Routine Description:
+
+    This function locates the first node following the specified node
+    which is preceded by a gap of at least the specified size.  Subtrees
+    which contain no such gap are skipped.
+
+Arguments:
+
+    Node - Supplies the node to start after.
+
+    Gap - Supplies the minimum size of the gap.
+
+Return Value:
+
+    Returns the node following the gap, NULL if none.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    PMMADDRESS_NODE Parent;
+
+    if ((Node->RightChild != NULL) && (Node->RightChild->LargestGap >= Gap)) {
+        Node = Node->RightChild;
+        goto Descend;
+    }
+
+    do {
+
+        Parent = SANITIZE_PARENT_NODE (Node->u1.Parent);
+
+        if (Parent == SANITIZE_PARENT_NODE (Parent->u1.Parent)) {
+            return NULL;
+        }
+
+        if (Parent->LeftChild == Node) {
+
+            //
+            // The parent and its right subtree follow this node.
+            //
+
+            if (Parent->PrecedingGap >= Gap) {
+                return Parent;
+            }
+
+            if ((Parent->RightChild != NULL) &&
+                (Parent->RightChild->LargestGap >= Gap)) {
+
+                Node = Parent->RightChild;
+                goto Descend;
+            }
+        }
+
+        Node = Parent;
+
+    } while (TRUE);
+
+Descend:
+
+    //
+    // The subtree rooted at Node contains a suitable gap, find the lowest.
+    //
+
+    do {
+
+        ASSERT (Node->LargestGap >= Gap);
+
+        if ((Node->LeftChild != NULL) && (Node->LeftChild->LargestGap >= Gap)) {
+            Node = Node->LeftChild;
+        }
+        else if (Node->PrecedingGap >= Gap) {
+            return Node;
+        }
+        else {
+            Node = Node->RightChild;
+        }
+
+    } while (TRUE);
+}
+
+
+PMMADDRESS_NODE
+MiGetPreviousGapNode (
+    IN PMMADDRESS_NODE Node,
+    IN ULONG_PTR Gap
+    )
+
+/*++
+
+Routine Description:
+
+    This function locates the last node preceding the specified node which
+    is itself preceded by a gap of at least the specified size.  Subtrees
+    which contain no such gap are skipped.
+
+Arguments:
+
+    Node - Supplies the node to start before.
+
+    Gap - Supplies the minimum size of the gap.
+
+Return Value:
+
+    Returns the node following the gap, NULL if none.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    PMMADDRESS_NODE Parent;
+
+    if ((Node->LeftChild != NULL) && (Node->LeftChild->LargestGap >= Gap)) {
+        Node = Node->LeftChild;
+        goto Descend;
+    }
+
+    do {
+
+        Parent = SANITIZE_PARENT_NODE (Node->u1.Parent);
+
+        if (Parent == SANITIZE_PARENT_NODE (Parent->u1.Parent)) {
+            return NULL;
+        }
+
+        if (Parent->RightChild == Node) {
+
+            //
+            // The parent and its left subtree precede this node.
+            //
+
+            if (Parent->PrecedingGap >= Gap) {
+                return Parent;
+            }
+
+            if ((Parent->LeftChild != NULL) &&
+                (Parent->LeftChild->LargestGap >= Gap)) {
+
+                Node = Parent->LeftChild;
+                goto Descend;
+            }
+        }
+
+        Node = Parent;
+
+    } while (TRUE);
+
+Descend:
+
+    //
+    // The subtree rooted at Node contains a suitable gap, find the highest.
+    //
+
+    do {
+
+        ASSERT (Node->LargestGap >= Gap);
+
+        if ((Node->RightChild != NULL) && (Node->RightChild->LargestGap >= Gap)) {
+            Node = Node->RightChild;
+        }
+        else if (Node->PrecedingGap >= Gap) {
+            return Node;
+        }
+        else {
+            Node = Node->LeftChild;
+        }
+
+    } while (TRUE);
+}
+
+
+PMMADDRESS_NODE
+MiGetStartingNodeDown (
+    IN PMM_AVL_TABLE Table,
+    IN ULONG_PTR OptimalStart
+    )
+
+/*++
+
+Routine Description:
+
+    This function locates the node at which a top down search should start
+    examining the gaps preceding each node.  Gaps preceded by a node that
+    ends at or above the optimal start can never be used, so the search
+    starts at the node following the last node that ends below it.
+
+Arguments:
+
+    Table - Supplies the non-empty table to search.
+
+    OptimalStart - Supplies the highest start of the range being searched
+                   for, in the units of the table.
+
+Return Value:
+
+    Returns the node to start the search at.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    PMMADDRESS_NODE Node;
+    PMMADDRESS_NODE Below;
+    PMMADDRESS_NODE Next;
+
+    Below = NULL;
+    Node = Table->BalancedRoot.RightChild;
+
+    ASSERT (Node != NULL);
+
+    do {
+
+        if (Node->EndingVpn < OptimalStart) {
+            Below = Node;
+            Next = Node->RightChild;
+        }
+        else {
+            Next = Node->LeftChild;
+        }
+
+        if (Next == NULL) {
+            break;
+        }
+
+        Node = Next;
+
+    } while (TRUE);
+
+    if (Below == NULL) {
+
+        //
+        // Every node ends above the optimal start, only the gap preceding
+        // the first node can be used.
+        //
+
+        return MiGetFirstNode (Table);
+    }
+
+    Next = MiGetNextNode (Below);
+
+    if (Next == NULL) {
+        return Below;
+    }
+
+    return Next;
+}
+
+
 PMMADDRESS_NODE
 FASTCALL
 MiLocateAddressInTree (
@@ -1875,10 +2377,19 @@ Return Value:
 
     do {
 
-        NextNode = MiGetNextNode (Node);
+        //
+        // Skip straight to the next gap which is at least large enough to
+        // hold the range, ignoring alignment.
+        //
+
+        NextNode = MiGetNextGapNode (Node, SizeOfRangeVpn);
 
         if (NextNode != NULL) {
 
+            Node = MiGetPreviousNode (NextNode);
+
+            ASSERT (Node != NULL);
+
             if (SizeOfRangeVpn <=
                 ((ULONG_PTR)NextNode->StartingVpn -
                                 MI_ROUND_TO_SIZE(1 + Node->EndingVpn,
@@ -1908,6 +2419,12 @@ Return Value:
             // of the address space.
             //
 
+            Node = Table->BalancedRoot.RightChild;
+
+            while (Node->RightChild != NULL) {
+                Node = Node->RightChild;
+            }
+
             if ((((ULONG_PTR)Node->EndingVpn + MI_VA_TO_VPN(X64K)) <
                     MI_VA_TO_VPN (MM_HIGHEST_VAD_ADDRESS))
                         &&
@@ -1981,6 +2498,7 @@ Return Value:
     ULONG_PTR OptimalStartVpn;
     ULONG_PTR HighestVpn;
     ULONG_PTR AlignmentVpn;
+    ULONG_PTR SizeOfRangeVpn;
 
     //
     // Note this cannot be used for the based section tree because only
@@ -2049,14 +2567,28 @@ Return Value:
     }
 
     //
-    // Walk the tree backwards looking for a fit.
+    // Walk the tree backwards looking for a fit, starting with the first
+    // gap which lies below the optimal start and skipping every gap which
+    // is too small to hold the range.
     //
 
     OptimalStartVpn = MI_VA_TO_VPN (OptimalStart);
     AlignmentVpn = MI_VA_TO_VPN (Alignment);
+    SizeOfRangeVpn = SizeOfRange >> PAGE_SHIFT;
+
+    Node = MiGetStartingNodeDown (Table, OptimalStartVpn);
 
     do {
 
+        if (Node->PrecedingGap < SizeOfRangeVpn) {
+
+            Node = MiGetPreviousGapNode (Node, SizeOfRangeVpn);
+
+            if (Node == NULL) {
+                return STATUS_NO_MEMORY;
+            }
+        }
+
         PreviousNode = MiGetPreviousNode (Node);
 
         if (PreviousNode != NULL) {
@@ -2066,7 +2598,7 @@ Return Value:
             //
 
             if (PreviousNode->EndingVpn < OptimalStartVpn) {
-                if ((SizeOfRange >> PAGE_SHIFT) <=
+                if (SizeOfRangeVpn <=
                     ((ULONG_PTR)Node->StartingVpn -
                     (ULONG_PTR)MI_ROUND_TO_SIZE(1 + PreviousNode->EndingVpn,
                                             AlignmentVpn))) {
@@ -2106,7 +2638,7 @@ Return Value:
             //
 
             if (Node->StartingVpn > MI_VA_TO_VPN (MM_LOWEST_USER_ADDRESS)) {
-                if ((SizeOfRange >> PAGE_SHIFT) <=
+                if (SizeOfRangeVpn <=
                     ((ULONG_PTR)Node->StartingVpn - MI_VA_TO_VPN (MM_LOWEST_USER_ADDRESS))) {
 
                     //
@@ -2247,11 +2779,24 @@ Return Value:
     }
 
     //
-    // Walk the tree backwards looking for a fit.
+    // Walk the tree backwards looking for a fit, starting with the first
+    // gap which lies below the optimal start and skipping every gap which
+    // is too small to hold the range.
     //
 
+    Node = MiGetStartingNodeDown (Table, OptimalStart);
+
     do {
 
+        if (Node->PrecedingGap < SizeOfRange) {
+
+            Node = MiGetPreviousGapNode (Node, SizeOfRange);
+
+            if (Node == NULL) {
+                return STATUS_NO_MEMORY;
+            }
+        }
+
         PreviousNode = MiGetPreviousNode (Node);
 
         PRINT("search down1: %p %p %p %p\n", PreviousNode, Node, OptimalStart, Alignment);
@@ -4816,6 +4816,13 @@ Environment:
 
     MiDeferredUnlockPages (MI_DEFER_PFN_HELD);
 
+    //
+    // Return cached pages to the lists so they do not break up the
+    // physical runs searched for below.
+    //
+
+    MiDrainPageCaches ();
+
     if ((SPFN_NUMBER)SizeInPages > MI_NONPAGEABLE_MEMORY_AVAILABLE()) {
         UNLOCK_PFN (OldIrql);
         goto Failed;
@@ -5476,6 +5483,13 @@ Environment:
 
     MiDeferredUnlockPages (MI_DEFER_PFN_HELD);
 
+    //
+    // Return cached pages to the lists so they do not break up the
+    // physical runs searched for below.
+    //
+
+    MiDrainPageCaches ();
+
     if ((SPFN_NUMBER)SizeInPages > MI_NONPAGEABLE_MEMORY_AVAILABLE()) {
         UNLOCK_PFN (OldIrql);
         return 0;
@@ -1769,6 +1769,8 @@ FinishedCharging:
 
         LOCK_WS_UNSAFE (CurrentThread, Process);
 
+        MI_DEMOTE_LARGE_PAGES (&Process->Vm, StartingAddress, EndingAddress);
+
         //
         // Quota charge failed, calculate the exact quota
         // taking into account pages that may already be
@@ -1840,6 +1842,8 @@ FinishedCharging:
         LOCK_WS_UNSAFE (CurrentThread, Process);
     }
 
+    MI_DEMOTE_LARGE_PAGES (&Process->Vm, StartingAddress, EndingAddress);
+
     //
     // Fill in all the page directory and page table pages with the
     // demand zero PTE.
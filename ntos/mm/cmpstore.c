@@ -0,0 +1,1487 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved.
+
+You may only use this code if you agree to the terms of the Windows Research Kernel Source Code License agreement (see License.txt).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    cmpstore.c
+
+Abstract:
+
+    This module contains the routines which implement the compressed
+    store for modified private pages destined for the paging file.
+
+    When the modified page writer builds a pagefile cluster, each private
+    user page in it is compressed with a small LZ77 codec and kept in
+    nonpaged pool, keyed by the pagefile slot that was allocated for it.
+    If every page of the cluster is kept the write is completed without
+    any I/O at all - the slots stay allocated but the pagefile contents
+    are stale until the page is evicted.  Otherwise the cluster is written
+    as usual and the kept pages are marked clean, so they can be dropped
+    at no cost.
+
+    Refaults of a kept slot are satisfied by decompressing straight into
+    the page that was going to be read into, and pagefile reads never
+    cluster across a kept slot.  Releasing a slot removes its page from
+    the store.
+
+    Only when available memory has stayed low for a while does the
+    modified page writer evict pages from the store - clean ones are
+    simply freed, the others are written to their slot first.
+
+--*/
+
+#include "mi.h"
+
+//
+// Pages that do not compress to at least this size are not kept - the
+// pool they would use is better spent elsewhere.
+//
+
+#define MI_COMPRESSED_PAGE_LIMIT    (PAGE_SIZE / 2)
+
+//
+// Codec parameters.  Matches are at least four bytes and offsets always
+// fit in two bytes as the input is a single page.
+//
+
+#define MI_LZ_MINIMUM_MATCH         4
+#define MI_LZ_HASH_BITS             12
+#define MI_LZ_HASH(_Value)          \
+            ((ULONG)(((_Value) * 2654435761U) >> (32 - MI_LZ_HASH_BITS)))
+
+//
+// Store keys combine the paging file number and the offset in pages.
+//
+
+#define MI_COMPRESSED_KEY(_PageFileNumber, _Offset)                 \
+            (((ULONG_PTR)(_Offset) << 4) | (_PageFileNumber))
+
+#define MI_COMPRESSED_KEY_FILE(_Key)    ((ULONG)((_Key) & 0xF))
+
+#define MI_COMPRESSED_KEY_OFFSET(_Key)  ((_Key) >> 4)
+
+#define MI_COMPRESSED_HASH(_Key)                                    \
+            ((ULONG)(((_Key) >> 4) ^ (((_Key) & 0xF) << 8)) &       \
+                MiCompressedStore.HashMask)
+
+typedef struct _MI_COMPRESSED_PAGE {
+    LIST_ENTRY HashLinks;
+    LIST_ENTRY AgeLinks;
+    ULONG_PTR Key;
+    USHORT Size;
+    USHORT References;
+    ULONG Flags;
+    UCHAR Data[1];
+} MI_COMPRESSED_PAGE, *PMI_COMPRESSED_PAGE;
+
+#define MI_COMPRESSED_PAGE_CLEAN        0x1     // Pagefile holds the data
+#define MI_COMPRESSED_PAGE_REMOVED      0x2     // Free on last dereference
+
+#define MI_COMPRESSED_PAGE_BYTES(_Entry)                            \
+            (FIELD_OFFSET (MI_COMPRESSED_PAGE, Data) + (_Entry)->Size)
+
+typedef struct _MI_COMPRESSED_STORE {
+
+    KSPIN_LOCK Lock;
+
+    //
+    // The hash table and age list are protected by the store lock.  The
+    // store lock may be acquired while holding the PFN lock but not the
+    // other way around.
+    //
+
+    PLIST_ENTRY HashTable;
+    ULONG HashMask;
+    ULONG NumberOfEntries;
+    SIZE_T Bytes;
+    SIZE_T MaximumBytes;
+    LIST_ENTRY AgeListHead;
+
+    //
+    // Pages removed while the PFN lock was held are freed later by the
+    // modified page writer.
+    //
+
+    LIST_ENTRY FreeListHead;
+
+    //
+    // The fields below are only referenced by the modified page writer.
+    //
+
+    LOGICAL Evicting;
+    LARGE_INTEGER PressureStart;
+    PUSHORT HashWorkspace;
+    PUCHAR CompressBuffer;
+    PUCHAR EvictBuffer;
+    PMDL EvictMdl;
+
+} MI_COMPRESSED_STORE, *PMI_COMPRESSED_STORE;
+
+MI_COMPRESSED_STORE MiCompressedStore;
+
+ULONG MmEnableCompressedStore = 1;
+
+//
+// Available memory must stay below this many pages for the pressure time
+// (in 100ns units) before pages are evicted from the store.
+//
+
+PFN_NUMBER MiCompressedStorePressurePages = MM_TIGHT_LIMIT;
+
+LONGLONG MiCompressedStorePressureTime = 10 * 1000 * 1000;
+
+ULONG MiCompressedStoreEvictBatch = 64;
+
+//
+// Store and refault statistics.  Refault times are in performance
+// counter ticks, measured from the issue of the inpage to its completion.
+//
+
+ULONG MiCompressedPagesStored;
+ULONG MiCompressedPagesRejected;
+ULONG MiCompressedPagesEvicted;
+ULONG MiCompressedPagesDropped;
+ULONG MiCompressedWritesAvoided;
+
+ULONG MiCompressedRefaults;
+LARGE_INTEGER MiCompressedRefaultTime;
+ULONG MiPageFileRefaults;
+LARGE_INTEGER MiPageFileRefaultTime;
+
+ULONG
+MiCompressPage (
+    IN PUCHAR Source,
+    OUT PUCHAR Destination,
+    IN ULONG DestinationSize,
+    IN PUSHORT HashTable
+    );
+
+LOGICAL
+MiDecompressPage (
+    IN PUCHAR Source,
+    IN ULONG SourceSize,
+    OUT PUCHAR Destination
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE,MiInitializeCompressedStore)
+#endif
+
+
+VOID
+MiInitializeCompressedStore (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine sizes and allocates the compressed store.  The store is
+    simply left disabled if any of its allocations fail.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, modified page writer thread.
+
+--*/
+
+{
+    ULONG i;
+    ULONG Buckets;
+    SIZE_T MaximumBytes;
+    PLIST_ENTRY HashTable;
+
+    PAGED_CODE ();
+
+    if (MmEnableCompressedStore == 0) {
+        return;
+    }
+
+    KeInitializeSpinLock (&MiCompressedStore.Lock);
+    InitializeListHead (&MiCompressedStore.AgeListHead);
+    InitializeListHead (&MiCompressedStore.FreeListHead);
+
+    //
+    // Let the store grow to an eighth of physical memory, but no more than
+    // a quarter of nonpaged pool.
+    //
+
+    MaximumBytes = (SIZE_T)(MmNumberOfPhysicalPages / 8) << PAGE_SHIFT;
+
+    if (MaximumBytes > MmMaximumNonPagedPoolInBytes / 4) {
+        MaximumBytes = MmMaximumNonPagedPoolInBytes / 4;
+    }
+
+    //
+    // Size the hash table for roughly one entry per bucket when the store
+    // is full of half page entries.
+    //
+
+    Buckets = 256;
+
+    while ((Buckets < (ULONG)(MaximumBytes / MI_COMPRESSED_PAGE_LIMIT)) &&
+           (Buckets < 0x10000)) {
+
+        Buckets *= 2;
+    }
+
+    HashTable = ExAllocatePoolWithTag (NonPagedPool,
+                                       Buckets * sizeof (LIST_ENTRY),
+                                       'hCmM');
+
+    if (HashTable == NULL) {
+        return;
+    }
+
+    for (i = 0; i < Buckets; i += 1) {
+        InitializeListHead (&HashTable[i]);
+    }
+
+    MiCompressedStore.HashWorkspace =
+        ExAllocatePoolWithTag (NonPagedPool,
+                               sizeof (USHORT) << MI_LZ_HASH_BITS,
+                               'wCmM');
+
+    MiCompressedStore.CompressBuffer = ExAllocatePoolWithTag (NonPagedPool,
+                                                              PAGE_SIZE,
+                                                              'wCmM');
+
+    MiCompressedStore.EvictBuffer = ExAllocatePoolWithTag (NonPagedPool,
+                                                           PAGE_SIZE,
+                                                           'wCmM');
+
+    if (MiCompressedStore.EvictBuffer != NULL) {
+
+        MiCompressedStore.EvictMdl = IoAllocateMdl (
+                                            MiCompressedStore.EvictBuffer,
+                                            PAGE_SIZE,
+                                            FALSE,
+                                            FALSE,
+                                            NULL);
+
+        if (MiCompressedStore.EvictMdl != NULL) {
+            MmBuildMdlForNonPagedPool (MiCompressedStore.EvictMdl);
+        }
+    }
+
+    if ((MiCompressedStore.HashWorkspace == NULL) ||
+        (MiCompressedStore.CompressBuffer == NULL) ||
+        (MiCompressedStore.EvictMdl == NULL)) {
+
+        if (MiCompressedStore.EvictMdl != NULL) {
+            IoFreeMdl (MiCompressedStore.EvictMdl);
+            MiCompressedStore.EvictMdl = NULL;
+        }
+        if (MiCompressedStore.EvictBuffer != NULL) {
+            ExFreePool (MiCompressedStore.EvictBuffer);
+            MiCompressedStore.EvictBuffer = NULL;
+        }
+        if (MiCompressedStore.CompressBuffer != NULL) {
+            ExFreePool (MiCompressedStore.CompressBuffer);
+            MiCompressedStore.CompressBuffer = NULL;
+        }
+        if (MiCompressedStore.HashWorkspace != NULL) {
+            ExFreePool (MiCompressedStore.HashWorkspace);
+            MiCompressedStore.HashWorkspace = NULL;
+        }
+
+        ExFreePool (HashTable);
+        return;
+    }
+
+    MiCompressedStore.HashMask = Buckets - 1;
+    MiCompressedStore.MaximumBytes = MaximumBytes;
+
+    //
+    // Setting the hash table enables the store.
+    //
+
+    MiCompressedStore.HashTable = HashTable;
+
+    return;
+}
+
+ULONG
+MiCompressPage (
+    IN PUCHAR Source,
+    OUT PUCHAR Destination,
+    IN ULONG DestinationSize,
+    IN PUSHORT HashTable
+    )
+
+/*++
+
+Routine Description:
+
+    This routine compresses a page with a byte oriented LZ77 codec.
+
+    The output is a series of sequences, each a token byte followed by
+    literals, a two byte match offset and any length extension bytes.  The
+    high nibble of the token is the literal count and the low nibble the
+    match length less the minimum - a nibble of 15 is extended by bytes
+    that are summed up to and including the first one that is not 255.
+    The last sequence carries literals only.
+
+Arguments:
+
+    Source - Supplies the page to compress.
+
+    Destination - Supplies the buffer to compress into.
+
+    DestinationSize - Supplies the size of the destination buffer.
+
+    HashTable - Supplies a workspace of 1 << MI_LZ_HASH_BITS entries.
+
+Return Value:
+
+    The compressed size, or zero if the page does not fit the destination.
+
+Environment:
+
+    Kernel mode, any IRQL.
+
+--*/
+
+{
+    PUCHAR Input;
+    PUCHAR InputEnd;
+    PUCHAR InputLimit;
+    PUCHAR Anchor;
+    PUCHAR Match;
+    PUCHAR Output;
+    PUCHAR OutputEnd;
+    PUCHAR Token;
+    ULONG Hash;
+    ULONG Sequence;
+    ULONG_PTR Length;
+    ULONG_PTR LiteralLength;
+    ULONG_PTR MatchLength;
+    ULONG_PTR Offset;
+
+    RtlZeroMemory (HashTable, sizeof (USHORT) << MI_LZ_HASH_BITS);
+
+    Input = Source;
+    InputEnd = Source + PAGE_SIZE;
+    InputLimit = InputEnd - MI_LZ_MINIMUM_MATCH;
+    Anchor = Source;
+    Output = Destination;
+    OutputEnd = Destination + DestinationSize;
+
+    while (TRUE) {
+
+        MatchLength = 0;
+        Offset = 0;
+
+        //
+        // Find the next match.  The hash table holds the most recent
+        // position for each hash - the candidate is verified so stale
+        // and colliding positions are harmless.
+        //
+
+        while (Input <= InputLimit) {
+
+            Sequence = *(ULONG UNALIGNED *)Input;
+            Hash = MI_LZ_HASH (Sequence);
+            Match = Source + HashTable[Hash];
+            HashTable[Hash] = (USHORT)(Input - Source);
+
+            if ((Match < Input) &&
+                (*(ULONG UNALIGNED *)Match == Sequence)) {
+
+                MatchLength = MI_LZ_MINIMUM_MATCH;
+
+                while ((Input + MatchLength < InputEnd) &&
+                       (Input[MatchLength] == Match[MatchLength])) {
+
+                    MatchLength += 1;
+                }
+
+                Offset = Input - Match;
+                break;
+            }
+
+            Input += 1;
+        }
+
+        if (MatchLength == 0) {
+            Input = InputEnd;
+        }
+
+        LiteralLength = Input - Anchor;
+
+        //
+        // Make sure the whole sequence fits, allowing for the worst case
+        // number of length extension bytes.
+        //
+
+        Length = 1 + LiteralLength + (LiteralLength / 255) + 1 +
+                 2 + (MatchLength / 255) + 1;
+
+        if ((ULONG_PTR)(OutputEnd - Output) < Length) {
+            return 0;
+        }
+
+        Token = Output;
+        Output += 1;
+
+        if (LiteralLength >= 15) {
+            *Token = 15 << 4;
+            Length = LiteralLength - 15;
+            while (Length >= 255) {
+                *Output = 255;
+                Output += 1;
+                Length -= 255;
+            }
+            *Output = (UCHAR) Length;
+            Output += 1;
+        }
+        else {
+            *Token = (UCHAR)(LiteralLength << 4);
+        }
+
+        RtlCopyMemory (Output, Anchor, LiteralLength);
+        Output += LiteralLength;
+
+        if (MatchLength == 0) {
+            break;
+        }
+
+        *Output = (UCHAR) Offset;
+        *(Output + 1) = (UCHAR)(Offset >> 8);
+        Output += 2;
+
+        Length = MatchLength - MI_LZ_MINIMUM_MATCH;
+
+        if (Length >= 15) {
+            *Token |= 15;
+            Length -= 15;
+            while (Length >= 255) {
+                *Output = 255;
+                Output += 1;
+                Length -= 255;
+            }
+            *Output = (UCHAR) Length;
+            Output += 1;
+        }
+        else {
+            *Token |= (UCHAR) Length;
+        }
+
+        //
+        // Note a match that runs to the end of the page is followed by an
+        // empty literal sequence to terminate the stream.
+        //
+
+        Input += MatchLength;
+        Anchor = Input;
+    }
+
+    return (ULONG)(Output - Destination);
+}
+
+LOGICAL
+MiDecompressPage (
+    IN PUCHAR Source,
+    IN ULONG SourceSize,
+    OUT PUCHAR Destination
+    )
+
+/*++
+
+Routine Description:
+
+    This routine decompresses a page compressed by MiCompressPage.  The
+    input is checked as it is decoded so nothing outside the destination
+    page can ever be written.
+
+Arguments:
+
+    Source - Supplies the compressed data.
+
+    SourceSize - Supplies the size of the compressed data.
+
+    Destination - Supplies the page to decompress into.
+
+Return Value:
+
+    TRUE if exactly one page was decoded, FALSE if the data is corrupt.
+
+Environment:
+
+    Kernel mode, any IRQL.
+
+--*/
+
+{
+    PUCHAR Input;
+    PUCHAR InputEnd;
+    PUCHAR Output;
+    PUCHAR OutputEnd;
+    PUCHAR Match;
+    ULONG Token;
+    ULONG Byte;
+    ULONG_PTR Length;
+    ULONG_PTR Offset;
+
+    Input = Source;
+    InputEnd = Source + SourceSize;
+    Output = Destination;
+    OutputEnd = Destination + PAGE_SIZE;
+
+    while (Input < InputEnd) {
+
+        Token = *Input;
+        Input += 1;
+
+        Length = Token >> 4;
+
+        if (Length == 15) {
+            do {
+                if (Input >= InputEnd) {
+                    return FALSE;
+                }
+                Byte = *Input;
+                Input += 1;
+                Length += Byte;
+            } while (Byte == 255);
+        }
+
+        if (((ULONG_PTR)(InputEnd - Input) < Length) ||
+            ((ULONG_PTR)(OutputEnd - Output) < Length)) {
+            return FALSE;
+        }
+
+        RtlCopyMemory (Output, Input, Length);
+        Output += Length;
+        Input += Length;
+
+        if (Input == InputEnd) {
+            break;
+        }
+
+        if (InputEnd - Input < 2) {
+            return FALSE;
+        }
+
+        Offset = *Input | (*(Input + 1) << 8);
+        Input += 2;
+
+        if ((Offset == 0) || (Offset > (ULONG_PTR)(Output - Destination))) {
+            return FALSE;
+        }
+
+        Length = Token & 0xF;
+
+        if (Length == 15) {
+            do {
+                if (Input >= InputEnd) {
+                    return FALSE;
+                }
+                Byte = *Input;
+                Input += 1;
+                Length += Byte;
+            } while (Byte == 255);
+        }
+
+        Length += MI_LZ_MINIMUM_MATCH;
+
+        if ((ULONG_PTR)(OutputEnd - Output) < Length) {
+            return FALSE;
+        }
+
+        //
+        // Matches may overlap their own output so copy forwards a byte
+        // at a time.
+        //
+
+        Match = Output - Offset;
+
+        do {
+            *Output = *Match;
+            Output += 1;
+            Match += 1;
+            Length -= 1;
+        } while (Length != 0);
+    }
+
+    return (LOGICAL)(Output == OutputEnd);
+}
+
+PMI_COMPRESSED_PAGE
+MiLookupCompressedPage (
+    IN ULONG_PTR Key
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks up the store entry for the specified slot.
+
+Arguments:
+
+    Key - Supplies the store key of the slot.
+
+Return Value:
+
+    The entry, or NULL if the slot is not in the store.
+
+Environment:
+
+    Kernel mode, store lock held.
+
+--*/
+
+{
+    PLIST_ENTRY ListHead;
+    PLIST_ENTRY NextEntry;
+    PMI_COMPRESSED_PAGE Entry;
+
+    ListHead = &MiCompressedStore.HashTable[MI_COMPRESSED_HASH (Key)];
+    NextEntry = ListHead->Flink;
+
+    while (NextEntry != ListHead) {
+
+        Entry = CONTAINING_RECORD (NextEntry, MI_COMPRESSED_PAGE, HashLinks);
+
+        if (Entry->Key == Key) {
+            return Entry;
+        }
+
+        NextEntry = NextEntry->Flink;
+    }
+
+    return NULL;
+}
+
+LOGICAL
+MiUnlinkCompressedPage (
+    IN PMI_COMPRESSED_PAGE Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes an entry from the store.
+
+Arguments:
+
+    Entry - Supplies the entry to remove.
+
+Return Value:
+
+    TRUE if the caller must free the entry, FALSE if a reference is still
+    outstanding in which case the last dereference frees it.
+
+Environment:
+
+    Kernel mode, store lock held.
+
+--*/
+
+{
+    ASSERT ((Entry->Flags & MI_COMPRESSED_PAGE_REMOVED) == 0);
+
+    RemoveEntryList (&Entry->HashLinks);
+    RemoveEntryList (&Entry->AgeLinks);
+
+    MiCompressedStore.NumberOfEntries -= 1;
+    MiCompressedStore.Bytes -= MI_COMPRESSED_PAGE_BYTES (Entry);
+
+    Entry->Flags |= MI_COMPRESSED_PAGE_REMOVED;
+
+    return (LOGICAL)(Entry->References == 0);
+}
+
+VOID
+MiDereferenceCompressedPage (
+    IN PMI_COMPRESSED_PAGE Entry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine drops a reference on a store entry, freeing it if it has
+    been removed from the store meanwhile.
+
+Arguments:
+
+    Entry - Supplies the entry to dereference.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, IRQL <= APC_LEVEL, no locks held.
+
+--*/
+
+{
+    KIRQL OldIrql;
+    LOGICAL FreeEntry;
+
+    KeAcquireSpinLock (&MiCompressedStore.Lock, &OldIrql);
+
+    ASSERT (Entry->References != 0);
+
+    Entry->References -= 1;
+
+    FreeEntry = (LOGICAL)((Entry->References == 0) &&
+                          (Entry->Flags & MI_COMPRESSED_PAGE_REMOVED));
+
+    KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+    if (FreeEntry == TRUE) {
+        ExFreePool (Entry);
+    }
+
+    return;
+}
+
+LOGICAL
+MiIsPageCompressed (
+    IN MMPTE PteContents
+    )
+
+/*++
+
+Routine Description:
+
+    This routine determines whether the paging file slot in the specified
+    PTE is held in the compressed store, ie: whether the paging file copy
+    of the slot is stale.
+
+Arguments:
+
+    PteContents - Supplies a PTE in paging file format.
+
+Return Value:
+
+    TRUE if the slot is in the store, FALSE if not.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    LOGICAL Found;
+    ULONG_PTR Key;
+
+    MM_PFN_LOCK_ASSERT();
+
+    if (MiCompressedStore.NumberOfEntries == 0) {
+        return FALSE;
+    }
+
+    Key = MI_COMPRESSED_KEY (GET_PAGING_FILE_NUMBER (PteContents),
+                             GET_PAGING_FILE_OFFSET (PteContents));
+
+    KeAcquireSpinLockAtDpcLevel (&MiCompressedStore.Lock);
+
+    Found = (LOGICAL)(MiLookupCompressedPage (Key) != NULL);
+
+    KeReleaseSpinLockFromDpcLevel (&MiCompressedStore.Lock);
+
+    return Found;
+}
+
+VOID
+MiRemoveCompressedPage (
+    IN ULONG PageFileNumber,
+    IN ULONG_PTR Offset
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes the specified paging file slot from the store as
+    the slot is being released.  The entry is queued for the modified page
+    writer to free as pool cannot be freed under the PFN lock.
+
+Arguments:
+
+    PageFileNumber - Supplies the paging file number of the slot.
+
+    Offset - Supplies the offset in pages of the slot.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    PMI_COMPRESSED_PAGE Entry;
+
+    MM_PFN_LOCK_ASSERT();
+
+    if (MiCompressedStore.NumberOfEntries == 0) {
+        return;
+    }
+
+    KeAcquireSpinLockAtDpcLevel (&MiCompressedStore.Lock);
+
+    Entry = MiLookupCompressedPage (MI_COMPRESSED_KEY (PageFileNumber, Offset));
+
+    if ((Entry != NULL) && (MiUnlinkCompressedPage (Entry) == TRUE)) {
+        InsertTailList (&MiCompressedStore.FreeListHead, &Entry->HashLinks);
+    }
+
+    KeReleaseSpinLockFromDpcLevel (&MiCompressedStore.Lock);
+
+    return;
+}
+
+VOID
+MiRemoveCompressedPageRange (
+    IN ULONG PageFileNumber,
+    IN ULONG_PTR StartingOffset,
+    IN PFN_NUMBER NumberOfPages
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes every page of the specified range of paging file
+    slots from the store as the range is being released.
+
+Arguments:
+
+    PageFileNumber - Supplies the paging file number of the range.
+
+    StartingOffset - Supplies the offset in pages of the first slot.
+
+    NumberOfPages - Supplies the number of slots in the range.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    PLIST_ENTRY NextEntry;
+    PMI_COMPRESSED_PAGE Entry;
+    ULONG_PTR Offset;
+    ULONG_PTR EndingOffset;
+
+    MM_PFN_LOCK_ASSERT();
+
+    if ((MiCompressedStore.NumberOfEntries == 0) || (NumberOfPages == 0)) {
+        return;
+    }
+
+    EndingOffset = StartingOffset + NumberOfPages;
+
+    KeAcquireSpinLockAtDpcLevel (&MiCompressedStore.Lock);
+
+    if (NumberOfPages <= MiCompressedStore.NumberOfEntries) {
+
+        //
+        // Look up each slot in the range.
+        //
+
+        for (Offset = StartingOffset; Offset < EndingOffset; Offset += 1) {
+
+            Entry = MiLookupCompressedPage (MI_COMPRESSED_KEY (PageFileNumber, Offset));
+
+            if ((Entry != NULL) && (MiUnlinkCompressedPage (Entry) == TRUE)) {
+                InsertTailList (&MiCompressedStore.FreeListHead, &Entry->HashLinks);
+            }
+        }
+    }
+    else {
+
+        //
+        // The range is larger than the store, so examine every entry
+        // instead.
+        //
+
+        NextEntry = MiCompressedStore.AgeListHead.Flink;
+
+        while (NextEntry != &MiCompressedStore.AgeListHead) {
+
+            Entry = CONTAINING_RECORD (NextEntry, MI_COMPRESSED_PAGE, AgeLinks);
+
+            NextEntry = NextEntry->Flink;
+
+            if ((MI_COMPRESSED_KEY_FILE (Entry->Key) == PageFileNumber) &&
+                (MI_COMPRESSED_KEY_OFFSET (Entry->Key) >= StartingOffset) &&
+                (MI_COMPRESSED_KEY_OFFSET (Entry->Key) < EndingOffset) &&
+                (MiUnlinkCompressedPage (Entry) == TRUE)) {
+
+                InsertTailList (&MiCompressedStore.FreeListHead, &Entry->HashLinks);
+            }
+        }
+    }
+
+    KeReleaseSpinLockFromDpcLevel (&MiCompressedStore.Lock);
+
+    return;
+}
+
+LOGICAL
+MiCompressModifiedWrite (
+    IN PMMMOD_WRITER_MDL_ENTRY ModWriterEntry,
+    IN ULONG PageFileNumber,
+    IN ULONG_PTR StartingOffset
+    )
+
+/*++
+
+Routine Description:
+
+    This routine keeps the private user pages of a pagefile write cluster
+    in the compressed store.
+
+Arguments:
+
+    ModWriterEntry - Supplies the writer entry whose MDL describes the
+                     cluster.  The pages are write-in-progress and their
+                     slots are allocated.
+
+    PageFileNumber - Supplies the paging file the slots were allocated in.
+
+    StartingOffset - Supplies the offset in pages of the first slot.
+
+Return Value:
+
+    TRUE if every page of the cluster was kept and the write need not be
+    issued, FALSE if the write must be issued.  Any pages that were kept
+    when FALSE is returned are marked clean.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, modified page writer thread.
+
+--*/
+
+{
+    KIRQL OldIrql;
+    ULONG i;
+    ULONG Size;
+    ULONG NumberOfPages;
+    ULONG PagesKept;
+    ULONG Flags;
+    PVOID Va;
+    PMMPFN Pfn1;
+    PPFN_NUMBER Page;
+    PEPROCESS Process;
+    PMI_COMPRESSED_PAGE Entry;
+    PMI_COMPRESSED_PAGE Kept[MM_MAXIMUM_WRITE_CLUSTER];
+
+    if ((MiCompressedStore.HashTable == NULL) ||
+        (MiCompressedStore.Evicting == TRUE) ||
+        (MmAvailablePages < MiCompressedStorePressurePages) ||
+        (MiCompressedStore.Bytes >= MiCompressedStore.MaximumBytes)) {
+
+        return FALSE;
+    }
+
+    NumberOfPages = ModWriterEntry->Mdl.ByteCount >> PAGE_SHIFT;
+
+    ASSERT (NumberOfPages <= MmModifiedWriteClusterSize);
+
+    Process = PsGetCurrentProcess ();
+    Page = &ModWriterEntry->Page[0];
+    PagesKept = 0;
+
+    for (i = 0; i < NumberOfPages; i += 1, Page += 1) {
+
+        Kept[i] = NULL;
+
+        //
+        // Only private user pages are kept.  Kernel stacks, page tables,
+        // pageable kernel memory and pagefile backed sections are read
+        // back through paths that do not consult the store.
+        //
+
+        Pfn1 = MI_PFN_ELEMENT (*Page);
+
+        if ((Pfn1->u3.e1.PrototypePte == 1) ||
+            (MI_IS_PFN_DELETED (Pfn1)) ||
+            (Pfn1->PteAddress > MiHighestUserPte)) {
+
+            continue;
+        }
+
+        Va = MiMapPageInHyperSpace (Process, *Page, &OldIrql);
+
+        Size = MiCompressPage (Va,
+                               MiCompressedStore.CompressBuffer,
+                               MI_COMPRESSED_PAGE_LIMIT,
+                               MiCompressedStore.HashWorkspace);
+
+        MiUnmapPageInHyperSpace (Process, Va, OldIrql);
+
+        if (Size == 0) {
+            MiCompressedPagesRejected += 1;
+            continue;
+        }
+
+        Entry = ExAllocatePoolWithTag (NonPagedPool,
+                                       FIELD_OFFSET (MI_COMPRESSED_PAGE, Data) +
+                                           Size,
+                                       'sCmM');
+
+        if (Entry == NULL) {
+            break;
+        }
+
+        Entry->Key = MI_COMPRESSED_KEY (PageFileNumber, StartingOffset + i);
+        Entry->Size = (USHORT) Size;
+        Entry->References = 0;
+        Entry->Flags = 0;
+
+        RtlCopyMemory (Entry->Data, MiCompressedStore.CompressBuffer, Size);
+
+        Kept[i] = Entry;
+        PagesKept += 1;
+    }
+
+    if (PagesKept == 0) {
+        return FALSE;
+    }
+
+    //
+    // If any page is going to the paging file the whole cluster is
+    // written, so the kept pages are clean.
+    //
+
+    Flags = 0;
+
+    if (PagesKept != NumberOfPages) {
+        Flags = MI_COMPRESSED_PAGE_CLEAN;
+    }
+
+    //
+    // The slots cannot be released until the write is completed so none
+    // of them can be in the store yet.
+    //
+
+    KeAcquireSpinLock (&MiCompressedStore.Lock, &OldIrql);
+
+    for (i = 0; i < NumberOfPages; i += 1) {
+
+        Entry = Kept[i];
+
+        if (Entry == NULL) {
+            continue;
+        }
+
+        ASSERT (MiLookupCompressedPage (Entry->Key) == NULL);
+
+        Entry->Flags = Flags;
+
+        InsertTailList (&MiCompressedStore.HashTable[MI_COMPRESSED_HASH (Entry->Key)],
+                        &Entry->HashLinks);
+
+        InsertTailList (&MiCompressedStore.AgeListHead, &Entry->AgeLinks);
+
+        MiCompressedStore.NumberOfEntries += 1;
+        MiCompressedStore.Bytes += MI_COMPRESSED_PAGE_BYTES (Entry);
+    }
+
+    KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+    MiCompressedPagesStored += PagesKept;
+
+    if (Flags == 0) {
+        MiCompressedWritesAvoided += 1;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+LOGICAL
+MiReadCompressedPage (
+    IN PMMINPAGE_SUPPORT ReadBlock
+    )
+
+/*++
+
+Routine Description:
+
+    This routine satisfies a single page paging file read from the
+    compressed store.  On success the read block is completed exactly as
+    the I/O system would have completed the read.
+
+Arguments:
+
+    ReadBlock - Supplies the read block built by MiResolvePageFileFault.
+
+Return Value:
+
+    TRUE if the read was satisfied, FALSE if the slot has been evicted
+    meanwhile and the read must be issued to the paging file.
+
+Environment:
+
+    Kernel mode, APC_LEVEL or below, no locks held.
+
+--*/
+
+{
+    KIRQL OldIrql;
+    ULONG i;
+    ULONG_PTR Key;
+    PVOID Va;
+    LOGICAL Decoded;
+    PEPROCESS Process;
+    PMI_COMPRESSED_PAGE Entry;
+
+    ASSERT (ReadBlock->Mdl.ByteCount == PAGE_SIZE);
+
+    for (i = 0; i < MmNumberOfPagingFiles; i += 1) {
+        if (MmPagingFile[i]->File == ReadBlock->FilePointer) {
+            break;
+        }
+    }
+
+    ASSERT (i < MmNumberOfPagingFiles);
+
+    Key = MI_COMPRESSED_KEY (i, ReadBlock->ReadOffset.QuadPart >> PAGE_SHIFT);
+
+    KeAcquireSpinLock (&MiCompressedStore.Lock, &OldIrql);
+
+    Entry = MiLookupCompressedPage (Key);
+
+    if (Entry != NULL) {
+        Entry->References += 1;
+    }
+
+    KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+    if (Entry == NULL) {
+        return FALSE;
+    }
+
+    Process = PsGetCurrentProcess ();
+
+    Va = MiMapPageInHyperSpace (Process, ReadBlock->Page[0], &OldIrql);
+
+    Decoded = MiDecompressPage (Entry->Data, Entry->Size, Va);
+
+    MiUnmapPageInHyperSpace (Process, Va, OldIrql);
+
+    MiDereferenceCompressedPage (Entry);
+
+    if (Decoded == TRUE) {
+        ReadBlock->IoStatus.Status = STATUS_SUCCESS;
+        ReadBlock->IoStatus.Information = PAGE_SIZE;
+    }
+    else {
+        ASSERT (FALSE);
+        ReadBlock->IoStatus.Status = STATUS_DATA_ERROR;
+        ReadBlock->IoStatus.Information = 0;
+    }
+
+    KeSetEvent (&ReadBlock->Event, 0, FALSE);
+
+    return TRUE;
+}
+
+VOID
+MiUpdateRefaultStatistics (
+    IN LOGICAL Compressed,
+    IN LARGE_INTEGER StartTime
+    )
+
+/*++
+
+Routine Description:
+
+    This routine accounts a completed paging file refault so the latency
+    of refaults satisfied from the compressed store can be compared with
+    that of paging file reads.
+
+Arguments:
+
+    Compressed - Supplies TRUE if the refault was satisfied from the store.
+
+    StartTime - Supplies the performance counter when the inpage was issued.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    LARGE_INTEGER EndTime;
+    ULONG Elapsed;
+
+    EndTime = KeQueryPerformanceCounter (NULL);
+
+    if (EndTime.QuadPart - StartTime.QuadPart > MAXULONG) {
+        Elapsed = MAXULONG;
+    }
+    else {
+        Elapsed = (ULONG)(EndTime.QuadPart - StartTime.QuadPart);
+    }
+
+    if (Compressed == TRUE) {
+        InterlockedIncrement ((PLONG) &MiCompressedRefaults);
+        ExInterlockedAddLargeStatistic (&MiCompressedRefaultTime, Elapsed);
+    }
+    else {
+        InterlockedIncrement ((PLONG) &MiPageFileRefaults);
+        ExInterlockedAddLargeStatistic (&MiPageFileRefaultTime, Elapsed);
+    }
+
+    return;
+}
+
+LOGICAL
+MiEvictCompressedPage (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine evicts the oldest page in the store.  A clean page is just
+    freed, any other page is decompressed and written to its slot first.
+    The entry stays in the store while the write is in progress so the
+    slot is never read from the paging file before the data reaches it.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if a page was evicted, FALSE if the store is empty or the write
+    failed.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, modified page writer thread.
+
+--*/
+
+{
+    KIRQL OldIrql;
+    KEVENT IoEvent;
+    NTSTATUS Status;
+    IO_STATUS_BLOCK IoStatus;
+    LARGE_INTEGER StartingOffset;
+    LOGICAL FreeEntry;
+    PMI_COMPRESSED_PAGE Entry;
+
+    KeAcquireSpinLock (&MiCompressedStore.Lock, &OldIrql);
+
+    if (IsListEmpty (&MiCompressedStore.AgeListHead)) {
+        KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+        return FALSE;
+    }
+
+    Entry = CONTAINING_RECORD (MiCompressedStore.AgeListHead.Flink,
+                               MI_COMPRESSED_PAGE,
+                               AgeLinks);
+
+    if (Entry->Flags & MI_COMPRESSED_PAGE_CLEAN) {
+
+        FreeEntry = MiUnlinkCompressedPage (Entry);
+
+        KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+        if (FreeEntry == TRUE) {
+            ExFreePool (Entry);
+        }
+
+        MiCompressedPagesDropped += 1;
+        return TRUE;
+    }
+
+    Entry->References += 1;
+
+    KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+    if (MiDecompressPage (Entry->Data,
+                          Entry->Size,
+                          MiCompressedStore.EvictBuffer) == FALSE) {
+
+        ASSERT (FALSE);
+        MiDereferenceCompressedPage (Entry);
+        return FALSE;
+    }
+
+    //
+    // The slot may be released while the write is in progress, but it
+    // cannot be reallocated as only this thread allocates slots.
+    //
+
+    StartingOffset.QuadPart =
+        (LONGLONG) MI_COMPRESSED_KEY_OFFSET (Entry->Key) << PAGE_SHIFT;
+
+    KeInitializeEvent (&IoEvent, NotificationEvent, FALSE);
+
+    Status = IoSynchronousPageWrite (
+                MmPagingFile[MI_COMPRESSED_KEY_FILE (Entry->Key)]->File,
+                MiCompressedStore.EvictMdl,
+                &StartingOffset,
+                &IoEvent,
+                &IoStatus);
+
+    if (Status == STATUS_PENDING) {
+        KeWaitForSingleObject (&IoEvent,
+                               WrPageOut,
+                               KernelMode,
+                               FALSE,
+                               NULL);
+        Status = IoStatus.Status;
+    }
+
+    if (MiCompressedStore.EvictMdl->MdlFlags & MDL_MAPPED_TO_SYSTEM_VA) {
+        MmUnmapLockedPages (MiCompressedStore.EvictMdl->MappedSystemVa,
+                            MiCompressedStore.EvictMdl);
+    }
+
+    KeAcquireSpinLock (&MiCompressedStore.Lock, &OldIrql);
+
+    if ((NT_SUCCESS (Status)) &&
+        ((Entry->Flags & MI_COMPRESSED_PAGE_REMOVED) == 0)) {
+
+        MiUnlinkCompressedPage (Entry);
+        MiCompressedPagesEvicted += 1;
+    }
+
+    Entry->References -= 1;
+
+    FreeEntry = (LOGICAL)((Entry->References == 0) &&
+                          (Entry->Flags & MI_COMPRESSED_PAGE_REMOVED));
+
+    KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+    if (FreeEntry == TRUE) {
+        ExFreePool (Entry);
+    }
+
+    return (LOGICAL) NT_SUCCESS (Status);
+}
+
+VOID
+MiTrimCompressedStore (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called by the modified page writer each time it wakes.
+    It frees the entries removed under the PFN lock and, once available
+    memory has stayed low for long enough, evicts a batch of the oldest
+    pages.  New clusters bypass the store until the pressure is relieved.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, modified page writer thread.
+
+--*/
+
+{
+    ULONG i;
+    KIRQL OldIrql;
+    LIST_ENTRY FreeList;
+    PLIST_ENTRY NextEntry;
+    LARGE_INTEGER CurrentTime;
+    PMI_COMPRESSED_PAGE Entry;
+
+    if (MiCompressedStore.HashTable == NULL) {
+        return;
+    }
+
+    if (!IsListEmpty (&MiCompressedStore.FreeListHead)) {
+
+        InitializeListHead (&FreeList);
+
+        KeAcquireSpinLock (&MiCompressedStore.Lock, &OldIrql);
+
+        while (!IsListEmpty (&MiCompressedStore.FreeListHead)) {
+            NextEntry = RemoveHeadList (&MiCompressedStore.FreeListHead);
+            InsertTailList (&FreeList, NextEntry);
+        }
+
+        KeReleaseSpinLock (&MiCompressedStore.Lock, OldIrql);
+
+        while (!IsListEmpty (&FreeList)) {
+            NextEntry = RemoveHeadList (&FreeList);
+            Entry = CONTAINING_RECORD (NextEntry, MI_COMPRESSED_PAGE, HashLinks);
+            ExFreePool (Entry);
+        }
+    }
+
+    if (MmAvailablePages >= MiCompressedStorePressurePages) {
+        MiCompressedStore.PressureStart.QuadPart = 0;
+        MiCompressedStore.Evicting = FALSE;
+        return;
+    }
+
+    KeQuerySystemTime (&CurrentTime);
+
+    if (MiCompressedStore.PressureStart.QuadPart == 0) {
+        MiCompressedStore.PressureStart = CurrentTime;
+        return;
+    }
+
+    if (CurrentTime.QuadPart - MiCompressedStore.PressureStart.QuadPart <
+                                            MiCompressedStorePressureTime) {
+        return;
+    }
+
+    MiCompressedStore.Evicting = TRUE;
+
+    for (i = 0; i < MiCompressedStoreEvictBatch; i += 1) {
+        if (MiEvictCompressedPage () == FALSE) {
+            break;
+        }
+    }
+
+    return;
+}
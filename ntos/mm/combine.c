@@ -0,0 +1,1478 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved.
+
+You may only use this code if you agree to the terms of the Windows Research Kernel Source Code License agreement (see License.txt).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    combine.c
+
+Abstract:
+
+    This module contains the routines which combine identical private
+    pages of user processes into shared copy on write pages.
+
+    When enabled, the working set manager calls MiCombineIdenticalPages
+    as it ages each process.  Private pages of the process which have been
+    trimmed to the standby or modified lists are hashed a bounded number
+    at a time.  Pages that are entirely zero are freed and their PTEs go
+    back to demand zero.  A page whose hash has been seen before (in any
+    process) becomes a fork prototype PTE - a clone block - owned by the
+    combiner, and each later page with the same contents is pointed at
+    that clone block and freed.
+
+    Combined pages are described by clone headers and clone descriptors
+    exactly like pages shared by fork, so the copy on write, fork and
+    address space deletion paths handle them unchanged.  Each clone header
+    the combiner creates covers a single locked page of clone blocks and
+    carries an extra reference for the combiner, which is dropped once
+    every clone block in it has been dereferenced.
+
+    Only trimmed pages are examined so the pages a process is actively
+    using are never touched and no TB flushes are needed.
+
+--*/
+
+#include "mi.h"
+
+//
+// Each clone header covers one page of clone blocks.  The page is locked
+// for the life of the header so the blocks can be examined with the PFN
+// lock held.
+//
+
+#define MI_COMBINE_BLOCKS           (PAGE_SIZE / sizeof (MMCLONE_BLOCK))
+
+#define MI_COMBINE_HASH_BUCKETS     1024
+#define MI_COMBINE_CANDIDATES       4096
+
+#define MI_COMBINE_HASH_MULTIPLIER  0x9E3779B1
+
+typedef struct _MI_COMBINE_HEADER *PMI_COMBINE_HEADER;
+
+typedef struct _MI_COMBINE_ENTRY {
+    struct _MI_COMBINE_ENTRY *Next;
+    PMI_COMBINE_HEADER Header;
+    ULONG Hash;
+    ULONG Protection;
+} MI_COMBINE_ENTRY, *PMI_COMBINE_ENTRY;
+
+typedef struct _MI_COMBINE_HEADER {
+    LIST_ENTRY Links;
+    PMMCLONE_HEADER CloneHeader;
+    ULONG NumberOfBlocks;               // Clone blocks handed out so far
+    MI_COMBINE_ENTRY Entries[MI_COMBINE_BLOCKS];
+} MI_COMBINE_HEADER;
+
+#define MI_COMBINE_ENTRY_TO_CLONE_BLOCK(_Entry)                             \
+        ((_Entry)->Header->CloneHeader->ClonePtes +                         \
+            ((_Entry) - (_Entry)->Header->Entries))
+
+//
+// A hash seen once is remembered here along with the page it came from.
+// Seeing it again from a different page promotes that page to a clone
+// block.
+//
+
+typedef struct _MI_COMBINE_CANDIDATE {
+    ULONG Hash;
+    PFN_NUMBER PageFrameIndex;
+} MI_COMBINE_CANDIDATE, *PMI_COMBINE_CANDIDATE;
+
+ULONG MmEnablePageCombining;
+
+//
+// The number of PTEs examined in each process per aging pass.
+//
+
+ULONG MiPageCombineScanLimit = 1024;
+
+//
+// The combiner's state is only touched with this mutex held.  The hash
+// table, candidates and compare buffer are allocated the first time the
+// combiner runs.
+//
+
+KGUARDED_MUTEX MiPageCombineMutex;
+
+LIST_ENTRY MiCombineHeaderList;
+PMI_COMBINE_HEADER MiCombineCurrent;
+PMI_COMBINE_ENTRY *MiCombineHash;
+PMI_COMBINE_CANDIDATE MiCombineCandidates;
+PVOID MiCombineBuffer;
+ULONG MiCombinePasses;
+
+//
+// Statistics for MmQueryPageCombineInformation.
+//
+
+SIZE_T MiCombinePagesScanned;
+SIZE_T MiCombinePagesCombined;
+SIZE_T MiCombineZeroPages;
+SIZE_T MiCombinePagesPromoted;
+LARGE_INTEGER MiCombineScanTicks;
+
+extern PFN_NUMBER MmTransitionPrivatePages;
+extern PFN_NUMBER MmTransitionSharedPages;
+
+LOGICAL
+MiPrepareCombiner (
+    VOID
+    );
+
+PMMCLONE_DESCRIPTOR
+MiReferenceCombineDescriptor (
+    IN PEPROCESS Process,
+    IN PMI_COMBINE_HEADER Header
+    );
+
+VOID
+MiDereferenceCombineDescriptor (
+    IN PEPROCESS Process,
+    IN PMMCLONE_DESCRIPTOR CloneDescriptor
+    );
+
+VOID
+MiCombinePage (
+    IN PEPROCESS Process,
+    IN PMMPTE PointerPte
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE,MiCombineIdenticalPages)
+#pragma alloc_text(PAGE,MiPrepareCombiner)
+#pragma alloc_text(PAGE,MiReferenceCombineDescriptor)
+#pragma alloc_text(PAGE,MiDereferenceCombineDescriptor)
+#pragma alloc_text(PAGE,MmQueryPageCombineInformation)
+#endif
+
+
+ULONG
+MiHashCombinePage (
+    IN PVOID VirtualAddress,
+    OUT PLOGICAL ZeroPage
+    )
+
+/*++
+
+Routine Description:
+
+    This routine hashes the contents of the specified page and notes
+    whether the page is entirely zero.
+
+Arguments:
+
+    VirtualAddress - Supplies the address the page is mapped at.
+
+    ZeroPage - Receives TRUE if every byte of the page is zero.
+
+Return Value:
+
+    The hash of the page contents.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    ULONG Hash;
+    ULONG Bits;
+    PULONG Word;
+    PULONG LastWord;
+
+    Hash = 0;
+    Bits = 0;
+
+    Word = (PULONG) VirtualAddress;
+    LastWord = Word + (PAGE_SIZE / sizeof (ULONG));
+
+    do {
+        Bits |= *Word;
+        Hash = (((Hash << 5) | (Hash >> 27)) ^ *Word) * MI_COMBINE_HASH_MULTIPLIER;
+        Word += 1;
+    } while (Word < LastWord);
+
+    *ZeroPage = (LOGICAL)(Bits == 0);
+
+    return Hash ^ (Hash >> 16);
+}
+
+
+LOGICAL
+MiIsCombineCandidate (
+    IN PMMPTE PointerPte,
+    IN MMPTE PteContents
+    )
+
+/*++
+
+Routine Description:
+
+    This routine checks whether the page referenced by the specified
+    transition PTE can be combined.  The page must be an unreferenced
+    cached private page on the standby or modified list with an ordinary
+    protection.
+
+Arguments:
+
+    PointerPte - Supplies the PTE which maps the page.
+
+    PteContents - Supplies the contents of the PTE.
+
+Return Value:
+
+    TRUE if the page can be combined, FALSE if not.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    ULONG Protection;
+    PMMPFN Pfn1;
+
+    MM_PFN_LOCK_ASSERT ();
+
+    if ((PteContents.u.Hard.Valid == 1) ||
+        (PteContents.u.Soft.Prototype == 1) ||
+        (PteContents.u.Soft.Transition == 0)) {
+
+        return FALSE;
+    }
+
+    Protection = (ULONG) PteContents.u.Trans.Protection;
+
+    if ((Protection == MM_ZERO_ACCESS) ||
+        ((Protection & ~MM_PROTECTION_OPERATION_MASK) != 0)) {
+        return FALSE;
+    }
+
+    Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_TRANSITION_PTE (&PteContents));
+
+    if ((Pfn1->PteAddress != PointerPte) ||
+        (Pfn1->u3.e1.PrototypePte == 1) ||
+        (Pfn1->u3.e2.ReferenceCount != 0) ||
+        (Pfn1->u3.e1.CacheAttribute != MiCached) ||
+        (Pfn1->u3.e1.RemovalRequested == 1) ||
+        (Pfn1->OriginalPte.u.Soft.Protection != Protection)) {
+
+        return FALSE;
+    }
+
+    if ((Pfn1->u3.e1.PageLocation != StandbyPageList) &&
+        (Pfn1->u3.e1.PageLocation != ModifiedPageList) &&
+        (Pfn1->u3.e1.PageLocation != ModifiedNoWritePageList)) {
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+PFN_NUMBER
+MiGetCombinedPageFrame (
+    IN PMMCLONE_BLOCK CloneBlock
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the frame currently holding the contents of the
+    specified combiner clone block.
+
+Arguments:
+
+    CloneBlock - Supplies the clone block.
+
+Return Value:
+
+    The frame holding the page, 0 if the clone block is no longer
+    referenced or its page is not resident.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    MMPTE ProtoContents;
+    PMMPFN Pfn1;
+    PFN_NUMBER PageFrameIndex;
+
+    MM_PFN_LOCK_ASSERT ();
+
+    if (CloneBlock->CloneRefCount == 0) {
+        return 0;
+    }
+
+    ProtoContents = CloneBlock->ProtoPte;
+
+    if (ProtoContents.u.Hard.Valid == 1) {
+        return MI_GET_PAGE_FRAME_FROM_PTE (&ProtoContents);
+    }
+
+    if ((ProtoContents.u.Soft.Prototype == 1) ||
+        (ProtoContents.u.Soft.Transition == 0)) {
+        return 0;
+    }
+
+    PageFrameIndex = MI_GET_PAGE_FRAME_FROM_TRANSITION_PTE (&ProtoContents);
+    Pfn1 = MI_PFN_ELEMENT (PageFrameIndex);
+
+    if (Pfn1->u3.e1.ReadInProgress == 1) {
+        return 0;
+    }
+
+    return PageFrameIndex;
+}
+
+
+VOID
+MiReleaseCombinedPage (
+    IN PMMPFN Pfn1,
+    IN PFN_NUMBER PageFrameIndex
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees a private transition page whose PTE has just been
+    pointed elsewhere, along with any paging file space it had.
+
+Arguments:
+
+    Pfn1 - Supplies the PFN element of the page.
+
+    PageFrameIndex - Supplies the page frame number.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    PMMPFN Pfn2;
+    PFN_NUMBER PageTableFrameIndex;
+
+    MM_PFN_LOCK_ASSERT ();
+
+    ASSERT (Pfn1->u3.e2.ReferenceCount == 0);
+
+    MI_SET_PFN_DELETED (Pfn1);
+
+    PageTableFrameIndex = Pfn1->u4.PteFrame;
+    Pfn2 = MI_PFN_ELEMENT (PageTableFrameIndex);
+
+    MiDecrementShareCount (Pfn2, PageTableFrameIndex);
+
+    MiUnlinkPageFromList (Pfn1);
+    MiReleasePageFileSpace (Pfn1->OriginalPte);
+    MiInsertPageInFreeList (PageFrameIndex);
+
+    return;
+}
+
+
+LOGICAL
+MiComparePageWithBuffer (
+    IN PEPROCESS Process,
+    IN PFN_NUMBER PageFrameIndex
+    )
+
+/*++
+
+Routine Description:
+
+    This routine compares the contents of the specified page with the
+    combiner's compare buffer.
+
+Arguments:
+
+    Process - Supplies the current process.
+
+    PageFrameIndex - Supplies the page to compare.
+
+Return Value:
+
+    TRUE if the contents are identical, FALSE if not.
+
+Environment:
+
+    Kernel mode, PFN lock and combiner mutex held.
+
+--*/
+
+{
+    PVOID VirtualAddress;
+    SIZE_T Matched;
+
+    VirtualAddress = MiMapPageInHyperSpaceAtDpc (Process, PageFrameIndex);
+
+    Matched = RtlCompareMemory (MiCombineBuffer, VirtualAddress, PAGE_SIZE);
+
+    MiUnmapPageInHyperSpaceFromDpc (Process, VirtualAddress);
+
+    return (LOGICAL)(Matched == PAGE_SIZE);
+}
+
+
+VOID
+MiCombinePage (
+    IN PEPROCESS Process,
+    IN PMMPTE PointerPte
+    )
+
+/*++
+
+Routine Description:
+
+    This routine examines a single PTE of the current process and, if it
+    maps a trimmed private page, reclaims the page if it is zero, merges
+    it into an existing combined page with the same contents, or promotes
+    it to a combined page if its hash has been seen before.
+
+    The PFN lock is released to find or create the clone descriptor that
+    the process needs to reference a clone block, so the PTE is checked
+    again before anything is changed.  The contents of the page cannot
+    change meanwhile as it is not mapped and the working set pushlock is
+    held - if the page is reused the PTE no longer refers to it.
+
+Arguments:
+
+    Process - Supplies the current process.
+
+    PointerPte - Supplies the PTE to examine.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, address creation mutex, working set
+    pushlock and combiner mutex held.
+
+--*/
+
+{
+    ULONG Hash;
+    ULONG Protection;
+    KIRQL OldIrql;
+    LOGICAL Merge;
+    LOGICAL Copied;
+    LOGICAL ZeroPage;
+    PVOID VirtualAddress;
+    MMPTE TempPte;
+    MMPTE PteContents;
+    PMMPTE ContainingPte;
+    PMMPFN Pfn1;
+    PMMPFN Pfn2;
+    PFN_NUMBER PageFrameIndex;
+    PFN_NUMBER PageTableFrameIndex;
+    PFN_NUMBER CombinedFrameIndex;
+    PMMCLONE_BLOCK CloneBlock;
+    PMMCLONE_DESCRIPTOR CloneDescriptor;
+    PMI_COMBINE_ENTRY Entry;
+    PMI_COMBINE_HEADER Header;
+    PMI_COMBINE_CANDIDATE Candidate;
+
+    LOCK_PFN (OldIrql);
+
+    PteContents = *PointerPte;
+
+    if (MiIsCombineCandidate (PointerPte, PteContents) == FALSE) {
+        UNLOCK_PFN (OldIrql);
+        return;
+    }
+
+    PageFrameIndex = MI_GET_PAGE_FRAME_FROM_TRANSITION_PTE (&PteContents);
+    Pfn1 = MI_PFN_ELEMENT (PageFrameIndex);
+
+    VirtualAddress = MiMapPageInHyperSpaceAtDpc (Process, PageFrameIndex);
+
+    Hash = MiHashCombinePage (VirtualAddress, &ZeroPage);
+
+    MiUnmapPageInHyperSpaceFromDpc (Process, VirtualAddress);
+
+    MiCombinePagesScanned += 1;
+
+    if (ZeroPage == TRUE) {
+
+        //
+        // Return the PTE to demand zero (the commitment is unchanged) and
+        // free the page.
+        //
+
+        TempPte.u.Long = 0;
+        TempPte.u.Soft.Protection = PteContents.u.Trans.Protection;
+
+        MI_WRITE_INVALID_PTE (PointerPte, TempPte);
+
+        MiReleaseCombinedPage (Pfn1, PageFrameIndex);
+
+        UNLOCK_PFN (OldIrql);
+
+        Process->NumberOfPrivatePages -= 1;
+        MiCombineZeroPages += 1;
+
+        return;
+    }
+
+    //
+    // Combined pages are always copy on write.
+    //
+
+    TempPte = PteContents;
+    MI_MAKE_PROTECT_WRITE_COPY (TempPte);
+    Protection = (ULONG) TempPte.u.Trans.Protection;
+
+    //
+    // Look for a combined page with the same contents.  The page is only
+    // copied into the compare buffer once a hash matches.
+    //
+
+    Copied = FALSE;
+    Entry = MiCombineHash[Hash & (MI_COMBINE_HASH_BUCKETS - 1)];
+
+    while (Entry != NULL) {
+
+        if ((Entry->Hash == Hash) && (Entry->Protection == Protection)) {
+
+            CombinedFrameIndex = MiGetCombinedPageFrame (MI_COMBINE_ENTRY_TO_CLONE_BLOCK (Entry));
+
+            if (CombinedFrameIndex != 0) {
+
+                if (Copied == FALSE) {
+
+                    VirtualAddress = MiMapPageInHyperSpaceAtDpc (Process,
+                                                                 PageFrameIndex);
+
+                    RtlCopyMemory (MiCombineBuffer, VirtualAddress, PAGE_SIZE);
+
+                    MiUnmapPageInHyperSpaceFromDpc (Process, VirtualAddress);
+
+                    Copied = TRUE;
+                }
+
+                if (MiComparePageWithBuffer (Process, CombinedFrameIndex) == TRUE) {
+                    break;
+                }
+            }
+        }
+
+        Entry = Entry->Next;
+    }
+
+    if (Entry != NULL) {
+        Merge = TRUE;
+        Header = Entry->Header;
+        CloneBlock = MI_COMBINE_ENTRY_TO_CLONE_BLOCK (Entry);
+    }
+    else {
+
+        //
+        // Nothing to merge with.  Remember the hash, and if it was already
+        // seen from a different page then promote this page.
+        //
+
+        Candidate = &MiCombineCandidates[Hash & (MI_COMBINE_CANDIDATES - 1)];
+
+        if ((Candidate->Hash != Hash) ||
+            (Candidate->PageFrameIndex == PageFrameIndex) ||
+            (MiCombineCurrent == NULL) ||
+            (MiCombineCurrent->NumberOfBlocks == MI_COMBINE_BLOCKS)) {
+
+            Candidate->Hash = Hash;
+            Candidate->PageFrameIndex = PageFrameIndex;
+
+            UNLOCK_PFN (OldIrql);
+            return;
+        }
+
+        Candidate->Hash = 0;
+        Candidate->PageFrameIndex = 0;
+
+        Merge = FALSE;
+
+        Header = MiCombineCurrent;
+        Entry = &Header->Entries[Header->NumberOfBlocks];
+        CloneBlock = MI_COMBINE_ENTRY_TO_CLONE_BLOCK (Entry);
+
+        ASSERT (CloneBlock->CloneRefCount == 0);
+    }
+
+    UNLOCK_PFN (OldIrql);
+
+    CloneDescriptor = MiReferenceCombineDescriptor (Process, Header);
+
+    if (CloneDescriptor == NULL) {
+        return;
+    }
+
+    LOCK_PFN (OldIrql);
+
+    if ((PointerPte->u.Long != PteContents.u.Long) ||
+        (MiIsCombineCandidate (PointerPte, PteContents) == FALSE)) {
+
+        UNLOCK_PFN (OldIrql);
+        MiDereferenceCombineDescriptor (Process, CloneDescriptor);
+        return;
+    }
+
+    if (Merge == TRUE) {
+
+        //
+        // Merge into the existing combined page (provided it is still
+        // referenced and resident) and free this page.
+        //
+
+        if (MiGetCombinedPageFrame (CloneBlock) == 0) {
+            UNLOCK_PFN (OldIrql);
+            MiDereferenceCombineDescriptor (Process, CloneDescriptor);
+            return;
+        }
+
+        InterlockedIncrement (&CloneBlock->CloneRefCount);
+
+        TempPte.u.Long = MiProtoAddressForPte (&CloneBlock->ProtoPte);
+        TempPte.u.Proto.Prototype = 1;
+        MI_WRITE_INVALID_PTE (PointerPte, TempPte);
+
+        MiReleaseCombinedPage (Pfn1, PageFrameIndex);
+
+        MiCombinePagesCombined += 1;
+    }
+    else {
+
+        //
+        // Promote this page to a clone block exactly as fork does for a
+        // private page in transition, except that this process holds the
+        // only reference.
+        //
+
+        ASSERT (Entry == &Header->Entries[Header->NumberOfBlocks]);
+
+        CloneBlock->ProtoPte = PteContents;
+        MI_MAKE_PROTECT_WRITE_COPY (CloneBlock->ProtoPte);
+        CloneBlock->CloneRefCount = 1;
+
+        PageTableFrameIndex = Pfn1->u4.PteFrame;
+
+        Pfn1->PteAddress = &CloneBlock->ProtoPte;
+        Pfn1->u3.e1.PrototypePte = 1;
+        MI_MAKE_PROTECT_WRITE_COPY (Pfn1->OriginalPte);
+
+        ContainingPte = MiGetPteAddress (&CloneBlock->ProtoPte);
+        ASSERT (ContainingPte->u.Hard.Valid == 1);
+
+        Pfn1->u4.PteFrame = MI_GET_PAGE_FRAME_FROM_PTE (ContainingPte);
+
+        //
+        // The page containing the clone block gains a share count for the
+        // transition PTE placed in it and the page table page loses one.
+        //
+
+        Pfn2 = MI_PFN_ELEMENT (Pfn1->u4.PteFrame);
+        Pfn2->u2.ShareCount += 1;
+
+        MmTransitionPrivatePages -= 1;
+        MmTransitionSharedPages += 1;
+
+        TempPte.u.Long = MiProtoAddressForPte (Pfn1->PteAddress);
+        TempPte.u.Proto.Prototype = 1;
+        MI_WRITE_INVALID_PTE (PointerPte, TempPte);
+
+        Pfn2 = MI_PFN_ELEMENT (PageTableFrameIndex);
+        MiDecrementShareCount (Pfn2, PageTableFrameIndex);
+
+        Entry->Header = Header;
+        Entry->Hash = Hash;
+        Entry->Protection = Protection;
+        Entry->Next = MiCombineHash[Hash & (MI_COMBINE_HASH_BUCKETS - 1)];
+        MiCombineHash[Hash & (MI_COMBINE_HASH_BUCKETS - 1)] = Entry;
+
+        Header->NumberOfBlocks += 1;
+
+        MiCombinePagesPromoted += 1;
+    }
+
+    CloneDescriptor->NumberOfReferences += 1;
+    CloneDescriptor->FinalNumberOfReferences += 1;
+
+    UNLOCK_PFN (OldIrql);
+
+    //
+    // One less private page (it's now shared).
+    //
+
+    Process->NumberOfPrivatePages -= 1;
+
+    return;
+}
+
+
+PMMCLONE_DESCRIPTOR
+MiReferenceCombineDescriptor (
+    IN PEPROCESS Process,
+    IN PMI_COMBINE_HEADER Header
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the clone descriptor through which the current
+    process references the clone blocks of the specified combiner header,
+    creating it if the process has none.
+
+    A newly created descriptor has no references.  If the caller does not
+    end up using it, it must be handed to MiDereferenceCombineDescriptor.
+
+Arguments:
+
+    Process - Supplies the current process.
+
+    Header - Supplies the combiner header.
+
+Return Value:
+
+    The clone descriptor, NULL if one could not be created.
+
+Environment:
+
+    Kernel mode, APCs disabled, address creation mutex, working set
+    pushlock and combiner mutex held.
+
+--*/
+
+{
+    PMM_AVL_TABLE CloneRoot;
+    PMMCLONE_HEADER CloneHeader;
+    PMMCLONE_DESCRIPTOR CloneDescriptor;
+
+    PAGED_CODE ();
+
+    CloneHeader = Header->CloneHeader;
+
+    CloneDescriptor = MiLocateCloneAddress (Process, CloneHeader->ClonePtes);
+
+    if (CloneDescriptor != NULL) {
+        ASSERT (CloneDescriptor->CloneHeader == CloneHeader);
+        return CloneDescriptor;
+    }
+
+    //
+    // As with fork, once allocated the clone root remains until the
+    // process exits.
+    //
+
+    if (Process->CloneRoot == NULL) {
+
+        CloneRoot = ExAllocatePoolWithTag (NonPagedPool,
+                                           sizeof(MM_AVL_TABLE),
+                                           'rCmM');
+
+        if (CloneRoot == NULL) {
+            return NULL;
+        }
+
+        RtlZeroMemory (CloneRoot, sizeof(MM_AVL_TABLE));
+        CloneRoot->BalancedRoot.u1.Parent = MI_MAKE_PARENT (&CloneRoot->BalancedRoot, 0);
+        Process->CloneRoot = CloneRoot;
+    }
+
+    //
+    // The clone header quota is returned when the descriptor is freed by
+    // MiDecrementCloneBlockReference.  The clone blocks themselves belong
+    // to the combiner so no paged pool quota is charged for them.
+    //
+
+    if (!NT_SUCCESS (PsChargeProcessNonPagedPoolQuota (Process,
+                                                       sizeof(MMCLONE_HEADER)))) {
+        return NULL;
+    }
+
+    CloneDescriptor = ExAllocatePoolWithTag (NonPagedPool,
+                                             sizeof(MMCLONE_DESCRIPTOR),
+                                             'dCmM');
+
+    if (CloneDescriptor == NULL) {
+        PsReturnProcessNonPagedPoolQuota (Process, sizeof(MMCLONE_HEADER));
+        return NULL;
+    }
+
+    CloneDescriptor->StartingVpn = (ULONG_PTR) CloneHeader->ClonePtes;
+    CloneDescriptor->EndingVpn = (ULONG_PTR) (CloneHeader->ClonePtes +
+                                              MI_COMBINE_BLOCKS);
+    CloneDescriptor->EndingVpn -= 1;
+    CloneDescriptor->NumberOfReferences = 0;
+    CloneDescriptor->FinalNumberOfReferences = 0;
+    CloneDescriptor->NumberOfPtes = MI_COMBINE_BLOCKS;
+    CloneDescriptor->CloneHeader = CloneHeader;
+    CloneDescriptor->PagedPoolQuotaCharge = 0;
+
+    InterlockedIncrement (&CloneHeader->NumberOfProcessReferences);
+
+    MiInsertClone (Process, CloneDescriptor);
+
+    return CloneDescriptor;
+}
+
+
+VOID
+MiDereferenceCombineDescriptor (
+    IN PEPROCESS Process,
+    IN PMMCLONE_DESCRIPTOR CloneDescriptor
+    )
+
+/*++
+
+Routine Description:
+
+    This routine deletes a clone descriptor returned by
+    MiReferenceCombineDescriptor if no PTE in the process was pointed at
+    its clone blocks.
+
+Arguments:
+
+    Process - Supplies the current process.
+
+    CloneDescriptor - Supplies the clone descriptor.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, address creation mutex, working set
+    pushlock and combiner mutex held.
+
+--*/
+
+{
+    LONG NewCount;
+
+    PAGED_CODE ();
+
+    if (CloneDescriptor->NumberOfReferences != 0) {
+        return;
+    }
+
+    ASSERT (CloneDescriptor->FinalNumberOfReferences == 0);
+
+    MiRemoveClone (Process, CloneDescriptor);
+
+    //
+    // The combiner's own reference keeps the clone header alive.
+    //
+
+    NewCount = InterlockedDecrement (&CloneDescriptor->CloneHeader->NumberOfProcessReferences);
+    ASSERT (NewCount > 0);
+
+    PsReturnProcessNonPagedPoolQuota (Process, sizeof(MMCLONE_HEADER));
+
+    ExFreePool (CloneDescriptor);
+
+    return;
+}
+
+
+VOID
+MiFreeCombineHeader (
+    IN PMI_COMBINE_HEADER Header
+    )
+
+/*++
+
+Routine Description:
+
+    This routine drops the combiner's reference on the clone header of
+    the specified combiner header and frees the combiner header.  The
+    clone header and its clone blocks are freed by whoever drops the last
+    reference.
+
+Arguments:
+
+    Header - Supplies the combiner header, already removed from the list
+             and hash table.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, combiner mutex held.
+
+--*/
+
+{
+    LONG NewCount;
+    PMMCLONE_HEADER CloneHeader;
+
+    CloneHeader = Header->CloneHeader;
+
+    MiUnlockPagedAddress (CloneHeader->ClonePtes);
+
+    NewCount = InterlockedDecrement (&CloneHeader->NumberOfProcessReferences);
+    ASSERT (NewCount >= 0);
+
+    if (NewCount == 0) {
+        ExFreePool (CloneHeader->ClonePtes);
+        ExFreePool (CloneHeader);
+    }
+
+    ExFreePool (Header);
+
+    return;
+}
+
+
+VOID
+MiRetireCombineHeaders (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees every full combiner header whose clone blocks have
+    all been dereferenced.  A clone block reference count never rises
+    again once it reaches zero, so such a header can never be used again.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, combiner mutex held.
+
+--*/
+
+{
+    ULONG i;
+    KIRQL OldIrql;
+    PLIST_ENTRY NextEntry;
+    PMMCLONE_BLOCK CloneBlock;
+    PMI_COMBINE_ENTRY Entry;
+    PMI_COMBINE_ENTRY *Link;
+    PMI_COMBINE_HEADER Header;
+
+    NextEntry = MiCombineHeaderList.Flink;
+
+    while (NextEntry != &MiCombineHeaderList) {
+
+        Header = CONTAINING_RECORD (NextEntry, MI_COMBINE_HEADER, Links);
+        NextEntry = NextEntry->Flink;
+
+        if (Header->NumberOfBlocks != MI_COMBINE_BLOCKS) {
+            continue;
+        }
+
+        CloneBlock = Header->CloneHeader->ClonePtes;
+
+        LOCK_PFN (OldIrql);
+
+        for (i = 0; i < MI_COMBINE_BLOCKS; i += 1) {
+            if (CloneBlock[i].CloneRefCount != 0) {
+                break;
+            }
+        }
+
+        UNLOCK_PFN (OldIrql);
+
+        if (i != MI_COMBINE_BLOCKS) {
+            continue;
+        }
+
+        for (i = 0; i < MI_COMBINE_BLOCKS; i += 1) {
+
+            Entry = &Header->Entries[i];
+            Link = &MiCombineHash[Entry->Hash & (MI_COMBINE_HASH_BUCKETS - 1)];
+
+            while (*Link != Entry) {
+                ASSERT (*Link != NULL);
+                Link = &(*Link)->Next;
+            }
+
+            *Link = Entry->Next;
+        }
+
+        RemoveEntryList (&Header->Links);
+
+        if (Header == MiCombineCurrent) {
+            MiCombineCurrent = NULL;
+        }
+
+        MiFreeCombineHeader (Header);
+    }
+
+    return;
+}
+
+
+LOGICAL
+MiPrepareCombiner (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine allocates the combiner's tables the first time it runs,
+    retires unused combiner headers and starts a new header if the
+    current one is full.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the combiner can run, FALSE if its tables could not be
+    allocated.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, combiner mutex held.
+
+--*/
+
+{
+    PVOID Buffer;
+    PMMCLONE_BLOCK ClonePtes;
+    PMMCLONE_HEADER CloneHeader;
+    PMI_COMBINE_HEADER Header;
+    PMI_COMBINE_ENTRY *HashTable;
+    PMI_COMBINE_CANDIDATE Candidates;
+
+    PAGED_CODE ();
+
+    if (MiCombineHash == NULL) {
+
+        HashTable = ExAllocatePoolWithTag (NonPagedPool,
+                                           MI_COMBINE_HASH_BUCKETS * sizeof (PMI_COMBINE_ENTRY),
+                                           'bCmM');
+
+        Candidates = ExAllocatePoolWithTag (NonPagedPool,
+                                            MI_COMBINE_CANDIDATES * sizeof (MI_COMBINE_CANDIDATE),
+                                            'bCmM');
+
+        Buffer = ExAllocatePoolWithTag (NonPagedPool, PAGE_SIZE, 'bCmM');
+
+        if ((HashTable == NULL) || (Candidates == NULL) || (Buffer == NULL)) {
+
+            if (HashTable != NULL) {
+                ExFreePool (HashTable);
+            }
+
+            if (Candidates != NULL) {
+                ExFreePool (Candidates);
+            }
+
+            if (Buffer != NULL) {
+                ExFreePool (Buffer);
+            }
+
+            return FALSE;
+        }
+
+        RtlZeroMemory (HashTable,
+                       MI_COMBINE_HASH_BUCKETS * sizeof (PMI_COMBINE_ENTRY));
+
+        RtlZeroMemory (Candidates,
+                       MI_COMBINE_CANDIDATES * sizeof (MI_COMBINE_CANDIDATE));
+
+        InitializeListHead (&MiCombineHeaderList);
+
+        MiCombineCandidates = Candidates;
+        MiCombineBuffer = Buffer;
+        MiCombineHash = HashTable;
+    }
+
+    MiRetireCombineHeaders ();
+
+    if ((MiCombineCurrent != NULL) &&
+        (MiCombineCurrent->NumberOfBlocks != MI_COMBINE_BLOCKS)) {
+
+        return TRUE;
+    }
+
+    //
+    // Start a new page of clone blocks.  If this fails the combiner still
+    // merges pages into existing clone blocks but promotes no new ones.
+    //
+
+    Header = ExAllocatePoolWithTag (NonPagedPool,
+                                    sizeof (MI_COMBINE_HEADER),
+                                    'cCmM');
+
+    if (Header == NULL) {
+        return TRUE;
+    }
+
+    CloneHeader = ExAllocatePoolWithTag (NonPagedPool,
+                                         sizeof(MMCLONE_HEADER),
+                                         'hCmM');
+
+    if (CloneHeader == NULL) {
+        ExFreePool (Header);
+        return TRUE;
+    }
+
+    ClonePtes = ExAllocatePoolWithTag (PagedPool, PAGE_SIZE, 'lCmM');
+
+    if (ClonePtes == NULL) {
+        ExFreePool (CloneHeader);
+        ExFreePool (Header);
+        return TRUE;
+    }
+
+    ASSERT (PAGE_ALIGN (ClonePtes) == ClonePtes);
+
+    MiLockPagedAddress (ClonePtes);
+
+    RtlZeroMemory (ClonePtes, PAGE_SIZE);
+
+    CloneHeader->NumberOfPtes = MI_COMBINE_BLOCKS;
+    CloneHeader->NumberOfProcessReferences = 1;
+    CloneHeader->ClonePtes = ClonePtes;
+
+    Header->CloneHeader = CloneHeader;
+    Header->NumberOfBlocks = 0;
+
+    InsertTailList (&MiCombineHeaderList, &Header->Links);
+
+    MiCombineCurrent = Header;
+
+    return TRUE;
+}
+
+
+VOID
+MiCombineIdenticalPages (
+    IN PMMSUPPORT WsInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called by the working set manager while aging a
+    process working set.  It examines up to MiPageCombineScanLimit PTEs
+    of the private memory of the process, continuing from where the
+    previous pass over the process stopped, and combines the trimmed
+    pages it finds.
+
+    The address creation mutex and the combiner mutex are only tried for
+    so busy processes (and concurrent callers) are simply skipped.
+
+Arguments:
+
+    WsInfo - Supplies the working set of the process.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, attached to the process with its working
+    set pushlock held.
+
+--*/
+
+{
+    LOGICAL First;
+    ULONG Examined;
+    PMMVAD Vad;
+    PCHAR Va;
+    PCHAR VadEnd;
+    PMMPTE PointerPte;
+    PMMPTE PointerPde;
+    PMMPTE LastPte;
+    PETHREAD Thread;
+    PEPROCESS Process;
+    LARGE_INTEGER StartTime;
+    LARGE_INTEGER EndTime;
+
+    PAGED_CODE ();
+
+    if ((MmEnablePageCombining == 0) ||
+        (WsInfo == &MmSystemCacheWs) ||
+        (WsInfo->Flags.SessionSpace == 1)) {
+
+        return;
+    }
+
+    Thread = PsGetCurrentThread ();
+    Process = CONTAINING_RECORD (WsInfo, EPROCESS, Vm);
+
+    ASSERT (Process == PsGetCurrentProcess ());
+
+    if (KeTryToAcquireGuardedMutex (&MiPageCombineMutex) == FALSE) {
+        return;
+    }
+
+    if (KeTryToAcquireGuardedMutex (&Process->AddressCreationLock) == FALSE) {
+        KeReleaseGuardedMutex (&MiPageCombineMutex);
+        return;
+    }
+
+    StartTime = KeQueryPerformanceCounter (NULL);
+
+    //
+    // Processes whose fork failed do not get their clone quota back, so
+    // they are left alone.
+    //
+
+    if (Process->Flags & (PS_PROCESS_FLAGS_VM_DELETED | PS_PROCESS_FLAGS_FORK_FAILED)) {
+        goto Done;
+    }
+
+    //
+    // Paged pool cannot be allocated or freed while holding the working
+    // set pushlock, so release it while the combiner's pool is managed.
+    //
+
+    MiCombinePasses += 1;
+
+    if ((MiCombineHash == NULL) ||
+        (MiCombineCurrent == NULL) ||
+        (MiCombineCurrent->NumberOfBlocks == MI_COMBINE_BLOCKS) ||
+        ((MiCombinePasses & 0x3F) == 0)) {
+
+        UNLOCK_WS (Thread, Process);
+
+        First = MiPrepareCombiner ();
+
+        LOCK_WS (Thread, Process);
+
+        if (First == FALSE) {
+            goto Done;
+        }
+    }
+
+    Va = (PCHAR) WsInfo->VmWorkingSetList->CombineAddress;
+
+    if (Va == NULL) {
+        Va = (PCHAR) MM_LOWEST_USER_ADDRESS;
+    }
+
+    Examined = 0;
+
+    for (Vad = MiGetFirstVad (Process); Vad != NULL; Vad = MiGetNextVad (Vad)) {
+
+        if ((Vad->u.VadFlags.PrivateMemory == 0) ||
+            (Vad->u.VadFlags.VadType != VadNone) ||
+            (Vad->u.VadFlags.NoChange == 1)) {
+
+            continue;
+        }
+
+        VadEnd = (PCHAR) MI_VPN_TO_VA_ENDING (Vad->EndingVpn);
+
+        if (VadEnd < Va) {
+            continue;
+        }
+
+        if (Va < (PCHAR) MI_VPN_TO_VA (Vad->StartingVpn)) {
+            Va = (PCHAR) MI_VPN_TO_VA (Vad->StartingVpn);
+        }
+
+        PointerPte = MiGetPteAddress (Va);
+        LastPte = MiGetPteAddress (VadEnd);
+        First = TRUE;
+
+        while (PointerPte <= LastPte) {
+
+            if (Examined == MiPageCombineScanLimit) {
+                WsInfo->VmWorkingSetList->CombineAddress =
+                            MiGetVirtualAddressMappedByPte (PointerPte);
+                goto Done;
+            }
+
+            Examined += 1;
+
+            if ((First == TRUE) || (MiIsPteOnPdeBoundary (PointerPte))) {
+
+                First = FALSE;
+
+                Va = (PCHAR) MiGetVirtualAddressMappedByPte (PointerPte);
+                PointerPde = MiGetPdeAddress (Va);
+
+                //
+                // Skip page tables which are not present, and those of
+                // transparent large pages.
+                //
+
+                if (
+#if (_MI_PAGING_LEVELS >= 4)
+                    (MiGetPxeAddress (Va)->u.Hard.Valid == 0) ||
+#endif
+#if (_MI_PAGING_LEVELS >= 3)
+                    (MiGetPpeAddress (Va)->u.Hard.Valid == 0) ||
+#endif
+                    (PointerPde->u.Hard.Valid == 0) ||
+                    (MI_PDE_MAPS_LARGE_PAGE (PointerPde))) {
+
+                    PointerPte = MiGetVirtualAddressMappedByPte (PointerPde + 1);
+                    First = TRUE;
+                    continue;
+                }
+            }
+
+            if ((PointerPte->u.Hard.Valid == 0) &&
+                (PointerPte->u.Soft.Prototype == 0) &&
+                (PointerPte->u.Soft.Transition == 1)) {
+
+                MiCombinePage (Process, PointerPte);
+            }
+
+            PointerPte += 1;
+        }
+
+        Va = VadEnd + 1;
+    }
+
+    //
+    // The whole address space has been scanned, start over next time.
+    //
+
+    WsInfo->VmWorkingSetList->CombineAddress = NULL;
+
+Done:
+
+    EndTime = KeQueryPerformanceCounter (NULL);
+
+    MiCombineScanTicks.QuadPart += EndTime.QuadPart - StartTime.QuadPart;
+
+    KeReleaseGuardedMutex (&Process->AddressCreationLock);
+
+    KeReleaseGuardedMutex (&MiPageCombineMutex);
+
+    return;
+}
+
+
+VOID
+MmQueryPageCombineInformation (
+    OUT PSYSTEM_PAGE_COMBINE_INFORMATION Info
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the page combiner statistics.  The pages
+    currently saved are counted from the live clone blocks, each of which
+    saves one page for every reference beyond the first.
+
+Arguments:
+
+    Info - Supplies a system buffer to receive the statistics.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL.
+
+--*/
+
+{
+    ULONG i;
+    LONG Count;
+    ULONGLONG Shared;
+    ULONGLONG Saved;
+    PLIST_ENTRY NextEntry;
+    PMMCLONE_BLOCK CloneBlock;
+    PMI_COMBINE_HEADER Header;
+    LARGE_INTEGER Frequency;
+
+    PAGED_CODE ();
+
+    Shared = 0;
+    Saved = 0;
+
+    KeQueryPerformanceCounter (&Frequency);
+
+    KeAcquireGuardedMutex (&MiPageCombineMutex);
+
+    if (MiCombineHash != NULL) {
+
+        NextEntry = MiCombineHeaderList.Flink;
+
+        while (NextEntry != &MiCombineHeaderList) {
+
+            Header = CONTAINING_RECORD (NextEntry, MI_COMBINE_HEADER, Links);
+
+            CloneBlock = Header->CloneHeader->ClonePtes;
+
+            for (i = 0; i < Header->NumberOfBlocks; i += 1) {
+
+                Count = CloneBlock[i].CloneRefCount;
+
+                if (Count > 0) {
+                    Shared += 1;
+                    Saved += Count - 1;
+                }
+            }
+
+            NextEntry = NextEntry->Flink;
+        }
+    }
+
+    Info->Enabled = MmEnablePageCombining;
+    Info->Reserved = 0;
+    Info->PagesScanned = MiCombinePagesScanned;
+    Info->PagesCombined = MiCombinePagesCombined;
+    Info->ZeroPagesReclaimed = MiCombineZeroPages;
+    Info->SharedPages = Shared;
+    Info->BytesSaved = Saved << PAGE_SHIFT;
+
+    //
+    // Convert the scan time from performance counter ticks to 100ns units
+    // without overflowing the intermediate product.
+    //
+
+    Info->ScanTime.QuadPart = 0;
+
+    if (Frequency.QuadPart != 0) {
+
+        Info->ScanTime.QuadPart =
+            (MiCombineScanTicks.QuadPart / Frequency.QuadPart) * 10000000 +
+            ((MiCombineScanTicks.QuadPart % Frequency.QuadPart) * 10000000) /
+                Frequency.QuadPart;
+    }
+
+    KeReleaseGuardedMutex (&MiPageCombineMutex);
+
+    return;
+}
@@ -1438,6 +1438,12 @@ Environment:
     PageFile->FreeSpace += 1;
     PageFile->CurrentUsage -= 1;
 
+    //
+    // Drop any compressed copy so the slot can be reused.
+    //
+
+    MiRemoveCompressedPage (PageFileNumber, FreeBit);
+
     //
     // Check to see if we should move some MDL entries for the
     // modified page writer now that more free space is available.
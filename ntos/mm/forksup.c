@@ -142,6 +142,7 @@ Environment:
     PMMPFN PfnPdPage;
     MMPTE TempPte;
     MMPTE PteContents;
+    MMPTE_FLUSH_LIST PteFlushList;
     KAPC_STATE ApcState;
     ULONG i;
 #if defined (_X86PAE_)
@@ -415,6 +416,15 @@ RetryPrivatePageAllocations:
         } while (TRUE);
     }
 
+    //
+    // The clone walks the parent page tables one PTE at a time so any
+    // transparent large pages must be split back out first.
+    //
+
+    MI_DEMOTE_LARGE_PAGES (&CurrentProcess->Vm,
+                           MM_LOWEST_USER_ADDRESS,
+                           MM_HIGHEST_USER_ADDRESS);
+
     ASSERT (CurrentProcess->ForkInProgress == NULL);
 
     //
@@ -791,6 +801,16 @@ RetryPrivatePageAllocations:
 
     TempCloneMapping = NULL;
 
+    //
+    // Parent PTEs made copy-on-write below are not flushed from the TB one
+    // at a time.  They are gathered here and flushed whenever the walk
+    // moves to another page table (or VAD) and before the working set
+    // pushlock is released.  Once the list overflows, a single process TB
+    // flush covers the remainder of that page table.
+    //
+
+    PteFlushList.Count = 0;
+
     //
     // Examine each virtual address descriptor and create the
     // proper structures for the new process.
@@ -938,6 +958,10 @@ RetryPrivatePageAllocations:
 
                 if ((FirstTime) || MiIsPteOnPdeBoundary (PointerPte)) {
 
+                    if (PteFlushList.Count != 0) {
+                        MiFlushPteList (&PteFlushList);
+                    }
+
                     PointerPxe = MiGetPpeAddress (PointerPte);
                     PointerPpe = MiGetPdeAddress (PointerPte);
                     PointerPde = MiGetPteAddress (PointerPte);
@@ -1542,6 +1566,10 @@ RetryPrivatePageAllocations:
                                 MI_WRITE_ZERO_PTE (PointerNewPte);
                                 MI_DECREMENT_USED_PTES_BY_HANDLE (UsedPageTableEntries);
 
+                                if (PteFlushList.Count != 0) {
+                                    MiFlushPteList (&PteFlushList);
+                                }
+
                                 UNLOCK_WS_UNSAFE (CurrentThread, CurrentProcess);
 
                                 if (TempCloneMapping != NULL) {
@@ -1574,7 +1602,16 @@ RetryPrivatePageAllocations:
 
                         MI_MAKE_VALID_PTE_WRITE_COPY (PointerPte);
 
-                        MI_FLUSH_SINGLE_TB (VirtualAddress, FALSE);
+                        //
+                        // Defer the TB flush - the hardware will not set the
+                        // dirty bit through the now read-only PTE without
+                        // faulting, so the captured contents stay accurate.
+                        //
+
+                        if (PteFlushList.Count < MM_MAXIMUM_FLUSH_COUNT) {
+                            PteFlushList.FlushVa[PteFlushList.Count] = VirtualAddress;
+                            PteFlushList.Count += 1;
+                        }
 
                         ForkProtoPte->ProtoPte = *PointerPte;
                         ForkProtoPte->CloneRefCount = 2;
@@ -1705,6 +1742,10 @@ RetryPrivatePageAllocations:
 
                             MI_DECREMENT_USED_PTES_BY_HANDLE (UsedPageTableEntries);
 
+                            if (PteFlushList.Count != 0) {
+                                MiFlushPteList (&PteFlushList);
+                            }
+
                             UNLOCK_WS_UNSAFE (CurrentThread, CurrentProcess);
 
                             if (TempCloneMapping != NULL) {
@@ -1836,6 +1877,10 @@ RetryPrivatePageAllocations:
 
             } while (PointerPte <= LastPte);
 AllDone:
+            if (PteFlushList.Count != 0) {
+                MiFlushPteList (&PteFlushList);
+            }
+
             NewVad = NewVad->u1.Parent;
         }
         Vad = MiGetNextVad (Vad);
@@ -333,6 +333,30 @@ Return Value:
 
     if (FreeType & MEM_RELEASE) {
 
+        //
+        // Delete any transparent large pages first as the commitment
+        // calculations and the deletion below walk the individual PTEs.
+        //
+
+        if ((Vad->u.VadFlags.VadType == VadNone) &&
+            (MmWorkingSetList->PromotedLargePages != 0)) {
+
+            LOCK_WS_UNSAFE (CurrentThread, Process);
+
+            if (CapturedRegionSize == 0) {
+                MiDeleteLargePages (&Process->Vm,
+                                    MI_VPN_TO_VA (Vad->StartingVpn),
+                                    MI_VPN_TO_VA_ENDING (Vad->EndingVpn));
+            }
+            else {
+                MiDeleteLargePages (&Process->Vm,
+                                    StartingAddress,
+                                    EndingAddress);
+            }
+
+            UNLOCK_WS_UNSAFE (CurrentThread, Process);
+        }
+
         //
         // *****************************************************************
         // MEM_RELEASE was specified.
@@ -510,6 +534,7 @@ Return Value:
                                                             Process);
 
                     Vad->StartingVpn = MI_VA_TO_VPN ((PCHAR)EndingAddress + 1);
+                    MiUpdateNodeGaps ((PMMADDRESS_NODE)Vad);
                     Vad->u.VadFlags.CommitCharge -= CommitReduction;
                     ASSERT ((SSIZE_T)Vad->u.VadFlags.CommitCharge >= 0);
                     NextVad = (PMMVAD)Vad;
@@ -553,6 +578,7 @@ Return Value:
                     Vad->u.VadFlags.CommitCharge -= CommitReduction;
 
                     Vad->EndingVpn = MI_VA_TO_VPN ((PCHAR)StartingAddress - 1);
+                    MiUpdateNodeGaps ((PMMADDRESS_NODE)Vad);
                     PreviousVad = (PMMVAD)Vad;
                 }
                 else {
@@ -1233,6 +1259,10 @@ Environment:
 
     LOCK_WS_UNSAFE (CurrentThread, Process);
 
+    MI_DELETE_LARGE_PAGES (&Process->Vm,
+                           StartingAddress,
+                           MiGetVirtualAddressMappedByPte (EndingPte));
+
     MiMakePdeExistAndMakeValid (PointerPde, Process, MM_NOIRQL);
 
     while (PointerPte <= EndingPte) {
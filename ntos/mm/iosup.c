@@ -10569,6 +10569,13 @@ Environment:
 
     MiDeferredUnlockPages (MI_DEFER_PFN_HELD);
 
+    //
+    // Return cached pages to the lists so the physical ranges walked
+    // below can use them.
+    //
+
+    MiDrainPageCaches ();
+
     MaxPages = MI_NONPAGEABLE_MEMORY_AVAILABLE() - 1024;
 
     if ((SPFN_NUMBER)MaxPages <= 0) {
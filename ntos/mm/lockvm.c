@@ -392,6 +392,8 @@ Return Value:
 
     LOCK_WS_UNSAFE (Thread, TargetProcess);
 
+    MI_DEMOTE_LARGE_PAGES (&TargetProcess->Vm, StartingVa, EndingAddress);
+
     while (Va <= EndingAddress) {
 
         //
@@ -777,6 +779,8 @@ Return Value:
 
     LOCK_WS_UNSAFE (Thread, TargetProcess);
 
+    MI_DEMOTE_LARGE_PAGES (&TargetProcess->Vm, Va, EndingAddress);
+
     while (Va <= EndingAddress) {
 
         //
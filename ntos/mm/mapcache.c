@@ -1314,6 +1314,10 @@ Environment:
     MmSystemCacheWorkingSetList->NextSlot = 1;
     MmSystemCacheWorkingSetList->HashTable = NULL;
     MmSystemCacheWorkingSetList->HashTableSize = 0;
+    MmSystemCacheWorkingSetList->ReverseIndex = NULL;
+    MmSystemCacheWorkingSetList->PromotedLargePages = 0;
+    MmSystemCacheWorkingSetList->ClusterVad = NULL;
+    MmSystemCacheWorkingSetList->CombineAddress = NULL;
     MmSystemCacheWorkingSetList->Wsle = MmSystemCacheWsle;
 
 #if defined(_X86_)
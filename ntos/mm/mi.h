@@ -2207,10 +2207,16 @@ extern LONG MiDelayPageFaults;
 #define MM_TRACK_COMMIT_REDUCTION(_index, bump)
 #define MI_INCREMENT_TOTAL_PROCESS_COMMIT(_charge)
 
+VOID
+FASTCALL
+MiReturnCommitmentBatched (
+    IN SIZE_T QuotaCharge
+    );
+
 #define MiReturnCommitment(_QuotaCharge)                                \
             ASSERT ((SSIZE_T)(_QuotaCharge) >= 0);                      \
             ASSERT (MmTotalCommittedPages >= (_QuotaCharge));           \
-            InterlockedExchangeAddSizeT (&MmTotalCommittedPages, 0-((SIZE_T)(_QuotaCharge))); \
+            MiReturnCommitmentBatched ((SIZE_T)(_QuotaCharge));         \
             MM_TRACK_COMMIT (MM_DBG_COMMIT_RETURN_NORMAL, (_QuotaCharge));
 
 
@@ -2998,6 +3004,16 @@ typedef struct _MMWSLE {
 #define MI_GENERATE_VALID_WSLE(Wsle)                   \
         ((PVOID)(ULONG_PTR)((Wsle)->u1.Long & (~(PAGE_SIZE - 1) | 0x1)))
 
+//
+// The maximum number of different ages a page can be.  Each age is a
+// generation - aging moves unaccessed entries one generation older and
+// accessed entries back to the youngest, trimming takes from the oldest
+// generations first.
+//
+
+#define MI_USE_AGE_COUNT 4
+#define MI_USE_AGE_MAX (MI_USE_AGE_COUNT - 1)
+
 #define MI_GET_PROTECTION_FROM_WSLE(Wsl) ((Wsl)->u1.e1.Protection)
 
 typedef MMWSLE *PMMWSLE;
@@ -3016,12 +3032,39 @@ typedef struct _MMWSL {
     WSLE_NUMBER NonDirectCount;
     PMMWSLE_HASH HashTable;
     ULONG HashTableSize;
+    PVOID ReverseIndex;                 // User VA to WSLE index, see wstree.c
     ULONG NumberOfCommittedPageTables;
     PVOID HashTableStart;
     PVOID HighestPermittedHashAddress;
     ULONG NumberOfImageWaiters;
     ULONG VadBitMapHint;
 
+    //
+    // Estimated number of unaccessed entries in each age generation as of
+    // the last estimation sample.  PagesTrimmed counts entries removed by
+    // working set trims and TrimRefaults counts transition faults that
+    // brought a page back from the standby or modified list, so their
+    // ratio shows how often trimming removed pages that were still in use.
+    //
+
+    WSLE_NUMBER GenerationCounts[MI_USE_AGE_COUNT];
+    WSLE_NUMBER PagesTrimmed;
+    WSLE_NUMBER TrimRefaults;
+
+    ULONG PromotedLargePages;           // Transparent large PDEs, see promote.c
+
+    //
+    // The pages speculatively mapped by the last transition cluster fault,
+    // checked at the next cluster fault in the same view to see whether
+    // they were referenced.  The VAD is only compared, never dereferenced.
+    //
+
+    PVOID ClusterVad;
+    PMMPTE ClusterPte;
+    ULONG ClusterCount;
+
+    PVOID CombineAddress;               // Next address to scan, see combine.c
+
 #if _WIN64
     PVOID HighestUserAddress;           // Maintained for wow64 processes only
 #endif
@@ -3076,13 +3119,6 @@ extern PKEVENT MiLowMemoryEvent;
 
 #define MI_CLAIM_INCR 30
 
-//
-// The maximum number of different ages a page can be.
-//
-
-#define MI_USE_AGE_COUNT 4
-#define MI_USE_AGE_MAX (MI_USE_AGE_COUNT - 1)
-
 //
 // If more than this "percentage" of the working set is estimated to
 // be used then allow it to grow freely.
@@ -3818,8 +3854,8 @@ typedef struct _MMWORKING_SET_EXPANSION_HEAD {
 
 typedef struct _MMINPAGE_FLAGS {
     ULONG_PTR Completed : 1;
-    ULONG_PTR Available1 : 1;
-    ULONG_PTR Available2 : 1;
+    ULONG_PTR Compressed : 1;           // Slot is in the compressed store
+    ULONG_PTR PageFileRead : 1;
 #if defined (_WIN64)
     ULONG_PTR PrefetchMdlHighBits : 61;
 #else
@@ -3982,6 +4018,8 @@ typedef struct _MMVAD {
     struct _MMVAD *RightChild;
     ULONG_PTR StartingVpn;
     ULONG_PTR EndingVpn;
+    ULONG_PTR PrecedingGap;
+    ULONG_PTR LargestGap;
 
     union {
         ULONG_PTR LongFlags;
@@ -3994,6 +4032,7 @@ typedef struct _MMVAD {
         ULONG LongFlags2;
         MMVAD_FLAGS2 VadFlags2;
     } u2;
+    ULONG TransitionCluster;        // Adaptive fault cluster, see pagfault.c
 } MMVAD, *PMMVAD;
 
 typedef struct _MMVAD_LONG {
@@ -4005,6 +4044,8 @@ typedef struct _MMVAD_LONG {
     struct _MMVAD *RightChild;
     ULONG_PTR StartingVpn;
     ULONG_PTR EndingVpn;
+    ULONG_PTR PrecedingGap;
+    ULONG_PTR LargestGap;
 
     union {
         ULONG_PTR LongFlags;
@@ -4017,6 +4058,7 @@ typedef struct _MMVAD_LONG {
         ULONG LongFlags2;
         MMVAD_FLAGS2 VadFlags2;
     } u2;
+    ULONG TransitionCluster;        // Adaptive fault cluster, see pagfault.c
     union {
         LIST_ENTRY List;
         MMADDRESS_LIST Secured;
@@ -4036,6 +4078,8 @@ typedef struct _MMVAD_SHORT {
     struct _MMVAD *RightChild;
     ULONG_PTR StartingVpn;
     ULONG_PTR EndingVpn;
+    ULONG_PTR PrecedingGap;
+    ULONG_PTR LargestGap;
 
     union {
         ULONG_PTR LongFlags;
@@ -4054,6 +4098,8 @@ typedef struct _MI_PHYSICAL_VIEW {
     struct _MMADDRESS_NODE *RightChild;
     ULONG_PTR StartingVpn;      // Actually a virtual address, not a VPN
     ULONG_PTR EndingVpn;        // Actually a virtual address, not a VPN
+    ULONG_PTR PrecedingGap;
+    ULONG_PTR LargestGap;
     PMMVAD Vad;
     MI_VAD_TYPE VadType;
     union {
@@ -4162,6 +4208,8 @@ typedef struct _MMCLONE_DESCRIPTOR {
     struct _MMADDRESS_NODE *RightChild;
     ULONG_PTR StartingVpn;
     ULONG_PTR EndingVpn;
+    ULONG_PTR PrecedingGap;
+    ULONG_PTR LargestGap;
     ULONG NumberOfPtes;
     PMMCLONE_HEADER CloneHeader;
     LONG NumberOfReferences;
@@ -4228,13 +4276,14 @@ typedef struct _MMMOD_WRITER_MDL_ENTRY {
     PFILE_OBJECT File;
     PCONTROL_AREA ControlArea;
     PERESOURCE FileResource;
+    ULONG TimesPassed;
     LARGE_INTEGER IssueTime;
     MDL Mdl;
     PFN_NUMBER Page[1];
 } MMMOD_WRITER_MDL_ENTRY, *PMMMOD_WRITER_MDL_ENTRY;
 
 
-#define MM_PAGING_FILE_MDLS 2
+#define MM_PAGING_FILE_MDLS 8
 
 typedef struct _MMPAGING_FILE {
     PFN_NUMBER Size;
@@ -4715,6 +4764,58 @@ MiRemoveZeroPage (
     IN ULONG PageColor
     );
 
+//
+// Per-processor page caches used by user demand zero faults.  Each cache
+// holds zeroed pages moved from the colored zeroed lists in batches and
+// pages freed on that processor which still need to be zeroed.  Cached
+// pages are counted as unavailable and carry a reference so PFN database
+// scans do not mistake them for free pages.  Each cache has its own lock
+// so a fault served from the cache does not take the PFN lock.  When both
+// locks are needed the PFN lock is acquired first.
+//
+
+#define MI_PAGE_CACHE_SIZE  32
+#define MI_PAGE_CACHE_BATCH 16
+
+typedef struct DECLSPEC_CACHEALIGN _MI_PAGE_CACHE {
+    KSPIN_LOCK Lock;
+    ULONG ZeroedCount;
+    ULONG FreedCount;
+    PFN_NUMBER ZeroedPages[MI_PAGE_CACHE_SIZE];
+    PFN_NUMBER FreedPages[MI_PAGE_CACHE_SIZE];
+    ULONG Hits;
+    ULONG Misses;
+    ULONG Refills;
+    ULONG Drains;
+} MI_PAGE_CACHE, *PMI_PAGE_CACHE;
+
+extern MI_PAGE_CACHE MiPageCache[MAXIMUM_PROCESSORS];
+
+extern LONG MiPageCacheTotal;
+
+PFN_NUMBER
+FASTCALL
+MiRemoveCachedPage (
+    IN ULONG PageColor,
+    OUT PLOGICAL NeedToZero
+    );
+
+VOID
+MiRefillPageCache (
+    IN ULONG PageColor
+    );
+
+LOGICAL
+FASTCALL
+MiInsertPageInCache (
+    IN PFN_NUMBER PageFrameIndex
+    );
+
+VOID
+MiDrainPageCaches (
+    VOID
+    );
+
 typedef struct _COLORED_PAGE_INFO {
     union {
         PFN_NUMBER PagesLeftToScan;
@@ -4738,6 +4839,51 @@ MiStartZeroPageWorkers (
     VOID
     );
 
+//
+// Per-node zeroing state.  Node 0 is serviced by the zero page thread
+// itself using MmZeroingPageEvent.  On NUMA systems every other node gets
+// its own zeroing thread and event so free pages are zeroed by processors
+// local to the memory.  The reserve target is the number of zeroed pages
+// the node should keep on hand, derived from the recent demand zero fault
+// rate of the node's processors.  Below the target the zeroing thread runs
+// at priority one instead of zero so it is not starved by busy processors.
+// The Active flags are protected by the PFN lock.
+//
+
+#define MI_ZERO_RESERVE_MINIMUM ((PFN_NUMBER)32)
+#define MI_ZERO_RESERVE_MAXIMUM ((PFN_NUMBER)((16 * 1024 * 1024) >> PAGE_SHIFT))
+
+typedef struct _MI_ZERO_PAGE_NODE {
+    PKEVENT ZeroingEvent;
+    PBOOLEAN ThreadActive;
+    KEVENT NodeEvent;
+    BOOLEAN NodeActive;
+    BOOLEAN Boosted;
+    PFN_NUMBER ReserveTarget;
+    ULONG DemandZeroCount;
+    ULONG SampleTime;
+    PFN_NUMBER PagesZeroed;
+} MI_ZERO_PAGE_NODE, *PMI_ZERO_PAGE_NODE;
+
+#if defined(MI_MULTINODE)
+#define MI_ZERO_PAGE_NODES  MAXIMUM_CCNUMA_NODES
+#else
+#define MI_ZERO_PAGE_NODES  1
+#endif
+
+extern MI_ZERO_PAGE_NODE MiZeroPageNodes[MI_ZERO_PAGE_NODES];
+
+extern LOGICAL MiZeroPageNodeThreads;
+
+//
+// Demand zero fault statistics, updated under the PFN lock.  A hit means
+// the fault was satisfied from a zeroed page list or cache, a miss means
+// the faulting thread had to zero the page itself.
+//
+
+extern PFN_NUMBER MiDemandZeroListHits;
+extern PFN_NUMBER MiDemandZeroListMisses;
+
 VOID
 MiPurgeTransitionList (
     VOID
@@ -4833,6 +4979,97 @@ MiUnmapLargePages (
     IN SIZE_T NumberOfBytes
     );
 
+//
+// Transparent large pages.  The working set manager promotes fully
+// populated, uniformly protected 2MB ranges of private memory to large
+// PDEs.  The page table page is kept (holding transition PTEs for the
+// large page frames) so any operation that needs individual PTEs can
+// demote the range first.  While promoted, the first frame of the large
+// page stands in for the page table page in the working set, ie: its
+// WsIndex is the WSLE of the page table page.
+//
+
+extern ULONG MmTransparentLargePages;
+extern ULONG MiLargePagePromotionsPerPass;
+extern ULONG MiLargePagePromotions;
+extern ULONG MiLargePageDemotions;
+extern ULONG MiLargePagePromotionFailures;
+
+//
+// Dispositions for MiDemoteLargePde.
+//
+
+#define MI_DEMOTE_RESIDENT      0
+#define MI_DEMOTE_TRIM          1
+#define MI_DEMOTE_DELETE        2
+
+#if defined (_AMD64_)
+
+#define MI_IS_PROMOTED_LARGE_PDE(PDE)                                       \
+        (((PDE) >= MiGetPdeAddress (MM_LOWEST_USER_ADDRESS)) &&             \
+         ((PDE) <= MiGetPdeAddress (MM_HIGHEST_USER_ADDRESS)) &&            \
+         (MI_PDE_MAPS_LARGE_PAGE (PDE)) &&                                  \
+         (MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (PDE))->PteAddress ==  \
+            (PMMPTE) MiGetVirtualAddressMappedByPte (PDE)))
+
+#define MI_DEMOTE_LARGE_PAGES(WSINFO, START, END)                           \
+        do {                                                            \
+            if ((WSINFO)->VmWorkingSetList->PromotedLargePages != 0) {      \
+                MiDemoteLargePages (WSINFO, START, END);                    \
+            }                                                           \
+        } while (0)
+
+#define MI_DELETE_LARGE_PAGES(WSINFO, START, END)                           \
+        do {                                                            \
+            if ((WSINFO)->VmWorkingSetList->PromotedLargePages != 0) {      \
+                MiDeleteLargePages (WSINFO, START, END);                    \
+            }                                                           \
+        } while (0)
+
+VOID
+MiPromoteLargePages (
+    IN PMMSUPPORT WsInfo
+    );
+
+VOID
+MiDemoteLargePages (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID StartingAddress,
+    IN PVOID EndingAddress
+    );
+
+VOID
+MiDeleteLargePages (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID StartingAddress,
+    IN PVOID EndingAddress
+    );
+
+VOID
+MiDemoteLargePde (
+    IN PMMSUPPORT WsInfo,
+    IN PMMPTE PointerPde,
+    IN ULONG Disposition
+    );
+
+#else
+
+#define MI_IS_PROMOTED_LARGE_PDE(PDE) FALSE
+
+#define MI_DEMOTE_LARGE_PAGES(WSINFO, START, END)
+
+#define MI_DELETE_LARGE_PAGES(WSINFO, START, END)
+
+#define MiPromoteLargePages(WSINFO)
+
+#define MiDemoteLargePages(WSINFO, START, END)
+
+#define MiDeleteLargePages(WSINFO, START, END)
+
+#define MiDemoteLargePde(WSINFO, PDE, DISPOSITION)
+
+#endif
+
 
 
 
@@ -5312,6 +5549,12 @@ MiRemoveNode (
     IN PMM_AVL_TABLE Root
     );
 
+VOID
+FASTCALL
+MiUpdateNodeGaps (
+    IN PMMADDRESS_NODE Node
+    );
+
 PMMADDRESS_NODE
 FASTCALL
 MiLocateAddressInTree (
@@ -5535,6 +5778,20 @@ MiWaitForForkToComplete (
     IN PEPROCESS CurrentProcess
     );
 
+//
+// Page combining.  Identical trimmed private pages are merged into fork
+// prototype PTEs (clone blocks) owned by the combiner, so the existing
+// copy on write and clone dereference paths handle them unchanged.
+//
+
+extern ULONG MmEnablePageCombining;
+extern KGUARDED_MUTEX MiPageCombineMutex;
+
+VOID
+MiCombineIdenticalPages (
+    IN PMMSUPPORT WsInfo
+    );
+
 //
 // Routines which operate on the working set list.
 //
@@ -5621,6 +5878,57 @@ MiRemoveWsle (
     IN PMMWSL WorkingSetList
     );
 
+//
+// Reverse index from user virtual page to working set index for the
+// non-direct (shared) entries of process working sets.  This is a radix
+// tree of nonpaged pool nodes whose leaves parallel a page table: one
+// WSLE_NUMBER per PTE.  Lookups are a fixed number of pointer loads and
+// entries are validated against the WSLE so stale slots are harmless.
+//
+// The index is built in place of the hash table once the working set
+// grows large enough to want one, and its nodes are charged to the
+// process as nonpaged pool quota.
+//
+
+#define MI_WSLE_INDEX_LEAF_SHIFT    9
+#define MI_WSLE_INDEX_NODE_SHIFT    9
+
+#define MI_WSLE_INDEX_LEAF_ENTRIES  (1 << MI_WSLE_INDEX_LEAF_SHIFT)
+#define MI_WSLE_INDEX_NODE_ENTRIES  (1 << MI_WSLE_INDEX_NODE_SHIFT)
+
+#if defined(_WIN64)
+#define MI_WSLE_INDEX_LEVELS        3
+#else
+#define MI_WSLE_INDEX_LEVELS        2
+#endif
+
+LOGICAL
+MiCreateWsleReverseIndex (
+    IN PMMSUPPORT WsInfo
+    );
+
+LOGICAL
+FASTCALL
+MiSetWsleReverseIndex (
+    IN PMMWSL WorkingSetList,
+    IN PVOID VirtualAddress,
+    IN WSLE_NUMBER Entry,
+    IN PEPROCESS Process OPTIONAL
+    );
+
+WSLE_NUMBER
+FASTCALL
+MiLookupWsleReverseIndex (
+    IN PMMWSL WorkingSetList,
+    IN PVOID VirtualAddress
+    );
+
+VOID
+MiDeleteWsleReverseIndex (
+    IN PMMWSL WorkingSetList,
+    IN PEPROCESS Process
+    );
+
 VOID
 FASTCALL
 MiTerminateWsle (
@@ -5746,6 +6054,63 @@ MiCancelWriteOfMappedPfn (
     IN KIRQL OldIrql
     );
 
+//
+// Routines which manage the compressed store for pagefile writes.
+//
+
+extern ULONG MmEnableCompressedStore;
+extern ULONG MiCompressedPagesStored;
+extern ULONG MiCompressedRefaults;
+extern LARGE_INTEGER MiCompressedRefaultTime;
+extern ULONG MiPageFileRefaults;
+extern LARGE_INTEGER MiPageFileRefaultTime;
+
+VOID
+MiInitializeCompressedStore (
+    VOID
+    );
+
+LOGICAL
+MiCompressModifiedWrite (
+    IN PMMMOD_WRITER_MDL_ENTRY ModWriterEntry,
+    IN ULONG PageFileNumber,
+    IN ULONG_PTR StartingOffset
+    );
+
+VOID
+MiTrimCompressedStore (
+    VOID
+    );
+
+LOGICAL
+MiIsPageCompressed (
+    IN MMPTE PteContents
+    );
+
+VOID
+MiRemoveCompressedPage (
+    IN ULONG PageFileNumber,
+    IN ULONG_PTR Offset
+    );
+
+VOID
+MiRemoveCompressedPageRange (
+    IN ULONG PageFileNumber,
+    IN ULONG_PTR StartingOffset,
+    IN PFN_NUMBER NumberOfPages
+    );
+
+LOGICAL
+MiReadCompressedPage (
+    IN PMMINPAGE_SUPPORT ReadBlock
+    );
+
+VOID
+MiUpdateRefaultStatistics (
+    IN LOGICAL Compressed,
+    IN LARGE_INTEGER StartTime
+    );
+
 //
 // Routines to delete address space.
 //
@@ -8120,6 +8485,12 @@ Environment:
     PageFile->FreeSpace += 1;
     PageFile->CurrentUsage -= 1;
 
+    //
+    // Drop any compressed copy so the slot can be reused.
+    //
+
+    MiRemoveCompressedPage (PageFileNumber, FreeBit);
+
     //
     // Check to see if we should move some MDL entries for the
     // modified page writer now that more free space is available.
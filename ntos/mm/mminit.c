@@ -1747,6 +1747,8 @@ Environment:
 
         KeInitializeGuardedMutex (&MmPageFileCreationLock);
 
+        KeInitializeGuardedMutex (&MiPageCombineMutex);
+
         //
         // Initialize resources for extending sections.
         //
@@ -36,6 +36,27 @@ extern ULONG_PTR MmAllocatedPagedPool;
 
 SIZE_T MmSystemCommitReserve = (5 * 1024 * 1024) / PAGE_SIZE;
 
+//
+// Each processor keeps a small budget of commitment which has already been
+// charged to MmTotalCommittedPages.  Small charges are satisfied from (and
+// small returns are given back to) the current processor's budget so the
+// global counter's cache line is only touched once per batch.  Budgets are
+// only used while system commit is comfortably below the limit - as the
+// limit is approached they are drained back so the accounting is exact.
+//
+
+#define MI_COMMIT_BUDGET_BATCH      64
+#define MI_COMMIT_BUDGET_MAXIMUM    256
+
+#define MI_COMMIT_BUDGET_ENABLED() \
+    (MmTotalCommittedPages < ((MmTotalCommitLimit / 10) * 8))
+
+typedef struct DECLSPEC_CACHEALIGN _MI_COMMIT_BUDGET {
+    SIZE_T Pages;
+} MI_COMMIT_BUDGET, *PMI_COMMIT_BUDGET;
+
+MI_COMMIT_BUDGET MiCommitBudget[MAXIMUM_PROCESSORS];
+
 VOID
 MiInitializeCommitment (
     VOID
@@ -47,6 +68,307 @@ MiInitializeCommitment (
 
 }
 
+FORCEINLINE
+LOGICAL
+MiDrawCommitBudget (
+    IN SIZE_T QuotaCharge
+    )
+
+/*++
+
+Routine Description:
+
+    This routine attempts to satisfy the commitment charge from the
+    current processor's budget.
+
+Arguments:
+
+    QuotaCharge - Supplies the quota amount to charge.
+
+Return Value:
+
+    TRUE if the budget covered the charge, FALSE if not.
+
+Environment:
+
+    Kernel mode, any IRQL up to DISPATCH_LEVEL.
+
+--*/
+
+{
+    SIZE_T OldPages;
+    SIZE_T NewPages;
+    PMI_COMMIT_BUDGET Budget;
+
+    Budget = &MiCommitBudget[KeGetCurrentProcessorNumber ()];
+
+    do {
+
+        OldPages = Budget->Pages;
+
+        if (OldPages < QuotaCharge) {
+            return FALSE;
+        }
+
+#if defined(_WIN64)
+        NewPages = InterlockedCompareExchange64 (
+                                (PLONGLONG) &Budget->Pages,
+                                (LONGLONG)  (OldPages - QuotaCharge),
+                                (LONGLONG)  OldPages);
+#else
+        NewPages = InterlockedCompareExchange (
+                                (PLONG) &Budget->Pages,
+                                (LONG)  (OldPages - QuotaCharge),
+                                (LONG)  OldPages);
+#endif
+
+    } while (NewPages != OldPages);
+
+    return TRUE;
+}
+
+SIZE_T
+MiDrainCommitBudgets (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns every processor's commitment budget to the
+    system so that MmTotalCommittedPages reflects only real charges.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of pages returned.
+
+Environment:
+
+    Kernel mode, any IRQL up to DISPATCH_LEVEL.
+
+--*/
+
+{
+    ULONG i;
+    SIZE_T Pages;
+    SIZE_T TotalPages;
+
+    TotalPages = 0;
+
+    for (i = 0; i < (ULONG) KeNumberProcessors; i += 1) {
+
+        if (MiCommitBudget[i].Pages == 0) {
+            continue;
+        }
+
+#if defined(_WIN64)
+        Pages = (SIZE_T) InterlockedExchange64 (
+                                (PLONGLONG) &MiCommitBudget[i].Pages, 0);
+#else
+        Pages = (SIZE_T) InterlockedExchange (
+                                (PLONG) &MiCommitBudget[i].Pages, 0);
+#endif
+
+        TotalPages += Pages;
+    }
+
+    if (TotalPages != 0) {
+        ASSERT (MmTotalCommittedPages >= TotalPages);
+        InterlockedExchangeAddSizeT (&MmTotalCommittedPages, 0 - TotalPages);
+    }
+
+    return TotalPages;
+}
+
+VOID
+FASTCALL
+MiReturnCommitmentBatched (
+    IN SIZE_T QuotaCharge
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns commitment, giving small amounts to the current
+    processor's budget instead of the global counter while system commit
+    is well below the limit.
+
+Arguments:
+
+    QuotaCharge - Supplies the quota amount to return.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, any IRQL up to DISPATCH_LEVEL.
+
+--*/
+
+{
+    PMI_COMMIT_BUDGET Budget;
+
+    if ((QuotaCharge < MI_COMMIT_BUDGET_BATCH) && (MI_COMMIT_BUDGET_ENABLED ())) {
+
+        Budget = &MiCommitBudget[KeGetCurrentProcessorNumber ()];
+
+        //
+        // The budget may slightly exceed its maximum if this thread is
+        // rescheduled or races with another - this is harmless as the
+        // pages remain charged globally either way.
+        //
+
+        if (Budget->Pages + QuotaCharge <= MI_COMMIT_BUDGET_MAXIMUM) {
+            InterlockedExchangeAddSizeT (&Budget->Pages, QuotaCharge);
+            return;
+        }
+    }
+
+    InterlockedExchangeAddSizeT (&MmTotalCommittedPages, 0 - QuotaCharge);
+}
+
+SIZE_T
+MmQueryCommittedPages (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the number of committed pages, excluding the
+    commitment currently held in per-processor budgets.  The peak
+    commitment is brought up to date with the result.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of committed pages.
+
+Environment:
+
+    Kernel mode, any IRQL up to DISPATCH_LEVEL.
+
+--*/
+
+{
+    ULONG i;
+    ULONG Retries;
+    SIZE_T CommittedPages;
+    SIZE_T CommittedPagesAfter;
+    SIZE_T BudgetPages;
+
+    Retries = 4;
+
+    do {
+
+        BudgetPages = 0;
+        CommittedPages = MmTotalCommittedPages;
+
+        for (i = 0; i < (ULONG) KeNumberProcessors; i += 1) {
+            BudgetPages += MiCommitBudget[i].Pages;
+        }
+
+        //
+        // A refill or drain moves pages between the total and a budget.
+        // If one raced with the sampling above, the snapshot is not
+        // consistent so try again.  Using the smaller of the totals keeps
+        // a persistently racing snapshot from overstating the commitment.
+        //
+
+        CommittedPagesAfter = MmTotalCommittedPages;
+
+        if (CommittedPagesAfter == CommittedPages) {
+            break;
+        }
+
+        if (CommittedPagesAfter < CommittedPages) {
+            CommittedPages = CommittedPagesAfter;
+        }
+
+        Retries -= 1;
+
+    } while (Retries != 0);
+
+    if (BudgetPages > CommittedPages) {
+        return 0;
+    }
+
+    CommittedPages -= BudgetPages;
+
+    if (CommittedPages > MmPeakCommitment) {
+        MmPeakCommitment = CommittedPages;
+    }
+
+    return CommittedPages;
+}
+
+
+FORCEINLINE
+VOID
+MiUpdatePeakCommitment (
+    IN LOGICAL Drained
+    )
+
+/*++
+
+Routine Description:
+
+    This routine raises the peak commitment after a charge.  Summing the
+    per-processor budgets here would make every charge walk all the
+    processors, so the global total less the most the budgets can hold is
+    used instead.  This never overstates the commitment and
+    MmQueryCommittedPages brings the peak up to the exact value whenever
+    the commitment is queried.
+
+Arguments:
+
+    Drained - Supplies TRUE if the budgets were just returned by this
+              charge, in which case the global total is already exact.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, any IRQL up to DISPATCH_LEVEL.
+
+--*/
+
+{
+    SIZE_T CommittedPages;
+    SIZE_T BudgetPages;
+
+    CommittedPages = MmTotalCommittedPages;
+
+    if (Drained == FALSE) {
+
+        BudgetPages = (SIZE_T) KeNumberProcessors * MI_COMMIT_BUDGET_MAXIMUM;
+
+        if (CommittedPages <= BudgetPages) {
+            return;
+        }
+
+        CommittedPages -= BudgetPages;
+    }
+
+    if (CommittedPages > MmPeakCommitment) {
+        MmPeakCommitment = CommittedPages;
+    }
+}
+
 
 LOGICAL
 FASTCALL
@@ -92,6 +414,8 @@ Environment:
     SIZE_T OldCommitValue;
     SIZE_T NewCommitValue;
     SIZE_T CommitLimit;
+    SIZE_T Refill;
+    LOGICAL Drained;
     PETHREAD Thread;
     MMPAGE_FILE_EXPANSION PageExtend;
     LOGICAL WsHeldSafe;
@@ -120,14 +444,55 @@ Environment:
     WsHeldSafe = FALSE;
     WsHeldShared = FALSE;
 
+    //
+    // Small charges are satisfied from this processor's budget when
+    // possible.  Otherwise charge a batch for the budget along with this
+    // request so subsequent small charges avoid the global counter.
+    //
+
+    Refill = 0;
+    Drained = FALSE;
+
+    if (QuotaCharge < MI_COMMIT_BUDGET_BATCH) {
+
+        if (MiDrawCommitBudget (QuotaCharge) == TRUE) {
+            MM_TRACK_COMMIT (MM_DBG_COMMIT_CHARGE_NORMAL, QuotaCharge);
+            return TRUE;
+        }
+
+        if (MI_COMMIT_BUDGET_ENABLED ()) {
+            Refill = MI_COMMIT_BUDGET_BATCH;
+        }
+    }
+
     do {
 
         OldCommitValue = MmTotalCommittedPages;
 
-        NewCommitValue = OldCommitValue + QuotaCharge;
+        NewCommitValue = OldCommitValue + QuotaCharge + Refill;
 
         while (NewCommitValue + MmSystemCommitReserve > MmTotalCommitLimit) {
 
+            //
+            // Commitment is getting tight - stop refilling and return all
+            // the processor budgets before considering paging file
+            // expansion so the limit is enforced exactly.
+            //
+
+            if (Drained == FALSE) {
+
+                Drained = TRUE;
+                Refill = 0;
+
+                MiDrainCommitBudgets ();
+
+                OldCommitValue = MmTotalCommittedPages;
+
+                NewCommitValue = OldCommitValue + QuotaCharge;
+
+                continue;
+            }
+
             //
             // If the pagefiles are already at the maximum, then don't
             // bother trying to extend them, but do trim the cache.
@@ -196,7 +561,7 @@ Environment:
 
             OldCommitValue = MmTotalCommittedPages;
 
-            NewCommitValue = OldCommitValue + QuotaCharge;
+            NewCommitValue = OldCommitValue + QuotaCharge + Refill;
         }
 
 #if defined(_WIN64)
@@ -217,13 +582,16 @@ Environment:
     // Success.
     //
 
+    if (Refill != 0) {
+        InterlockedExchangeAddSizeT (&MiCommitBudget[KeGetCurrentProcessorNumber ()].Pages,
+                                     Refill);
+    }
+
     MI_LOG_COMMIT_CHANGE (NewCommitValue + QuotaCharge, QuotaCharge);
 
     MM_TRACK_COMMIT (MM_DBG_COMMIT_CHARGE_NORMAL, QuotaCharge);
 
-    if (MmTotalCommittedPages > MmPeakCommitment) {
-        MmPeakCommitment = MmTotalCommittedPages;
-    }
+    MiUpdatePeakCommitment (Drained);
 
     //
     // Success.  If system commit exceeds 90%, attempt a preemptive pagefile
@@ -299,11 +667,16 @@ Environment:
     SIZE_T ExtendAmount;
     SIZE_T OldCommitValue;
     SIZE_T NewCommitValue;
+    LOGICAL Drained;
 
     ASSERT ((SSIZE_T)QuotaCharge > 0);
 
     ASSERT32 ((QuotaCharge < 0x100000) || (QuotaCharge < MmTotalCommitLimit));
 
+    Drained = FALSE;
+
+retry:
+
     do {
 
         OldCommitValue = ReadForWriteAccess (&MmTotalCommittedPages);
@@ -312,6 +685,17 @@ Environment:
 
         if ((NewCommitValue > MmTotalCommitLimit) && (!MustSucceed)) {
 
+            //
+            // Return the processor budgets before failing the charge.
+            //
+
+            if (Drained == FALSE) {
+                Drained = TRUE;
+                if (MiDrainCommitBudgets () != 0) {
+                    goto retry;
+                }
+            }
+
             if ((NewCommitValue < MmTotalCommittedPages) ||
                 (MmTotalCommitLimit + 100 >= MmTotalCommitLimitMaximum)) {
 
@@ -416,9 +800,14 @@ Environment:
 {
     SIZE_T OldCommitValue;
     SIZE_T NewCommitValue;
+    LOGICAL Drained;
 
     ASSERT ((SSIZE_T)QuotaCharge > 0);
 
+    Drained = FALSE;
+
+retry:
+
     do {
 
         OldCommitValue = ReadForWriteAccess (&MmTotalCommittedPages);
@@ -426,6 +815,18 @@ Environment:
         NewCommitValue = OldCommitValue + QuotaCharge;
 
         if (NewCommitValue > MmTotalCommitLimit) {
+
+            //
+            // Return the processor budgets before failing the charge.
+            //
+
+            if (Drained == FALSE) {
+                Drained = TRUE;
+                if (MiDrainCommitBudgets () != 0) {
+                    goto retry;
+                }
+            }
+
             return FALSE;
         }
 
@@ -449,9 +850,7 @@ Environment:
 
     MM_TRACK_COMMIT (MM_DBG_COMMIT_CHARGE_NORMAL, QuotaCharge);
 
-    if (MmTotalCommittedPages > MmPeakCommitment) {
-        MmPeakCommitment = MmTotalCommittedPages;
-    }
+    MiUpdatePeakCommitment (Drained);
 
     return TRUE;
 }
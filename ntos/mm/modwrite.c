@@ -112,6 +112,19 @@ extern SIZE_T MmSystemCommitReserve;
 
 LIST_ENTRY MmMappedPageWriterList;
 
+//
+// Number of mapped writes queued ahead of an earlier arrival to keep the
+// writes to a file in offset order.
+//
+
+ULONG MiMappedWritesReordered;
+
+//
+// Number of later writes that may be queued ahead of a mapped write.
+//
+
+#define MI_MAPPED_WRITE_PASS_LIMIT  8
+
 KEVENT MmMappedPageWriterEvent;
 
 KEVENT MmMappedFileIoComplete;
@@ -135,6 +148,11 @@ MiGatherMappedPages (
     IN KIRQL OldIrql
     );
 
+VOID
+MiQueueMappedWrite (
+    IN PMMMOD_WRITER_MDL_ENTRY ModWriterEntry
+    );
+
 VOID
 MiGatherPagefilePages (
     IN PMMMOD_WRITER_MDL_ENTRY ModWriterEntry,
@@ -1045,8 +1063,9 @@ Arguments:
         // Allocate pool failed.
         //
 
-        ExFreePool (NewPagingFile->Entry[0]);
-        ExFreePool (NewPagingFile->Entry[1]);
+        for (i = 0; i < MM_PAGING_FILE_MDLS; i += 1) {
+            ExFreePool (NewPagingFile->Entry[i]);
+        }
         ExFreePool (NewPagingFile);
         Status = STATUS_INSUFFICIENT_RESOURCES;
         goto ErrorReturn3;
@@ -1380,6 +1399,10 @@ Return Value:
                   (ULONG)PagingFile->Size,
                   (ULONG)AdditionalAllocation);
 
+    MiRemoveCompressedPageRange (PageFileNumber,
+                                 PagingFile->Size,
+                                 AdditionalAllocation);
+
     PagingFile->Size += AdditionalAllocation;
     PagingFile->FreeSpace += AdditionalAllocation;
 
@@ -2110,6 +2133,10 @@ Return Value:
                           (ULONG)StartReduction,
                           (ULONG)ReductionSize );
 
+            MiRemoveCompressedPageRange (PagingFile->PageFileNumber,
+                                         StartReduction,
+                                         ReductionSize);
+
             UNLOCK_PFN (OldIrql);
 
             ASSERT ((LONG)(MaxReduce + ReductionSize) >= 0);
@@ -2924,6 +2951,8 @@ Environment:
 
     MmNumberOfMappedMdls = i;
 
+    MiInitializeCompressedStore ();
+
     //
     // Make this a real time thread.
     //
@@ -2939,28 +2968,39 @@ Environment:
     // a secondary thread allows that thread to block without affecting
     // on going page file writes.
     //
+    // On NUMA systems one mapped writer is created per node so that a
+    // single filesystem or storage stall does not serialize all mapped
+    // writes.  All of them service the same (offset ordered) queue.  Only
+    // the first thread is required - the others are best effort.
+    //
 
     KeInitializeEvent (&MmMappedPageWriterEvent, NotificationEvent, FALSE);
     InitializeListHead (&MmMappedPageWriterList);
     InitializeObjectAttributes (&ObjectAttributes, NULL, 0, NULL, NULL);
 
-    Status = PsCreateSystemThread (&ThreadHandle,
-                                   THREAD_ALL_ACCESS,
-                                   &ObjectAttributes,
-                                   0L,
-                                   NULL,
-                                   MiMappedPageWriter,
-                                   NULL);
+    for (i = 0; i < KeNumberNodes; i += 1) {
 
-    if (!NT_SUCCESS(Status)) {
-        KeBugCheckEx (MEMORY_MANAGEMENT,
-                      0x41288,
-                      Status,
-                      0,
-                      0);
-    }
+        Status = PsCreateSystemThread (&ThreadHandle,
+                                       THREAD_ALL_ACCESS,
+                                       &ObjectAttributes,
+                                       0L,
+                                       NULL,
+                                       MiMappedPageWriter,
+                                       (PVOID) (ULONG_PTR) i);
 
-    ZwClose (ThreadHandle);
+        if (!NT_SUCCESS(Status)) {
+            if (i == 0) {
+                KeBugCheckEx (MEMORY_MANAGEMENT,
+                              0x41288,
+                              Status,
+                              0,
+                              0);
+            }
+            break;
+        }
+
+        ZwClose (ThreadHandle);
+    }
 
     MiModifiedPageWriterWorker ();
 
@@ -3087,6 +3127,8 @@ Environment:
                                                  NULL,
                                                  &WaitBlockArray[0]);
 
+        MiTrimCompressedStore ();
+
         LOCK_PFN (OldIrql);
 
         for (;;) {
@@ -3397,6 +3439,112 @@ Environment:
     } // end for
 }
 
+VOID
+MiQueueMappedWrite (
+    IN PMMMOD_WRITER_MDL_ENTRY ModWriterEntry
+    )
+
+/*++
+
+Routine Description:
+
+    This routine queues a mapped write for the mapped page writer threads.
+
+    Writes to the same file are kept in ascending file offset order no
+    matter which subsection or control area produced them, so the file
+    system and storage stack see one sequential stream instead of the
+    order the pages happened to reach the modified list in.  Writes to
+    different files keep their arrival order so no file is starved.
+
+    A queued write may only be passed by MI_MAPPED_WRITE_PASS_LIMIT later
+    writes.  After that nothing is placed in front of it, so a write high
+    in a file cannot be held back indefinitely by a stream of writes at
+    lower offsets.
+
+Arguments:
+
+    ModWriterEntry - Supplies the filled in writer entry to queue.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PFN lock held.
+
+--*/
+
+{
+    PLIST_ENTRY NextEntry;
+    PLIST_ENTRY InsertAfter;
+    PMMMOD_WRITER_MDL_ENTRY QueuedEntry;
+
+    MM_PFN_LOCK_ASSERT();
+
+    ModWriterEntry->TimesPassed = 0;
+
+    //
+    // Walk back from the tail until a queued write to the same file that
+    // starts below this one is found, or a write that has already been
+    // passed as often as allowed.  This write goes in front of the
+    // earliest write to the file passed on the way, or at the tail if
+    // there was none.
+    //
+
+    InsertAfter = MmMappedPageWriterList.Blink;
+    NextEntry = InsertAfter;
+
+    while (NextEntry != &MmMappedPageWriterList) {
+
+        QueuedEntry = CONTAINING_RECORD (NextEntry,
+                                         MMMOD_WRITER_MDL_ENTRY,
+                                         Links);
+
+        if (QueuedEntry->TimesPassed >= MI_MAPPED_WRITE_PASS_LIMIT) {
+            break;
+        }
+
+        if (QueuedEntry->File == ModWriterEntry->File) {
+
+            if (QueuedEntry->WriteOffset.QuadPart <
+                                    ModWriterEntry->WriteOffset.QuadPart) {
+                break;
+            }
+
+            InsertAfter = NextEntry->Blink;
+        }
+
+        NextEntry = NextEntry->Blink;
+    }
+
+    if (InsertAfter != MmMappedPageWriterList.Blink) {
+
+        MiMappedWritesReordered += 1;
+
+        //
+        // Charge every write this one is being placed ahead of.
+        //
+
+        NextEntry = InsertAfter->Flink;
+
+        while (NextEntry != &MmMappedPageWriterList) {
+
+            QueuedEntry = CONTAINING_RECORD (NextEntry,
+                                             MMMOD_WRITER_MDL_ENTRY,
+                                             Links);
+
+            QueuedEntry->TimesPassed += 1;
+
+            NextEntry = NextEntry->Flink;
+        }
+    }
+
+    InsertHeadList (InsertAfter, &ModWriterEntry->Links);
+
+    return;
+}
+
 VOID
 MiGatherMappedPages (
     IN KIRQL OldIrql
@@ -3823,7 +3971,7 @@ Environment:
     // Send the entry to the MappedPageWriter.
     //
 
-    InsertTailList (&MmMappedPageWriterList, &ModWriterEntry->Links);
+    MiQueueMappedWrite (ModWriterEntry);
 
     KeSetEvent (&MmMappedPageWriterEvent, 0, FALSE);
 
@@ -4191,6 +4339,10 @@ bail:
                       StartBit,
                       (ULONG)(ThisCluster - ClusterSize));
 
+        MiRemoveCompressedPageRange (CurrentPagingFile->PageFileNumber,
+                                     StartBit,
+                                     ThisCluster - ClusterSize);
+
         CurrentPagingFile->FreeSpace += ThisCluster - ClusterSize;
         CurrentPagingFile->CurrentUsage -= ThisCluster - ClusterSize;
 
@@ -4251,16 +4403,38 @@ bail:
 
     UNLOCK_PFN (OldIrql);
 
+    ModWriterEntry->Mdl.ByteCount = (ULONG)(ClusterSize * PAGE_SIZE);
+
+    KeQuerySystemTime (&ModWriterEntry->IssueTime);
+
+    if (MiCompressModifiedWrite (
+                ModWriterEntry,
+                CurrentPagingFile->PageFileNumber,
+                (ULONG_PTR)(StartingOffset.QuadPart >> PAGE_SHIFT)) == TRUE) {
+
+        //
+        // Every page in the cluster is held in the compressed store so
+        // complete the write without issuing it.  The paging file space
+        // stays allocated for when the pages are evicted from the store.
+        //
+
+        ModWriterEntry->u.IoStatus.Status = STATUS_SUCCESS;
+        ModWriterEntry->u.IoStatus.Information = ModWriterEntry->Mdl.ByteCount;
+        KeRaiseIrql (APC_LEVEL, &OldIrql);
+        MiWriteComplete ((PVOID)ModWriterEntry,
+                         &ModWriterEntry->u.IoStatus,
+                         0);
+        KeLowerIrql (OldIrql);
+
+        goto WriteIssued;
+    }
+
     Prcb = KeGetCurrentPrcb ();
     InterlockedIncrement (&Prcb->MmDirtyWriteIoCount);
 
     InterlockedExchangeAdd (&Prcb->MmDirtyPagesWriteCount,
                             (LONG) ClusterSize);
 
-    ModWriterEntry->Mdl.ByteCount = (ULONG)(ClusterSize * PAGE_SIZE);
-
-    KeQuerySystemTime (&ModWriterEntry->IssueTime);
-
     IrpPriority = IoPagingPriorityNormal;
 
     if (MiModifiedWriteBurstCount != 0) {
@@ -4316,6 +4490,8 @@ bail:
         KeLowerIrql (OldIrql);
     }
 
+WriteIssued:
+
     if ((Bitmap != NULL) && (Bitmap != CurrentPagingFile->Bitmap)) {
 
         //
@@ -4352,7 +4528,7 @@ Routine Description:
 
 Arguments:
 
-    StartContext - not used.
+    StartContext - Supplies the node number this writer is affinitized to.
 
 Return Value:
 
@@ -4368,11 +4544,31 @@ Environment:
     KIRQL OldIrql;
     NTSTATUS Status;
     KEVENT TempEvent;
+#if defined(MI_MULTINODE)
+    PKNODE KeNode;
+#endif
     PETHREAD CurrentThread;
     IO_PAGING_PRIORITY IrpPriority;
     PMMMOD_WRITER_MDL_ENTRY ModWriterEntry;
 
+#if defined(MI_MULTINODE)
+
+    //
+    // Run on this node's processors.  Nodes without processors leave the
+    // thread free to run anywhere.
+    //
+
+    if (KeNumberNodes > 1) {
+
+        KeNode = KeNodeBlock[(ULONG) (ULONG_PTR) StartContext];
+
+        if (KeNode->ProcessorMask != 0) {
+            KeSetSystemAffinityThread (KeNode->ProcessorMask);
+        }
+    }
+#else
     UNREFERENCED_PARAMETER (StartContext);
+#endif
 
     //
     // Make this a real time thread.
@@ -4839,7 +5035,7 @@ Return Value:
 
     MmPagingFile[MmNumberOfPagingFiles - 1]->ReferenceCount = 0;
 
-    MmNumberOfActiveMdlEntries += 2;
+    MmNumberOfActiveMdlEntries += MM_PAGING_FILE_MDLS;
 
     UNLOCK_PFN (OldIrql);
 
@@ -93,7 +93,24 @@ MiCompleteProtoPteFault (
     IN OUT PMMPFN *LockedProtoPfn
     );
 
-ULONG MmMaxTransitionCluster = 8;
+ULONG
+MiGetTransitionCluster (
+    IN PMMVAD Vad,
+    IN PMMPTE PointerPte
+    );
+
+//
+// Transition cluster faults map up to MmMaxTransitionCluster resident pages
+// of a data view at once.  Each view starts at MmInitialTransitionCluster
+// and its size is doubled or halved depending on whether the pages mapped
+// speculatively by the previous cluster were referenced.
+//
+
+ULONG MmMaxTransitionCluster = 16;
+ULONG MmInitialTransitionCluster = 8;
+
+ULONG MiClusterPagesMapped;
+ULONG MiClusterPagesReferenced;
 
 
 NTSTATUS
@@ -163,6 +180,9 @@ Environment:
 #define VARIOUS_FLAGS_ACCESS_CHECK_NEEDED       0x04
 #define VARIOUS_FLAGS_LOG_HARD_FAULT            0x08
 #define VARIOUS_FLAGS_ENTERED_CRITICAL_REGION   0x10
+#define VARIOUS_FLAGS_TRANSITION_CLUSTER        0x20
+#define VARIOUS_FLAGS_PAGEFILE_READ             0x40
+#define VARIOUS_FLAGS_COMPRESSED_READ           0x80
 
     //
     // Miscellaneous unrelated flags kept here in one ULONG to save stack space.
@@ -184,6 +204,7 @@ Environment:
     ULONG_PTR i;
     ULONG_PTR NumberOfProtos;
     ULONG_PTR MaxProtos;
+    ULONG_PTR FilledPtes;
     ULONG_PTR ProtosProcessed;
     NTSTATUS status;
     PMMINPAGE_SUPPORT ReadBlock;
@@ -200,6 +221,7 @@ Environment:
     PETHREAD WsThread;
     PERFINFO_HARDPAGEFAULT_INFORMATION HardFaultEvent;
     LARGE_INTEGER IoStartTime;
+    LARGE_INTEGER ReadStartTime;
     ULONG_PTR StoreInstruction;
     PMMPFN LockedProtoPfn;
     WSLE_NUMBER WorkingSetIndex;
@@ -273,7 +295,9 @@ Environment:
                      (Process->Vm.WorkingSetSize + MmMaxTransitionCluster <= Process->Vm.MaximumWorkingSetSize)) &&
                     (RecheckAccess == FALSE)) {
     
-                    NumberOfProtos = MmMaxTransitionCluster;
+                    NumberOfProtos = MiGetTransitionCluster (Vad, PointerPte);
+
+                    VariousFlags |= VARIOUS_FLAGS_TRANSITION_CLUSTER;
     
                     //
                     // Ensure the cluster doesn't cross the VAD contiguous PTE
@@ -348,21 +372,39 @@ Environment:
                     // each PTE we fill (regardless of whether the prototype
                     // cluster pages are already in transition).
                     //
+                    // PTEs that were trimmed (or never faulted after a
+                    // protection change) already hold the same prototype
+                    // lookup encoding as the faulting PTE and are already
+                    // counted, so they are clustered as they are.  Zero PTEs
+                    // take the view protection, so they are only filled if
+                    // the faulting PTE carries that protection as well.
+                    //
 
                     ASSERT (VirtualAddress <= MM_HIGHEST_USER_ADDRESS);
 
+                    FilledPtes = 0;
+
                     for (i = 1; i < NumberOfProtos; i += 1) {
-                        if ((PointerPte + i)->u.Long != MM_ZERO_PTE) {
+                        if ((PointerPte + i)->u.Long == MM_ZERO_PTE) {
+                            if (MI_GET_PROTECTION_FROM_SOFT_PTE (PointerPte) != MI_GET_PROTECTION_FROM_VAD (Vad)) {
+                                break;
+                            }
+                            MI_WRITE_INVALID_PTE (PointerPte + i, *PointerPte);
+                            FilledPtes += 1;
+                        }
+                        else if ((PointerPte + i)->u.Long != PointerPte->u.Long) {
                             break;
                         }
-                        MI_WRITE_INVALID_PTE (PointerPte + i, *PointerPte);
                     }
 
                     NumberOfProtos = i;
 
                     if (NumberOfProtos > 1) {
-                        UsedPageTableHandle = MI_GET_USED_PTES_HANDLE (VirtualAddress);
-                        MI_INCREMENT_USED_PTES_BY_HANDLE_CLUSTER (UsedPageTableHandle, NumberOfProtos - 1);
+
+                        if (FilledPtes != 0) {
+                            UsedPageTableHandle = MI_GET_USED_PTES_HANDLE (VirtualAddress);
+                            MI_INCREMENT_USED_PTES_BY_HANDLE_CLUSTER (UsedPageTableHandle, FilledPtes);
+                        }
 
                         //
                         // The protection code for the real PTE comes from
@@ -728,6 +770,15 @@ Environment:
 
                     NewPteContents.u.Hard.PageFrameNumber = PageFrameIndex;
 
+                    //
+                    // Speculatively mapped pages start out unreferenced so
+                    // the next cluster fault can tell whether they were used.
+                    //
+
+                    if (ProtosProcessed > 1) {
+                        MI_SET_ACCESSED_IN_PTE (&NewPteContents, 0);
+                    }
+
 #if DBG
 
                     //
@@ -823,6 +874,8 @@ Environment:
                 // VAs were purely optional.
                 //
 
+                NumberOfProtos = ProtosProcessed - 1;
+
                 if (VariousFlags & VARIOUS_FLAGS_PFN_HELD) {
 
                     //
@@ -846,6 +899,15 @@ Environment:
                     InterlockedExchangeAdd (&KeGetCurrentPrcb ()->MmTransitionCount,
                                             (LONG) ProtosProcessed);
 
+                    //
+                    // The last VA was made valid by MiCompleteProtoPteFault
+                    // as referenced - if it was speculative, clear that.
+                    //
+
+                    if (ProtosProcessed > 1) {
+                        MI_SET_ACCESSED_IN_PTE (PointerPte, 0);
+                    }
+
                     ProtosProcessed -= 1;
                 }
 
@@ -926,6 +988,19 @@ Environment:
                     }
                 }
 
+                //
+                // PointerPte is back at the faulting PTE.  Remember the
+                // speculatively mapped pages so the next cluster fault in
+                // this view can size itself by how many of them were used.
+                //
+
+                if (VariousFlags & VARIOUS_FLAGS_TRANSITION_CLUSTER) {
+                    MmWorkingSetList->ClusterVad = (PVOID) Vad;
+                    MmWorkingSetList->ClusterPte = PointerPte + 1;
+                    MmWorkingSetList->ClusterCount = (ULONG) NumberOfProtos;
+                    MiClusterPagesMapped += (ULONG) NumberOfProtos;
+                }
+
                 ASSERT (EntryIrql == KeGetCurrentIrql ());
                 ASSERT (EntryIrql <= APC_LEVEL);
                 ASSERT (KeAreAllApcsDisabled () == TRUE);
@@ -1228,25 +1303,42 @@ NonProtoFault:
 
         ASSERT (ReadBlock->u1.e1.PrefetchMdlHighBits == 0);
 
+        if (ReadBlock->u1.e1.PageFileRead == 1) {
+            VariousFlags |= VARIOUS_FLAGS_PAGEFILE_READ;
+            ReadStartTime = KeQueryPerformanceCounter (NULL);
+        }
+        else {
+            SATISFY_OVERZEALOUS_COMPILER (ReadStartTime.QuadPart = 0);
+        }
+
         //
-        // Issue the read request.
+        // Issue the read request unless the page can be decompressed from
+        // the compressed store instead.
         //
 
-        status = IoPageRead (ReadBlock->FilePointer,
-                             &ReadBlock->Mdl,
-                             &ReadBlock->ReadOffset,
-                             &ReadBlock->Event,
-                             &ReadBlock->IoStatus);
+        if ((ReadBlock->u1.e1.Compressed == 1) &&
+            (MiReadCompressedPage (ReadBlock) == TRUE)) {
+
+            VariousFlags |= VARIOUS_FLAGS_COMPRESSED_READ;
+        }
+        else {
+
+            status = IoPageRead (ReadBlock->FilePointer,
+                                 &ReadBlock->Mdl,
+                                 &ReadBlock->ReadOffset,
+                                 &ReadBlock->Event,
+                                 &ReadBlock->IoStatus);
 
-        if (!NT_SUCCESS(status)) {
+            if (!NT_SUCCESS(status)) {
 
-            //
-            // Set the event as the I/O system doesn't set it on errors.
-            //
+                //
+                // Set the event as the I/O system doesn't set it on errors.
+                //
 
-            ReadBlock->IoStatus.Status = status;
-            ReadBlock->IoStatus.Information = 0;
-            KeSetEvent (&ReadBlock->Event, 0, FALSE);
+                ReadBlock->IoStatus.Status = status;
+                ReadBlock->IoStatus.Information = 0;
+                KeSetEvent (&ReadBlock->Event, 0, FALSE);
+            }
         }
 
         //
@@ -1279,6 +1371,12 @@ NonProtoFault:
             HardFaultEvent.IoTime.QuadPart -= IoStartTime.QuadPart;
         }
 
+        if (VariousFlags & VARIOUS_FLAGS_PAGEFILE_READ) {
+            MiUpdateRefaultStatistics (
+                (LOGICAL)((VariousFlags & VARIOUS_FLAGS_COMPRESSED_READ) != 0),
+                ReadStartTime);
+        }
+
         //
         // MiWaitForInPageComplete RETURNS WITH THE WORKING SET LOCK
         // AND PFN LOCK HELD!!!
@@ -1605,6 +1703,110 @@ NonProtoFault:
     return status;
 }
 
+
+ULONG
+MiGetTransitionCluster (
+    IN PMMVAD Vad,
+    IN PMMPTE PointerPte
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the number of pages a transition cluster fault in
+    the specified view should map, including the faulting page.
+
+    If the previous cluster fault in this process was in the same view, the
+    pages it mapped speculatively are checked first.  The view's cluster is
+    doubled if at least half of them have been referenced and halved
+    otherwise.  If nothing was mapped speculatively, a fault on the page
+    right after the previous fault is taken as a sequential scan and the
+    cluster is doubled.
+
+Arguments:
+
+    Vad - Supplies the data view the fault is in.
+
+    PointerPte - Supplies the PTE for the faulting address.
+
+Return Value:
+
+    The number of pages to cluster, from 1 to MmMaxTransitionCluster.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set pushlock held.
+
+--*/
+
+{
+    ULONG i;
+    ULONG Cluster;
+    ULONG Referenced;
+    PMMPTE ClusterPte;
+
+    Cluster = Vad->TransitionCluster;
+
+    if (Cluster == 0) {
+        Cluster = MmInitialTransitionCluster;
+    }
+
+    if (MmWorkingSetList->ClusterVad == (PVOID) Vad) {
+
+        ClusterPte = MmWorkingSetList->ClusterPte;
+
+        if (MmWorkingSetList->ClusterCount == 0) {
+
+            if (PointerPte == ClusterPte) {
+                Cluster *= 2;
+            }
+        }
+        else if (MiIsAddressValid (ClusterPte, FALSE)) {
+
+            //
+            // The cluster never crosses a page table page so the page table
+            // page being resident means all of its PTEs can be examined.
+            //
+
+            Referenced = 0;
+
+            for (i = 0; i < MmWorkingSetList->ClusterCount; i += 1) {
+
+                if ((ClusterPte->u.Hard.Valid == 1) &&
+                    (MI_GET_ACCESSED_IN_PTE (ClusterPte) != 0)) {
+
+                    Referenced += 1;
+                }
+
+                ClusterPte += 1;
+            }
+
+            MiClusterPagesReferenced += Referenced;
+
+            if (Referenced * 2 >= MmWorkingSetList->ClusterCount) {
+                Cluster *= 2;
+            }
+            else {
+                Cluster /= 2;
+            }
+        }
+
+        MmWorkingSetList->ClusterVad = NULL;
+    }
+
+    if (Cluster > MmMaxTransitionCluster) {
+        Cluster = MmMaxTransitionCluster;
+    }
+    else if (Cluster == 0) {
+        Cluster = 1;
+    }
+
+    Vad->TransitionCluster = Cluster;
+
+    return Cluster;
+}
+
 
 NTSTATUS
 MiResolveDemandZeroFault (
@@ -1728,6 +1930,19 @@ Environment:
         PageColor = 0xFFFFFFFF;
     }
 
+    //
+    // A user page can be taken from this processor's page cache without
+    // the PFN lock.  The page was already counted as unavailable when it
+    // entered the cache.
+    //
+
+    PageFrameIndex = 0;
+
+    if (PageColor != 0xFFFFFFFF) {
+        ASSERT (OldIrql == MM_NOIRQL);
+        PageFrameIndex = MiRemoveCachedPage (PageColor, &NeedToZero);
+    }
+
     if (OldIrql == MM_NOIRQL) {
         CallerHeldPfn = FALSE;
         LOCK_PFN (OldIrql);
@@ -1742,18 +1957,41 @@ Environment:
     // returned, do not continue, just return success.
     //
 
-    if ((MmAvailablePages >= MM_HIGH_LIMIT) ||
+    if ((PageFrameIndex != 0) ||
+        (MmAvailablePages >= MM_HIGH_LIMIT) ||
         (!MiEnsureAvailablePageOrWait (Process, OldIrql))) {
 
         if (PageColor != 0xFFFFFFFF) {
 
             //
             // This page is for a user process and so must be zeroed.
+            // On a cache miss refill the cache in a batch and retry.
             //
 
-            PageFrameIndex = MiRemoveZeroPageIfAny (PageColor);
+            if (PageFrameIndex == 0) {
+                MiRefillPageCache (PageColor);
+                PageFrameIndex = MiRemoveCachedPage (PageColor, &NeedToZero);
+            }
+
+            if (PageFrameIndex != 0) {
+
+                //
+                // Drop the cache's reference now that the PFN lock is
+                // held so the page can be initialized like any other.
+                //
+
+                Pfn1 = MI_PFN_ELEMENT (PageFrameIndex);
+
+                ASSERT (Pfn1->u3.e2.ReferenceCount == 1);
+                ASSERT (Pfn1->u2.ShareCount == 0);
+
+                Pfn1->u3.e2.ReferenceCount = 0;
+            }
+            else {
+                PageFrameIndex = MiRemoveZeroPageIfAny (PageColor);
+            }
 
-            if (PageFrameIndex) {
+            if ((PageFrameIndex) && (NeedToZero == FALSE)) {
 
                 //
                 // This barrier check is needed after zeroing the page
@@ -1765,10 +2003,16 @@ Environment:
 
                 Pfn1 = MI_PFN_ELEMENT (PageFrameIndex);
                 BarrierStamp = (ULONG)Pfn1->u4.PteFrame;
+
+                MiDemandZeroListHits += 1;
             }
             else {
-                PageFrameIndex = MiRemoveAnyPage (PageColor);
+                if (PageFrameIndex == 0) {
+                    PageFrameIndex = MiRemoveAnyPage (PageColor);
+                }
                 NeedToZero = TRUE;
+
+                MiDemandZeroListMisses += 1;
             }
         }
         else {
@@ -1974,6 +2218,9 @@ Environment:
     WSLE_NUMBER WorkingSetIndex;
     ULONG PfnLockHeld;
     LOGICAL EnteredCritical;
+    LOGICAL Refault;
+
+    Refault = FALSE;
 
     //
     // ***********************************************************
@@ -2347,6 +2594,8 @@ Environment:
 
             MiUnlinkPageFromList (Pfn1);
 
+            Refault = TRUE;
+
             //
             // Update the PFN database - the reference count must be
             // incremented as the share count is going to go from zero to 1.
@@ -2476,6 +2725,16 @@ Environment:
 
         UNLOCK_PFN (OldIrql);
 
+        //
+        // The page came back from the standby or modified list, charge
+        // the refault to the process so trim effectiveness can be judged.
+        // The working set mutex is held.
+        //
+
+        if ((Refault == TRUE) && (CurrentProcess > HYDRA_PROCESS)) {
+            CurrentProcess->Vm.VmWorkingSetList->TrimRefaults += 1;
+        }
+
         WorkingSetIndex = MiAddValidPageToWorkingSet (FaultingAddress,
                                                       PointerPte,
                                                       Pfn1,
@@ -2653,6 +2912,19 @@ Environment:
     ClusterSize = MmClusterPageFileReads;
     ASSERT (ClusterSize <= MM_MAXIMUM_READ_CLUSTER_SIZE);
 
+    ReadBlockLocal->u1.e1.PageFileRead = 1;
+
+    //
+    // A page held in the compressed store is decompressed on its own.
+    // The paging file copy of such a slot is stale, so clusters read
+    // from the paging file must not include any of them either.
+    //
+
+    if (MiIsPageCompressed (TempPte) == TRUE) {
+        ReadBlockLocal->u1.e1.Compressed = 1;
+        ClusterSize = 1;
+    }
+
     if (MiInPageSinglePages != 0) {
         MiInPageSinglePages -= 1;
     }
@@ -2758,7 +3030,8 @@ Environment:
 
                 ComparePte.u.Soft.PageFileHigh += 1;
 
-                if (CheckPte->u.Long != ComparePte.u.Long) {
+                if ((CheckPte->u.Long != ComparePte.u.Long) ||
+                    (MiIsPageCompressed (ComparePte) == TRUE)) {
                     break;
                 }
 
@@ -2792,7 +3065,8 @@ Environment:
                 CheckPte -= 1;
                 ComparePte.u.Soft.PageFileHigh -= 1;
 
-                if (CheckPte->u.Long != ComparePte.u.Long) {
+                if ((CheckPte->u.Long != ComparePte.u.Long) ||
+                    (MiIsPageCompressed (ComparePte) == TRUE)) {
                     break;
                 }
 
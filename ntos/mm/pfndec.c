@@ -183,7 +183,9 @@ Environment:
 
                 Pfn1->u3.e1.PageLocation = ActiveAndValid;
 
-                MiInsertPageInFreeList (PageFrameIndex);
+                if (MiInsertPageInCache (PageFrameIndex) == FALSE) {
+                    MiInsertPageInFreeList (PageFrameIndex);
+                }
             }
             else {
                 MiDecrementReferenceCount (Pfn1, PageFrameIndex);
@@ -285,7 +287,9 @@ Environment:
             }
         }
 
-        MiInsertPageInFreeList (PageFrameIndex);
+        if (MiInsertPageInCache (PageFrameIndex) == FALSE) {
+            MiInsertPageInFreeList (PageFrameIndex);
+        }
 
         return;
     }
@@ -57,6 +57,18 @@ PFN_NUMBER MmTransitionSharedPages;
 
 ULONG MmStandbyRePurposed;
 
+//
+// Per-processor page caches for demand zero faults.  Pages are only moved
+// into the caches while this many pages above the minimum free target are
+// available, so they never hold pages a waiter needs.
+//
+
+MI_PAGE_CACHE MiPageCache[MAXIMUM_PROCESSORS];
+
+LONG MiPageCacheTotal;
+
+#define MI_PAGE_CACHE_REFILL_LIMIT (MM_HIGH_LIMIT + MI_PAGE_CACHE_SIZE)
+
 MM_LDW_WORK_CONTEXT MiLastChanceLdwContext;
     
 ULONG MiAvailablePagesEventLowSets;
@@ -133,6 +145,9 @@ Environment:
     MMLISTS ListName;
     PMMPFNLIST ListHead;
     PMMCOLOR_TABLES ColorHead;
+#if defined(MI_MULTINODE)
+    PMI_ZERO_PAGE_NODE ZeroNode;
+#endif
 
     MM_PFN_LOCK_ASSERT();
     ASSERT ((PageFrameIndex != 0) &&
@@ -334,6 +349,30 @@ Environment:
     ColorHead->Count += 1;
     Pfn1->OriginalPte.u.Long = MM_EMPTY_LIST;
 
+#if defined(MI_MULTINODE)
+
+    //
+    // Once each node has its own zeroing thread, only wake the thread
+    // that owns the node this page belongs to, and base the decision on
+    // that node's free count rather than the systemwide total.
+    //
+
+    if (MiZeroPageNodeThreads == TRUE) {
+
+        ZeroNode = &MiZeroPageNodes[Pfn1->u3.e1.PageColor];
+
+        if ((KeNodeBlock[Pfn1->u3.e1.PageColor]->FreeCount[FreePageList] >= MmMinimumFreePagesToZero) &&
+            (*ZeroNode->ThreadActive == FALSE)) {
+
+            *ZeroNode->ThreadActive = TRUE;
+            KeSetEvent (ZeroNode->ZeroingEvent, 0, FALSE);
+        }
+
+        return;
+    }
+
+#endif
+
     if ((ListHead->Total >= MmMinimumFreePagesToZero) &&
         (MmZeroingPageThreadActive == FALSE)) {
 
@@ -1922,6 +1961,20 @@ Environment:
         return FALSE;
     }
 
+    //
+    // Give back any pages held in the per-processor caches before
+    // considering a wait.
+    //
+
+    if (MiPageCacheTotal != 0) {
+
+        MiDrainPageCaches ();
+
+        if (MmAvailablePages >= MM_HIGH_LIMIT) {
+            return FALSE;
+        }
+    }
+
     //
     // If this thread has explicitly disabled APCs (FsRtlEnterFileSystem
     // does this), then it may be holding resources or mutexes that may in
@@ -2592,9 +2645,9 @@ Environment:
 }
 
 
-PFN_NUMBER
-FASTCALL
-MiRemovePageByColor (
+FORCEINLINE
+VOID
+MiUnlinkPageByColor (
     IN PFN_NUMBER Page,
     IN ULONG Color
     )
@@ -2603,23 +2656,19 @@ MiRemovePageByColor (
 
 Routine Description:
 
-    This procedure removes a page from the front of the free or
-    zeroed page list.
+    This routine unlinks a page from the front of the free or zeroed
+    page list and its color list.  The available page count is left to
+    the caller.
 
 Arguments:
 
     Page - Supplies the physical page number to unlink from the list.
 
     Color - Supplies the page color for which this page is destined.
-            This is used for checking virtual address alignments to
-            determine if the D cache needs flushing before the page
-            can be reused.
 
 Return Value:
 
-    The page frame number that was unlinked (always equal to the one
-    passed in, but returned so the caller's fastcall sequences save
-    extra register pushes and pops.
+    None.
 
 Environment:
 
@@ -2713,28 +2762,61 @@ Environment:
 
     ColorHead->Count -= 1;
 
-    //
-    // Note that we now have one less page available.
-    //
-
 #if defined(MI_MULTINODE)
     if (KeNumberNodes > 1) {
         KeNodeBlock[NodeColor]->FreeCount[ListName]--;
     }
 #endif
+}
+
+
+FORCEINLINE
+VOID
+MiDecrementAvailablePages (
+    IN PFN_NUMBER NumberOfPages
+    )
+
+/*++
+
+Routine Description:
+
+    This routine accounts for pages unlinked from the free or zeroed
+    lists, signalling the memory events for any threshold crossed.
+
+Arguments:
+
+    NumberOfPages - Supplies the number of pages unlinked.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Must be holding the PFN database lock.
+
+--*/
+
+{
+    MM_PFN_LOCK_ASSERT();
+
+    ASSERT (MmAvailablePages >= NumberOfPages);
 
     //
-    // Signal if allocating this page caused a threshold cross.
+    // Signal if allocating these pages caused a threshold cross.
     //
 
-    if (MmAvailablePages == MmHighMemoryThreshold) {
+    if ((MmAvailablePages >= MmHighMemoryThreshold) &&
+        (MmAvailablePages - NumberOfPages < MmHighMemoryThreshold)) {
         KeClearEvent (MiHighMemoryEvent);
     }
-    else if (MmAvailablePages == MmLowMemoryThreshold) {
+
+    if ((MmAvailablePages >= MmLowMemoryThreshold) &&
+        (MmAvailablePages - NumberOfPages < MmLowMemoryThreshold)) {
         KeSetEvent (MiLowMemoryEvent, 0, FALSE);
     }
 
-    MmAvailablePages -= 1;
+    MmAvailablePages -= NumberOfPages;
 
     if (MmAvailablePages < MmMinimumFreePages) {
 
@@ -2744,6 +2826,436 @@ Environment:
 
         MiObtainFreePages ();
     }
+}
+
+
+VOID
+MiRefillPageCache (
+    IN ULONG Color
+    )
+
+/*++
+
+Routine Description:
+
+    This routine refills the current processor's page cache with a batch
+    of zeroed pages.  Pages are taken one per color, starting at the
+    requested color and staying on its node, so the batch keeps the color
+    spread.  The whole batch is unlinked in this one hold of the PFN lock
+    and the available page count is adjusted once for it.
+
+Arguments:
+
+    Color - Supplies the color of the page that caused the refill.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Must be holding the PFN database lock.
+
+--*/
+
+{
+    PMI_PAGE_CACHE Cache;
+    PFN_NUMBER Page;
+    PMMPFN Pfn1;
+    ULONG NodeColor;
+    ULONG EmptyColors;
+    ULONG Count;
+
+    MM_PFN_LOCK_ASSERT();
+
+    //
+    // The batch is never larger than the cache so the available pages
+    // stay above the limit.
+    //
+
+    if (MmAvailablePages <= MmMinimumFreePages + MI_PAGE_CACHE_REFILL_LIMIT) {
+        return;
+    }
+
+    Cache = &MiPageCache[KeGetCurrentProcessorNumber ()];
+
+    NodeColor = Color & ~MmSecondaryColorMask;
+    EmptyColors = 0;
+    Count = 0;
+
+    KeAcquireSpinLockAtDpcLevel (&Cache->Lock);
+
+    while ((Cache->ZeroedCount < MI_PAGE_CACHE_BATCH) &&
+           (EmptyColors <= MmSecondaryColorMask)) {
+
+        ASSERT (Color < MmSecondaryColors);
+        Page = MmFreePagesByColor[ZeroedPageList][Color].Flink;
+
+        if (Page != MM_EMPTY_LIST) {
+
+            MiUnlinkPageByColor (Page, Color);
+
+            //
+            // Mark the page in use so scans of the PFN database skip it
+            // while it sits in the cache.
+            //
+
+            Pfn1 = MI_PFN_ELEMENT (Page);
+
+            ASSERT (Pfn1->u3.e2.ReferenceCount == 0);
+            ASSERT (Pfn1->u2.ShareCount == 0);
+
+            Pfn1->u3.e2.ReferenceCount = 1;
+            Pfn1->u3.e1.PageLocation = ActiveAndValid;
+
+            Cache->ZeroedPages[Cache->ZeroedCount] = Page;
+            Cache->ZeroedCount += 1;
+            Count += 1;
+            EmptyColors = 0;
+        }
+        else {
+            EmptyColors += 1;
+        }
+
+        Color = ((Color + 1) & MmSecondaryColorMask) | NodeColor;
+    }
+
+    if (Count != 0) {
+        Cache->Refills += 1;
+    }
+
+    KeReleaseSpinLockFromDpcLevel (&Cache->Lock);
+
+    if (Count != 0) {
+        InterlockedExchangeAdd (&MiPageCacheTotal, (LONG) Count);
+        MiDecrementAvailablePages (Count);
+    }
+}
+
+
+PFN_NUMBER
+FASTCALL
+MiRemoveCachedPage (
+    IN ULONG Color,
+    OUT PLOGICAL NeedToZero
+    )
+
+/*++
+
+Routine Description:
+
+    This procedure removes a page from the current processor's page
+    cache.  A zeroed page is preferred over a freed one and a page of the
+    requested color over any other.  Only the cache lock is taken, so a
+    cache hit does not touch the PFN lock.
+
+Arguments:
+
+    Color - Supplies the page color for which this page is destined.
+
+    NeedToZero - Receives TRUE if the page was freed into the cache and
+                 must be zeroed by the caller, FALSE if it is zeroed.
+
+Return Value:
+
+    The physical page number removed from the cache, or 0 if the cache is
+    empty.  The page still carries the cache's reference, the caller must
+    drop it with the PFN lock held before initializing the PFN.
+
+Environment:
+
+    Kernel mode, IRQL <= DISPATCH_LEVEL, PFN lock held or not held.
+
+--*/
+
+{
+    KIRQL OldIrql;
+    PMI_PAGE_CACHE Cache;
+    PFN_NUMBER Page;
+    PPFN_NUMBER Pages;
+    PULONG Count;
+    ULONG Index;
+    ULONG i;
+
+    KeRaiseIrql (DISPATCH_LEVEL, &OldIrql);
+
+    Cache = &MiPageCache[KeGetCurrentProcessorNumber ()];
+
+    KeAcquireSpinLockAtDpcLevel (&Cache->Lock);
+
+    if (Cache->ZeroedCount != 0) {
+        Pages = Cache->ZeroedPages;
+        Count = &Cache->ZeroedCount;
+        *NeedToZero = FALSE;
+    }
+    else if (Cache->FreedCount != 0) {
+        Pages = Cache->FreedPages;
+        Count = &Cache->FreedCount;
+        *NeedToZero = TRUE;
+    }
+    else {
+        Cache->Misses += 1;
+        KeReleaseSpinLockFromDpcLevel (&Cache->Lock);
+        KeLowerIrql (OldIrql);
+        return 0;
+    }
+
+    Index = *Count - 1;
+
+    for (i = 0; i < *Count; i += 1) {
+        if (MI_GET_SECONDARY_COLOR (Pages[i], MI_PFN_ELEMENT (Pages[i])) ==
+            (Color & MmSecondaryColorMask)) {
+            Index = i;
+            break;
+        }
+    }
+
+    Page = Pages[Index];
+
+    *Count -= 1;
+    Pages[Index] = Pages[*Count];
+    Cache->Hits += 1;
+
+    KeReleaseSpinLockFromDpcLevel (&Cache->Lock);
+    KeLowerIrql (OldIrql);
+
+    InterlockedDecrement (&MiPageCacheTotal);
+
+    ASSERT (MI_PFN_ELEMENT (Page)->u4.PteFrame != MI_MAGIC_AWE_PTEFRAME);
+
+    return Page;
+}
+
+
+LOGICAL
+FASTCALL
+MiInsertPageInCache (
+    IN PFN_NUMBER PageFrameIndex
+    )
+
+/*++
+
+Routine Description:
+
+    This routine places a page that is being freed in the current
+    processor's page cache instead of on the free list, so a demand zero
+    fault on this processor can zero and reuse it without going through
+    the free lists.  Pages are only cached while plenty are available.
+
+Arguments:
+
+    PageFrameIndex - Supplies the physical page number being freed.
+
+Return Value:
+
+    TRUE if the page was cached, FALSE if the caller must insert it in
+    the free list.
+
+Environment:
+
+    Must be holding the PFN database lock.  The reference and share
+    counts of the page are zero.
+
+--*/
+
+{
+    PMMPFN Pfn1;
+    PMI_PAGE_CACHE Cache;
+    MI_PFN_CACHE_ATTRIBUTE CacheAttribute;
+    ULONG NodeColor;
+
+    MM_PFN_LOCK_ASSERT();
+
+    Pfn1 = MI_PFN_ELEMENT (PageFrameIndex);
+
+    ASSERT (Pfn1->u3.e2.ReferenceCount == 0);
+    ASSERT (Pfn1->u2.ShareCount == 0);
+
+    if ((Pfn1->u3.e1.RemovalRequested == 1) ||
+        (Pfn1->u3.e1.CacheAttribute != MiCached) ||
+        (MmAvailablePages <= MmMinimumFreePages + MI_PAGE_CACHE_REFILL_LIMIT)) {
+        return FALSE;
+    }
+
+    Cache = &MiPageCache[KeGetCurrentProcessorNumber ()];
+
+    KeAcquireSpinLockAtDpcLevel (&Cache->Lock);
+
+    if (Cache->FreedCount == MI_PAGE_CACHE_SIZE) {
+        KeReleaseSpinLockFromDpcLevel (&Cache->Lock);
+        return FALSE;
+    }
+
+    //
+    // Leave the page as it would be coming off the free list, but marked
+    // in use so scans of the PFN database skip it.
+    //
+
+    MI_RESET_PFN_PRIORITY (Pfn1);
+
+    NodeColor = Pfn1->u3.e1.PageColor;
+    CacheAttribute = Pfn1->u3.e1.CacheAttribute;
+
+    Pfn1->u3.e2.ShortFlags = 0;
+    Pfn1->u3.e1.PageColor = (USHORT) NodeColor;
+    Pfn1->u3.e1.CacheAttribute = CacheAttribute;
+    Pfn1->u3.e1.PageLocation = ActiveAndValid;
+    Pfn1->u3.e2.ReferenceCount = 1;
+
+    Pfn1->u1.Flink = 0;
+    Pfn1->u2.Blink = 0;
+    Pfn1->u4.InPageError = 0;
+    Pfn1->u4.AweAllocation = 0;
+
+    Cache->FreedPages[Cache->FreedCount] = PageFrameIndex;
+    Cache->FreedCount += 1;
+
+    KeReleaseSpinLockFromDpcLevel (&Cache->Lock);
+
+    InterlockedIncrement (&MiPageCacheTotal);
+
+    return TRUE;
+}
+
+
+VOID
+MiDrainPageCaches (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the pages held in all the per-processor page
+    caches to the zeroed and free lists.  It is called when available
+    pages run low so cached pages are never withheld from a waiter, and
+    before the PFN database is searched for free physical ranges so
+    cached pages do not break up a run.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Must be holding the PFN database lock.
+
+--*/
+
+{
+    PMI_PAGE_CACHE Cache;
+    PMI_PAGE_CACHE LastCache;
+    PFN_NUMBER Page;
+    PMMPFN Pfn1;
+    LONG Drained;
+
+    MM_PFN_LOCK_ASSERT();
+
+    Cache = &MiPageCache[0];
+    LastCache = &MiPageCache[KeNumberProcessors];
+
+    while (Cache < LastCache) {
+
+        Drained = 0;
+
+        KeAcquireSpinLockAtDpcLevel (&Cache->Lock);
+
+        if ((Cache->ZeroedCount != 0) || (Cache->FreedCount != 0)) {
+            Cache->Drains += 1;
+        }
+
+        while (Cache->ZeroedCount != 0) {
+
+            Cache->ZeroedCount -= 1;
+            Page = Cache->ZeroedPages[Cache->ZeroedCount];
+
+            Pfn1 = MI_PFN_ELEMENT (Page);
+
+            ASSERT (Pfn1->u3.e2.ReferenceCount == 1);
+
+            Pfn1->u3.e2.ReferenceCount = 0;
+            Pfn1->u3.e1.PageLocation = ZeroedPageList;
+
+            MiInsertPageInList (&MmZeroedPageListHead, Page);
+
+            Drained += 1;
+        }
+
+        while (Cache->FreedCount != 0) {
+
+            Cache->FreedCount -= 1;
+            Page = Cache->FreedPages[Cache->FreedCount];
+
+            Pfn1 = MI_PFN_ELEMENT (Page);
+
+            ASSERT (Pfn1->u3.e2.ReferenceCount == 1);
+
+            Pfn1->u3.e2.ReferenceCount = 0;
+
+            MiInsertPageInFreeList (Page);
+
+            Drained += 1;
+        }
+
+        KeReleaseSpinLockFromDpcLevel (&Cache->Lock);
+
+        if (Drained != 0) {
+            InterlockedExchangeAdd (&MiPageCacheTotal, -Drained);
+        }
+
+        Cache += 1;
+    }
+}
+
+
+PFN_NUMBER
+FASTCALL
+MiRemovePageByColor (
+    IN PFN_NUMBER Page,
+    IN ULONG Color
+    )
+
+/*++
+
+Routine Description:
+
+    This procedure removes a page from the front of the free or
+    zeroed page list.
+
+Arguments:
+
+    Page - Supplies the physical page number to unlink from the list.
+
+    Color - Supplies the page color for which this page is destined.
+            This is used for checking virtual address alignments to
+            determine if the D cache needs flushing before the page
+            can be reused.
+
+Return Value:
+
+    The page frame number that was unlinked (always equal to the one
+    passed in, but returned so the caller's fastcall sequences save
+    extra register pushes and pops.
+
+Environment:
+
+    Must be holding the PFN database lock.
+
+--*/
+
+{
+    MiUnlinkPageByColor (Page, Color);
+
+    //
+    // Note that we now have one less page available.
+    //
+
+    MiDecrementAvailablePages (1);
 
     return Page;
 }
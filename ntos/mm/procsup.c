@@ -116,10 +116,20 @@ MiDeleteAddressesInWorkingSet (
     IN PEPROCESS Process
     );
 
+//
+// Number of working set entries torn down per PFN lock acquisition (and
+// process TB flush) during address space deletion.  The list is allocated
+// from pool - if that fails, a stack list of MM_MAXIMUM_FLUSH_COUNT entries
+// is used instead.
+//
+
+#define MI_TEARDOWN_DELETE_COUNT 256
+
 typedef struct _MMPTE_DELETE_LIST {
     ULONG Count;
-    PMMPTE PointerPte[MM_MAXIMUM_FLUSH_COUNT];
-    MMPTE PteContents[MM_MAXIMUM_FLUSH_COUNT];
+    ULONG MaximumCount;
+    PMMPTE *PointerPte;
+    PMMPTE PteContents;
 } MMPTE_DELETE_LIST, *PMMPTE_DELETE_LIST;
 
 VOID
@@ -2588,6 +2598,8 @@ Environment:
 
 {
     PMMVAD Vad;
+    PMMVAD PreviousVad;
+    PMMVAD NextVad;
     PMMPTE LastPte;
     PMMPTE PointerPte;
     PETHREAD Thread;
@@ -2690,6 +2702,13 @@ Environment:
     // requires that we keep the working set structure consistent until we
     // finally take it all down.
     //
+    // Transparent large pages are deleted first so the page table pages
+    // they retained are torn down through the normal paths.
+    //
+
+    MI_DELETE_LARGE_PAGES (&Process->Vm,
+                           MM_LOWEST_USER_ADDRESS,
+                           MM_HIGHEST_USER_ADDRESS);
 
     MiDeleteAddressesInWorkingSet (Process);
 
@@ -2718,6 +2737,20 @@ Environment:
     MmWorkingSetList->HashTableSize = 0;
     MmWorkingSetList->HashTable = NULL;
 
+    MiDeleteWsleReverseIndex (MmWorkingSetList, Process);
+
+    //
+    // Every user page has now left the working set, so the resident
+    // available charged for the working set minimum can be returned now
+    // instead of after the (potentially very long) VAD teardown below.
+    // Only page table pages can be faulted back into the working set from
+    // here on and those do not need the guarantee.
+    //
+
+    MI_INCREMENT_RESIDENT_AVAILABLE (
+        Process->Vm.MinimumWorkingSetSize - MM_PROCESS_CREATE_CHARGE,
+        MM_RESAVAIL_FREE_CLEAN_PROCESS2);
+
     UNLOCK_WS_UNSAFE (Thread, Process)
 
     //
@@ -2733,6 +2766,9 @@ Environment:
 
         LOCK_WS_UNSAFE (Thread, Process)
 
+        PreviousVad = MiGetPreviousVad (Vad);
+        NextVad = MiGetNextVad (Vad);
+
         MiRemoveVad (Vad, Process);
 
         //
@@ -2828,6 +2864,26 @@ Environment:
             UNLOCK_WS_UNSAFE (Thread, Process)
         }
 
+        //
+        // Return the commitment for the page table pages this VAD no longer
+        // shares with any remaining VAD now rather than holding all of it
+        // until the entire address space is gone.  Whatever is left is
+        // returned in bulk below.
+        //
+
+        if ((Vad->u.VadFlags.CommitCharge != MM_MAX_COMMIT)
+#if (_MI_PAGING_LEVELS >= 3)
+            && (MmWorkingSetList->CommittedPageTables != NULL)
+#endif
+           ) {
+
+            MiReturnPageTablePageCommitment (MI_VPN_TO_VA (Vad->StartingVpn),
+                                             MI_VPN_TO_VA_ENDING (Vad->EndingVpn),
+                                             Process,
+                                             PreviousVad,
+                                             NextVad);
+        }
+
         ExFreePool (Vad);
     }
 
@@ -3078,6 +3134,8 @@ Environment:
     MmWorkingSetList->HashTableSize = 0;
     MmWorkingSetList->HashTable = NULL;
 
+    MiDeleteWsleReverseIndex (MmWorkingSetList, Process);
+
     //
     // Remove all the working set list pages except for the first one.
     //
@@ -3090,14 +3148,6 @@ Environment:
 
     MiRemoveWorkingSetPages (&Process->Vm);
 
-    //
-    // Update the count of available resident pages.
-    //
-
-    MI_INCREMENT_RESIDENT_AVAILABLE (
-        Process->Vm.MinimumWorkingSetSize - MM_PROCESS_CREATE_CHARGE,
-        MM_RESAVAIL_FREE_CLEAN_PROCESS2);
-
     UNLOCK_WS_AND_ADDRESS_SPACE (Thread, Process);
 
     if (Process->JobStatus & PS_JOB_STATUS_REPORT_COMMIT_CHANGES) {
@@ -6387,7 +6437,10 @@ Environment:
     WSLE_NUMBER Entry;
     PVOID Va;
     PMMPTE PointerPte;
+    PVOID DeleteBuffer;
     MMPTE_DELETE_LIST PteDeleteList;
+    PMMPTE StackPointerPte[MM_MAXIMUM_FLUSH_COUNT];
+    MMPTE StackPteContents[MM_MAXIMUM_FLUSH_COUNT];
 #if DBG
     PMMPFN Pfn1;
     PVOID SwapVa;
@@ -6403,6 +6456,28 @@ Environment:
     Wsle = &MmWsle[index];
     PteDeleteList.Count = 0;
 
+    //
+    // Gather the PTEs into large batches so that each PFN lock acquisition
+    // and process TB flush covers many pages rather than just the handful
+    // that a single TB flush list can describe.
+    //
+
+    DeleteBuffer = ExAllocatePoolWithTag (NonPagedPool,
+                                          MI_TEARDOWN_DELETE_COUNT *
+                                            (sizeof (PMMPTE) + sizeof (MMPTE)),
+                                          'lDmM');
+
+    if (DeleteBuffer != NULL) {
+        PteDeleteList.MaximumCount = MI_TEARDOWN_DELETE_COUNT;
+        PteDeleteList.PteContents = (PMMPTE) DeleteBuffer;
+        PteDeleteList.PointerPte = (PMMPTE *) (PteDeleteList.PteContents + MI_TEARDOWN_DELETE_COUNT);
+    }
+    else {
+        PteDeleteList.MaximumCount = MM_MAXIMUM_FLUSH_COUNT;
+        PteDeleteList.PteContents = StackPteContents;
+        PteDeleteList.PointerPte = StackPointerPte;
+    }
+
     MmWorkingSetList->HashTable = NULL;
 
     //
@@ -6501,7 +6576,7 @@ Environment:
         PteDeleteList.PteContents[PteDeleteList.Count] = *PointerPte;
         PteDeleteList.Count += 1;
 
-        if (PteDeleteList.Count == MM_MAXIMUM_FLUSH_COUNT) {
+        if (PteDeleteList.Count == PteDeleteList.MaximumCount) {
             MiDeletePteList (&PteDeleteList, Process);
             PteDeleteList.Count = 0;
         }
@@ -6511,6 +6586,10 @@ Environment:
         MiDeletePteList (&PteDeleteList, Process);
     }
 
+    if (DeleteBuffer != NULL) {
+        ExFreePool (DeleteBuffer);
+    }
+
 #if DBG
     Wsle = &MmWsle[2];
     LastWsle = &MmWsle[MmWorkingSetList->LastInitializedWsle];
@@ -6661,12 +6740,17 @@ Environment:
                 // the last call and still retain a pristine PteDeleteList
                 // for debugging purposes.
                 //
+                // The delete list can be larger than the flush list - once
+                // the flush list is full it is left at its maximum count,
+                // which causes the entire process TB to be flushed.
+                //
 
                 while (j <= i) {
-                    ASSERT (PteFlushList.Count < MM_MAXIMUM_FLUSH_COUNT);
-                    PteFlushList.FlushVa[PteFlushList.Count] = MiGetVirtualAddressMappedByPte (PteDeleteList->PointerPte[j]);
+                    if (PteFlushList.Count < MM_MAXIMUM_FLUSH_COUNT) {
+                        PteFlushList.FlushVa[PteFlushList.Count] = MiGetVirtualAddressMappedByPte (PteDeleteList->PointerPte[j]);
+                        PteFlushList.Count += 1;
+                    }
                     j += 1;
-                    PteFlushList.Count += 1;
                 }
 
                 MiDecrementCloneBlockReference (CloneDescriptor,
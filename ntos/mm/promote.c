@@ -0,0 +1,1159 @@
+/*++
+
+Copyright (c) Microsoft Corporation. All rights reserved.
+
+You may only use this code if you agree to the terms of the Windows Research Kernel Source Code License agreement (see License.txt).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    promote.c
+
+Abstract:
+
+    This module contains the routines which transparently promote ranges
+    of private user memory to large pages and demote them again.
+
+    The working set manager calls MiPromoteLargePages when it ages a
+    process working set.  Each 2MB aligned range of private memory whose
+    PTEs are all valid, unshared, unlocked and identically protected is
+    copied into a physically contiguous run and mapped with a large PDE.
+
+    The page table page for the range is retained and filled with
+    transition PTEs that refer to the frames of the large page.  Any
+    operation that needs to see individual PTEs demotes the range first,
+    which points the PDE back at the page table page and makes those PTEs
+    valid again so the frames stay resident as ordinary private pages.
+    Trimming instead releases the frames onto the modified list, and
+    releasing or tearing down the range frees them directly.
+
+    Promotion is disabled by default (see MmTransparentLargePages).
+
+--*/
+
+#include "mi.h"
+
+#if defined (_AMD64_)
+
+#define MI_LARGE_PAGE_PTES  (MM_VA_MAPPED_BY_PDE >> PAGE_SHIFT)
+
+//
+// Promotion is only attempted while this many pages are available so
+// gathering contiguous runs never competes with the trimmer.
+//
+
+#define MI_PROMOTION_MINIMUM_AVAILABLE  (MM_HIGH_LIMIT + 16 * MI_LARGE_PAGE_PTES)
+
+//
+// Disabled until the copy and demotion costs have been measured against
+// the TB savings on real workloads.
+//
+
+ULONG MmTransparentLargePages = 0;
+
+ULONG MiLargePagePromotionsPerPass = 4;
+
+ULONG MiLargePagePromotions;
+ULONG MiLargePageDemotions;
+ULONG MiLargePagePromotionFailures;
+
+LOGICAL
+MiIsPromotionCandidate (
+    IN PMMWSL WorkingSetList,
+    IN PVOID VirtualAddress,
+    OUT PULONG Protection
+    );
+
+PVOID
+MiFindPromotionCandidate (
+    IN PEPROCESS Process,
+    IN PVOID StartingAddress,
+    OUT PULONG Protection
+    );
+
+LOGICAL
+MiPromoteLargePde (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID VirtualAddress,
+    IN PFN_NUMBER PageFrameIndex,
+    IN PMMPTE CapturedPtes
+    );
+
+VOID
+MiDemoteLargePdesInRange (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID StartingAddress,
+    IN PVOID EndingAddress,
+    IN ULONG Disposition
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE,MiPromoteLargePages)
+#pragma alloc_text(PAGE,MiFindPromotionCandidate)
+#pragma alloc_text(PAGE,MiDemoteLargePages)
+#pragma alloc_text(PAGE,MiDeleteLargePages)
+#pragma alloc_text(PAGE,MiDemoteLargePdesInRange)
+#endif
+
+
+LOGICAL
+MiIsPromotionCandidate (
+    IN PMMWSL WorkingSetList,
+    IN PVOID VirtualAddress,
+    OUT PULONG Protection
+    )
+
+/*++
+
+Routine Description:
+
+    This routine checks whether the 2MB aligned range at the specified
+    address can be promoted to a large page.  Every PTE in the range must
+    be valid and map an unshared, unlocked, cached private page that is
+    in the dynamic portion of the working set, and every page must have
+    the same (read/write) protection.
+
+    The caller rechecks the reference counts under the PFN lock before
+    committing to the promotion.
+
+Arguments:
+
+    WorkingSetList - Supplies the working set list of the current process.
+
+    VirtualAddress - Supplies the 2MB aligned base of the range.
+
+    Protection - Receives the protection of the pages in the range.
+
+Return Value:
+
+    TRUE if the range can be promoted, FALSE if not.
+
+Environment:
+
+    Kernel mode, APCs disabled, address creation mutex and working set
+    pushlock held.
+
+--*/
+
+{
+    ULONG i;
+    ULONG PageProtection;
+    MMPTE PteContents;
+    PMMPTE PointerPte;
+    PMMPTE PointerPde;
+    PMMPFN Pfn1;
+    WSLE_NUMBER WsIndex;
+
+    ASSERT (((ULONG_PTR) VirtualAddress & (MM_VA_MAPPED_BY_PDE - 1)) == 0);
+
+    PointerPde = MiGetPdeAddress (VirtualAddress);
+
+    if ((MiGetPxeAddress (VirtualAddress)->u.Hard.Valid == 0) ||
+        (MiGetPpeAddress (VirtualAddress)->u.Hard.Valid == 0) ||
+        (PointerPde->u.Hard.Valid == 0) ||
+        (MI_PDE_MAPS_LARGE_PAGE (PointerPde))) {
+
+        return FALSE;
+    }
+
+    PointerPte = MiGetPteAddress (VirtualAddress);
+
+    PageProtection = MM_ZERO_ACCESS;
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1, PointerPte += 1) {
+
+        PteContents = *PointerPte;
+
+        if ((PteContents.u.Hard.Valid == 0) ||
+            (PteContents.u.Hard.CopyOnWrite == 1)) {
+            return FALSE;
+        }
+
+        Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (&PteContents));
+
+        if ((Pfn1->u3.e1.PrototypePte == 1) ||
+            (Pfn1->u3.e2.ReferenceCount != 1) ||
+            (Pfn1->u2.ShareCount != 1) ||
+            (Pfn1->u3.e1.CacheAttribute != MiCached)) {
+            return FALSE;
+        }
+
+        if (i == 0) {
+            PageProtection = (ULONG) Pfn1->OriginalPte.u.Soft.Protection;
+
+            if ((PageProtection != MM_READWRITE) &&
+                (PageProtection != MM_EXECUTE_READWRITE)) {
+                return FALSE;
+            }
+        }
+        else if (Pfn1->OriginalPte.u.Soft.Protection != PageProtection) {
+            return FALSE;
+        }
+
+        //
+        // Locked entries live below FirstDynamic.
+        //
+
+        WsIndex = Pfn1->u1.WsIndex;
+
+        if ((WsIndex < WorkingSetList->FirstDynamic) ||
+            (WsIndex > WorkingSetList->LastEntry)) {
+            return FALSE;
+        }
+    }
+
+    *Protection = PageProtection;
+
+    return TRUE;
+}
+
+
+PVOID
+MiFindPromotionCandidate (
+    IN PEPROCESS Process,
+    IN PVOID StartingAddress,
+    OUT PULONG Protection
+    )
+
+/*++
+
+Routine Description:
+
+    This routine walks the private VADs of the current process looking
+    for the next 2MB range at or above the specified address which can be
+    promoted to a large page.
+
+Arguments:
+
+    Process - Supplies the current process.
+
+    StartingAddress - Supplies the 2MB aligned address to start at.
+
+    Protection - Receives the protection of the pages in the range.
+
+Return Value:
+
+    The base of the range to promote, NULL if there is none.
+
+Environment:
+
+    Kernel mode, APCs disabled, address creation mutex and working set
+    pushlock held.
+
+--*/
+
+{
+    PMMVAD Vad;
+    PCHAR Va;
+    PCHAR VadEnd;
+
+    PAGED_CODE ();
+
+    for (Vad = MiGetFirstVad (Process); Vad != NULL; Vad = MiGetNextVad (Vad)) {
+
+        if ((Vad->u.VadFlags.PrivateMemory == 0) ||
+            (Vad->u.VadFlags.VadType != VadNone) ||
+            (Vad->u.VadFlags.NoChange == 1)) {
+
+            continue;
+        }
+
+        VadEnd = (PCHAR) MI_VPN_TO_VA_ENDING (Vad->EndingVpn);
+
+        if (VadEnd < (PCHAR) StartingAddress) {
+            continue;
+        }
+
+        Va = (PCHAR) MI_ROUND_TO_SIZE ((ULONG_PTR) MI_VPN_TO_VA (Vad->StartingVpn),
+                                       MM_VA_MAPPED_BY_PDE);
+
+        if (Va < (PCHAR) StartingAddress) {
+            Va = (PCHAR) StartingAddress;
+        }
+
+        while ((Va + MM_VA_MAPPED_BY_PDE - 1 <= VadEnd) &&
+               (Va + MM_VA_MAPPED_BY_PDE - 1 > Va)) {
+
+            if (MiIsPromotionCandidate (MmWorkingSetList, Va, Protection)) {
+                return Va;
+            }
+
+            Va += MM_VA_MAPPED_BY_PDE;
+        }
+    }
+
+    return NULL;
+}
+
+
+LOGICAL
+MiPromoteLargePde (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID VirtualAddress,
+    IN PFN_NUMBER PageFrameIndex,
+    IN PMMPTE CapturedPtes
+    )
+
+/*++
+
+Routine Description:
+
+    This routine promotes the specified 2MB range of the current process to
+    the large page run starting at the specified frame.
+
+    The PTEs are cleaned and the contents copied with the working set
+    pushlock released so the process keeps running meanwhile.  The
+    pushlock is then reacquired and each PTE is made transition - if any
+    of them was trimmed, repointed or written since it was cleaned the
+    range is restored and left alone.  Otherwise the small pages are
+    freed, the page table page is refilled with transition PTEs for the
+    large page frames and the PDE is rewritten to map the large page.
+
+Arguments:
+
+    WsInfo - Supplies the working set of the current process.
+
+    VirtualAddress - Supplies the 2MB aligned base of the range.
+
+    PageFrameIndex - Supplies the first frame of a run obtained from
+                     MiFindLargePageMemory.
+
+    CapturedPtes - Supplies nonpaged scratch space for MI_LARGE_PAGE_PTES
+                   PTEs.
+
+Return Value:
+
+    TRUE if the range was promoted, FALSE if it is no longer a candidate
+    in which case the caller still owns the run.
+
+Environment:
+
+    Kernel mode, APCs disabled, address creation mutex and working set
+    pushlock held.  The working set pushlock is released and reacquired.
+
+--*/
+
+{
+    ULONG i;
+    ULONG j;
+    ULONG Protection;
+    ULONG NewProtection;
+    KIRQL OldIrql;
+    PVOID CopyFrom;
+    PVOID CopyTo;
+    PCHAR Va;
+    MMPTE TempPte;
+    MMPTE TempPde;
+    MMPTE PreviousPte;
+    PMMPTE PointerPte;
+    PMMPTE PointerPde;
+    PMMPTE MappingPte;
+    PMMPFN Pfn1;
+    PMMPFN Pfn2;
+    PETHREAD Thread;
+    PEPROCESS Process;
+    PFN_NUMBER OldPageFrameIndex;
+    PFN_NUMBER PageTableFrameIndex;
+
+    if (MiIsPromotionCandidate (WsInfo->VmWorkingSetList,
+                                VirtualAddress,
+                                &Protection) == FALSE) {
+        return FALSE;
+    }
+
+    Thread = PsGetCurrentThread ();
+    Process = CONTAINING_RECORD (WsInfo, EPROCESS, Vm);
+
+    PointerPde = MiGetPdeAddress (VirtualAddress);
+    PointerPte = MiGetPteAddress (VirtualAddress);
+    PageTableFrameIndex = MI_GET_PAGE_FRAME_FROM_PTE (PointerPde);
+
+    MappingPte = MiReserveSystemPtes ((ULONG) MI_LARGE_PAGE_PTES,
+                                      SystemPteSpace);
+
+    if (MappingPte == NULL) {
+        return FALSE;
+    }
+
+    //
+    // Clean the PTEs so any write made while the contents are copied can
+    // be detected below.  The reference counts can only be raised through
+    // a valid PTE with the PFN lock held so recheck them before any PTE
+    // is touched.
+    //
+
+    LOCK_PFN (OldIrql);
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+        Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (PointerPte + i));
+
+        if ((Pfn1->u3.e2.ReferenceCount != 1) ||
+            (Pfn1->u2.ShareCount != 1)) {
+
+            UNLOCK_PFN (OldIrql);
+            MiReleaseSystemPtes (MappingPte,
+                                 (ULONG) MI_LARGE_PAGE_PTES,
+                                 SystemPteSpace);
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+        TempPte = PointerPte[i];
+        Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (&TempPte));
+
+        MI_CAPTURE_DIRTY_BIT_TO_PFN (&TempPte, Pfn1);
+
+        MI_SET_ACCESSED_IN_PTE (&TempPte, 0);
+        MI_SET_PTE_CLEAN (TempPte);
+
+        MI_WRITE_VALID_PTE_NEW_PROTECTION (PointerPte + i, TempPte);
+
+        CapturedPtes[i] = TempPte;
+    }
+
+    MI_FLUSH_PROCESS_TB (FALSE);
+
+    UNLOCK_PFN (OldIrql);
+
+    //
+    // Copy the contents into the large page run without the working set
+    // pushlock.  The address creation mutex keeps the VAD and its
+    // protection stable, anything else is caught by the revalidation.
+    //
+
+    UNLOCK_WS (Thread, Process);
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+        MI_MAKE_VALID_KERNEL_PTE (TempPte,
+                                  PageFrameIndex + i,
+                                  MM_READWRITE,
+                                  MappingPte + i);
+
+        MI_SET_PTE_DIRTY (TempPte);
+
+        MI_WRITE_VALID_PTE (MappingPte + i, TempPte);
+
+        CopyTo = MiGetVirtualAddressMappedByPte (MappingPte + i);
+
+        OldPageFrameIndex = MI_GET_PAGE_FRAME_FROM_PTE (&CapturedPtes[i]);
+
+        CopyFrom = MiMapPageInHyperSpace (Process, OldPageFrameIndex, &OldIrql);
+
+        KeCopyPage (CopyTo, CopyFrom);
+
+        MiUnmapPageInHyperSpace (Process, CopyFrom, OldIrql);
+    }
+
+    MiReleaseSystemPtes (MappingPte, (ULONG) MI_LARGE_PAGE_PTES, SystemPteSpace);
+
+    LOCK_WS (Thread, Process);
+
+    if ((MiIsPromotionCandidate (WsInfo->VmWorkingSetList,
+                                 VirtualAddress,
+                                 &NewProtection) == FALSE) ||
+        (NewProtection != Protection)) {
+
+        return FALSE;
+    }
+
+    LOCK_PFN (OldIrql);
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+        Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (PointerPte + i));
+
+        if ((Pfn1->u3.e2.ReferenceCount != 1) ||
+            (Pfn1->u2.ShareCount != 1)) {
+
+            UNLOCK_PFN (OldIrql);
+            return FALSE;
+        }
+    }
+
+    //
+    // Make the small pages transition.  The exchange captures any dirty
+    // bit set since the PTE was cleaned - a PTE which no longer matches
+    // (apart from the accessed bit) means the copy is stale so every PTE
+    // changed so far is restored.
+    //
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+        TempPte = CapturedPtes[i];
+        MI_MAKE_VALID_PTE_TRANSITION (TempPte, Protection);
+
+        PreviousPte.u.Long = InterlockedExchangePte (PointerPte + i,
+                                                     TempPte.u.Long);
+
+        TempPte = PreviousPte;
+        MI_SET_ACCESSED_IN_PTE (&TempPte, 0);
+
+        if (TempPte.u.Long != CapturedPtes[i].u.Long) {
+
+            MI_WRITE_VALID_PTE (PointerPte + i, PreviousPte);
+
+            for (j = 0; j < i; j += 1) {
+                MI_WRITE_VALID_PTE (PointerPte + j, CapturedPtes[j]);
+            }
+
+            UNLOCK_PFN (OldIrql);
+
+            return FALSE;
+        }
+    }
+
+    MI_FLUSH_PROCESS_TB (FALSE);
+
+    Va = (PCHAR) VirtualAddress;
+
+    for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1, Va += PAGE_SIZE) {
+
+        //
+        // Remove the small page from the working set and free it.  The
+        // page table page keeps its share count as the PTE is refilled
+        // below.
+        //
+
+        OldPageFrameIndex = MI_GET_PAGE_FRAME_FROM_TRANSITION_PTE (PointerPte + i);
+        Pfn1 = MI_PFN_ELEMENT (OldPageFrameIndex);
+
+        MiTerminateWsle (Va, WsInfo, Pfn1->u1.WsIndex);
+
+        MI_SET_PFN_DELETED (Pfn1);
+
+        MiDecrementShareCount (Pfn1, OldPageFrameIndex);
+
+        //
+        // Turn the large page frame into an ordinary private page whose
+        // PTE is the transition PTE left behind in the page table page.
+        //
+
+        Pfn2 = MI_PFN_ELEMENT (PageFrameIndex + i);
+
+        ASSERT (Pfn2->u4.AweAllocation == 1);
+        ASSERT (Pfn2->u3.e2.ReferenceCount == 1);
+
+        Pfn2->PteAddress = PointerPte + i;
+        Pfn2->OriginalPte.u.Long = 0;
+        Pfn2->OriginalPte.u.Soft.Protection = Protection;
+        Pfn2->u4.PteFrame = PageTableFrameIndex;
+        Pfn2->u4.AweAllocation = 0;
+        Pfn2->u3.e1.StartOfAllocation = 0;
+        Pfn2->u3.e1.EndOfAllocation = 0;
+        MI_ZERO_WSINDEX (Pfn2);
+        MI_SET_MODIFIED (Pfn2, 1, 0x2A);
+
+        MI_MAKE_VALID_PTE (TempPte,
+                           PageFrameIndex + i,
+                           Protection,
+                           PointerPte + i);
+
+        MI_SET_PTE_DIRTY (TempPte);
+        MI_MAKE_VALID_PTE_TRANSITION (TempPte, Protection);
+        MI_WRITE_INVALID_PTE (PointerPte + i, TempPte);
+    }
+
+    //
+    // The first large page frame stands in for the page table page in
+    // the working set while the range is promoted.
+    //
+
+    Pfn1 = MI_PFN_ELEMENT (PageTableFrameIndex);
+    Pfn2 = MI_PFN_ELEMENT (PageFrameIndex);
+    Pfn2->u1.WsIndex = Pfn1->u1.WsIndex;
+
+    MI_MAKE_VALID_PTE (TempPde,
+                       PageFrameIndex,
+                       Protection,
+                       PointerPte);
+
+    MI_SET_PTE_DIRTY (TempPde);
+    MI_SET_ACCESSED_IN_PTE (&TempPde, 1);
+    MI_MAKE_PDE_MAP_LARGE_PAGE (&TempPde);
+    MI_SET_PTE_IN_WORKING_SET (&TempPde, MI_GET_WORKING_SET_FROM_PTE (PointerPde));
+
+    MI_WRITE_VALID_PTE_NEW_PAGE (PointerPde, TempPde);
+
+    MI_FLUSH_PROCESS_TB (FALSE);
+
+    UNLOCK_PFN (OldIrql);
+
+    WsInfo->VmWorkingSetList->PromotedLargePages += 1;
+
+    InterlockedIncrement ((PLONG) &MiLargePagePromotions);
+
+    return TRUE;
+}
+
+
+VOID
+MiPromoteLargePages (
+    IN PMMSUPPORT WsInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called by the working set manager while aging a
+    process working set.  It promotes up to MiLargePagePromotionsPerPass
+    eligible 2MB ranges of private memory to large pages.
+
+    The address creation mutex is only tried for (it is normally acquired
+    before the working set pushlock) so busy processes are simply skipped.
+    The working set pushlock is released while each contiguous run is
+    gathered (as that may need to wait for dynamic memory operations) and
+    while the contents of each range are copied.
+
+Arguments:
+
+    WsInfo - Supplies the working set to promote ranges in.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, attached to the process with its working
+    set pushlock held.
+
+--*/
+
+{
+    ULONG Color;
+    ULONG Count;
+    ULONG Protection;
+    PVOID VirtualAddress;
+    PVOID StartingAddress;
+    PETHREAD Thread;
+    PEPROCESS Process;
+    PFN_NUMBER PageFrameIndex;
+    PFN_NUMBER ZeroCount;
+    PMMPTE CapturedPtes;
+    PCOLORED_PAGE_INFO ColoredPageInfoBase;
+    PMI_LARGEPAGE_MEMORY_RUN LargePageInfo;
+
+    PAGED_CODE ();
+
+    if ((MmTransparentLargePages == 0) ||
+        (WsInfo == &MmSystemCacheWs) ||
+        (WsInfo->Flags.SessionSpace == 1) ||
+        (MmAvailablePages < MI_PROMOTION_MINIMUM_AVAILABLE)) {
+
+        return;
+    }
+
+    Thread = PsGetCurrentThread ();
+    Process = CONTAINING_RECORD (WsInfo, EPROCESS, Vm);
+
+    ASSERT (Process == PsGetCurrentProcess ());
+
+    if (KeTryToAcquireGuardedMutex (&Process->AddressCreationLock) == FALSE) {
+        return;
+    }
+
+    ColoredPageInfoBase = NULL;
+    LargePageInfo = NULL;
+    CapturedPtes = NULL;
+
+    if (Process->Flags & PS_PROCESS_FLAGS_VM_DELETED) {
+        goto Done;
+    }
+
+    ColoredPageInfoBase = (PCOLORED_PAGE_INFO) ExAllocatePoolWithTag (
+                                NonPagedPool,
+                                MmSecondaryColors * sizeof (COLORED_PAGE_INFO),
+                                'ldmM');
+
+    if (ColoredPageInfoBase == NULL) {
+        goto Done;
+    }
+
+    LargePageInfo = ExAllocatePoolWithTag (NonPagedPool,
+                                           sizeof (MI_LARGEPAGE_MEMORY_RUN),
+                                           'lLmM');
+
+    if (LargePageInfo == NULL) {
+        goto Done;
+    }
+
+    CapturedPtes = ExAllocatePoolWithTag (NonPagedPool,
+                                          MI_LARGE_PAGE_PTES * sizeof (MMPTE),
+                                          'tLmM');
+
+    if (CapturedPtes == NULL) {
+        goto Done;
+    }
+
+    StartingAddress = (PVOID) MI_ROUND_TO_SIZE ((ULONG_PTR) MM_LOWEST_USER_ADDRESS,
+                                                MM_VA_MAPPED_BY_PDE);
+
+    for (Count = 0; Count < MiLargePagePromotionsPerPass; Count += 1) {
+
+        VirtualAddress = MiFindPromotionCandidate (Process,
+                                                   StartingAddress,
+                                                   &Protection);
+
+        if (VirtualAddress == NULL) {
+            break;
+        }
+
+        for (Color = 0; Color < MmSecondaryColors; Color += 1) {
+            ColoredPageInfoBase[Color].PagesQueued = 0;
+            ColoredPageInfoBase[Color].PfnAllocation = (PMMPFN) MM_EMPTY_LIST;
+        }
+
+        UNLOCK_WS (Thread, Process);
+
+        MmLockPageableSectionByHandle (ExPageLockHandle);
+
+        PageFrameIndex = MiFindLargePageMemory (ColoredPageInfoBase,
+                                                MI_LARGE_PAGE_PTES,
+                                                Protection,
+                                                &ZeroCount);
+
+        MmUnlockPageableImageSection (ExPageLockHandle);
+
+        LOCK_WS (Thread, Process);
+
+        if (PageFrameIndex == 0) {
+            InterlockedIncrement ((PLONG) &MiLargePagePromotionFailures);
+            break;
+        }
+
+        //
+        // The pages are overwritten by the copy so the zeroing list built
+        // by MiFindLargePageMemory is ignored.
+        //
+
+        if (MiPromoteLargePde (WsInfo,
+                               VirtualAddress,
+                               PageFrameIndex,
+                               CapturedPtes) == FALSE) {
+
+            //
+            // The range changed while the working set pushlock was
+            // released - return the run and try again on the next pass.
+            //
+
+            LargePageInfo->Next = NULL;
+            LargePageInfo->BasePage = PageFrameIndex;
+            LargePageInfo->PageCount = MI_LARGE_PAGE_PTES;
+
+            MiReturnLargePages (LargePageInfo);
+            LargePageInfo = NULL;
+
+            InterlockedIncrement ((PLONG) &MiLargePagePromotionFailures);
+            break;
+        }
+
+        StartingAddress = (PVOID)((PCHAR) VirtualAddress + MM_VA_MAPPED_BY_PDE);
+    }
+
+Done:
+
+    if (CapturedPtes != NULL) {
+        ExFreePool (CapturedPtes);
+    }
+
+    if (LargePageInfo != NULL) {
+        ExFreePool (LargePageInfo);
+    }
+
+    if (ColoredPageInfoBase != NULL) {
+        ExFreePool (ColoredPageInfoBase);
+    }
+
+    KeReleaseGuardedMutex (&Process->AddressCreationLock);
+
+    return;
+}
+
+
+VOID
+MiDemoteLargePde (
+    IN PMMSUPPORT WsInfo,
+    IN PMMPTE PointerPde,
+    IN ULONG Disposition
+    )
+
+/*++
+
+Routine Description:
+
+    This routine demotes a promoted large PDE back to its page table page,
+    which already holds a transition PTE for each frame.
+
+Arguments:
+
+    WsInfo - Supplies the working set of the current process.
+
+    PointerPde - Supplies the promoted PDE.
+
+    Disposition - Supplies what happens to the large page frames :
+
+        MI_DEMOTE_RESIDENT - the PTEs are made valid and the frames are
+                             added to the working set as ordinary private
+                             pages.
+
+        MI_DEMOTE_TRIM - the frames are released onto the modified list.
+
+        MI_DEMOTE_DELETE - the contents are discarded, the frames are
+                           freed and the PTEs are left demand zero.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set pushlock held.
+
+--*/
+
+{
+    ULONG i;
+    KIRQL OldIrql;
+    PCHAR Va;
+    MMPTE TempPte;
+    MMPTE TempPde;
+    PMMPTE PointerPte;
+    PMMPFN Pfn1;
+    PMMPFN Pfn2;
+    PMMPFN Pfn3;
+    PEPROCESS Process;
+    PFN_NUMBER PageFrameIndex;
+    PFN_NUMBER PageTableFrameIndex;
+
+    MM_WS_LOCK_ASSERT (WsInfo);
+
+    ASSERT (MI_IS_PROMOTED_LARGE_PDE (PointerPde));
+
+    PointerPte = (PMMPTE) MiGetVirtualAddressMappedByPte (PointerPde);
+
+    PageFrameIndex = MI_GET_PAGE_FRAME_FROM_PTE (PointerPde);
+    Pfn1 = MI_PFN_ELEMENT (PageFrameIndex);
+
+    PageTableFrameIndex = Pfn1->u4.PteFrame;
+    Pfn2 = MI_PFN_ELEMENT (PageTableFrameIndex);
+
+    MI_MAKE_VALID_PTE (TempPde,
+                       PageTableFrameIndex,
+                       MM_READWRITE,
+                       PointerPde);
+
+    MI_SET_PTE_DIRTY (TempPde);
+    MI_SET_ACCESSED_IN_PTE (&TempPde, 1);
+    MI_SET_PTE_IN_WORKING_SET (&TempPde, MI_GET_WORKING_SET_FROM_PTE (PointerPde));
+
+    LOCK_PFN (OldIrql);
+
+    //
+    // Hand the working set index back to the page table page.
+    //
+
+    Pfn2->u1.WsIndex = Pfn1->u1.WsIndex;
+
+    MI_WRITE_VALID_PTE_NEW_PAGE (PointerPde, TempPde);
+
+    if (Disposition == MI_DEMOTE_TRIM) {
+
+        for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1, Pfn1 += 1) {
+
+            ASSERT (Pfn1->u4.PteFrame == PageTableFrameIndex);
+            ASSERT (Pfn1->u2.ShareCount == 1);
+
+            MI_ZERO_WSINDEX (Pfn1);
+            MiDecrementShareCount (Pfn1, PageFrameIndex + i);
+        }
+
+        MI_FLUSH_PROCESS_TB (FALSE);
+    }
+    else if (Disposition == MI_DEMOTE_DELETE) {
+
+        //
+        // Point the PTEs away from the frames and flush before any frame
+        // is freed.
+        //
+
+        for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+            Pfn3 = Pfn1 + i;
+
+            ASSERT (Pfn3->u4.PteFrame == PageTableFrameIndex);
+            ASSERT (Pfn3->u2.ShareCount == 1);
+
+            TempPte = ZeroPte;
+            TempPte.u.Soft.Protection = Pfn3->OriginalPte.u.Soft.Protection;
+
+            MI_WRITE_INVALID_PTE (PointerPte + i, TempPte);
+        }
+
+        MI_FLUSH_PROCESS_TB (FALSE);
+
+        for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1, Pfn1 += 1) {
+
+            MI_ZERO_WSINDEX (Pfn1);
+            MI_SET_PFN_DELETED (Pfn1);
+
+            MiDecrementShareCount (Pfn2, PageTableFrameIndex);
+            MiDecrementShareCount (Pfn1, PageFrameIndex + i);
+        }
+    }
+    else {
+
+        ASSERT (Disposition == MI_DEMOTE_RESIDENT);
+
+        //
+        // The frames keep their share and reference counts, only the PTEs
+        // go from transition back to valid.
+        //
+
+        for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1) {
+
+            Pfn3 = Pfn1 + i;
+
+            ASSERT (Pfn3->u4.PteFrame == PageTableFrameIndex);
+            ASSERT (Pfn3->u2.ShareCount == 1);
+
+            MI_ZERO_WSINDEX (Pfn3);
+
+            MI_MAKE_VALID_PTE (TempPte,
+                               PageFrameIndex + i,
+                               Pfn3->OriginalPte.u.Soft.Protection,
+                               PointerPte + i);
+
+            if (Pfn3->u3.e1.Modified == 1) {
+                MI_SET_PTE_DIRTY (TempPte);
+            }
+
+            MI_WRITE_VALID_PTE (PointerPte + i, TempPte);
+        }
+
+        MI_FLUSH_PROCESS_TB (FALSE);
+    }
+
+    UNLOCK_PFN (OldIrql);
+
+    if (Disposition == MI_DEMOTE_RESIDENT) {
+
+        //
+        // Insert each page into the working set.  A page which cannot get
+        // an entry is trimmed just as it would be on a failed fault.
+        //
+
+        Process = CONTAINING_RECORD (WsInfo, EPROCESS, Vm);
+
+        Va = (PCHAR) MiGetVirtualAddressMappedByPte (PointerPte);
+
+        for (i = 0; i < MI_LARGE_PAGE_PTES; i += 1, Pfn1 += 1, Va += PAGE_SIZE) {
+
+            if (MiAllocateWsle (WsInfo, PointerPte + i, Pfn1, 0) == 0) {
+
+                MiTrimPte (Va,
+                           PointerPte + i,
+                           Pfn1,
+                           Process,
+                           ZeroPte);
+            }
+        }
+    }
+
+    MI_INCREMENT_RESIDENT_AVAILABLE (MI_LARGE_PAGE_PTES,
+                                     MM_RESAVAIL_FREE_LARGE_PAGES);
+
+    ASSERT (WsInfo->VmWorkingSetList->PromotedLargePages != 0);
+
+    WsInfo->VmWorkingSetList->PromotedLargePages -= 1;
+
+    InterlockedIncrement ((PLONG) &MiLargePageDemotions);
+
+    return;
+}
+
+
+VOID
+MiDemoteLargePdesInRange (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID StartingAddress,
+    IN PVOID EndingAddress,
+    IN ULONG Disposition
+    )
+
+/*++
+
+Routine Description:
+
+    This routine demotes every promoted large PDE which maps any part of
+    the specified range.
+
+Arguments:
+
+    WsInfo - Supplies the working set of the current process.
+
+    StartingAddress - Supplies the first address of the range.
+
+    EndingAddress - Supplies the last address of the range.
+
+    Disposition - Supplies MI_DEMOTE_RESIDENT or MI_DEMOTE_DELETE.  PDEs
+                  only partially covered by the range are always demoted
+                  resident so the rest of their contents are preserved.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set pushlock held.
+
+--*/
+
+{
+    PMMPTE PointerPde;
+    PMMPTE LastPde;
+    PCHAR Va;
+
+    PAGED_CODE ();
+
+    MM_WS_LOCK_ASSERT (WsInfo);
+
+    if (EndingAddress > MM_HIGHEST_USER_ADDRESS) {
+        EndingAddress = MM_HIGHEST_USER_ADDRESS;
+    }
+
+    PointerPde = MiGetPdeAddress (StartingAddress);
+    LastPde = MiGetPdeAddress (EndingAddress);
+
+    while ((PointerPde <= LastPde) &&
+           (WsInfo->VmWorkingSetList->PromotedLargePages != 0)) {
+
+        Va = (PCHAR) MiGetVirtualAddressMappedByPde (PointerPde);
+
+        if (MiGetPxeAddress (Va)->u.Hard.Valid == 0) {
+            Va = (PCHAR)(((ULONG_PTR) Va | (MM_VA_MAPPED_BY_PXE - 1)) + 1);
+            PointerPde = MiGetPdeAddress (Va);
+            continue;
+        }
+
+        if (MiGetPpeAddress (Va)->u.Hard.Valid == 0) {
+            Va = (PCHAR)(((ULONG_PTR) Va | (MM_VA_MAPPED_BY_PPE - 1)) + 1);
+            PointerPde = MiGetPdeAddress (Va);
+            continue;
+        }
+
+        if ((PointerPde->u.Hard.Valid == 1) &&
+            (MI_IS_PROMOTED_LARGE_PDE (PointerPde))) {
+
+            if ((Disposition == MI_DEMOTE_DELETE) &&
+                (Va >= (PCHAR) StartingAddress) &&
+                (Va + MM_VA_MAPPED_BY_PDE - 1 <= (PCHAR) EndingAddress)) {
+
+                MiDemoteLargePde (WsInfo, PointerPde, MI_DEMOTE_DELETE);
+            }
+            else {
+                MiDemoteLargePde (WsInfo, PointerPde, MI_DEMOTE_RESIDENT);
+            }
+        }
+
+        PointerPde += 1;
+    }
+
+    return;
+}
+
+
+VOID
+MiDemoteLargePages (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID StartingAddress,
+    IN PVOID EndingAddress
+    )
+
+/*++
+
+Routine Description:
+
+    This routine demotes every promoted large PDE which maps any part of
+    the specified range, keeping the frames resident.  Callers that are
+    about to examine or change the PTEs of a user range invoke this (via
+    MI_DEMOTE_LARGE_PAGES) first.
+
+Arguments:
+
+    WsInfo - Supplies the working set of the current process.
+
+    StartingAddress - Supplies the first address of the range.
+
+    EndingAddress - Supplies the last address of the range.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set pushlock held.
+
+--*/
+
+{
+    PAGED_CODE ();
+
+    MiDemoteLargePdesInRange (WsInfo,
+                              StartingAddress,
+                              EndingAddress,
+                              MI_DEMOTE_RESIDENT);
+}
+
+
+VOID
+MiDeleteLargePages (
+    IN PMMSUPPORT WsInfo,
+    IN PVOID StartingAddress,
+    IN PVOID EndingAddress
+    )
+
+/*++
+
+Routine Description:
+
+    This routine is called (via MI_DELETE_LARGE_PAGES) before the specified
+    range is released, decommitted or torn down.  Promoted large PDEs that
+    lie entirely within the range are deleted outright, those that straddle
+    its ends are demoted with their frames kept resident.
+
+Arguments:
+
+    WsInfo - Supplies the working set of the current process.
+
+    StartingAddress - Supplies the first address of the range.
+
+    EndingAddress - Supplies the last address of the range.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set pushlock held.
+
+--*/
+
+{
+    PAGED_CODE ();
+
+    MiDemoteLargePdesInRange (WsInfo,
+                              StartingAddress,
+                              EndingAddress,
+                              MI_DEMOTE_DELETE);
+}
+
+#endif
@@ -741,6 +741,8 @@ Environment:
 
         LOCK_WS_UNSAFE (Thread, Process);
 
+        MI_DEMOTE_LARGE_PAGES (&Process->Vm, StartingAddress, EndingAddress);
+
         //
         // Ensure all of the pages are already committed as described
         // in the virtual address descriptor.
@@ -26,6 +26,18 @@ Abstract:
 
 #define MAX_LOCK_SIZE ((ULONG)(14 * PAGE_SIZE))
 
+//
+// Transfers of at least MI_LARGE_COPY_THRESHOLD bytes lock and map spans
+// of up to MI_LARGE_LOCK_SIZE bytes at a time through a pool allocated
+// MDL, so each attach, probe and lock, and system PTE mapping covers far
+// more data.  If the larger span cannot be locked or mapped, the copy
+// continues in MAX_LOCK_SIZE pieces.
+//
+
+#define MI_LARGE_LOCK_SIZE ((ULONG)(256 * PAGE_SIZE))
+
+#define MI_LARGE_COPY_THRESHOLD ((SIZE_T)(4 * MAX_LOCK_SIZE))
+
 //
 // The maximum to move in a single block is 64k bytes.
 //
@@ -570,8 +582,10 @@ Return Value:
     PSIZE_T MappedAddress;
     SIZE_T MaximumMoved;
     PMDL Mdl;
+    PMDL LargeMdl;
     PFN_NUMBER MdlHack[(sizeof(MDL)/sizeof(PFN_NUMBER)) + (MAX_LOCK_SIZE >> PAGE_SHIFT) + 1];
     PVOID OutVa;
+    NTSTATUS Status;
     LOGICAL MappingFailed;
     LOGICAL ExceptionAddressConfirmed;
 
@@ -583,11 +597,25 @@ Return Value:
     OutVa = ToAddress;
 
     MaximumMoved = MAX_LOCK_SIZE;
-    if (BufferSize <= MAX_LOCK_SIZE) {
-        MaximumMoved = BufferSize;
+    Mdl = (PMDL)&MdlHack[0];
+    LargeMdl = NULL;
+
+    if (BufferSize >= MI_LARGE_COPY_THRESHOLD) {
+
+        LargeMdl = ExAllocatePoolWithTag (NonPagedPool,
+                                          sizeof(MDL) + sizeof(PFN_NUMBER) *
+                                            ((MI_LARGE_LOCK_SIZE >> PAGE_SHIFT) + 1),
+                                          'lRmM');
+
+        if (LargeMdl != NULL) {
+            Mdl = LargeMdl;
+            MaximumMoved = MI_LARGE_LOCK_SIZE;
+        }
     }
 
-    Mdl = (PMDL)&MdlHack[0];
+    if (BufferSize <= MaximumMoved) {
+        MaximumMoved = BufferSize;
+    }
 
     //
     // Map the data into the system part of the address space, then copy it.
@@ -703,13 +731,30 @@ Return Value:
                 MmUnlockPages (Mdl);
             }
 
+            if ((Mdl == LargeMdl) &&
+                ((MappingFailed == TRUE) ||
+                 (GetExceptionCode() == STATUS_WORKING_SET_QUOTA))) {
+
+                //
+                // The large span could not be locked or mapped.  Carry on
+                // with this chunk and the rest in the smaller pieces.
+                //
+
+                Mdl = (PMDL)&MdlHack[0];
+                MaximumMoved = MAX_LOCK_SIZE;
+                AmountToMove = MAX_LOCK_SIZE;
+                MappingFailed = FALSE;
+                continue;
+            }
+
             if (GetExceptionCode() == STATUS_WORKING_SET_QUOTA) {
-                return STATUS_WORKING_SET_QUOTA;
+                Status = STATUS_WORKING_SET_QUOTA;
+                goto Done;
             }
 
             if ((Probing == TRUE) || (MappingFailed == TRUE)) {
-                return GetExceptionCode();
-
+                Status = GetExceptionCode();
+                goto Done;
             }
 
             //
@@ -726,7 +771,8 @@ Return Value:
                 }
             }
 
-            return STATUS_PARTIAL_COPY;
+            Status = STATUS_PARTIAL_COPY;
+            goto Done;
         }
 
         KeUnstackDetachProcess (&ApcState);
@@ -744,7 +790,15 @@ Return Value:
     //
 
     *NumberOfBytesRead = BufferSize;
-    return STATUS_SUCCESS;
+    Status = STATUS_SUCCESS;
+
+Done:
+
+    if (LargeMdl != NULL) {
+        ExFreePool (LargeMdl);
+    }
+
+    return Status;
 }
 
 NTSTATUS
@@ -235,6 +235,10 @@ Environment:
 
                 RtlClearBits (PagingFile->Bitmap, (ULONG) first, count);
 
+                MiRemoveCompressedPageRange (PagingFile->PageFileNumber,
+                                             first,
+                                             count);
+
                 break;
             }
 
@@ -245,6 +249,9 @@ Environment:
             write = FALSE;
             LOCK_PFN (OldIrql);
             RtlClearBits (PagingFile->Bitmap, (ULONG) first, count);
+            MiRemoveCompressedPageRange (PagingFile->PageFileNumber,
+                                         first,
+                                         count);
             count = 0;
         }
     }
@@ -62,6 +62,32 @@ PVOID MmPoolCodeEnd;
 PVOID MmPteCodeStart;
 PVOID MmPteCodeEnd;
 
+//
+// Export name hash tables, one per module that has had imports bound to
+// it.  Each is built the first time an import is resolved against the
+// module and is freed when the module is unloaded.  The list and the
+// tables are protected by MmSystemLoadLock.
+//
+
+#define MI_EXPORT_HASH_EMPTY    MAXULONG
+
+typedef struct _MI_EXPORT_HASH_ENTRY {
+    ULONG Hash;
+    ULONG NameIndex;
+} MI_EXPORT_HASH_ENTRY, *PMI_EXPORT_HASH_ENTRY;
+
+typedef struct _MI_EXPORT_HASH {
+    LIST_ENTRY Links;
+    PVOID DllBase;
+    PIMAGE_EXPORT_DIRECTORY ExportDirectory;
+    ULONG TimeDateStamp;
+    ULONG NumberOfNames;
+    ULONG Mask;
+    MI_EXPORT_HASH_ENTRY Entries[1];
+} MI_EXPORT_HASH, *PMI_EXPORT_HASH;
+
+LIST_ENTRY MiExportHashList = {&MiExportHashList, &MiExportHashList};
+
 NTSTATUS
 LookupEntryPoint (
     IN PVOID DllBase,
@@ -222,6 +248,30 @@ MiComputeDriverProtection (
     IN ULONG SectionProtection
     );
 
+ULONG
+MiHashExportName (
+    IN PCHAR Name
+    );
+
+PMI_EXPORT_HASH
+MiBuildExportHash (
+    IN PVOID DllBase,
+    IN PIMAGE_EXPORT_DIRECTORY ExportDirectory
+    );
+
+LOGICAL
+MiLookupExportHash (
+    IN PVOID DllBase,
+    IN PIMAGE_EXPORT_DIRECTORY ExportDirectory,
+    IN PCHAR Name,
+    OUT PUSHORT OrdinalNumber
+    );
+
+VOID
+MiDeleteExportHash (
+    IN PVOID DllBase
+    );
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE,MmCheckSystemImage)
 #pragma alloc_text(PAGE,MmLoadSystemImage)
@@ -246,6 +296,10 @@ MiComputeDriverProtection (
 #pragma alloc_text(PAGE,MiSessionProcessGlobalSubsections)
 #pragma alloc_text(PAGE,MiCaptureImageExceptionValues)
 #pragma alloc_text(PAGE,MiComputeDriverProtection)
+#pragma alloc_text(PAGE,MiHashExportName)
+#pragma alloc_text(PAGE,MiBuildExportHash)
+#pragma alloc_text(PAGE,MiLookupExportHash)
+#pragma alloc_text(PAGE,MiDeleteExportHash)
 #pragma alloc_text(INIT,MiBuildImportsForBootDrivers)
 #pragma alloc_text(INIT,MiReloadBootLoadedDrivers)
 #pragma alloc_text(INIT,MiUpdateThunks)
@@ -3884,6 +3938,8 @@ Environment:
             MiRundownHotpatchList ((PVOID)DataTableEntry->PatchInformation);
         }
 
+        MiDeleteExportHash (DataTableEntry->DllBase);
+
         ExFreePool (DataTableEntry);
     }
 
@@ -5179,6 +5235,310 @@ LoadFinished:
     return STATUS_SUCCESS;
 }
 
+ULONG
+MiHashExportName (
+    IN PCHAR Name
+    )
+
+/*++
+
+Routine Description:
+
+    This function computes the hash of an export name as used by the
+    per-module export hash tables.
+
+Arguments:
+
+    Name - Supplies the NULL terminated export name.
+
+Return Value:
+
+    The hash of the name.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    ULONG Hash;
+
+    PAGED_CODE();
+
+    Hash = 0;
+
+    while (*Name != '\0') {
+        Hash = (Hash * 37) + (UCHAR) *Name;
+        Name += 1;
+    }
+
+    return Hash;
+}
+
+PMI_EXPORT_HASH
+MiBuildExportHash (
+    IN PVOID DllBase,
+    IN PIMAGE_EXPORT_DIRECTORY ExportDirectory
+    )
+
+/*++
+
+Routine Description:
+
+    This function builds an open addressed hash table of the export names
+    of the argument module.  The table holds indices into the export name
+    table, sized to at least twice the number of names so probe sequences
+    stay short.
+
+Arguments:
+
+    DllBase - Supplies the base of the exporting module.
+
+    ExportDirectory - Supplies the export directory of the module.
+
+Return Value:
+
+    The hash table or NULL if it could not be allocated.
+
+Environment:
+
+    Kernel mode, MmSystemLoadLock held.
+
+--*/
+
+{
+    ULONG i;
+    ULONG Hash;
+    ULONG Index;
+    ULONG NumberOfEntries;
+    PULONG NameTableBase;
+    PMI_EXPORT_HASH ExportHash;
+
+    PAGED_CODE();
+
+    if (ExportDirectory->NumberOfNames == 0) {
+        return NULL;
+    }
+
+    NumberOfEntries = 16;
+
+    while (NumberOfEntries < 2 * ExportDirectory->NumberOfNames) {
+        NumberOfEntries <<= 1;
+    }
+
+    ExportHash = ExAllocatePoolWithTag (PagedPool,
+                                        sizeof (MI_EXPORT_HASH) +
+                                            (NumberOfEntries - 1) * sizeof (MI_EXPORT_HASH_ENTRY),
+                                        'hEmM');
+
+    if (ExportHash == NULL) {
+        return NULL;
+    }
+
+    ExportHash->DllBase = DllBase;
+    ExportHash->ExportDirectory = ExportDirectory;
+    ExportHash->TimeDateStamp = ExportDirectory->TimeDateStamp;
+    ExportHash->NumberOfNames = ExportDirectory->NumberOfNames;
+    ExportHash->Mask = NumberOfEntries - 1;
+
+    for (i = 0; i < NumberOfEntries; i += 1) {
+        ExportHash->Entries[i].NameIndex = MI_EXPORT_HASH_EMPTY;
+    }
+
+    NameTableBase = (PULONG)((PCHAR)DllBase + (ULONG)ExportDirectory->AddressOfNames);
+
+    for (i = 0; i < ExportDirectory->NumberOfNames; i += 1) {
+
+        Hash = MiHashExportName ((PCHAR)DllBase + NameTableBase[i]);
+
+        Index = Hash & ExportHash->Mask;
+
+        while (ExportHash->Entries[Index].NameIndex != MI_EXPORT_HASH_EMPTY) {
+            Index = (Index + 1) & ExportHash->Mask;
+        }
+
+        ExportHash->Entries[Index].Hash = Hash;
+        ExportHash->Entries[Index].NameIndex = i;
+    }
+
+    InsertTailList (&MiExportHashList, &ExportHash->Links);
+
+    return ExportHash;
+}
+
+LOGICAL
+MiLookupExportHash (
+    IN PVOID DllBase,
+    IN PIMAGE_EXPORT_DIRECTORY ExportDirectory,
+    IN PCHAR Name,
+    OUT PUSHORT OrdinalNumber
+    )
+
+/*++
+
+Routine Description:
+
+    This function looks up the argument name in the export hash table of
+    the argument module, building the table if this is the first lookup.
+
+Arguments:
+
+    DllBase - Supplies the base of the exporting module.
+
+    ExportDirectory - Supplies the export directory of the module.
+
+    Name - Supplies the name to be located.
+
+    OrdinalNumber - Receives the (unbiased) ordinal number of the export.
+
+Return Value:
+
+    TRUE if the name was found, FALSE if not.  A FALSE return is not
+    authoritative (the table may not have been allocated) - the caller
+    must fall back to searching the export name table.
+
+Environment:
+
+    Kernel mode, MmSystemLoadLock held.
+
+--*/
+
+{
+    ULONG Hash;
+    ULONG Index;
+    PULONG NameTableBase;
+    PUSHORT NameOrdinalTableBase;
+    PLIST_ENTRY NextEntry;
+    PMI_EXPORT_HASH ExportHash;
+    PMI_EXPORT_HASH_ENTRY Entry;
+
+    PAGED_CODE();
+
+    ExportHash = NULL;
+
+    NextEntry = MiExportHashList.Flink;
+
+    while (NextEntry != &MiExportHashList) {
+
+        ExportHash = CONTAINING_RECORD (NextEntry, MI_EXPORT_HASH, Links);
+
+        if (ExportHash->DllBase == DllBase) {
+
+            //
+            // Make sure this is still the same image - the address
+            // may have been reused by a different one.
+            //
+
+            if ((ExportHash->ExportDirectory != ExportDirectory) ||
+                (ExportHash->TimeDateStamp != ExportDirectory->TimeDateStamp) ||
+                (ExportHash->NumberOfNames != ExportDirectory->NumberOfNames)) {
+
+                RemoveEntryList (&ExportHash->Links);
+                ExFreePool (ExportHash);
+                ExportHash = NULL;
+            }
+            break;
+        }
+
+        ExportHash = NULL;
+        NextEntry = NextEntry->Flink;
+    }
+
+    if (ExportHash == NULL) {
+
+        ExportHash = MiBuildExportHash (DllBase, ExportDirectory);
+
+        if (ExportHash == NULL) {
+            return FALSE;
+        }
+    }
+    else if (NextEntry != MiExportHashList.Flink) {
+
+        //
+        // Keep recently bound modules at the front of the list.
+        //
+
+        RemoveEntryList (&ExportHash->Links);
+        InsertHeadList (&MiExportHashList, &ExportHash->Links);
+    }
+
+    NameTableBase = (PULONG)((PCHAR)DllBase + (ULONG)ExportDirectory->AddressOfNames);
+    NameOrdinalTableBase = (PUSHORT)((PCHAR)DllBase + (ULONG)ExportDirectory->AddressOfNameOrdinals);
+
+    Hash = MiHashExportName (Name);
+
+    Index = Hash & ExportHash->Mask;
+
+    do {
+
+        Entry = &ExportHash->Entries[Index];
+
+        if (Entry->NameIndex == MI_EXPORT_HASH_EMPTY) {
+            break;
+        }
+
+        if ((Entry->Hash == Hash) &&
+            (strcmp (Name, (PCHAR)DllBase + NameTableBase[Entry->NameIndex]) == 0)) {
+
+            *OrdinalNumber = NameOrdinalTableBase[Entry->NameIndex];
+            return TRUE;
+        }
+
+        Index = (Index + 1) & ExportHash->Mask;
+
+    } while (TRUE);
+
+    return FALSE;
+}
+
+VOID
+MiDeleteExportHash (
+    IN PVOID DllBase
+    )
+
+/*++
+
+Routine Description:
+
+    This function frees the export hash table of a module being unloaded.
+
+Arguments:
+
+    DllBase - Supplies the base of the module.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, MmSystemLoadLock held.
+
+--*/
+
+{
+    PLIST_ENTRY NextEntry;
+    PMI_EXPORT_HASH ExportHash;
+
+    PAGED_CODE();
+
+    NextEntry = MiExportHashList.Flink;
+
+    while (NextEntry != &MiExportHashList) {
+
+        ExportHash = CONTAINING_RECORD (NextEntry, MI_EXPORT_HASH, Links);
+
+        if (ExportHash->DllBase == DllBase) {
+            RemoveEntryList (&ExportHash->Links);
+            ExFreePool (ExportHash);
+            return;
+        }
+
+        NextEntry = NextEntry->Flink;
+    }
+}
+
 
 NTSTATUS
 MiSnapThunk(
@@ -5289,6 +5649,17 @@ Return Value:
             OrdinalNumber = NameOrdinalTableBase[HintIndex];
 
         }
+        else if (MiLookupExportHash (DllBase,
+                                     ExportDirectory,
+                                     (PCHAR)&((PIMAGE_IMPORT_BY_NAME)NameThunk->u1.AddressOfData)->Name[0],
+                                     &OrdinalNumber) == TRUE) {
+
+            //
+            // The export hash table of the DLL located the name.
+            //
+
+            NOTHING;
+        }
         else {
 
             //
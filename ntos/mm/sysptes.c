@@ -45,6 +45,11 @@ MiRecoverExtraPtes (
     ULONG NumberOfPtes
     );
 
+LOGICAL
+MiDrainSystemPteCaches (
+    VOID
+    );
+
 #if !defined (_WIN64)
 extern ULONG MiSpecialPoolExtraCount;
 #endif
@@ -151,6 +156,38 @@ ULONG MmSysPteListBySizeCount [MM_SYS_PTE_TABLES_MAX];
 PVOID MiSystemPteNBHead[MM_SYS_PTE_TABLES_MAX];
 LONG MiSystemPteFreeCount[MM_SYS_PTE_TABLES_MAX];
 
+//
+// Each processor keeps a few free PTE ranges of every binned size in front
+// of the shared nonblocking queues so that a map and unmap on the same
+// processor do not bounce the queue heads between processors.  Entries are
+// the same packed pointer and TB flush time stamp values that the queues
+// hold and are counted in MmSysPteListBySizeCount just like queued entries,
+// so the limits on how many PTEs are binned are unchanged.  Slots are
+// claimed with interlocked compare exchanges, so a thread that is moved to
+// another processor midway simply operates on that processor's slots.
+//
+
+#define MI_SYSPTE_CACHE_DEPTH 4
+
+typedef struct DECLSPEC_CACHEALIGN _MI_SYSPTE_CACHE {
+    LONG64 Entries[MM_SYS_PTE_TABLES_MAX][MI_SYSPTE_CACHE_DEPTH];
+    ULONG Hits;
+    ULONG Misses;
+} MI_SYSPTE_CACHE, *PMI_SYSPTE_CACHE;
+
+MI_SYSPTE_CACHE MiSystemPteCache[MAXIMUM_PROCESSORS];
+
+ULONG MiSystemPteCacheDrains;
+
+//
+// Set in the PTE pointer passed to MiReleaseSystemPtes for a range drained
+// from a processor cache.  Such ranges were already released as far as PTE
+// tracking is concerned and go straight back to the free list rather than
+// being binned again.
+//
+
+#define MI_SYSPTE_RELEASE_UNBINNED  0x2
+
 ULONG MiSysPteTimeStamp[MaximumPtePoolTypes];
 
 #if defined(_WIN64)
@@ -350,6 +387,205 @@ UnpackPTETimeStamp (
     return (ULONG)(Entry->TimeStamp);
 }
 
+
+LOGICAL
+MiRemoveBinnedSystemPtes (
+    IN ULONG Index,
+    OUT PPTE_QUEUE_POINTER Value
+    )
+
+/*++
+
+Routine Description:
+
+    This routine removes a free PTE range of the specified bin, trying
+    the current processor's cache before the shared nonblocking queue.
+
+Arguments:
+
+    Index - Supplies the bin index of the range to remove.
+
+    Value - Receives the packed PTE pointer and TB flush time stamp.
+
+Return Value:
+
+    TRUE if a range was removed, FALSE if the bin is empty.
+
+Environment:
+
+    Kernel mode, DISPATCH_LEVEL or below.
+
+--*/
+
+{
+    ULONG i;
+    LONG64 Data;
+    PLONG64 Slot;
+    PMI_SYSPTE_CACHE Cache;
+
+    Cache = &MiSystemPteCache[KeGetCurrentProcessorNumber ()];
+    Slot = &Cache->Entries[Index][0];
+
+    for (i = 0; i < MI_SYSPTE_CACHE_DEPTH; i += 1, Slot += 1) {
+
+        Data = *Slot;
+
+        if ((Data != 0) &&
+            (InterlockedCompareExchange64 (Slot, 0, Data) == Data)) {
+
+            Cache->Hits += 1;
+            Value->Data = Data;
+            InterlockedDecrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+            return TRUE;
+        }
+    }
+
+    Cache->Misses += 1;
+
+    if (ExRemoveHeadNBQueue (MiSystemPteNBHead[Index], (PULONG64)Value) == TRUE) {
+        InterlockedDecrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+LOGICAL
+MiInsertBinnedSystemPtes (
+    IN ULONG Index,
+    IN PPTE_QUEUE_POINTER Value
+    )
+
+/*++
+
+Routine Description:
+
+    This routine inserts a free (zeroed) PTE range into the specified bin,
+    using a free slot in the current processor's cache if there is one and
+    the shared nonblocking queue otherwise.
+
+Arguments:
+
+    Index - Supplies the bin index of the range.
+
+    Value - Supplies the packed PTE pointer and TB flush time stamp.
+
+Return Value:
+
+    TRUE if the range was inserted, FALSE if the nonblocking queue has no
+    free blocks left (the caller must release the range the long way).
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    ULONG i;
+    PLONG64 Slot;
+
+    ASSERT (Value->Data != 0);
+
+    Slot = &MiSystemPteCache[KeGetCurrentProcessorNumber ()].Entries[Index][0];
+
+    for (i = 0; i < MI_SYSPTE_CACHE_DEPTH; i += 1, Slot += 1) {
+
+        if ((*Slot == 0) &&
+            (InterlockedCompareExchange64 (Slot, Value->Data, 0) == 0)) {
+
+            InterlockedIncrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+            return TRUE;
+        }
+    }
+
+    if (ExInsertTailNBQueue (MiSystemPteNBHead[Index], Value->Data) == TRUE) {
+        InterlockedIncrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+LOGICAL
+MiDrainSystemPteCaches (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine empties every processor's cache of free PTE ranges back
+    into the system PTE free list so the ranges can be coalesced and
+    allocated from any processor.  It is called when system PTEs run short.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if any ranges were returned, FALSE if the caches were empty.
+
+Environment:
+
+    Kernel mode, DISPATCH_LEVEL or below.  The system space lock must not
+    be held.
+
+--*/
+
+{
+    ULONG i;
+    ULONG Index;
+    ULONG Depth;
+    PLONG64 Slot;
+    PMMPTE PointerPte;
+    PTE_QUEUE_POINTER Value;
+    LOGICAL Drained;
+
+    Drained = FALSE;
+
+    for (i = 0; i < (ULONG) KeNumberProcessors; i += 1) {
+
+        for (Index = 0; Index < MM_SYS_PTE_TABLES_MAX; Index += 1) {
+
+            Slot = &MiSystemPteCache[i].Entries[Index][0];
+
+            for (Depth = 0; Depth < MI_SYSPTE_CACHE_DEPTH; Depth += 1, Slot += 1) {
+
+                if (*Slot == 0) {
+                    continue;
+                }
+
+                Value.Data = InterlockedExchange64 (Slot, 0);
+
+                if (Value.Data == 0) {
+                    continue;
+                }
+
+                InterlockedDecrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+
+                PointerPte = UnpackPTEPointer (&Value);
+
+                MiReleaseSystemPtes ((PMMPTE)((ULONG_PTR)PointerPte | MI_SYSPTE_RELEASE_UNBINNED),
+                                     MmSysPteIndex[Index],
+                                     SystemPteSpace);
+
+                Drained = TRUE;
+            }
+        }
+    }
+
+    if (Drained == TRUE) {
+        MiSystemPteCacheDrains += 1;
+    }
+
+    return Drained;
+}
+
 
 PMMPTE
 MiReserveSystemPtes (
@@ -395,8 +631,7 @@ Environment:
             Index = MmSysPteTables [NumberOfPtes];
             ASSERT (NumberOfPtes <= MmSysPteIndex[Index]);
 
-            if (ExRemoveHeadNBQueue (MiSystemPteNBHead[Index], (PULONG64)&Value) == TRUE) {
-                InterlockedDecrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+            if (MiRemoveBinnedSystemPtes (Index, &Value) == TRUE) {
 
                 PointerPte = UnpackPTEPointer (&Value);
 
@@ -451,6 +686,20 @@ Environment:
                                              SystemPtePoolType,
                                              0);
 
+    if ((PointerPte == NULL) &&
+        (SystemPtePoolType == SystemPteSpace) &&
+        (MiDrainSystemPteCaches () == TRUE)) {
+
+        //
+        // Ranges parked in processor caches were returned to the free
+        // list, try again.
+        //
+
+        PointerPte = MiReserveAlignedSystemPtes (NumberOfPtes,
+                                                 SystemPtePoolType,
+                                                 0);
+    }
+
     if (PointerPte == NULL) {
         MiSystemPteAllocationFailed += 1;
     }
@@ -1366,8 +1615,7 @@ Environment:
             Index = MmSysPteTables [NumberOfPages];
             ASSERT (NumberOfPages <= MmSysPteIndex[Index]);
 
-            if (ExRemoveHeadNBQueue (MiSystemPteNBHead[Index], (PULONG64)&Value) == TRUE) {
-                InterlockedDecrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+            if (MiRemoveBinnedSystemPtes (Index, &Value) == TRUE) {
 
                 PointerPte = UnpackPTEPointer (&Value);
 
@@ -1792,8 +2040,7 @@ Environment:
             
                     PackPTEValue (&Value, PointerPte, TimeStamp);
             
-                    if (ExInsertTailNBQueue (MiSystemPteNBHead[Index], Value.Data) == TRUE) {
-                        InterlockedIncrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+                    if (MiInsertBinnedSystemPtes (Index, &Value) == TRUE) {
                         return;
                     }
                 }
@@ -1867,9 +2114,20 @@ Environment:
     ULONG TimeStamp;
     PTE_QUEUE_POINTER Value;
     ULONG ExtensionInProgress;
+    LOGICAL Unbinned;
 
+    Unbinned = FALSE;
 
-    if ((MmTrackPtes & 0x2) && (SystemPtePoolType == SystemPteSpace)) {
+    if ((ULONG_PTR)StartingPte & MI_SYSPTE_RELEASE_UNBINNED) {
+
+        //
+        // This range was drained from a processor cache.
+        //
+
+        StartingPte = (PMMPTE) ((ULONG_PTR)StartingPte & ~MI_SYSPTE_RELEASE_UNBINNED);
+        Unbinned = TRUE;
+    }
+    else if ((MmTrackPtes & 0x2) && (SystemPtePoolType == SystemPteSpace)) {
 
         //
         // If the low bit is set, this range was never reserved and therefore
@@ -1899,7 +2157,8 @@ Environment:
     MiZeroMemoryPte (StartingPte, NumberOfPtes);
 
     if ((SystemPtePoolType == SystemPteSpace) &&
-        (NumberOfPtes <= MM_PTE_TABLE_LIMIT)) {
+        (NumberOfPtes <= MM_PTE_TABLE_LIMIT) &&
+        (Unbinned == FALSE)) {
 
         //
         // Encode the PTE pointer and the TB flush counter into Value.
@@ -1931,8 +2190,7 @@ Environment:
             i += 15;
             if (MmSysPteListBySizeCount[Index] <= i) {
 
-                if (ExInsertTailNBQueue (MiSystemPteNBHead[Index], Value.Data) == TRUE) {
-                    InterlockedIncrement ((PLONG)&MmSysPteListBySizeCount[Index]);
+                if (MiInsertBinnedSystemPtes (Index, &Value) == TRUE) {
                     return;
                 }
 
@@ -3169,11 +3427,12 @@ Environment:
 
     //
     // Quickly do an unsynchronized check so we avoid the spinlock if we
-    // have no chance.
+    // have no chance.  With no extra PTEs left, the ranges parked in the
+    // processor caches are the only ones left to recover.
     //
 
     if (ThisPte->u.List.NextEntry == MM_EMPTY_PTE_LIST) {
-        return FALSE;
+        return MiDrainSystemPteCaches ();
     }
 
     //
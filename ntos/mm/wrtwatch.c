@@ -537,6 +537,30 @@ ClearPteIfValid:
 
         PointerPte += 1;
         if (MiIsPteOnPdeBoundary(PointerPte)) {
+
+            //
+            // Each page table page is processed as one batch.  Flush the
+            // TB entries for the PTEs whose protection was changed in it
+            // and briefly release the PFN lock so a sweep of a very large
+            // region does not hold it for the entire walk.  The working
+            // set pushlock remains held so neither the PTEs nor the
+            // bitmap can change underneath us meanwhile.
+            //
+            // Once the flush list has overflowed, the rest of the walk is
+            // left to the single full TB flush at the end rather than
+            // issuing a full flush for every page table page.
+            //
+
+            if (PteFlushList.Count < MM_MAXIMUM_FLUSH_COUNT) {
+
+                if (PteFlushList.Count != 0) {
+                    MiFlushPteList (&PteFlushList);
+                }
+
+                UNLOCK_PFN (OldIrql);
+                LOCK_PFN (OldIrql);
+            }
+
             PointerPde = MiGetPteAddress (PointerPte);
             if (MiIsPteOnPdeBoundary(PointerPde)) {
                 PointerPpe = MiGetPdeAddress (PointerPte);
@@ -797,6 +821,27 @@ Return Value:
         //
 
         if ((First == TRUE) || MiIsPteOnPdeBoundary(PointerPte)) {
+
+            if ((First == FALSE) &&
+                (PteFlushList.Count < MM_MAXIMUM_FLUSH_COUNT)) {
+
+                //
+                // The previous page table page has been completed.  Flush
+                // its batch of TB entries with a single request and let
+                // other processors acquire the PFN lock before starting on
+                // the next one.  Once the flush list has overflowed, the
+                // rest of the range is left to the single full TB flush at
+                // the end.
+                //
+
+                if (PteFlushList.Count != 0) {
+                    MiFlushPteList (&PteFlushList);
+                }
+
+                UNLOCK_PFN (OldIrql);
+                LOCK_PFN (OldIrql);
+            }
+
             First = FALSE;
 
             PointerPpe = MiGetPpeAddress (BaseAddress);
@@ -92,6 +92,22 @@ MiCheckNullIndex (
     IN PMMWSL WorkingSetList
     );
 
+VOID
+MiTrimWorkingSetEntry (
+    IN PMMSUPPORT WsInfo,
+    IN WSLE_NUMBER WorkingSetIndex,
+    IN PMMPTE PointerPte,
+    IN PMMWSLE_FLUSH_LIST WsleFlushList,
+    IN OUT PWSLE_NUMBER NumberLeftToRemove
+    );
+
+//
+// Number of trim candidates of each younger age generation collected by
+// the pass over the working set in MiTrimWorkingSet.
+//
+
+#define MI_TRIM_BUCKET_SIZE 64
+
 #if DBG
 ULONG MiTbDebug;
 #endif
@@ -1241,10 +1257,12 @@ Environment:
 
         NOTHING;
     }
-    else if (WorkingSetList->HashTable != NULL) {
+    else if ((WorkingSetList->HashTable != NULL) ||
+             (WorkingSetList->ReverseIndex != NULL)) {
 
         //
-        // Insert the valid WSLE into the working set hash list.
+        // Insert the valid WSLE into the reverse index or the working set
+        // hash list.
         //
 
         MiInsertWsleHash (WorkingSetIndex, WsInfo);
@@ -1319,6 +1337,16 @@ Environment:
 
     Pfn1 = MI_PFN_ELEMENT (PointerPte->u.Hard.PageFrameNumber);
 
+    //
+    // The page table page of a promoted large page range is only removed
+    // by trimming (which demotes it first).
+    //
+
+    if ((WorkingSetList->PromotedLargePages != 0) &&
+        (MI_IS_PROMOTED_LARGE_PDE (PointerPte))) {
+        return FALSE;
+    }
+
     //
     // Perform a preliminary check without the PFN lock so that lock
     // contention is avoided for cases that cannot possibly succeed.
@@ -1432,9 +1460,17 @@ Environment:
     MmWorkingSetList->LastEntry = CurrentProcess->Vm.MinimumWorkingSetSize;
     MmWorkingSetList->HashTable = NULL;
     MmWorkingSetList->HashTableSize = 0;
+    MmWorkingSetList->ReverseIndex = NULL;
     MmWorkingSetList->NumberOfImageWaiters = 0;
     MmWorkingSetList->Wsle = MmWsle;
     MmWorkingSetList->VadBitMapHint = 1;
+    MmWorkingSetList->PagesTrimmed = 0;
+    MmWorkingSetList->TrimRefaults = 0;
+    MmWorkingSetList->PromotedLargePages = 0;
+    MmWorkingSetList->ClusterVad = NULL;
+    MmWorkingSetList->CombineAddress = NULL;
+    RtlZeroMemory (MmWorkingSetList->GenerationCounts,
+                   sizeof (MmWorkingSetList->GenerationCounts));
     MmWorkingSetList->HashTableStart = 
        (PVOID)((PCHAR)PAGE_ALIGN (&MmWsle[MM_MAXIMUM_WORKING_SET]) + PAGE_SIZE);
 
@@ -1881,6 +1917,10 @@ Environment:
     WorkingSetList->LastEntry = MI_SESSION_SPACE_WORKING_SET_MINIMUM;
     WorkingSetList->HashTable = NULL;
     WorkingSetList->HashTableSize = 0;
+    WorkingSetList->ReverseIndex = NULL;
+    WorkingSetList->PromotedLargePages = 0;
+    WorkingSetList->ClusterVad = NULL;
+    WorkingSetList->CombineAddress = NULL;
     WorkingSetList->Wsle = MmSessionSpace->Wsle;
 
     //
@@ -2123,6 +2163,69 @@ Environment:
     return STATUS_SUCCESS;
 }
 
+NTSTATUS
+MmQueryWorkingSetAgingInformation (
+    IN OUT PSYSTEM_WORKING_SET_AGING_INFORMATION Info
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns the working set aging statistics of the current
+    process.
+
+Arguments:
+
+    Info - Supplies a system buffer to receive the statistics.  The
+           UniqueProcessId field is left unchanged.
+
+Return Value:
+
+    NTSTATUS.
+
+Environment:
+
+    Kernel mode, IRQL APC_LEVEL or below.
+
+--*/
+
+{
+    ULONG i;
+    PETHREAD Thread;
+    PEPROCESS Process;
+    PMMWSL WorkingSetList;
+
+    C_ASSERT (MI_USE_AGE_COUNT == SYSTEM_WORKING_SET_GENERATIONS);
+
+    ASSERT (KeGetCurrentIrql () <= APC_LEVEL);
+
+    Thread = PsGetCurrentThread ();
+    Process = PsGetCurrentProcessByThread (Thread);
+
+    LOCK_WS_SHARED (Thread, Process);
+
+    if (Process->Flags & PS_PROCESS_FLAGS_VM_DELETED) {
+        UNLOCK_WS_SHARED (Thread, Process);
+        return STATUS_PROCESS_IS_TERMINATING;
+    }
+
+    WorkingSetList = Process->Vm.VmWorkingSetList;
+
+    Info->WorkingSetSize = Process->Vm.WorkingSetSize;
+
+    for (i = 0; i < MI_USE_AGE_COUNT; i += 1) {
+        Info->GenerationCounts[i] = WorkingSetList->GenerationCounts[i];
+    }
+
+    Info->PagesTrimmed = WorkingSetList->PagesTrimmed;
+    Info->TrimRefaults = WorkingSetList->TrimRefaults;
+
+    UNLOCK_WS_SHARED (Thread, Process);
+
+    return STATUS_SUCCESS;
+}
+
 VOID
 MmQuerySystemCacheWorkingSetInformation (
     OUT PSYSTEM_FILECACHE_INFORMATION Info
@@ -3111,11 +3214,13 @@ Environment:
     ASSERT ((MiGetPteAddress(&Wsle[WorkingSetList->LastInitializedWsle]))->u.Hard.Valid == 1);
 
     if ((WorkingSetList->HashTable == NULL) &&
+        (WorkingSetList->ReverseIndex == NULL) &&
         (MmAvailablePages > MM_HIGH_LIMIT)) {
 
         //
         // Add a hash table to support shared pages in the working set to
-        // eliminate costly lookups.
+        // eliminate costly lookups.  Process working sets build a reverse
+        // index instead when their quota allows.
         //
 
         WsInfo->Flags.GrowWsleHash = 1;
@@ -3349,6 +3454,23 @@ Environment:
 
     WorkingSetList = WsInfo->VmWorkingSetList;
 
+    //
+    // Process working sets locate their shared entries through a reverse
+    // index rather than a hash table.  The hash table is only built if
+    // the index cannot be charged or allocated.
+    //
+
+    if ((WorkingSetList->ReverseIndex == NULL) &&
+        (WorkingSetList->HashTable == NULL) &&
+        (WorkingSetList->HashTableSize == 0) &&
+        (WsInfo != &MmSystemCacheWs) &&
+        (WsInfo->Flags.SessionSpace == 0) &&
+        (MiCreateWsleReverseIndex (WsInfo) == TRUE)) {
+
+        WsInfo->Flags.GrowWsleHash = 0;
+        return;
+    }
+
     Table = WorkingSetList->HashTable;
     OriginalTable = WorkingSetList->HashTable;
 
@@ -4018,6 +4140,70 @@ Environment:
     return NumberNotFlushed;
 }
 
+VOID
+MiTrimWorkingSetEntry (
+    IN PMMSUPPORT WsInfo,
+    IN WSLE_NUMBER WorkingSetIndex,
+    IN PMMPTE PointerPte,
+    IN PMMWSLE_FLUSH_LIST WsleFlushList,
+    IN OUT PWSLE_NUMBER NumberLeftToRemove
+    )
+
+/*++
+
+Routine Description:
+
+    This function queues a working set entry for removal by a trim,
+    flushing the queue when it fills.
+
+Arguments:
+
+    WsInfo - Supplies a pointer to the working set information to trim.
+
+    WorkingSetIndex - Supplies the index of the entry to remove.
+
+    PointerPte - Supplies the PTE mapping the entry.
+
+    WsleFlushList - Supplies the list of entries queued for removal.
+
+    NumberLeftToRemove - Supplies the number of pages the trim still has to
+                         remove, updated for this entry and for any entries
+                         the flush could not remove.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set lock.  PFN lock NOT held.
+
+--*/
+
+{
+    if ((WsInfo->VmWorkingSetList->PromotedLargePages != 0) &&
+        (MI_IS_PROMOTED_LARGE_PDE (PointerPte))) {
+
+        //
+        // This is the page table page of a promoted range.  Demote it so
+        // the large page frames go to the modified list, the page table
+        // page itself stays until its transition pages leave.
+        //
+
+        MiDemoteLargePde (WsInfo, PointerPte, MI_DEMOTE_TRIM);
+        return;
+    }
+
+    WsleFlushList->FlushIndex[WsleFlushList->Count] = WorkingSetIndex;
+    WsleFlushList->Count += 1;
+    *NumberLeftToRemove -= 1;
+
+    if (WsleFlushList->Count == MM_MAXIMUM_FLUSH_COUNT) {
+        *NumberLeftToRemove += MiFreeWsleList (WsInfo, WsleFlushList);
+        WsleFlushList->Count = 0;
+    }
+}
+
 WSLE_NUMBER
 MiTrimWorkingSet (
     IN WSLE_NUMBER Reduction,
@@ -4040,6 +4226,12 @@ Arguments:
     TrimAge - Supplies the age value to use - ie: pages of this age or older
               will be removed.
 
+              Pages are taken from the oldest generation first.  A single
+              pass over the working set removes the oldest generation and
+              collects the candidates of each younger generation down to
+              TrimAge into a bucket, the buckets are then emptied oldest
+              first until enough pages have been removed.
+
 Return Value:
 
     Returns the actual number of pages removed.
@@ -4054,12 +4246,18 @@ Environment:
     WSLE_NUMBER TryToFree;
     WSLE_NUMBER StartEntry;
     WSLE_NUMBER LastEntry;
+    WSLE_NUMBER Index;
+    WSLE_NUMBER i;
     PMMWSL WorkingSetList;
     PMMWSLE Wsle;
     PMMPTE PointerPte;
     WSLE_NUMBER NumberLeftToRemove;
-    WSLE_NUMBER NumberNotFlushed;
     MMWSLE_FLUSH_LIST WsleFlushList;
+    ULONG Age;
+    ULONG Generation;
+    ULONG Overflowed;
+    WSLE_NUMBER BucketCount[MI_USE_AGE_MAX];
+    WSLE_NUMBER Bucket[MI_USE_AGE_MAX][MI_TRIM_BUCKET_SIZE];
 
     WsleFlushList.Count = 0;
 
@@ -4069,6 +4267,8 @@ Environment:
 
     MM_WS_LOCK_ASSERT (WsInfo);
 
+    ASSERT (TrimAge <= MI_USE_AGE_MAX);
+
     LastEntry = WorkingSetList->LastEntry;
 
     TryToFree = WorkingSetList->NextSlot;
@@ -4076,55 +4276,161 @@ Environment:
         TryToFree = WorkingSetList->FirstDynamic;
     }
 
+    RtlZeroMemory (BucketCount, sizeof (BucketCount));
+    Overflowed = 0;
+
+    //
+    // Make one pass over the working set.  Entries of the oldest generation
+    // are removed as they are found (a trim age of zero removes any entry
+    // regardless of age or access).  Unaccessed entries of the younger
+    // generations down to the trim age are collected by age.
+    //
+
     StartEntry = TryToFree;
 
-TrimMore:
+    do {
 
-    while (NumberLeftToRemove != 0) {
-        if (Wsle[TryToFree].u1.e1.Valid == 1) {
-            PointerPte = MiGetPteAddress (Wsle[TryToFree].u1.VirtualAddress);
-            ASSERT (PointerPte->u.Hard.Valid == 1);
+        while (NumberLeftToRemove != 0) {
+
+            if (Wsle[TryToFree].u1.e1.Valid == 1) {
+                PointerPte = MiGetPteAddress (Wsle[TryToFree].u1.VirtualAddress);
+                ASSERT (PointerPte->u.Hard.Valid == 1);
 
-            if ((TrimAge == 0) ||
-                ((MI_GET_ACCESSED_IN_PTE (PointerPte) == 0) &&
-                (MI_GET_WSLE_AGE(PointerPte, &Wsle[TryToFree]) >= TrimAge))) {
+                if (TrimAge == 0) {
+                    MiTrimWorkingSetEntry (WsInfo,
+                                           TryToFree,
+                                           PointerPte,
+                                           &WsleFlushList,
+                                           &NumberLeftToRemove);
+                }
+                else if (MI_GET_ACCESSED_IN_PTE (PointerPte) == 0) {
 
-                WsleFlushList.FlushIndex[WsleFlushList.Count] = TryToFree;
-                WsleFlushList.Count += 1;
-                NumberLeftToRemove -= 1;
+                    Age = MI_GET_WSLE_AGE (PointerPte, &Wsle[TryToFree]);
 
-                if (WsleFlushList.Count == MM_MAXIMUM_FLUSH_COUNT) {
-                    NumberNotFlushed = MiFreeWsleList (WsInfo, &WsleFlushList);
-                    WsleFlushList.Count = 0;
-                    NumberLeftToRemove += NumberNotFlushed;
+                    if (Age == MI_USE_AGE_MAX) {
+                        MiTrimWorkingSetEntry (WsInfo,
+                                               TryToFree,
+                                               PointerPte,
+                                               &WsleFlushList,
+                                               &NumberLeftToRemove);
+                    }
+                    else if (Age >= TrimAge) {
+                        if (BucketCount[Age] < MI_TRIM_BUCKET_SIZE) {
+                            Bucket[Age][BucketCount[Age]] = TryToFree;
+                            BucketCount[Age] += 1;
+                        }
+                        else {
+                            Overflowed |= (1UL << Age);
+                        }
+                    }
                 }
             }
+
+            TryToFree += 1;
+
+            if (TryToFree > LastEntry) {
+                TryToFree = WorkingSetList->FirstDynamic;
+            }
+
+            if (TryToFree == StartEntry) {
+                break;
+            }
         }
-        TryToFree += 1;
 
-        if (TryToFree > LastEntry) {
-            TryToFree = WorkingSetList->FirstDynamic;
+        //
+        // Entries that could not be removed are made up for by continuing
+        // the pass.
+        //
+
+        if (WsleFlushList.Count != 0) {
+            NumberLeftToRemove += MiFreeWsleList (WsInfo, &WsleFlushList);
+            WsleFlushList.Count = 0;
         }
 
-        if (TryToFree == StartEntry) {
-            break;
+    } while ((NumberLeftToRemove != 0) && (TryToFree != StartEntry));
+
+    //
+    // Take the collected entries, oldest generation first.  Each entry is
+    // checked again as it may have been accessed since it was collected.
+    // If a generation did not fit in its bucket, the rest of it is found
+    // with another pass before moving on to the next younger generation.
+    //
+
+    Generation = MI_USE_AGE_MAX;
+
+    while ((NumberLeftToRemove != 0) && (Generation > TrimAge)) {
+
+        Generation -= 1;
+
+        for (i = 0; i < BucketCount[Generation]; i += 1) {
+
+            if (NumberLeftToRemove == 0) {
+                break;
+            }
+
+            Index = Bucket[Generation][i];
+
+            if (Wsle[Index].u1.e1.Valid == 1) {
+                PointerPte = MiGetPteAddress (Wsle[Index].u1.VirtualAddress);
+                ASSERT (PointerPte->u.Hard.Valid == 1);
+
+                if (MI_GET_ACCESSED_IN_PTE (PointerPte) == 0) {
+                    MiTrimWorkingSetEntry (WsInfo,
+                                           Index,
+                                           PointerPte,
+                                           &WsleFlushList,
+                                           &NumberLeftToRemove);
+                }
+            }
         }
-    }
 
-    if (WsleFlushList.Count != 0) {
-        NumberNotFlushed = MiFreeWsleList (WsInfo, &WsleFlushList);
-        NumberLeftToRemove += NumberNotFlushed;
+        if (WsleFlushList.Count != 0) {
+            NumberLeftToRemove += MiFreeWsleList (WsInfo, &WsleFlushList);
+            WsleFlushList.Count = 0;
+        }
 
-        if (NumberLeftToRemove != 0) {
-            if (TryToFree != StartEntry) {
-                WsleFlushList.Count = 0;
-                goto TrimMore;
+        if ((NumberLeftToRemove == 0) ||
+            ((Overflowed & (1UL << Generation)) == 0)) {
+            continue;
+        }
+
+        StartEntry = TryToFree;
+
+        do {
+
+            if (Wsle[TryToFree].u1.e1.Valid == 1) {
+                PointerPte = MiGetPteAddress (Wsle[TryToFree].u1.VirtualAddress);
+                ASSERT (PointerPte->u.Hard.Valid == 1);
+
+                if ((MI_GET_ACCESSED_IN_PTE (PointerPte) == 0) &&
+                    (MI_GET_WSLE_AGE (PointerPte, &Wsle[TryToFree]) == Generation)) {
+
+                    MiTrimWorkingSetEntry (WsInfo,
+                                           TryToFree,
+                                           PointerPte,
+                                           &WsleFlushList,
+                                           &NumberLeftToRemove);
+                }
             }
+
+            TryToFree += 1;
+
+            if (TryToFree > LastEntry) {
+                TryToFree = WorkingSetList->FirstDynamic;
+            }
+
+        } while ((NumberLeftToRemove != 0) && (TryToFree != StartEntry));
+
+        if (WsleFlushList.Count != 0) {
+            NumberLeftToRemove += MiFreeWsleList (WsInfo, &WsleFlushList);
+            WsleFlushList.Count = 0;
         }
     }
 
     WorkingSetList->NextSlot = TryToFree;
 
+    WorkingSetList->PagesTrimmed += Reduction - NumberLeftToRemove;
+
     //
     // See if the working set list can be contracted.
     //
@@ -4942,6 +5248,12 @@ Environment:
 
             PointerPte = MiGetPteAddress (Wsle[Entry].u1.VirtualAddress);
             ASSERT (PointerPte->u.Hard.Valid == 1);
+
+            if ((WorkingSetList->PromotedLargePages != 0) &&
+                (MI_IS_PROMOTED_LARGE_PDE (PointerPte))) {
+                MiDemoteLargePde (WsInfo, PointerPte, MI_DEMOTE_TRIM);
+            }
+
             Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (PointerPte));
 
             if (MiTrimRemovalPagesOnly == TRUE) {
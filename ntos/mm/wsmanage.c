@@ -1180,6 +1180,19 @@ Environment:
                                  &WslesScanned,
                                  &TrimCriteria->NewTotalClaim,
                                  &TrimCriteria->NewTotalEstimatedAvailable);
+
+                //
+                // Memory is not tight so this is a good time to promote
+                // fully populated private ranges to large pages.
+                //
+
+                MiPromoteLargePages (VmSupport);
+
+                //
+                // Look for trimmed pages that duplicate each other.
+                //
+
+                MiCombineIdenticalPages (VmSupport);
             }
 
             if (WorkingSetRequestFlags & MI_CAPTURE_AND_RESET_ALL_ACCESS_BITS) {
@@ -1822,6 +1835,15 @@ Environment:
 
     Estimate = MI_CALCULATE_USAGE_ESTIMATE(SampledAgeCounts, CounterShift);
 
+    //
+    // Remember the size of each generation for
+    // SystemWorkingSetAgingInformation queries.
+    //
+
+    for (i = 0; i < MI_USE_AGE_COUNT; i += 1) {
+        WorkingSetList->GenerationCounts[i] = SampledAgeCounts[i] << CounterShift;
+    }
+
     Claim = VmSupport->Claim + MI_CLAIM_INCR;
 
     if (Claim > Estimate) {
@@ -44,6 +44,19 @@ MiCheckWsleHash (
     IN PMMWSL WorkingSetList
     );
 
+PVOID
+MiAllocateWsleReverseIndexNode (
+    IN PEPROCESS Process,
+    IN SIZE_T NumberOfBytes
+    );
+
+VOID
+MiFreeWsleReverseIndexNode (
+    IN PVOID *Node,
+    IN ULONG Level,
+    IN PEPROCESS Process
+    );
+
 
 VOID
 FASTCALL
@@ -59,6 +72,10 @@ Routine Description:
     This routine inserts a Working Set List Entry (WSLE) into the
     hash list for the specified working set.
 
+    User addresses are recorded in the reverse index instead if the
+    working set has one, the hash is only used for them if the index
+    could not be extended.
+
 Arguments:
 
     Entry - The index number of the WSLE to insert.
@@ -98,9 +115,29 @@ Environment:
     ASSERT (Wsle[Entry].u1.e1.Direct != 1);
     ASSERT (Wsle[Entry].u1.e1.Hashed == 0);
 
+    if ((WorkingSetList->ReverseIndex != NULL) &&
+        (MiSetWsleReverseIndex (WorkingSetList,
+                                Wsle[Entry].u1.VirtualAddress,
+                                Entry,
+                                CONTAINING_RECORD (WsInfo, EPROCESS, Vm)) == TRUE)) {
+        return;
+    }
+
     Table = WorkingSetList->HashTable;
 
     if (Table == NULL) {
+
+        //
+        // The reverse index could not be extended, have a hash table
+        // built for the entries it does not cover.
+        //
+
+        if ((WorkingSetList->ReverseIndex != NULL) &&
+            (MmAvailablePages > MM_HIGH_LIMIT)) {
+
+            WsInfo->Flags.GrowWsleHash = 1;
+        }
+
         return;
     }
 
@@ -373,6 +410,16 @@ Environment:
                 goto DidOne;
             }
 
+            if (MiLookupWsleReverseIndex (WorkingSetList,
+                                          Wsle->u1.VirtualAddress) == Index) {
+
+                //
+                // The reverse index already locates this entry.
+                //
+
+                goto DidOne;
+            }
+
             //
             // Hash this.
             //
@@ -534,6 +581,15 @@ Environment:
         return WsPfnIndex;
     }
 
+    if (WorkingSetList->ReverseIndex != NULL) {
+
+        Hash = MiLookupWsleReverseIndex (WorkingSetList, VirtualAddress);
+
+        if (Hash != WSLE_NULL_INDEX) {
+            return Hash;
+        }
+    }
+
 #if defined (_WIN64)
     PointerPte = MiGetPteAddress (VirtualAddress);
     WsPteIndex = MI_GET_WORKING_SET_FROM_PTE (PointerPte);
@@ -619,6 +675,429 @@ Environment:
                   (ULONG_PTR) WorkingSetList);
 }
 
+
+PVOID
+MiAllocateWsleReverseIndexNode (
+    IN PEPROCESS Process,
+    IN SIZE_T NumberOfBytes
+    )
+
+/*++
+
+Routine Description:
+
+    This routine allocates a zeroed reverse index node and charges it to
+    the process as nonpaged pool quota.
+
+Arguments:
+
+    Process - Supplies the process that owns the working set.
+
+    NumberOfBytes - Supplies the size of the node.
+
+Return Value:
+
+    The node, or NULL if the quota could not be charged or the pool could
+    not be allocated.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set mutex held.
+
+--*/
+
+{
+    PVOID Node;
+
+    if (!NT_SUCCESS (PsChargeProcessNonPagedPoolQuota (Process,
+                                                       NumberOfBytes))) {
+        return NULL;
+    }
+
+    Node = ExAllocatePoolWithTag (NonPagedPool, NumberOfBytes, 'iWmM');
+
+    if (Node == NULL) {
+        PsReturnProcessNonPagedPoolQuota (Process, NumberOfBytes);
+        return NULL;
+    }
+
+    RtlZeroMemory (Node, NumberOfBytes);
+
+    return Node;
+}
+
+
+LOGICAL
+MiCreateWsleReverseIndex (
+    IN PMMSUPPORT WsInfo
+    )
+
+/*++
+
+Routine Description:
+
+    This routine builds the reverse index for a process working set and
+    records every shared entry already in the working set in it.
+
+Arguments:
+
+    WsInfo - Supplies the process working set.
+
+Return Value:
+
+    TRUE if the index now locates every shared entry, FALSE if it could
+    not be created or extended, in which case a hash table is needed for
+    the remaining entries.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set mutex held.
+
+--*/
+
+{
+    PMMWSL WorkingSetList;
+    PMMWSLE Wsle;
+    PMMPTE PointerPte;
+    PMMPFN Pfn1;
+    PEPROCESS Process;
+    WSLE_NUMBER Index;
+
+    WorkingSetList = WsInfo->VmWorkingSetList;
+    Process = CONTAINING_RECORD (WsInfo, EPROCESS, Vm);
+
+    ASSERT (WorkingSetList->ReverseIndex == NULL);
+
+    WorkingSetList->ReverseIndex = MiAllocateWsleReverseIndexNode (
+                                    Process,
+                                    MI_WSLE_INDEX_NODE_ENTRIES * sizeof (PVOID));
+
+    if (WorkingSetList->ReverseIndex == NULL) {
+        return FALSE;
+    }
+
+    Wsle = WorkingSetList->Wsle;
+
+    for (Index = 0; Index <= WorkingSetList->LastEntry; Index += 1) {
+
+        if ((Wsle[Index].u1.e1.Valid == 0) ||
+            (Wsle[Index].u1.e1.Direct == 1)) {
+            continue;
+        }
+
+        PointerPte = MiGetPteAddress (Wsle[Index].u1.VirtualAddress);
+        ASSERT (PointerPte->u.Hard.Valid == 1);
+        Pfn1 = MI_PFN_ELEMENT (MI_GET_PAGE_FRAME_FROM_PTE (PointerPte));
+
+        if (Pfn1->u1.WsIndex == Index) {
+            continue;
+        }
+
+        if (MiSetWsleReverseIndex (WorkingSetList,
+                                   Wsle[Index].u1.VirtualAddress,
+                                   Index,
+                                   Process) == FALSE) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+LOGICAL
+FASTCALL
+MiSetWsleReverseIndex (
+    IN PMMWSL WorkingSetList,
+    IN PVOID VirtualAddress,
+    IN WSLE_NUMBER Entry,
+    IN PEPROCESS Process OPTIONAL
+    )
+
+/*++
+
+Routine Description:
+
+    This routine records the working set index for the specified user
+    virtual address in the working set list's reverse index.
+
+Arguments:
+
+    WorkingSetList - Supplies the working set list to update.
+
+    VirtualAddress - Supplies the virtual address of the entry.
+
+    Entry - Supplies the working set index to record, WSLE_NULL_INDEX to
+            clear the slot.
+
+    Process - Supplies the process to charge for any missing tree nodes.
+              If NULL and the slot does not exist, nothing is done.
+
+Return Value:
+
+    TRUE if the index was recorded, FALSE if the working set has no index,
+    the address is not a user address or the slot did not exist and could
+    not (or was not permitted to) be allocated.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set mutex held.
+
+--*/
+
+{
+    ULONG Level;
+    ULONG Shift;
+    ULONG_PTR Vpn;
+    PVOID *Node;
+    PVOID *Slot;
+    PWSLE_NUMBER Leaf;
+
+    if ((WorkingSetList->ReverseIndex == NULL) ||
+        (VirtualAddress > MM_HIGHEST_USER_ADDRESS)) {
+        return FALSE;
+    }
+
+    Vpn = MI_VA_TO_VPN (VirtualAddress);
+
+    Slot = &WorkingSetList->ReverseIndex;
+    Shift = MI_WSLE_INDEX_LEAF_SHIFT +
+                (MI_WSLE_INDEX_LEVELS - 1) * MI_WSLE_INDEX_NODE_SHIFT;
+
+    for (Level = 0; Level < MI_WSLE_INDEX_LEVELS; Level += 1) {
+
+        Node = (PVOID *) *Slot;
+
+        if (Node == NULL) {
+
+            if (Process == NULL) {
+                return FALSE;
+            }
+
+            Node = MiAllocateWsleReverseIndexNode (
+                                    Process,
+                                    MI_WSLE_INDEX_NODE_ENTRIES * sizeof (PVOID));
+
+            if (Node == NULL) {
+                return FALSE;
+            }
+
+            *Slot = (PVOID) Node;
+        }
+
+        Slot = &Node[(Vpn >> Shift) & (MI_WSLE_INDEX_NODE_ENTRIES - 1)];
+
+        Shift -= MI_WSLE_INDEX_NODE_SHIFT;
+    }
+
+    Leaf = (PWSLE_NUMBER) *Slot;
+
+    if (Leaf == NULL) {
+
+        if (Process == NULL) {
+            return FALSE;
+        }
+
+        //
+        // A zeroed slot is harmless as lookups validate the index against
+        // the working set list entry.
+        //
+
+        Leaf = MiAllocateWsleReverseIndexNode (
+                                Process,
+                                MI_WSLE_INDEX_LEAF_ENTRIES * sizeof (WSLE_NUMBER));
+
+        if (Leaf == NULL) {
+            return FALSE;
+        }
+
+        *Slot = (PVOID) Leaf;
+    }
+
+    Leaf[Vpn & (MI_WSLE_INDEX_LEAF_ENTRIES - 1)] = Entry;
+
+    return TRUE;
+}
+
+
+WSLE_NUMBER
+FASTCALL
+MiLookupWsleReverseIndex (
+    IN PMMWSL WorkingSetList,
+    IN PVOID VirtualAddress
+    )
+
+/*++
+
+Routine Description:
+
+    This routine looks up the working set index for the specified user
+    virtual address in the working set list's reverse index.
+
+Arguments:
+
+    WorkingSetList - Supplies the working set list to search.
+
+    VirtualAddress - Supplies the virtual address to locate.
+
+Return Value:
+
+    The working set index, or WSLE_NULL_INDEX if the address is not
+    indexed.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set mutex held.
+
+--*/
+
+{
+    ULONG Level;
+    ULONG Shift;
+    ULONG_PTR Vpn;
+    PVOID *Node;
+    PWSLE_NUMBER Leaf;
+    WSLE_NUMBER Entry;
+
+    Node = (PVOID *) WorkingSetList->ReverseIndex;
+
+    if ((Node == NULL) || (VirtualAddress > MM_HIGHEST_USER_ADDRESS)) {
+        return WSLE_NULL_INDEX;
+    }
+
+    Vpn = MI_VA_TO_VPN (VirtualAddress);
+
+    Shift = MI_WSLE_INDEX_LEAF_SHIFT +
+                (MI_WSLE_INDEX_LEVELS - 1) * MI_WSLE_INDEX_NODE_SHIFT;
+
+    for (Level = 1; Level < MI_WSLE_INDEX_LEVELS; Level += 1) {
+
+        Node = (PVOID *) Node[(Vpn >> Shift) & (MI_WSLE_INDEX_NODE_ENTRIES - 1)];
+
+        if (Node == NULL) {
+            return WSLE_NULL_INDEX;
+        }
+
+        Shift -= MI_WSLE_INDEX_NODE_SHIFT;
+    }
+
+    Leaf = (PWSLE_NUMBER) Node[(Vpn >> Shift) & (MI_WSLE_INDEX_NODE_ENTRIES - 1)];
+
+    if (Leaf == NULL) {
+        return WSLE_NULL_INDEX;
+    }
+
+    Entry = Leaf[Vpn & (MI_WSLE_INDEX_LEAF_ENTRIES - 1)];
+
+    if ((Entry <= WorkingSetList->LastInitializedWsle) &&
+        (MI_GENERATE_VALID_WSLE (&WorkingSetList->Wsle[Entry]) ==
+            (PVOID)((ULONG_PTR)PAGE_ALIGN (VirtualAddress) | 0x1))) {
+
+        return Entry;
+    }
+
+    return WSLE_NULL_INDEX;
+}
+
+
+VOID
+MiFreeWsleReverseIndexNode (
+    IN PVOID *Node,
+    IN ULONG Level,
+    IN PEPROCESS Process
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees a reverse index node and everything below it and
+    returns the quota charged for them.
+
+Arguments:
+
+    Node - Supplies the node to free.
+
+    Level - Supplies the depth of the node, zero for the root.
+
+    Process - Supplies the process the nodes were charged to.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode.
+
+--*/
+
+{
+    ULONG i;
+
+    for (i = 0; i < MI_WSLE_INDEX_NODE_ENTRIES; i += 1) {
+
+        if (Node[i] == NULL) {
+            continue;
+        }
+
+        if (Level == MI_WSLE_INDEX_LEVELS - 1) {
+            ExFreePool (Node[i]);
+            PsReturnProcessNonPagedPoolQuota (
+                                Process,
+                                MI_WSLE_INDEX_LEAF_ENTRIES * sizeof (WSLE_NUMBER));
+        }
+        else {
+            MiFreeWsleReverseIndexNode ((PVOID *) Node[i], Level + 1, Process);
+        }
+    }
+
+    ExFreePool (Node);
+    PsReturnProcessNonPagedPoolQuota (Process,
+                                      MI_WSLE_INDEX_NODE_ENTRIES * sizeof (PVOID));
+}
+
+
+VOID
+MiDeleteWsleReverseIndex (
+    IN PMMWSL WorkingSetList,
+    IN PEPROCESS Process
+    )
+
+/*++
+
+Routine Description:
+
+    This routine frees the working set list's reverse index.
+
+Arguments:
+
+    WorkingSetList - Supplies the working set list.
+
+    Process - Supplies the process that owns the working set.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, APCs disabled, working set mutex held or the working
+    set is being deleted.
+
+--*/
+
+{
+    PVOID *Root;
+
+    Root = (PVOID *) WorkingSetList->ReverseIndex;
+
+    if (Root != NULL) {
+        WorkingSetList->ReverseIndex = NULL;
+        MiFreeWsleReverseIndexNode (Root, 0, Process);
+    }
+}
+
 
 VOID
 FASTCALL
@@ -714,6 +1193,13 @@ Environment:
 
         WorkingSetList->NonDirectCount -= 1;
 
+        if (WorkingSetList->ReverseIndex != NULL) {
+            MiSetWsleReverseIndex (WorkingSetList,
+                                   VirtualAddress,
+                                   WSLE_NULL_INDEX,
+                                   NULL);
+        }
+
         if (WsleContents.u1.e1.Hashed == 0) {
 #if DBG
             if (WorkingSetList->HashTable != NULL) {
@@ -880,9 +1366,16 @@ Environment:
         else {
 
             //
-            // Update hash table.
+            // Update the reverse index and hash table.
             //
 
+            if (WorkingSetList->ReverseIndex != NULL) {
+                MiSetWsleReverseIndex (WorkingSetList,
+                                       WsleSwap.u1.VirtualAddress,
+                                       Entry,
+                                       NULL);
+            }
+
             if (Table != NULL) {
                 MiRepointWsleHashIndex (WsleSwap, WorkingSetList, Entry);
             }
@@ -963,6 +1456,15 @@ Environment:
             }
         }
 
+        if ((WsleEntry.u1.e1.Direct == 0) &&
+            (WorkingSetList->ReverseIndex != NULL)) {
+
+            MiSetWsleReverseIndex (WorkingSetList,
+                                   WsleEntry.u1.VirtualAddress,
+                                   SwapEntry,
+                                   NULL);
+        }
+
         MI_SET_PTE_IN_WORKING_SET (PointerPte, SwapEntry);
 
         MI_LOG_WSLE_CHANGE (WorkingSetList, Entry, WsleSwap);
@@ -993,6 +1495,12 @@ Environment:
             Pfn1->u1.WsIndex = Entry;
         }
         else {
+            if (WorkingSetList->ReverseIndex != NULL) {
+                MiSetWsleReverseIndex (WorkingSetList,
+                                       WsleSwap.u1.VirtualAddress,
+                                       Entry,
+                                       NULL);
+            }
             if (Table != NULL) {
                 MiRepointWsleHashIndex (WsleSwap, WorkingSetList, Entry);
             }
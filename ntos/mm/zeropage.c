@@ -30,6 +30,44 @@ LOGICAL MiZeroingDisabled = FALSE;
 ULONG MiInitialZeroNoPtes = 0;
 #endif
 
+MI_ZERO_PAGE_NODE MiZeroPageNodes[MI_ZERO_PAGE_NODES];
+
+//
+// Set once every node has its own zeroing thread.  Until then the zero
+// page thread services all nodes.
+//
+
+LOGICAL MiZeroPageNodeThreads;
+
+PFN_NUMBER MiDemandZeroListHits;
+PFN_NUMBER MiDemandZeroListMisses;
+
+VOID
+MiInitializeZeroPageNodes (
+    VOID
+    );
+
+VOID
+MiUpdateZeroPageReserve (
+    IN PMI_ZERO_PAGE_NODE ZeroNode,
+    IN ULONG Node
+    );
+
+VOID
+MiAdjustZeroPagePriority (
+    IN PMI_ZERO_PAGE_NODE ZeroNode,
+    IN ULONG Node
+    );
+
+#if defined(MI_MULTINODE)
+
+VOID
+MiZeroNodePageThread (
+    IN PVOID Context
+    );
+
+#endif
+
 #if !defined(NT_UP)
 
 LONG MiNextZeroProcessor = (LONG)-1;
@@ -85,6 +123,7 @@ Environment:
     PMMPFN PfnAllocation;
     ULONG SecondaryColorMask;
     PMMCOLOR_TABLES FreePagesByColor;
+    PMI_ZERO_PAGE_NODE ZeroNode;
 
 #if defined(MI_MULTINODE)
 
@@ -105,6 +144,16 @@ Environment:
     FreePagesByColor = MmFreePagesByColor[FreePageList];
     SecondaryColorMask = MmSecondaryColorMask;
 
+    //
+    // Start the zeroing threads for the other nodes (if any).  From here
+    // on this thread only zeroes pages belonging to node 0 unless one of
+    // the node threads could not be created.
+    //
+
+    MiInitializeZeroPageNodes ();
+
+    ZeroNode = &MiZeroPageNodes[0];
+
     //
     // Before this becomes the zero page thread, free the kernel
     // initialization code.
@@ -211,15 +260,33 @@ Environment:
             //
 
             KeSetPriorityZeroPageThread (0);
+            ZeroNode->Boosted = FALSE;
             continue;
         }
 
+        MiUpdateZeroPageReserve (ZeroNode, 0);
+
         PagesToZero = 0;
 
         LOCK_PFN (OldIrql);
 
         do {
 
+#if defined(MI_MULTINODE)
+            if ((MiZeroPageNodeThreads == TRUE) &&
+                (KeNodeBlock[0]->FreeCount[FreePageList] == 0)) {
+
+                //
+                // No pages on this node's free list at this time, the
+                // other nodes are zeroed by their own threads.
+                //
+
+                MmZeroingPageThreadActive = FALSE;
+                UNLOCK_PFN (OldIrql);
+                break;
+            }
+#endif
+
             if (MmFreePageListHead.Total == 0) {
 
                 //
@@ -249,7 +316,7 @@ Environment:
             // need to be zeroed.
             //
 
-            if (KeNumberNodes > 1) {
+            if ((KeNumberNodes > 1) && (MiZeroPageNodeThreads == FALSE)) {
 
                 n = LastNodeZeroing;
 
@@ -412,6 +479,8 @@ Environment:
 
                 MiInsertPageInList (&MmZeroedPageListHead, PageFrame);
 
+                ZeroNode->PagesZeroed += 1;
+
             } while (Pfn1 != (PMMPFN) MM_EMPTY_LIST);
 
             //
@@ -423,13 +492,653 @@ Environment:
 
             PfnAllocation = (PMMPFN) MM_EMPTY_LIST;
 
+            MiAdjustZeroPagePriority (ZeroNode, 0);
+
             LOCK_PFN (OldIrql);
 
         } while (TRUE);
 
+        //
+        // Drop back to priority zero now that the free list is drained.
+        //
+
+        if (ZeroNode->Boosted == TRUE) {
+            ZeroNode->Boosted = FALSE;
+            KeSetPriorityZeroPageThread (0);
+        }
+
     } while (TRUE);
 }
 
+VOID
+MiInitializeZeroPageNodes (
+    VOID
+    )
+
+/*++
+
+Routine Description:
+
+    This routine initializes the per-node zeroing state and, on NUMA
+    systems, creates a zeroing thread for each node other than node 0.
+    Node 0 is serviced by the zero page thread itself.
+
+    If any node thread cannot be created, the zero page thread keeps
+    servicing every node in round robin fashion as before.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, called by the zero page thread before it
+    frees the initialization code.
+
+--*/
+
+{
+    ULONG i;
+    PMI_ZERO_PAGE_NODE ZeroNode;
+#if defined(MI_MULTINODE)
+    KIRQL OldIrql;
+    NTSTATUS Status;
+    HANDLE ThreadHandle;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+#endif
+
+    for (i = 0; i < MI_ZERO_PAGE_NODES; i += 1) {
+
+        ZeroNode = &MiZeroPageNodes[i];
+
+        KeInitializeEvent (&ZeroNode->NodeEvent, SynchronizationEvent, FALSE);
+        ZeroNode->ZeroingEvent = &ZeroNode->NodeEvent;
+        ZeroNode->ThreadActive = &ZeroNode->NodeActive;
+        ZeroNode->ReserveTarget = MI_ZERO_RESERVE_MINIMUM;
+    }
+
+    //
+    // Node 0 (and non-NUMA systems) use the original zero page thread
+    // event and activity flag.
+    //
+
+    MiZeroPageNodes[0].ZeroingEvent = &MmZeroingPageEvent;
+    MiZeroPageNodes[0].ThreadActive = &MmZeroingPageThreadActive;
+
+#if defined(MI_MULTINODE)
+
+    if (KeNumberNodes <= 1) {
+        return;
+    }
+
+    InitializeObjectAttributes (&ObjectAttributes, NULL, 0, NULL, NULL);
+
+    for (i = 1; i < KeNumberNodes; i += 1) {
+
+        Status = PsCreateSystemThread (&ThreadHandle,
+                                       THREAD_ALL_ACCESS,
+                                       &ObjectAttributes,
+                                       0L,
+                                       NULL,
+                                       MiZeroNodePageThread,
+                                       (PVOID) (ULONG_PTR) i);
+
+        if (!NT_SUCCESS (Status)) {
+
+            //
+            // Any threads already created stay blocked on their events
+            // as nothing signals them while MiZeroPageNodeThreads is FALSE.
+            //
+
+            return;
+        }
+
+        ZwClose (ThreadHandle);
+    }
+
+    //
+    // Keep the zero page thread itself on node 0's processors.
+    //
+
+    if (KeNodeBlock[0]->ProcessorMask != 0) {
+
+        KeFindFirstSetLeftAffinity (KeNodeBlock[0]->ProcessorMask, &i);
+
+        if (i != NO_BITS_FOUND) {
+            KeSetIdealProcessorThread (KeGetCurrentThread (), (UCHAR) i);
+        }
+    }
+
+    //
+    // Switch the free list insertion path over to per-node wakeups and
+    // kick any node that already has enough free pages to zero, as the
+    // insertion path will not signal it until its count changes again.
+    //
+
+    LOCK_PFN (OldIrql);
+
+    MiZeroPageNodeThreads = TRUE;
+
+    for (i = 0; i < KeNumberNodes; i += 1) {
+
+        ZeroNode = &MiZeroPageNodes[i];
+
+        if ((KeNodeBlock[i]->FreeCount[FreePageList] >= MmMinimumFreePagesToZero) &&
+            (*ZeroNode->ThreadActive == FALSE)) {
+
+            *ZeroNode->ThreadActive = TRUE;
+            KeSetEvent (ZeroNode->ZeroingEvent, 0, FALSE);
+        }
+    }
+
+    UNLOCK_PFN (OldIrql);
+
+#endif
+
+    return;
+}
+
+
+VOID
+MiUpdateZeroPageReserve (
+    IN PMI_ZERO_PAGE_NODE ZeroNode,
+    IN ULONG Node
+    )
+
+/*++
+
+Routine Description:
+
+    This routine recomputes the number of zeroed pages the specified node
+    should keep in reserve from the demand zero fault rate of the node's
+    processors since the last sample.  The target covers one second of
+    faults at that rate, averaged with the previous target so a single
+    burst does not swing it, and is clamped to a sane range.
+
+Arguments:
+
+    ZeroNode - Supplies the zeroing state for the node.
+
+    Node - Supplies the node number.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, called only by the node's zeroing thread.
+
+--*/
+
+{
+    ULONG i;
+    ULONG Elapsed;
+    ULONG Faults;
+    ULONG DemandZeroCount;
+    ULONG TicksPerSecond;
+    PFN_NUMBER Target;
+    KAFFINITY ProcessorMask;
+    LARGE_INTEGER CurrentTime;
+
+    KeQueryTickCount (&CurrentTime);
+
+    Elapsed = CurrentTime.LowPart - ZeroNode->SampleTime;
+
+    TicksPerSecond = (10 * 1000 * 1000) / KeMaximumIncrement;
+
+    //
+    // Windows shorter than a quarter second are too noisy to size the
+    // reserve from, keep the current target.
+    //
+
+    if (Elapsed < TicksPerSecond / 4) {
+        return;
+    }
+
+    ProcessorMask = (KAFFINITY) -1;
+
+#if defined(MI_MULTINODE)
+    if (MiZeroPageNodeThreads == TRUE) {
+        ProcessorMask = KeNodeBlock[Node]->ProcessorMask;
+    }
+#else
+    UNREFERENCED_PARAMETER (Node);
+#endif
+
+    DemandZeroCount = 0;
+
+    for (i = 0; i < (ULONG) KeNumberProcessors; i += 1) {
+        if (ProcessorMask & AFFINITY_MASK (i)) {
+            DemandZeroCount += (ULONG) KiProcessorBlock[i]->MmDemandZeroCount;
+        }
+    }
+
+    Faults = DemandZeroCount - ZeroNode->DemandZeroCount;
+
+    ZeroNode->DemandZeroCount = DemandZeroCount;
+    ZeroNode->SampleTime = CurrentTime.LowPart;
+
+    Target = (PFN_NUMBER) (((ULONGLONG) Faults * TicksPerSecond) / Elapsed);
+
+    Target = (Target + ZeroNode->ReserveTarget) / 2;
+
+    if (Target < MI_ZERO_RESERVE_MINIMUM) {
+        Target = MI_ZERO_RESERVE_MINIMUM;
+    }
+    else if (Target > MI_ZERO_RESERVE_MAXIMUM) {
+        Target = MI_ZERO_RESERVE_MAXIMUM;
+    }
+
+    ZeroNode->ReserveTarget = Target;
+
+    return;
+}
+
+
+VOID
+MiAdjustZeroPagePriority (
+    IN PMI_ZERO_PAGE_NODE ZeroNode,
+    IN ULONG Node
+    )
+
+/*++
+
+Routine Description:
+
+    This routine raises the calling zeroing thread to priority one while
+    the node's zeroed page count is below its reserve target, so the
+    thread can participate in the balance set manager's priority boosts
+    instead of only running on otherwise idle processors.  Once the
+    reserve is met the thread drops back to priority zero.
+
+Arguments:
+
+    ZeroNode - Supplies the zeroing state for the node.
+
+    Node - Supplies the node number.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL, PFN lock NOT held.  Called only by the
+    node's zeroing thread.
+
+--*/
+
+{
+    PFN_NUMBER ZeroedPages;
+
+    //
+    // The counts are sampled without the PFN lock, this is only a hint.
+    //
+
+    ZeroedPages = MmZeroedPageListHead.Total;
+
+#if defined(MI_MULTINODE)
+    if (MiZeroPageNodeThreads == TRUE) {
+        ZeroedPages = KeNodeBlock[Node]->FreeCount[ZeroedPageList];
+    }
+#else
+    UNREFERENCED_PARAMETER (Node);
+#endif
+
+    if (ZeroedPages < ZeroNode->ReserveTarget) {
+        if (ZeroNode->Boosted == FALSE) {
+            ZeroNode->Boosted = TRUE;
+            KeSetPriorityZeroPageThread (1);
+        }
+    }
+    else if (ZeroNode->Boosted == TRUE) {
+        ZeroNode->Boosted = FALSE;
+        KeSetPriorityZeroPageThread (0);
+    }
+
+    return;
+}
+
+#if defined(MI_MULTINODE)
+
+
+VOID
+MiZeroNodePageThread (
+    IN PVOID Context
+    )
+
+/*++
+
+Routine Description:
+
+    This is the zeroing thread for a single NUMA node other than node 0.
+    It runs on the node's processors, removes pages belonging to the node
+    from the free list, zeroes them and places them on the zeroed page
+    list.  As only the zero page thread may use the hyperspace zeroing
+    PTEs, the pages are mapped with system PTEs instead.
+
+Arguments:
+
+    Context - Supplies the node number.
+
+Return Value:
+
+    None.
+
+Environment:
+
+    Kernel mode, PASSIVE_LEVEL.
+
+--*/
+
+{
+    ULONG Node;
+    KIRQL OldIrql;
+    PKNODE KeNode;
+    PMI_ZERO_PAGE_NODE ZeroNode;
+    MMPTE TempPte;
+    MMPTE DefaultCachedPte;
+    PMMPTE PointerPte;
+    PVOID ZeroBase;
+    PMMPFN Pfn1;
+    PMMPFN PfnAllocation;
+    PFN_NUMBER PageFrame;
+    PFN_NUMBER PageFrame1;
+    PFN_COUNT PagesToZero;
+    PFN_COUNT MaximumPagesToZero;
+    ULONG Color;
+    ULONG StartColor;
+    ULONG SecondaryColorMask;
+    PMMCOLOR_TABLES FreePagesByColor;
+
+    Node = (ULONG) (ULONG_PTR) Context;
+
+    ASSERT ((Node != 0) && (Node < KeNumberNodes));
+
+    KeNode = KeNodeBlock[Node];
+    ZeroNode = &MiZeroPageNodes[Node];
+
+    DefaultCachedPte = ValidKernelPte;
+
+    //
+    // Make local copies of globals so they don't have to be wastefully
+    // refetched while holding the PFN lock.
+    //
+
+    FreePagesByColor = MmFreePagesByColor[FreePageList];
+    SecondaryColorMask = MmSecondaryColorMask;
+
+    //
+    // Run on the node's processors so the pages are zeroed locally.  Nodes
+    // without processors are zeroed from wherever the thread gets scheduled.
+    //
+
+    if (KeNode->ProcessorMask != 0) {
+        KeSetSystemAffinityThread (KeNode->ProcessorMask);
+    }
+
+    //
+    // Zero a cluster of colors at once to reduce PFN lock contention, up to
+    // 64k since that is the largest binned system PTE size.  Charge
+    // commitment and resident available up front as the zero page thread
+    // does since zeroing may get starved priority-wise.
+    //
+
+    MaximumPagesToZero = 1;
+
+    PagesToZero = SecondaryColorMask + 1;
+
+    if (PagesToZero > (64 * 1024) / PAGE_SIZE) {
+        PagesToZero = (64 * 1024) / PAGE_SIZE;
+    }
+
+    if (MiChargeCommitment (PagesToZero, NULL) == TRUE) {
+
+        LOCK_PFN (OldIrql);
+
+        if (MI_NONPAGEABLE_MEMORY_AVAILABLE() > (SPFN_NUMBER)(PagesToZero)) {
+            MI_DECREMENT_RESIDENT_AVAILABLE (PagesToZero,
+                                    MM_RESAVAIL_ALLOCATE_ZERO_PAGE_CLUSTERS);
+            MaximumPagesToZero = PagesToZero;
+        }
+
+        UNLOCK_PFN (OldIrql);
+    }
+
+    KeSetPriorityZeroPageThread (0);
+
+    Color = KeNode->MmShiftedColor;
+    PfnAllocation = (PMMPFN) MM_EMPTY_LIST;
+
+    do {
+
+        KeWaitForSingleObject (&ZeroNode->NodeEvent,
+                               WrFreePage,
+                               KernelMode,
+                               FALSE,
+                               NULL);
+
+        MiUpdateZeroPageReserve (ZeroNode, Node);
+
+        PagesToZero = 0;
+
+        LOCK_PFN (OldIrql);
+
+        do {
+
+            if (KeNode->FreeCount[FreePageList] == 0) {
+                ZeroNode->NodeActive = FALSE;
+                UNLOCK_PFN (OldIrql);
+                break;
+            }
+
+            if (MiZeroingDisabled == TRUE) {
+                ZeroNode->NodeActive = FALSE;
+                UNLOCK_PFN (OldIrql);
+                KeDelayExecutionThread (KernelMode,
+                                        FALSE,
+                                        (PLARGE_INTEGER)&MmHalfSecond);
+                break;
+            }
+
+            ASSERT (PagesToZero == 0);
+
+            StartColor = Color;
+
+            do {
+
+                PageFrame = FreePagesByColor[Color].Flink;
+
+                if (PageFrame != MM_EMPTY_LIST) {
+
+                    Pfn1 = MI_PFN_ELEMENT (PageFrame);
+
+                    //
+                    // Check the frame carefully because a single bit (hardware)
+                    // error causing us to zero the wrong frame is very hard
+                    // to reconstruct after the fact.
+                    //
+
+                    if ((Pfn1->u3.e1.PageLocation != FreePageList) ||
+                        (Pfn1->u3.e2.ReferenceCount != 0)) {
+
+                        KeBugCheckEx (PFN_LIST_CORRUPT,
+                                      0x8D,
+                                      PageFrame,
+                                      (Pfn1->u3.e2.ShortFlags << 16) |
+                                        Pfn1->u3.e2.ReferenceCount,
+                                      (ULONG_PTR) Pfn1->PteAddress);
+                    }
+
+                    PageFrame1 = MiRemoveAnyPage (Color);
+
+                    if (PageFrame != PageFrame1) {
+
+                        KeBugCheckEx (PFN_LIST_CORRUPT,
+                                      0x8E,
+                                      PageFrame,
+                                      PageFrame1,
+                                      0);
+                    }
+
+                    Pfn1->u1.Flink = (PFN_NUMBER) PfnAllocation;
+
+                    //
+                    // Temporarily mark the page as bad so that contiguous
+                    // memory allocators won't steal it when we release
+                    // the PFN lock below.
+                    //
+
+                    Pfn1->u3.e1.PageLocation = BadPageList;
+
+                    PfnAllocation = Pfn1;
+
+                    PagesToZero += 1;
+                }
+
+                //
+                // March to the next color within this node.
+                //
+
+                Color = (Color & ~SecondaryColorMask) |
+                        ((Color + 1) & SecondaryColorMask);
+
+                if (PagesToZero == MaximumPagesToZero) {
+                    break;
+                }
+
+                if (Color == StartColor) {
+                    break;
+                }
+
+            } while (TRUE);
+
+            ASSERT (PagesToZero != 0);
+            ASSERT (PfnAllocation != (PMMPFN) MM_EMPTY_LIST);
+
+            UNLOCK_PFN (OldIrql);
+
+            PointerPte = MiReserveSystemPtes (PagesToZero, SystemPteSpace);
+
+            if (PointerPte == NULL) {
+
+                //
+                // Put these pages back on the free list and retry later.
+                // The insertion does not signal this thread as it is
+                // still marked active.
+                //
+
+                Pfn1 = PfnAllocation;
+
+                LOCK_PFN (OldIrql);
+
+                do {
+
+                    PageFrame = MI_PFN_ELEMENT_TO_INDEX (Pfn1);
+
+                    Pfn1 = (PMMPFN) Pfn1->u1.Flink;
+
+                    MiInsertPageInFreeList (PageFrame);
+
+                } while (Pfn1 != (PMMPFN) MM_EMPTY_LIST);
+
+                UNLOCK_PFN (OldIrql);
+
+                PfnAllocation = (PMMPFN) MM_EMPTY_LIST;
+                PagesToZero = 0;
+
+                KeDelayExecutionThread (KernelMode,
+                                        FALSE,
+                                        (PLARGE_INTEGER)&MmHalfSecond);
+
+                LOCK_PFN (OldIrql);
+
+                continue;
+            }
+
+            ZeroBase = MiGetVirtualAddressMappedByPte (PointerPte);
+
+            Pfn1 = PfnAllocation;
+
+            do {
+
+                ASSERT (PointerPte->u.Hard.Valid == 0);
+
+                PageFrame = MI_PFN_ELEMENT_TO_INDEX (Pfn1);
+
+                TempPte = DefaultCachedPte;
+
+                if (Pfn1->u3.e1.CacheAttribute == MiWriteCombined) {
+                    MI_SET_PTE_WRITE_COMBINE (TempPte);
+                }
+                else if (Pfn1->u3.e1.CacheAttribute == MiNonCached) {
+                    MI_DISABLE_CACHING (TempPte);
+                }
+
+                TempPte.u.Hard.PageFrameNumber = PageFrame;
+
+                MI_WRITE_VALID_PTE (PointerPte, TempPte);
+
+                PointerPte += 1;
+
+                Pfn1 = (PMMPFN) Pfn1->u1.Flink;
+
+            } while (Pfn1 != (PMMPFN) MM_EMPTY_LIST);
+
+            //
+            // KeZeroPages uses non-temporal stores so the zeroed pages do
+            // not displace the node's working data from the caches.
+            //
+
+            KeZeroPages (ZeroBase, PagesToZero << PAGE_SHIFT);
+
+            PointerPte -= PagesToZero;
+
+            MiReleaseSystemPtes (PointerPte, PagesToZero, SystemPteSpace);
+
+            PagesToZero = 0;
+
+            Pfn1 = PfnAllocation;
+
+            LOCK_PFN (OldIrql);
+
+            do {
+
+                PageFrame = MI_PFN_ELEMENT_TO_INDEX (Pfn1);
+
+                Pfn1 = (PMMPFN) Pfn1->u1.Flink;
+
+                MiInsertPageInList (&MmZeroedPageListHead, PageFrame);
+
+                ZeroNode->PagesZeroed += 1;
+
+            } while (Pfn1 != (PMMPFN) MM_EMPTY_LIST);
+
+            UNLOCK_PFN (OldIrql);
+
+            PfnAllocation = (PMMPFN) MM_EMPTY_LIST;
+
+            MiAdjustZeroPagePriority (ZeroNode, Node);
+
+            LOCK_PFN (OldIrql);
+
+        } while (TRUE);
+
+        if (ZeroNode->Boosted == TRUE) {
+            ZeroNode->Boosted = FALSE;
+            KeSetPriorityZeroPageThread (0);
+        }
+
+    } while (TRUE);
+}
+
+#endif
+
 #if !defined(NT_UP)
 
 
@@ -881,6 +881,9 @@ Return Value:
 
     PERFINFO_THREAD_DELETE(Thread);
 
+    ExRecordProcessInformationExit (Process->UniqueProcessId,
+                                    Thread->Cid.UniqueThread);
+
     if (PspCreateThreadNotifyRoutineCount != 0) {
         ULONG i;
         PEX_CALLBACK_ROUTINE_BLOCK CallBack;
@@ -1359,6 +1362,8 @@ PspExitProcess(
 
         PERFINFO_PROCESS_DELETE(Process);
 
+        ExRecordProcessInformationExit (Process->UniqueProcessId, NULL);
+
         if (PspCreateProcessNotifyRoutineCount != 0) {
             ULONG i;
             PEX_CALLBACK_ROUTINE_BLOCK CallBack;
@@ -291,7 +291,19 @@ LdrProcessRelocationBlockLongLong(
                 // HighLow - (32-bits) relocate the high and low half
                 //      of an address.
                 //
-                *(LONG UNALIGNED *)FixupVA += (ULONG) Diff;
+                // These make up nearly all the fixups of an x86 image and
+                // come in long runs, so apply the rest of the run here
+                // instead of dispatching through the switch for each one.
+                //
+                Temp32 = (ULONG) Diff;
+                *(LONG UNALIGNED *)FixupVA += Temp32;
+
+                while ((SizeOfBlock != 0) &&
+                       ((NextOffset[1] >> 12) == IMAGE_REL_BASED_HIGHLOW)) {
+                    ++NextOffset;
+                    --SizeOfBlock;
+                    *(LONG UNALIGNED *)(VA + (*NextOffset & (USHORT)0xfff)) += Temp32;
+                }
                 break;
 
             case IMAGE_REL_BASED_HIGH :
@@ -448,8 +460,20 @@ LdrProcessRelocationBlockLongLong(
 
             case IMAGE_REL_BASED_DIR64:
 
+                //
+                // As with HIGHLOW above, apply the whole run of 64-bit
+                // fixups in one pass.
+                //
+
                 *(ULONGLONG UNALIGNED *)FixupVA += Diff;
 
+                while ((SizeOfBlock != 0) &&
+                       ((NextOffset[1] >> 12) == IMAGE_REL_BASED_DIR64)) {
+                    ++NextOffset;
+                    --SizeOfBlock;
+                    *(ULONGLONG UNALIGNED *)(VA + (*NextOffset & (USHORT)0xfff)) += Diff;
+                }
+
                 break;
 
             case IMAGE_REL_BASED_MIPS_JMPADDR :